@@ -86,7 +86,7 @@ START_TEST(test_basic)
     encrypt_precompute(response_plain, t_secret_key, f_shared_key);
     memcpy(f_nonce_r, response_plain + crypto_box_BEFORENMBYTES, crypto_box_NONCEBYTES);
 
-    uint8_t r_req_p[1 + crypto_box_PUBLICKEYBYTES] = {0};
+    uint8_t r_req_p[1 + crypto_box_PUBLICKEYBYTES] = {TCP_PACKET_ROUTING_REQUEST};
     memcpy(r_req_p + 1, f_public_key, crypto_box_PUBLICKEYBYTES);
     uint8_t r_req[2 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES];
     uint16_t size = 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES;
@@ -115,7 +115,7 @@ START_TEST(test_basic)
     ret = decrypt_data_symmetric(f_shared_key, f_nonce_r, packet_resp + 2, recv_data_len - 2, packet_resp_plain);
     ck_assert_msg(ret != -1, "decryption failed");
     increment_nonce(f_nonce_r);
-    ck_assert_msg(packet_resp_plain[0] == 1, "wrong packet id %u", packet_resp_plain[0]);
+    ck_assert_msg(packet_resp_plain[0] == TCP_PACKET_ROUTING_RESPONSE, "wrong packet id %u", packet_resp_plain[0]);
     ck_assert_msg(packet_resp_plain[1] == 0, "connection not refused %u", packet_resp_plain[1]);
     ck_assert_msg(public_key_cmp(packet_resp_plain + 2, f_public_key) == 0, "key in packet wrong");
     kill_TCP_server(tcp_s);
@@ -223,7 +223,7 @@ START_TEST(test_some)
     struct sec_TCP_con *con3 = new_TCP_con(tcp_s);
 
     uint8_t requ_p[1 + crypto_box_PUBLICKEYBYTES];
-    requ_p[0] = 0;
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
     memcpy(requ_p + 1, con3->public_key, crypto_box_PUBLICKEYBYTES);
     write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
     memcpy(requ_p + 1, con1->public_key, crypto_box_PUBLICKEYBYTES);
@@ -233,12 +233,12 @@ START_TEST(test_some)
     uint8_t data[2048];
     int len = read_packet_sec_TCP(con1, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
     ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
-    ck_assert_msg(data[0] == 1, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "wrong packet id %u", data[0]);
     ck_assert_msg(data[1] == 16, "connection not refused %u", data[1]);
     ck_assert_msg(public_key_cmp(data + 2, con3->public_key) == 0, "key in packet wrong");
     len = read_packet_sec_TCP(con3, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
     ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
-    ck_assert_msg(data[0] == 1, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "wrong packet id %u", data[0]);
     ck_assert_msg(data[1] == 16, "connection not refused %u", data[1]);
     ck_assert_msg(public_key_cmp(data + 2, con1->public_key) == 0, "key in packet wrong");
 
@@ -251,11 +251,11 @@ START_TEST(test_some)
     c_sleep(50);
     len = read_packet_sec_TCP(con1, data, 2 + 2 + crypto_box_MACBYTES);
     ck_assert_msg(len == 2, "wrong len %u", len);
-    ck_assert_msg(data[0] == 2, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "wrong packet id %u", data[0]);
     ck_assert_msg(data[1] == 16, "wrong peer id %u", data[1]);
     len = read_packet_sec_TCP(con3, data, 2 + 2 + crypto_box_MACBYTES);
     ck_assert_msg(len == 2, "wrong len %u", len);
-    ck_assert_msg(data[0] == 2, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "wrong packet id %u", data[0]);
     ck_assert_msg(data[1] == 16, "wrong peer id %u", data[1]);
     len = read_packet_sec_TCP(con1, data, 2 + sizeof(test_packet) + crypto_box_MACBYTES);
     ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
@@ -288,14 +288,14 @@ START_TEST(test_some)
     ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong %u %u %u %u", data[0], data[1],
                   data[sizeof(test_packet) - 2], data[sizeof(test_packet) - 1]);
 
-    uint8_t ping_packet[1 + sizeof(uint64_t)] = {4, 8, 6, 9, 67};
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 8, 6, 9, 67};
     write_packet_TCP_secure_connection(con1, ping_packet, sizeof(ping_packet));
     c_sleep(50);
     do_TCP_server(tcp_s);
     c_sleep(50);
     len = read_packet_sec_TCP(con1, data, 2 + sizeof(ping_packet) + crypto_box_MACBYTES);
     ck_assert_msg(len == sizeof(ping_packet), "wrong len %u", len);
-    ck_assert_msg(data[0] == 5, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[0] == TCP_PACKET_PONG, "wrong packet id %u", data[0]);
     ck_assert_msg(memcmp(ping_packet + 1, data + 1, sizeof(uint64_t)) == 0, "wrong packet data");
     kill_TCP_server(tcp_s);
     kill_TCP_con(con1);
@@ -304,6 +304,204 @@ START_TEST(test_some)
 }
 END_TEST
 
+#if !(defined(_WIN32) || defined(__WIN32__) || defined (WIN32))
+/* Read everything available on sock and check that it continues the byte sequence in *next. */
+static uint32_t read_sequence(int sock, uint8_t *next)
+{
+    uint8_t data[4096];
+    uint32_t total = 0;
+    int len, i;
+
+    while ((len = recv(sock, data, sizeof(data), 0)) > 0) {
+        for (i = 0; i < len; ++i) {
+            ck_assert_msg(data[i] == *next, "Wrong byte %u at %u", data[i], total + i);
+            ++*next;
+        }
+
+        total += len;
+    }
+
+    return total;
+}
+
+START_TEST(test_send_queue)
+{
+    int fds[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Failed to create sockets");
+    ck_assert_msg(set_socket_nonblock(fds[0]) && set_socket_nonblock(fds[1]), "Failed to set sockets non blocking");
+
+    uint8_t packet[MAX_PACKET_SIZE + 2];
+    uint8_t next = 0, expected = 5;
+    uint32_t i, queued = 0;
+
+    TCP_Send_Queue queue;
+    tcp_send_queue_init(&queue, 3 * sizeof(packet));
+
+    /* Small packets are packed together, the part of a packet that was sent is not queued. */
+    for (i = 0; i < 12; ++i)
+        packet[i] = next++;
+
+    ck_assert_msg(tcp_send_queue_add(&queue, packet, 12, 5) == 1, "Failed to add packet");
+
+    for (i = 0; i < sizeof(packet); ++i)
+        packet[i] = next++;
+
+    ck_assert_msg(tcp_send_queue_add(&queue, packet, sizeof(packet), 0) == 1, "Failed to add packet");
+    ck_assert_msg(queue.count == 1 && queue.bytes == 7 + sizeof(packet), "Wrong queue size %u %u", queue.count,
+                  queue.bytes);
+    ck_assert_msg(tcp_send_queue_fits(&queue, sizeof(packet)), "Packet should fit");
+
+    for (i = 0; i < sizeof(packet); ++i)
+        packet[i] = next++;
+
+    ck_assert_msg(tcp_send_queue_add(&queue, packet, sizeof(packet), 0) == 1, "Failed to add packet");
+    ck_assert_msg(!tcp_send_queue_fits(&queue, sizeof(packet)), "Packet should not fit");
+
+    ck_assert_msg(tcp_send_queue_flush(&queue, fds[0]) == 0, "Failed to flush queue");
+    ck_assert_msg(queue.count == 0 && queue.bytes == 0, "Queue not empty after flush");
+    ck_assert_msg(read_sequence(fds[1], &expected) == 7 + 2 * sizeof(packet), "Wrong number of bytes received");
+    tcp_send_queue_free(&queue);
+
+    /* Without a limit, fill the socket so that buffers are sent partly and the ring wraps around. */
+    tcp_send_queue_init(&queue, 0);
+    next = expected = 0;
+
+    do {
+        uint16_t length = 1 + (queued * 7919) % sizeof(packet);
+
+        for (i = 0; i < length; ++i)
+            packet[i] = next++;
+
+        ck_assert_msg(tcp_send_queue_add(&queue, packet, length, 0) == 1, "Failed to add packet");
+        queued += length;
+    } while (tcp_send_queue_flush(&queue, fds[0]) == 0 || queued < 512 * 1024);
+
+    uint32_t received = 0;
+
+    while (queue.count) {
+        received += read_sequence(fds[1], &expected);
+        tcp_send_queue_flush(&queue, fds[0]);
+    }
+
+    received += read_sequence(fds[1], &expected);
+    ck_assert_msg(received == queued, "Received %u bytes instead of %u", received, queued);
+
+    tcp_send_queue_free(&queue);
+    kill_sock(fds[0]);
+    kill_sock(fds[1]);
+}
+END_TEST
+#endif
+
+#ifdef TCP_SERVER_USE_WORKERS
+#define NUM_WORKERS 4
+#define NUM_WORKER_CONS 8
+
+START_TEST(test_workers)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server_workers(1, NUM_PORTS, ports, self_secret_key, NULL, NUM_WORKERS);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    ck_assert_msg(TCP_server_num_workers(tcp_s) == NUM_WORKERS, "wrong number of workers");
+
+    struct sec_TCP_con *cons[NUM_WORKER_CONS];
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_WORKER_CONS; ++i) {
+        cons[i] = new_TCP_con(tcp_s);
+    }
+
+    c_sleep(50);
+    TCP_Server_Stats stats;
+    uint64_t connections = 0;
+
+    for (i = 0; i < NUM_WORKERS; ++i) {
+        ck_assert_msg(TCP_server_stats(tcp_s, i, &stats) == 0, "could not get stats");
+        connections += stats.connections;
+    }
+
+    ck_assert_msg(TCP_server_stats(tcp_s, NUM_WORKERS, &stats) == -1, "got stats of a worker that doesn't exist");
+    ck_assert_msg(connections == 0, "connections confirmed before their first packet");
+
+    uint8_t data[2048];
+    int len;
+
+    /* Route every connection to the next one, whichever worker they ended up on. */
+    for (i = 0; i < NUM_WORKER_CONS; i += 2) {
+        struct sec_TCP_con *con1 = cons[i], *con2 = cons[i + 1];
+        uint8_t requ_p[1 + crypto_box_PUBLICKEYBYTES];
+        requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+        memcpy(requ_p + 1, con2->public_key, crypto_box_PUBLICKEYBYTES);
+        write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+        len = read_packet_sec_TCP(con1, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
+        ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
+        ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "wrong packet id %u", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "connection refused %u", data[1]);
+
+        memcpy(requ_p + 1, con1->public_key, crypto_box_PUBLICKEYBYTES);
+        write_packet_TCP_secure_connection(con2, requ_p, sizeof(requ_p));
+        len = read_packet_sec_TCP(con2, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
+        ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
+        ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "wrong packet id %u", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "connection refused %u", data[1]);
+
+        for (j = i; j < i + 2; ++j) {
+            len = read_packet_sec_TCP(cons[j], data, 2 + 2 + crypto_box_MACBYTES);
+            ck_assert_msg(len == 2, "wrong len %u", len);
+            ck_assert_msg(data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "wrong packet id %u", data[0]);
+            ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "wrong peer id %u", data[1]);
+        }
+    }
+
+    uint8_t test_packet[512] = {NUM_RESERVED_PORTS, 17, 16, 86, 99, 127, 255, 189, 78};
+
+    for (i = 0; i < NUM_WORKER_CONS; ++i) {
+        write_packet_TCP_secure_connection(cons[i], test_packet, sizeof(test_packet));
+        len = read_packet_sec_TCP(cons[i ^ 1], data, 2 + sizeof(test_packet) + crypto_box_MACBYTES);
+        ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
+        ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong %u %u", data[0], data[1]);
+    }
+
+    uint8_t oob_packet[1 + crypto_box_PUBLICKEYBYTES + 5] = {TCP_PACKET_OOB_SEND};
+    memcpy(oob_packet + 1, cons[NUM_WORKER_CONS - 1]->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(oob_packet + 1 + crypto_box_PUBLICKEYBYTES, "\x01\x02\x03\x04\x05", 5);
+    write_packet_TCP_secure_connection(cons[0], oob_packet, sizeof(oob_packet));
+    len = read_packet_sec_TCP(cons[NUM_WORKER_CONS - 1], data, 2 + sizeof(oob_packet) + crypto_box_MACBYTES);
+    ck_assert_msg(len == sizeof(oob_packet), "wrong len %u", len);
+    ck_assert_msg(data[0] == TCP_PACKET_OOB_RECV, "wrong packet id %u", data[0]);
+    ck_assert_msg(public_key_cmp(data + 1, cons[0]->public_key) == 0, "wrong sender");
+    ck_assert_msg(memcmp(data + 1 + crypto_box_PUBLICKEYBYTES, "\x01\x02\x03\x04\x05", 5) == 0, "wrong oob data");
+
+    connections = 0;
+    uint64_t routed = 0;
+
+    for (i = 0; i < NUM_WORKERS; ++i) {
+        TCP_server_stats(tcp_s, i, &stats);
+        connections += stats.connections;
+        routed += stats.packets_routed + stats.handoffs_sent;
+    }
+
+    ck_assert_msg(connections == NUM_WORKER_CONS, "wrong number of connections %u", (unsigned int)connections);
+    ck_assert_msg(routed >= NUM_WORKER_CONS, "packets were not counted");
+
+    /* Closing a connection tells the other end, even if it is on another worker. */
+    kill_TCP_con(cons[0]);
+    len = read_packet_sec_TCP(cons[1], data, 2 + 2 + crypto_box_MACBYTES);
+    ck_assert_msg(len == 2, "wrong len %u", len);
+    ck_assert_msg(data[0] == TCP_PACKET_DISCONNECT_NOTIFICATION, "wrong packet id %u", data[0]);
+    ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "wrong peer id %u", data[1]);
+
+    kill_TCP_server(tcp_s);
+
+    for (i = 1; i < NUM_WORKER_CONS; ++i) {
+        kill_TCP_con(cons[i]);
+    }
+}
+END_TEST
+#endif
+
 static int response_callback_good;
 static uint8_t response_callback_connection_id;
 static uint8_t response_callback_public_key[crypto_box_PUBLICKEYBYTES];
@@ -718,6 +916,12 @@ Suite *TCP_suite(void)
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
+#if !(defined(_WIN32) || defined(__WIN32__) || defined (WIN32))
+    DEFTESTCASE(send_queue);
+#endif
+#ifdef TCP_SERVER_USE_WORKERS
+    DEFTESTCASE_SLOW(workers, 10);
+#endif
     DEFTESTCASE_SLOW(client, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
@@ -7,6 +7,7 @@
 
 #include "../toxcore/tox.h"
 #include "../toxcore/DHT.c"
+#include "../toxcore/node_cache.h"
 
 #include "helpers.h"
 
@@ -18,28 +19,38 @@
     } while(0)
 
 
+Hardening *get_hardening(IPPTsPng *ipptp)
+{
+    IPPTs_Cold *cold = ipptsp_cold(ipptp);
+    ck_assert_msg(cold != NULL, "Failed to allocate the cold state of a node");
+    return &cold->hardening;
+}
+
 void mark_bad(IPPTsPng *ipptp)
 {
+    Hardening *hardening = get_hardening(ipptp);
     ipptp->timestamp = unix_time() - 2 * BAD_NODE_TIMEOUT;
-    ipptp->hardening.routes_requests_ok = 0;
-    ipptp->hardening.send_nodes_ok = 0;
-    ipptp->hardening.testing_requests = 0;
+    hardening->routes_requests_ok = 0;
+    hardening->send_nodes_ok = 0;
+    hardening->testing_requests = 0;
 }
 
 void mark_possible_bad(IPPTsPng *ipptp)
 {
+    Hardening *hardening = get_hardening(ipptp);
     ipptp->timestamp = unix_time();
-    ipptp->hardening.routes_requests_ok = 0;
-    ipptp->hardening.send_nodes_ok = 0;
-    ipptp->hardening.testing_requests = 0;
+    hardening->routes_requests_ok = 0;
+    hardening->send_nodes_ok = 0;
+    hardening->testing_requests = 0;
 }
 
 void mark_good(IPPTsPng *ipptp)
 {
+    Hardening *hardening = get_hardening(ipptp);
     ipptp->timestamp = unix_time();
-    ipptp->hardening.routes_requests_ok = (HARDENING_ALL_OK >> 0) & 1;
-    ipptp->hardening.send_nodes_ok = (HARDENING_ALL_OK >> 1) & 1;
-    ipptp->hardening.testing_requests = (HARDENING_ALL_OK >> 2) & 1;
+    hardening->routes_requests_ok = (HARDENING_ALL_OK >> 0) & 1;
+    hardening->send_nodes_ok = (HARDENING_ALL_OK >> 1) & 1;
+    hardening->testing_requests = (HARDENING_ALL_OK >> 2) & 1;
 }
 
 void mark_all_good(Client_data *list, uint32_t length, uint8_t ipv6)
@@ -237,19 +248,19 @@ void test_addto_lists_possible_bad(DHT            *dht,
     ck_assert_msg(inlist_id1 + inlist_id2 + inlist_id3 == 2, "Wrong client removed");
 
     if (!inlist_id1) {
-        ck_assert_msg(id_closest(comp_client_id, test_id2, test_id1, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id2, test_id1) == 1,
                       "Id has been removed but is closer to than another one");
-        ck_assert_msg(id_closest(comp_client_id, test_id3, test_id1, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id3, test_id1) == 1,
                       "Id has been removed but is closer to than another one");
     } else if (!inlist_id2) {
-        ck_assert_msg(id_closest(comp_client_id, test_id1, test_id2, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id1, test_id2) == 1,
                       "Id has been removed but is closer to than another one");
-        ck_assert_msg(id_closest(comp_client_id, test_id3, test_id2, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id3, test_id2) == 1,
                       "Id has been removed but is closer to than another one");
     } else if (!inlist_id3) {
-        ck_assert_msg(id_closest(comp_client_id, test_id1, test_id3, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id1, test_id3) == 1,
                       "Id has been removed but is closer to than another one");
-        ck_assert_msg(id_closest(comp_client_id, test_id2, test_id3, CLIENT_ID_SIZE) == 1,
+        ck_assert_msg(id_closest(comp_client_id, test_id2, test_id3) == 1,
                       "Id has been removed but is closer to than another one");
     }
 }
@@ -633,12 +644,458 @@ loop_top:
 }
 END_TEST
 
+START_TEST(test_shared_keys)
+{
+    Shared_Keys shared_keys;
+    memset(&shared_keys, 0, sizeof(Shared_Keys));
+    ck_assert_msg(shared_keys_init(&shared_keys, 4) == 0, "Failed to init shared keys.");
+
+    uint8_t self_pk[crypto_box_PUBLICKEYBYTES], self_sk[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_pk, self_sk);
+
+    uint8_t pks[6][crypto_box_PUBLICKEYBYTES];
+    uint8_t expected[6][crypto_box_BEFORENMBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint32_t i;
+
+    for (i = 0; i < 6; ++i) {
+        uint8_t sk[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(pks[i], sk);
+        encrypt_precompute(pks[i], self_sk, expected[i]);
+    }
+
+    for (i = 0; i < 4; ++i) {
+        get_shared_key(&shared_keys, shared_key, self_sk, pks[i]);
+        ck_assert_msg(memcmp(shared_key, expected[i], sizeof(shared_key)) == 0, "Wrong shared key.");
+    }
+
+    ck_assert_msg(shared_keys.misses == 4 && shared_keys.hits == 0, "Expected 4 misses.");
+
+    for (i = 0; i < 4; ++i) {
+        get_shared_key(&shared_keys, shared_key, self_sk, pks[i]);
+        ck_assert_msg(memcmp(shared_key, expected[i], sizeof(shared_key)) == 0, "Wrong cached shared key.");
+    }
+
+    ck_assert_msg(shared_keys.misses == 4 && shared_keys.hits == 4, "Expected 4 hits.");
+
+    /* Every key was requested so the clock hand gives them all a second chance and replaces the first. */
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[4]);
+    ck_assert_msg(shared_keys.evictions == 1, "Expected 1 eviction.");
+
+    /* Key 1 was requested since the hand passed, key 2 wasn't and gets replaced. */
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[1]);
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[5]);
+    ck_assert_msg(memcmp(shared_key, expected[5], sizeof(shared_key)) == 0, "Wrong shared key.");
+    ck_assert_msg(shared_keys.evictions == 2 && shared_keys.hits == 5, "Expected 2 evictions and 5 hits.");
+
+    uint64_t misses = shared_keys.misses;
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[1]);
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[3]);
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[4]);
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[5]);
+    ck_assert_msg(shared_keys.misses == misses, "Recently used keys were evicted.");
+
+    get_shared_key(&shared_keys, shared_key, self_sk, pks[2]);
+    ck_assert_msg(shared_keys.misses == misses + 1, "Evicted key is still cached.");
+    ck_assert_msg(memcmp(shared_key, expected[2], sizeof(shared_key)) == 0, "Wrong shared key.");
+
+    shared_keys_free(&shared_keys);
+}
+END_TEST
+
+/* Check that no node in list that could have been returned by get_close_nodes() for
+ * public_key is closer to it than the furthest node returned. */
+static void check_close_nodes(const uint8_t *public_key, const Node_format *nodes, unsigned int num_nodes,
+                              const Client_data *list, unsigned int length)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < length; ++i) {
+        if (is_timeout(list[i].assoc4.timestamp, BAD_NODE_TIMEOUT))
+            continue;
+
+        if (client_in_nodelist(nodes, num_nodes, list[i].public_key))
+            continue;
+
+        for (j = 0; j < num_nodes; ++j) {
+            ck_assert_msg(id_closest(public_key, nodes[j].public_key, list[i].public_key) != 2,
+                          "get_close_nodes() missed a closer node.");
+        }
+    }
+}
+
+START_TEST(test_close_nodes)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(ip, TOX_PORT_DEFAULT);
+    ck_assert_msg(net != 0, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    unsigned int i, j;
+
+    unix_time_update();
+
+    for (i = 0; i < 5000; ++i) {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 0);
+        ip_port.ip.ip4.uint32 = rand();
+        ip_port.port = rand() % (UINT16_MAX - 1) + 1;
+        randombytes(public_key, sizeof(public_key));
+        addto_lists(dht, ip_port, public_key);
+
+        if (i % 2 == 0) {
+            ck_assert_msg(get_close_client(dht, public_key) != NULL
+                          || !node_addable_to_close_list(dht, public_key, ip_port), "Node not in its bucket");
+        }
+    }
+
+    for (i = 0; i < 1000; ++i) {
+        Node_format nodes[MAX_SENT_NODES];
+
+        /* Also look for nodes in our own bucket and in the ones close to it. */
+        randombytes(public_key, sizeof(public_key));
+        memcpy(public_key, dht->self_public_key, i % 4);
+
+        int num_nodes = get_close_nodes(dht, public_key, nodes, 0, 1, 0);
+        ck_assert_msg(num_nodes == MAX_SENT_NODES, "Wrong number of close nodes: %i", num_nodes);
+        check_close_nodes(public_key, nodes, num_nodes, dht->close_clientlist, LCLIENT_LIST);
+
+        for (j = 0; j < dht->num_friends; ++j)
+            check_close_nodes(public_key, nodes, num_nodes, dht->friends_list[j].client_list, MAX_FRIEND_CLIENTS);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+/* Every address in the close list must be indexed, and nothing else. */
+static void check_close_ip_ports(const DHT *dht)
+{
+    unsigned int i, num = 0;
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *client = &dht->close_clientlist[i];
+
+        if (ipport_isset(&client->assoc4.ip_port)) {
+            ck_assert_msg(close_ip_port_index(dht, client->assoc4.ip_port) == (int)i, "IPv4 address %u not indexed", i);
+            ++num;
+        }
+
+        if (ipport_isset(&client->assoc6.ip_port)) {
+            ck_assert_msg(close_ip_port_index(dht, client->assoc6.ip_port) == (int)i, "IPv6 address %u not indexed", i);
+            ++num;
+        }
+    }
+
+    ck_assert_msg(dht->close_ip_ports.n == num, "%u addresses indexed, %u in the close list", dht->close_ip_ports.n, num);
+}
+
+START_TEST(test_close_ip_ports)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(ip, TOX_PORT_DEFAULT);
+    ck_assert_msg(net != 0, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    unsigned int i;
+
+    unix_time_update();
+
+    for (i = 0; i < 3000; ++i) {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 0);
+        /* Few addresses so that known addresses come back with new keys. */
+        ip_port.ip.ip4.uint32 = rand() % 512 + 1;
+        ip_port.port = rand() % 2 + 1;
+        randombytes(public_key, sizeof(public_key));
+
+        int old_index = close_ip_port_index(dht, ip_port);
+        addto_lists(dht, ip_port, public_key);
+
+        /* The old key at a known address is killed, the new one may not fit in its bucket. */
+        if (old_index != -1) {
+            const Client_data *client = get_close_client(dht, public_key);
+            int index = client == NULL ? -1 : client - dht->close_clientlist;
+            ck_assert_msg(close_ip_port_index(dht, ip_port) == index, "Known address not moved to the new key");
+        }
+
+        if (i % 100 == 0)
+            check_close_ip_ports(dht);
+    }
+
+    check_close_ip_ports(dht);
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+static Node_format random_cache_node(void)
+{
+    Node_format node;
+    randombytes(node.public_key, sizeof(node.public_key));
+    ip_init(&node.ip_port.ip, 0);
+    node.ip_port.ip.ip4.uint32 = rand();
+    node.ip_port.port = rand() % (UINT16_MAX - 1) + 1;
+    return node;
+}
+
+START_TEST(test_node_cache)
+{
+    Node_Cache *cache = new_node_cache();
+    ck_assert_msg(cache != NULL, "Failed to create the node cache");
+
+    unix_time_update();
+
+    Node_format nodes[NODE_CACHE_DHT_NODES];
+    ck_assert_msg(node_cache_best(cache, NODE_CACHE_TYPE_DHT, nodes, NODE_CACHE_DHT_NODES) == 0, "Nodes in empty cache");
+
+    /* A node that always answers, one that answers half the time and one that always answers slowly. */
+    Node_format reliable = random_cache_node(), flaky = random_cache_node(), slow = random_cache_node();
+    node_cache_success(cache, NODE_CACHE_TYPE_DHT, &reliable, 10);
+    node_cache_success(cache, NODE_CACHE_TYPE_DHT, &flaky, 10);
+    node_cache_success(cache, NODE_CACHE_TYPE_DHT, &slow, 1000);
+
+    unsigned int i;
+
+    for (i = 0; i < 20; ++i) {
+        node_cache_attempt(cache, NODE_CACHE_TYPE_DHT, reliable.public_key);
+        node_cache_success(cache, NODE_CACHE_TYPE_DHT, &reliable, 10);
+        node_cache_attempt(cache, NODE_CACHE_TYPE_DHT, flaky.public_key);
+
+        if (i % 2)
+            node_cache_success(cache, NODE_CACHE_TYPE_DHT, &flaky, 10);
+
+        node_cache_attempt(cache, NODE_CACHE_TYPE_DHT, slow.public_key);
+        node_cache_success(cache, NODE_CACHE_TYPE_DHT, &slow, 1000);
+    }
+
+    /* Relays are kept apart from DHT nodes. */
+    Node_format relay = random_cache_node();
+    node_cache_success(cache, NODE_CACHE_TYPE_TCP, &relay, 50);
+
+    ck_assert_msg(node_cache_best(cache, NODE_CACHE_TYPE_DHT, nodes, NODE_CACHE_DHT_NODES) == 3, "Wrong number of nodes");
+    ck_assert_msg(public_key_cmp(nodes[0].public_key, reliable.public_key) == 0, "Reliable node not ranked first");
+    ck_assert_msg(public_key_cmp(nodes[1].public_key, flaky.public_key) == 0, "Flaky node not ranked second");
+    ck_assert_msg(node_cache_best(cache, NODE_CACHE_TYPE_TCP, nodes, NODE_CACHE_DHT_NODES) == 1
+                  && public_key_cmp(nodes[0].public_key, relay.public_key) == 0, "Relay not cached");
+
+    /* New nodes replace the worst ones once the cache is full, the reliable node stays. */
+    for (i = 0; i < NODE_CACHE_DHT_NODES * 2; ++i) {
+        Node_format node = random_cache_node();
+        node_cache_success(cache, NODE_CACHE_TYPE_DHT, &node, 10);
+    }
+
+    ck_assert_msg(node_cache_best(cache, NODE_CACHE_TYPE_DHT, nodes, NODE_CACHE_DHT_NODES) == NODE_CACHE_DHT_NODES,
+                  "Cache not full");
+    ck_assert_msg(public_key_cmp(nodes[0].public_key, reliable.public_key) == 0, "Reliable node evicted");
+
+    uint32_t size = node_cache_size(cache);
+    uint8_t data[size];
+    node_cache_save(cache, data);
+
+    Node_Cache *loaded = new_node_cache();
+    ck_assert_msg(loaded != NULL, "Failed to create the node cache");
+    ck_assert_msg(node_cache_load(loaded, data, size) == 0, "Failed to load the node cache");
+    ck_assert_msg(memcmp(loaded->num_entries, cache->num_entries, sizeof(cache->num_entries)) == 0, "Wrong number of nodes loaded");
+
+    Node_format loaded_nodes[NODE_CACHE_DHT_NODES];
+    node_cache_best(loaded, NODE_CACHE_TYPE_DHT, loaded_nodes, NODE_CACHE_DHT_NODES);
+
+    for (i = 0; i < NODE_CACHE_DHT_NODES; ++i) {
+        ck_assert_msg(public_key_cmp(loaded_nodes[i].public_key, nodes[i].public_key) == 0
+                      && ipport_equal(&loaded_nodes[i].ip_port, &nodes[i].ip_port), "Node %u changed by loading", i);
+    }
+
+    ck_assert_msg(node_cache_load(loaded, data, size - 1) == -1, "Loaded a truncated node cache");
+    ck_assert_msg(loaded->num_entries[NODE_CACHE_TYPE_DHT] == 0, "Failed load left nodes in the cache");
+    data[0] ^= 1;
+    ck_assert_msg(node_cache_load(loaded, data, size) == -1, "Loaded a node cache with a wrong cookie");
+
+    kill_node_cache(loaded);
+    kill_node_cache(cache);
+}
+END_TEST
+
+/* The byte by byte comparison the kernels replace. */
+static int reference_id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        uint8_t distance1 = pk[i] ^ pk1[i], distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 != distance2)
+            return distance1 < distance2 ? 1 : 2;
+    }
+
+    return 0;
+}
+
+#define XOR_TEST_KEYS 1000
+#define XOR_TEST_CLOSEST 8
+
+static _Bool even_index(const void *object, uint32_t index)
+{
+    return index % 2 == 0;
+}
+
+START_TEST(test_xor_distance)
+{
+    uint8_t pk[crypto_box_PUBLICKEYBYTES], pk1[crypto_box_PUBLICKEYBYTES], pk2[crypto_box_PUBLICKEYBYTES];
+    unsigned int i, j;
+
+    for (i = 0; i < 10000; ++i) {
+        randombytes(pk, sizeof(pk));
+        randombytes(pk1, sizeof(pk1));
+        memcpy(pk2, pk1, sizeof(pk2));
+
+        /* Keys that share a random number of bytes. */
+        unsigned int shared = rand() % (crypto_box_PUBLICKEYBYTES + 1);
+
+        if (shared < crypto_box_PUBLICKEYBYTES)
+            pk2[shared] ^= 1 << (rand() % 8);
+
+        ck_assert_msg(id_closest(pk, pk1, pk2) == reference_id_closest(pk, pk1, pk2), "Wrong id_closest");
+        ck_assert_msg(key_first_difference(pk1, pk2) == shared, "Wrong first difference");
+
+        unsigned int bit = 0;
+
+        while (bit < crypto_box_PUBLICKEYBYTES * 8 && !((pk1[bit / 8] ^ pk2[bit / 8]) & (0x80 >> (bit % 8))))
+            ++bit;
+
+        ck_assert_msg(bit_by_bit_cmp(pk1, pk2) == bit, "Wrong bit_by_bit_cmp");
+    }
+
+    Key_Array keys;
+    ck_assert_msg(key_array_init(&keys, XOR_TEST_KEYS) == 0, "Failed to create key array");
+    uint8_t (*key_list)[crypto_box_PUBLICKEYBYTES] = malloc(XOR_TEST_KEYS * crypto_box_PUBLICKEYBYTES);
+
+    for (i = 0; i < XOR_TEST_KEYS; ++i) {
+        randombytes(key_list[i], crypto_box_PUBLICKEYBYTES);
+
+        /* Some keys share their first word with others. */
+        if (i % 10 == 1)
+            memcpy(key_list[i], key_list[i - 1], sizeof(uint32_t));
+
+        key_array_set(&keys, i, key_list[i]);
+    }
+
+    key_array_get(&keys, 5, pk);
+    ck_assert_msg(public_key_cmp(pk, key_list[5]) == 0, "Key changed in the key array");
+    ck_assert_msg(key_array_find(&keys, 0, XOR_TEST_KEYS, key_list[777]) == 777, "Key not found");
+    ck_assert_msg(key_array_find(&keys, 0, 777, key_list[777]) == -1, "Key found outside of the range");
+    key_array_clear(&keys, 777);
+    ck_assert_msg(key_array_find(&keys, 0, XOR_TEST_KEYS, key_list[777]) == -1, "Cleared key found");
+    key_array_set(&keys, 777, key_list[777]);
+
+    for (i = 0; i < 100; ++i) {
+        randombytes(pk, sizeof(pk));
+
+        uint32_t first = rand() % XOR_TEST_KEYS, num = rand() % (XOR_TEST_KEYS - first + 1);
+        uint32_t indexes[XOR_TEST_CLOSEST];
+
+        /* Every other search only picks the keys with an even index. */
+        _Bool filtered = i % 2;
+        uint32_t num_picked = filtered ? (first + num + 1) / 2 - (first + 1) / 2 : num;
+        uint32_t count = key_array_closest(&keys, first, num, pk, indexes, XOR_TEST_CLOSEST,
+                                           filtered ? even_index : NULL, NULL);
+        ck_assert_msg(count == MIN(num_picked, XOR_TEST_CLOSEST), "Wrong number of closest keys");
+
+        for (j = 0; j < count; ++j) {
+            ck_assert_msg(indexes[j] >= first && indexes[j] < first + num, "Closest key outside of the range");
+            ck_assert_msg(!filtered || indexes[j] % 2 == 0, "Filtered out key picked");
+
+            if (j > 0)
+                ck_assert_msg(id_closest(pk, key_list[indexes[j - 1]], key_list[indexes[j]]) == 1,
+                              "Closest keys not in order");
+        }
+
+        /* No key left out is closer than the furthest one returned. */
+        uint32_t k;
+
+        for (k = first; k < first + num && count == XOR_TEST_CLOSEST; ++k) {
+            if (filtered && k % 2)
+                continue;
+
+            for (j = 0; j < count && indexes[j] != k; ++j);
+
+            if (j == count)
+                ck_assert_msg(id_closest(pk, key_list[indexes[count - 1]], key_list[k]) == 1, "Closer key left out");
+        }
+    }
+
+    free(key_list);
+    key_array_free(&keys);
+}
+END_TEST
+
+START_TEST(test_cold_state)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(ip, TOX_PORT_DEFAULT);
+    ck_assert_msg(net != 0, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ip_port, ret_ip_port, self_ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 1;
+    ip_port.ip.ip4.uint8[3] = 4;
+    ip_port.port = htons(33445);
+    randombytes(public_key, sizeof(public_key));
+    addto_lists(dht, ip_port, public_key);
+
+    int index = close_client_index(dht, public_key);
+    ck_assert_msg(index != -1, "Node not added to the close list");
+    Client_data *client = &dht->close_clientlist[index];
+    ck_assert_msg(client->assoc4.cold == NULL && client->assoc6.cold == NULL, "Cold state allocated for a new node");
+
+    ret_ip_port = ip_port;
+    ret_ip_port.ip.ip4.uint8[3] = 5;
+    returnedip_ports(dht, ret_ip_port, dht->self_public_key, public_key);
+    ck_assert_msg(client->assoc4.cold != NULL && client->assoc6.cold == NULL, "Cold state not allocated when set");
+    ck_assert_msg(ipport_equal(ipptsp_ret(&client->assoc4), &ret_ip_port), "Wrong returned ip_port");
+
+    ip_init(&self_ip_port.ip, 0);
+    self_ip_port.port = 0;
+    ck_assert_msg(ipport_self_copy(dht, &self_ip_port) == 0 && ipport_equal(&self_ip_port, &ret_ip_port),
+                  "Wrong ip_port of self");
+
+    /* A new public key at the same ip_port kills the old node with its cold state. */
+    randombytes(public_key, sizeof(public_key));
+    addto_lists(dht, ip_port, public_key);
+    index = close_client_index(dht, public_key);
+    ck_assert_msg(index != -1, "Node not added to the close list");
+    ck_assert_msg(dht->close_clientlist[index].assoc4.cold == NULL, "Cold state of the old node kept");
+    ip_reset(&self_ip_port.ip);
+    ck_assert_msg(ipport_self_copy(dht, &self_ip_port) == -1, "Returned ip_port of the old node kept");
+
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
 Suite *dht_suite(void)
 {
     Suite *s = suite_create("DHT");
 
     //DEFTESTCASE(addto_lists_ipv4);
     //DEFTESTCASE(addto_lists_ipv6);
+    DEFTESTCASE(shared_keys);
+    DEFTESTCASE(close_nodes);
+    DEFTESTCASE(close_ip_ports);
+    DEFTESTCASE(node_cache);
+    DEFTESTCASE(xor_distance);
+    DEFTESTCASE(cold_state);
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
     return s;
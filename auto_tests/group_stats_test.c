@@ -0,0 +1,259 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/tox.h"
+#include "../toxcore/Messenger.h"
+#include "../toxcore/group_connection.h"
+#include "../toxcore/util.h"
+
+#include "helpers.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+#define GROUP_NAME "Stats"
+#define NUM_MESSAGES 10
+#define TCP_RELAY_PORT 33580
+
+/* What the callbacks of a tox saw. */
+typedef struct {
+    uint32_t peer_id; /* Last peer that joined the group. */
+    _Bool peer_joined;
+    uint32_t messages;
+} State;
+
+static State states[2];
+
+static void handle_friend_request(Tox *tox, const uint8_t *public_key, const uint8_t *message, size_t length,
+                                  void *user_data)
+{
+    tox_friend_add_norequest(tox, public_key, 0);
+}
+
+static void set_peer_info(struct Group_Chat_Self_Peer_Info *peer_info, const char *nick)
+{
+    memset(peer_info, 0, sizeof(struct Group_Chat_Self_Peer_Info));
+    memcpy(peer_info->nick, nick, strlen(nick));
+    peer_info->nick_length = strlen(nick);
+    peer_info->user_status = TOX_USER_STATUS_NONE;
+}
+
+static void handle_group_invite(Tox *tox, uint32_t friend_number, const uint8_t *invite_data, size_t length,
+                                void *user_data)
+{
+    struct Group_Chat_Self_Peer_Info peer_info;
+    set_peer_info(&peer_info, "invited");
+
+    TOX_ERR_GROUP_INVITE_ACCEPT error;
+    tox_group_invite_accept(tox, friend_number, invite_data, length, 0, 0, &peer_info, &error);
+    ck_assert_msg(error == TOX_ERR_GROUP_INVITE_ACCEPT_OK, "Failed to accept invite: %d", error);
+}
+
+static void handle_peer_join(Tox *tox, uint32_t groupnumber, uint32_t peer_id, void *user_data)
+{
+    State *state = user_data;
+    state->peer_id = peer_id;
+    state->peer_joined = 1;
+}
+
+static void handle_group_message(Tox *tox, uint32_t groupnumber, uint32_t peer_id, TOX_MESSAGE_TYPE type,
+                                 const uint8_t *message, size_t length, void *user_data)
+{
+    State *state = user_data;
+    ++state->messages;
+}
+
+static _Bool relay_connected(TCP_Connections *tcp_c)
+{
+    Node_format relay;
+    return tcp_copy_connected_relays(tcp_c, &relay, 1) != 0;
+}
+
+static void iterate(Tox **toxes)
+{
+    tox_iterate(toxes[0]);
+    tox_iterate(toxes[1]);
+    c_sleep(20);
+}
+
+/* Stats of the peer the other tox sees in the group, which must be there. */
+static struct Tox_Connection_Stats peer_stats(Tox *tox, const State *state)
+{
+    struct Tox_Connection_Stats stats;
+    TOX_ERR_GROUP_PEER_QUERY error;
+    ck_assert_msg(tox_group_peer_get_connection_stats(tox, 0, state->peer_id, &stats, &error),
+                  "Failed to get peer stats: %d", error);
+    ck_assert_msg(error == TOX_ERR_GROUP_PEER_QUERY_OK, "Wrong error: %d", error);
+    return stats;
+}
+
+static GC_Connection *peer_connection(Tox *tox, const State *state)
+{
+    Messenger *m = (Messenger *)tox;
+    GC_Chat *chat = gc_get_group(m->group_handler, 0);
+    uint32_t i;
+
+    for (i = 0; i < chat->numpeers; ++i) {
+        if (chat->group[i].peer_id == state->peer_id)
+            return gcc_get_connection(chat, i);
+    }
+
+    ck_abort_msg("Peer %u not found", state->peer_id);
+    return NULL;
+}
+
+START_TEST(test_group_peer_stats)
+{
+    Tox *toxes[2];
+    uint32_t i;
+
+    struct Tox_Options options;
+    tox_options_default(&options);
+
+    for (i = 0; i < 2; ++i) {
+        /* Group handshakes carry a TCP relay, the first tox is one. */
+        options.tcp_port = i == 0 ? TCP_RELAY_PORT : 0;
+        toxes[i] = tox_new(&options, 0);
+        ck_assert_msg(toxes[i] != NULL, "Failed to create tox");
+        tox_callback_group_peer_join(toxes[i], &handle_peer_join, &states[i]);
+        tox_callback_group_message(toxes[i], &handle_group_message, &states[i]);
+    }
+
+    tox_callback_friend_request(toxes[0], &handle_friend_request, NULL);
+    tox_callback_group_invite(toxes[1], &handle_group_invite, NULL);
+
+    uint8_t address[TOX_ADDRESS_SIZE], dht_id[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_address(toxes[0], address);
+    tox_self_get_dht_id(toxes[0], dht_id);
+    ck_assert_msg(tox_friend_add(toxes[1], address, (const uint8_t *)"hi", 2, 0) == 0, "Failed to add friend");
+    ck_assert_msg(tox_bootstrap(toxes[1], "::1", tox_self_get_udp_port(toxes[0], 0), dht_id, 0), "Failed to bootstrap");
+
+    for (i = 0; i < 2; ++i)
+        ck_assert_msg(tox_add_tcp_relay(toxes[i], "127.0.0.1", TCP_RELAY_PORT, dht_id, 0), "Failed to add TCP relay");
+
+    uint64_t start = time(NULL);
+
+    while (tox_friend_get_connection_status(toxes[0], 0, 0) == TOX_CONNECTION_NONE
+            || tox_friend_get_connection_status(toxes[1], 0, 0) == TOX_CONNECTION_NONE
+            || !relay_connected(((Messenger *)toxes[0])->net_crypto->tcp_c)
+            || !relay_connected(((Messenger *)toxes[1])->net_crypto->tcp_c)) {
+        ck_assert_msg(time(NULL) - start < 60, "Friends failed to connect");
+        iterate(toxes);
+    }
+
+    struct Group_Chat_Self_Peer_Info peer_info;
+    set_peer_info(&peer_info, "founder");
+    TOX_ERR_GROUP_NEW new_error;
+    uint32_t groupnumber = tox_group_new(toxes[0], TOX_GROUP_PRIVACY_STATE_PRIVATE, (const uint8_t *)GROUP_NAME,
+                                         sizeof(GROUP_NAME) - 1, &peer_info, &new_error);
+    ck_assert_msg(new_error == TOX_ERR_GROUP_NEW_OK && groupnumber == 0, "Failed to create group: %d", new_error);
+
+    /* The invite is only confirmed once the group is connected to a relay. */
+    start = time(NULL);
+
+    while (!relay_connected(gc_get_group(((Messenger *)toxes[0])->group_handler, 0)->tcp_conn)) {
+        ck_assert_msg(time(NULL) - start < 60, "Group failed to connect to the relay");
+        iterate(toxes);
+    }
+
+    TOX_ERR_GROUP_INVITE_FRIEND invite_error;
+    tox_group_invite_friend(toxes[0], 0, 0, &invite_error);
+    ck_assert_msg(invite_error == TOX_ERR_GROUP_INVITE_FRIEND_OK, "Failed to invite friend: %d", invite_error);
+
+    start = time(NULL);
+
+    while (!states[0].peer_joined || !states[1].peer_joined
+            || peer_stats(toxes[0], &states[0]).connection_status == TOX_CONNECTION_NONE
+            || peer_stats(toxes[1], &states[1]).connection_status == TOX_CONNECTION_NONE) {
+        ck_assert_msg(time(NULL) - start < 60, "Peers failed to connect in the group");
+        iterate(toxes);
+    }
+
+    struct Tox_Connection_Stats before = peer_stats(toxes[0], &states[0]);
+
+    for (i = 0; i < NUM_MESSAGES; ++i) {
+        TOX_ERR_GROUP_SEND_MESSAGE error;
+        tox_group_send_message(toxes[0], 0, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *)"stats", 5, &error);
+        ck_assert_msg(error == TOX_ERR_GROUP_SEND_MESSAGE_OK, "Failed to send message: %d", error);
+    }
+
+    start = time(NULL);
+
+    while (states[1].messages < NUM_MESSAGES) {
+        ck_assert_msg(time(NULL) - start < 60, "Only %u messages arrived", states[1].messages);
+        iterate(toxes);
+    }
+
+    struct Tox_Connection_Stats after = peer_stats(toxes[0], &states[0]);
+    ck_assert_msg(after.packets_sent - before.packets_sent >= NUM_MESSAGES, "Sent %llu packets for %u messages",
+                  (unsigned long long)(after.packets_sent - before.packets_sent), NUM_MESSAGES);
+    ck_assert_msg(peer_stats(toxes[1], &states[1]).packets_received >= NUM_MESSAGES, "Peer received too few packets");
+    ck_assert_msg(after.send_rate == 0 && after.recv_rate == 0, "Rates set for a group peer");
+
+    /* The peers found each other through the relay, direct packets make it UDP. */
+    Messenger *m = (Messenger *)toxes[0];
+    GC_Connection *gconn = peer_connection(toxes[0], &states[0]);
+    gconn->last_recv_direct_time = 0;
+    ck_assert_msg(peer_stats(toxes[0], &states[0]).connection_status == TOX_CONNECTION_TCP, "Peer not reported on TCP");
+    gconn->last_recv_direct_time = unix_time();
+    ck_assert_msg(peer_stats(toxes[0], &states[0]).connection_status == TOX_CONNECTION_UDP, "Peer not reported direct");
+
+    /* Neither without the relay. */
+    gconn->last_recv_direct_time = 0;
+    kill_tcp_connection_to(gc_get_group(m->group_handler, 0)->tcp_conn, gconn->tcp_connection_num);
+    ck_assert_msg(peer_stats(toxes[0], &states[0]).connection_status == TOX_CONNECTION_NONE,
+                  "Peer reported connected without a path");
+
+    struct Tox_Connection_Stats stats;
+    TOX_ERR_GROUP_PEER_QUERY error;
+    ck_assert_msg(!tox_group_peer_get_connection_stats(toxes[0], 1, states[0].peer_id, &stats, &error)
+                  && error == TOX_ERR_GROUP_PEER_QUERY_GROUP_NOT_FOUND, "Got stats in a group that doesn't exist");
+    ck_assert_msg(!tox_group_peer_get_connection_stats(toxes[0], 0, states[0].peer_id + 1000, &stats, &error)
+                  && error == TOX_ERR_GROUP_PEER_QUERY_PEER_NOT_FOUND, "Got stats of a peer that doesn't exist");
+    ck_assert_msg(!tox_group_peer_get_connection_stats(toxes[0], 0, states[0].peer_id, NULL, &error)
+                  && error == TOX_ERR_GROUP_PEER_QUERY_NULL, "Got stats without a struct to put them in");
+
+    TOX_ERR_FRIEND_QUERY friend_error;
+    ck_assert_msg(!tox_friend_get_connection_stats(toxes[0], 0, NULL, &friend_error)
+                  && friend_error == TOX_ERR_FRIEND_QUERY_NULL, "Got friend stats without a struct to put them in");
+
+    tox_kill(toxes[0]);
+    tox_kill(toxes[1]);
+}
+END_TEST
+
+Suite *group_stats_suite(void)
+{
+    Suite *s = suite_create("Group_Stats");
+
+    DEFTESTCASE_SLOW(group_peer_stats, 200);
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *group_stats = group_stats_suite();
+    SRunner *test_runner = srunner_create(group_stats);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -0,0 +1,181 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/hash_map.h"
+#include "../toxcore/crypto_core.h"
+
+#include "helpers.h"
+
+#define ELEMENT_SIZE 37
+#define NUM_ELEMENTS 5000
+
+/* Every element must be reachable from its home slot without crossing an empty slot. */
+static void check_probe_sequences(const Hash_Map *map)
+{
+    uint32_t mask = map->capacity - 1;
+    uint32_t i, n = 0;
+
+    for (i = 0; i < map->capacity; ++i) {
+        if (map->slots[i].id == -1)
+            continue;
+
+        ++n;
+        uint32_t j;
+
+        for (j = map->slots[i].hash & mask; j != i; j = (j + 1) & mask)
+            ck_assert_msg(map->slots[j].id != -1, "Empty slot %u between the home of slot %u and it", j, i);
+    }
+
+    ck_assert_msg(n == map->n, "Map holds %u elements but counts %u", n, map->n);
+    ck_assert_msg(map->n < map->capacity || map->capacity == 0, "Map has no empty slot");
+}
+
+START_TEST(test_basic)
+{
+    Hash_Map map;
+    uint8_t element[ELEMENT_SIZE], other[ELEMENT_SIZE];
+
+    ck_assert_msg(hash_map_init(&map, ELEMENT_SIZE, 0) == 1, "Failed to init map");
+    randombytes(element, sizeof(element));
+    memcpy(other, element, sizeof(other));
+    other[ELEMENT_SIZE - 1] ^= 1;
+
+    ck_assert_msg(hash_map_find(&map, element) == -1, "Found element in empty map");
+    ck_assert_msg(hash_map_remove(&map, element, 0) == 0, "Removed element from empty map");
+    ck_assert_msg(hash_map_add(&map, element, -1) == 0, "Added negative id");
+    ck_assert_msg(hash_map_add(&map, element, 7) == 1, "Failed to add element");
+    ck_assert_msg(hash_map_add(&map, element, 8) == 0, "Added element twice");
+    ck_assert_msg(hash_map_find(&map, element) == 7, "Wrong id found");
+    /* Elements that differ in the bytes after the last full word are different elements. */
+    ck_assert_msg(hash_map_find(&map, other) == -1, "Found element never added");
+    ck_assert_msg(hash_map_add(&map, other, 8) == 1, "Failed to add second element");
+    ck_assert_msg(hash_map_remove(&map, element, 8) == 0, "Removed element with the wrong id");
+    ck_assert_msg(hash_map_remove(&map, element, 7) == 1, "Failed to remove element");
+    ck_assert_msg(hash_map_find(&map, element) == -1, "Found removed element");
+    ck_assert_msg(hash_map_find(&map, other) == 8, "Lost second element");
+    ck_assert_msg(hash_map_remove(&map, other, 8) == 1, "Failed to remove second element");
+    ck_assert_msg(map.n == 0, "Map not empty");
+    ck_assert_msg(hash_map_trim(&map) == 1 && map.capacity == 0, "Failed to trim empty map");
+    ck_assert_msg(hash_map_add(&map, element, 1) == 1, "Failed to add element after trim");
+    hash_map_free(&map);
+}
+END_TEST
+
+START_TEST(test_full)
+{
+    Hash_Map map;
+    uint8_t elements[64][ELEMENT_SIZE];
+    uint32_t i;
+
+    randombytes((uint8_t *)elements, sizeof(elements));
+    ck_assert_msg(hash_map_init(&map, ELEMENT_SIZE, 6) == 1, "Failed to init map");
+    ck_assert_msg(map.capacity == 8, "Capacity for 6 elements is %u", map.capacity);
+
+    /* A map fills up to 3/4 of its slots before growing, so probing always ends at an empty slot. */
+    for (i = 0; i < 6; ++i)
+        ck_assert_msg(hash_map_add(&map, elements[i], i) == 1, "Failed to add element %u", i);
+
+    ck_assert_msg(map.capacity == 8, "Map grew before it was 3/4 full");
+    check_probe_sequences(&map);
+    ck_assert_msg(hash_map_find(&map, elements[63]) == -1, "Found element never added in full map");
+
+    ck_assert_msg(hash_map_add(&map, elements[6], 6) == 1, "Failed to add element to full map");
+    ck_assert_msg(map.capacity == 16, "Full map grew to %u slots", map.capacity);
+    check_probe_sequences(&map);
+
+    for (i = 7; i < 64; ++i)
+        ck_assert_msg(hash_map_add(&map, elements[i], i) == 1, "Failed to add element %u", i);
+
+    for (i = 0; i < 64; ++i)
+        ck_assert_msg(hash_map_find(&map, elements[i]) == (int)i, "Element %u lost while growing", i);
+
+    uint32_t capacity = map.capacity;
+
+    /* The map shrinks when it is less than 1/8 full. */
+    for (i = 0; i < 64; ++i) {
+        ck_assert_msg(hash_map_remove(&map, elements[i], i) == 1, "Failed to remove element %u", i);
+        check_probe_sequences(&map);
+    }
+
+    ck_assert_msg(map.capacity < capacity, "Map did not shrink");
+    hash_map_free(&map);
+}
+END_TEST
+
+START_TEST(test_backward_shift)
+{
+    Hash_Map map;
+    uint8_t (*elements)[ELEMENT_SIZE] = malloc(NUM_ELEMENTS * ELEMENT_SIZE);
+    uint8_t *added = calloc(NUM_ELEMENTS, 1);
+    uint32_t i, round;
+
+    ck_assert_msg(elements != NULL && added != NULL, "Out of memory");
+    randombytes((uint8_t *)elements, NUM_ELEMENTS * ELEMENT_SIZE);
+    ck_assert_msg(hash_map_init(&map, ELEMENT_SIZE, 8) == 1, "Failed to init map");
+
+    /* Removing an element shifts the rest of its probe sequence back, which must leave every
+     * other element findable whatever the order of adds and removes. */
+    for (round = 0; round < 20 * NUM_ELEMENTS; ++round) {
+        i = rand() % NUM_ELEMENTS;
+
+        if (added[i]) {
+            ck_assert_msg(hash_map_remove(&map, elements[i], i) == 1, "Failed to remove element %u", i);
+        } else {
+            ck_assert_msg(hash_map_add(&map, elements[i], i) == 1, "Failed to add element %u", i);
+        }
+
+        added[i] = !added[i];
+
+        if (round % 1000 == 0)
+            check_probe_sequences(&map);
+    }
+
+    check_probe_sequences(&map);
+
+    for (i = 0; i < NUM_ELEMENTS; ++i)
+        ck_assert_msg(hash_map_find(&map, elements[i]) == (added[i] ? (int)i : -1), "Wrong id for element %u", i);
+
+    ck_assert_msg(hash_map_trim(&map) == 1, "Failed to trim map");
+
+    for (i = 0; i < NUM_ELEMENTS; ++i)
+        ck_assert_msg(hash_map_find(&map, elements[i]) == (added[i] ? (int)i : -1), "Wrong id after trim for %u", i);
+
+    hash_map_free(&map);
+    free(added);
+    free(elements);
+}
+END_TEST
+
+Suite *hash_map_suite(void)
+{
+    Suite *s = suite_create("Hash_Map");
+
+    DEFTESTCASE(basic);
+    DEFTESTCASE(full);
+    DEFTESTCASE_SLOW(backward_shift, 20);
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *hash_map = hash_map_suite();
+    SRunner *test_runner = srunner_create(hash_map);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -0,0 +1,142 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/tox.h"
+#include "../toxcore/network.h"
+
+#include "helpers.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+/* Interval tox_iteration_interval() returns at most while something has to run on every iteration. */
+#define BUSY_INTERVAL 50
+
+static Tox *new_test_tox(void)
+{
+    Tox *tox = tox_new(0, 0);
+    ck_assert_msg(tox != NULL, "Failed to create tox");
+    return tox;
+}
+
+/* Run tox for ms, sleeping for tox_iteration_interval() between iterations.
+ *
+ * return the number of iterations.
+ */
+static unsigned int run_for(Tox *tox, uint64_t ms)
+{
+    uint64_t end = current_time_monotonic() + ms;
+    unsigned int iterations = 0;
+
+    while (current_time_monotonic() < end) {
+        tox_iterate(tox);
+        ++iterations;
+
+        uint32_t interval = tox_iteration_interval(tox);
+        ck_assert_msg(interval <= 1000, "Idle tox sleeps for %u ms", interval);
+        c_sleep(interval);
+    }
+
+    return iterations;
+}
+
+START_TEST(test_idle)
+{
+    Tox *tox = new_test_tox();
+
+    /* Nothing but the once a second timers has to run. */
+    unsigned int iterations = run_for(tox, 5000);
+    ck_assert_msg(iterations <= 5 * 3, "Idle tox iterated %u times in 5 seconds", iterations);
+
+    /* The interval is the time to the next deadline, not a fixed throttle. */
+    tox_iterate(tox);
+    uint32_t interval = tox_iteration_interval(tox);
+    c_sleep(interval);
+    ck_assert_msg(tox_iteration_interval(tox) == 0, "Deadline of %u ms not reached after sleeping for it", interval);
+
+    tox_kill(tox);
+}
+END_TEST
+
+START_TEST(test_group_kick)
+{
+    Tox *tox = new_test_tox();
+    run_for(tox, 1000);
+
+    struct Group_Chat_Self_Peer_Info peer_info;
+    memset(&peer_info, 0, sizeof(peer_info));
+    memcpy(peer_info.nick, "test", 4);
+    peer_info.nick_length = 4;
+
+    TOX_ERR_GROUP_NEW err;
+    uint32_t groupnumber = tox_group_new(tox, TOX_GROUP_PRIVACY_STATE_PRIVATE, (const uint8_t *)"test", 4, &peer_info, &err);
+    ck_assert_msg(err == TOX_ERR_GROUP_NEW_OK, "Failed to create group: %d", err);
+
+    /* The first group chat has to run on the next iteration, without waiting for the idle deadline. */
+    ck_assert_msg(tox_iteration_interval(tox) <= BUSY_INTERVAL, "Interval %u ms with a group chat",
+                  tox_iteration_interval(tox));
+
+    unsigned int iterations = run_for(tox, 1000);
+    ck_assert_msg(iterations >= 1000 / BUSY_INTERVAL / 2, "Group chat iterated %u times in a second", iterations);
+
+    tox_group_leave(tox, groupnumber, NULL, 0, NULL);
+    tox_kill(tox);
+}
+END_TEST
+
+START_TEST(test_friend_request)
+{
+    Tox *tox = new_test_tox();
+    run_for(tox, 1000);
+
+    uint8_t address[TOX_ADDRESS_SIZE];
+    Tox *other = new_test_tox();
+    tox_self_get_address(other, address);
+    tox_kill(other);
+
+    /* A friend request waits to be sent on every iteration. */
+    ck_assert_msg(tox_friend_add(tox, address, (const uint8_t *)"hi", 2, NULL) == 0, "Failed to add friend");
+    ck_assert_msg(tox_iteration_interval(tox) <= BUSY_INTERVAL, "Interval %u ms with a friend request to send",
+                  tox_iteration_interval(tox));
+
+    tox_kill(tox);
+}
+END_TEST
+
+Suite *iteration_suite(void)
+{
+    Suite *s = suite_create("Iteration");
+
+    DEFTESTCASE_SLOW(idle, 20);
+    DEFTESTCASE_SLOW(group_kick, 20);
+    DEFTESTCASE_SLOW(friend_request, 20);
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *iteration = iteration_suite();
+    SRunner *test_runner = srunner_create(iteration);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
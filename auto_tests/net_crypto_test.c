@@ -0,0 +1,870 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../toxcore/net_crypto.c"
+
+#include "helpers.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+#define NUM_CONNECTIONS 100
+
+static Net_Crypto *new_test_net_crypto(uint16_t port)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(ip, port);
+    ck_assert_msg(net != NULL, "Failed to create networking on port %u", port);
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+    TCP_Proxy_Info inf = {{{0}}};
+    Net_Crypto *c = new_net_crypto(dht, &inf);
+    ck_assert_msg(c != NULL, "Failed to create Net_Crypto");
+    return c;
+}
+
+static void kill_test_net_crypto(Net_Crypto *c)
+{
+    DHT *dht = c->dht;
+    Networking_Core *net = dht->net;
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+}
+
+START_TEST(test_connection_lookup)
+{
+    Net_Crypto *c = new_test_net_crypto(34600);
+
+    uint8_t real_pk[NUM_CONNECTIONS][crypto_box_PUBLICKEYBYTES];
+    uint8_t dht_pk[NUM_CONNECTIONS][crypto_box_PUBLICKEYBYTES];
+    int ids[NUM_CONNECTIONS];
+    unsigned int i;
+
+    randombytes((uint8_t *)real_pk, sizeof(real_pk));
+    randombytes((uint8_t *)dht_pk, sizeof(dht_pk));
+
+    for (i = 0; i < NUM_CONNECTIONS; ++i) {
+        ids[i] = new_crypto_connection(c, real_pk[i], dht_pk[i]);
+        ck_assert_msg(ids[i] != -1, "Failed to create connection %u", i);
+        ck_assert_msg(getcryptconnection_id(c, real_pk[i]) == ids[i], "Connection %u not found", i);
+    }
+
+    for (i = 0; i < NUM_CONNECTIONS; ++i)
+        ck_assert_msg(new_crypto_connection(c, real_pk[i], dht_pk[i]) == ids[i], "Connection %u created twice", i);
+
+    for (i = 0; i < NUM_CONNECTIONS; i += 2)
+        ck_assert_msg(crypto_kill(c, ids[i]) == 0, "Failed to kill connection %u", i);
+
+    for (i = 0; i < NUM_CONNECTIONS; ++i) {
+        int id = getcryptconnection_id(c, real_pk[i]);
+
+        if (i % 2 == 0) {
+            ck_assert_msg(id == -1, "Killed connection %u still found", i);
+        } else {
+            ck_assert_msg(id == ids[i], "Connection %u lost after others were killed: %i", i, id);
+        }
+    }
+
+    /* Killed connections can be created again, maybe with the ids of others that were killed. */
+    for (i = 0; i < NUM_CONNECTIONS; i += 2) {
+        ids[i] = new_crypto_connection(c, real_pk[i], dht_pk[i]);
+        ck_assert_msg(ids[i] != -1, "Failed to create connection %u again", i);
+    }
+
+    for (i = 0; i < NUM_CONNECTIONS; ++i)
+        ck_assert_msg(getcryptconnection_id(c, real_pk[i]) == ids[i], "Connection %u not found at the end", i);
+
+    kill_test_net_crypto(c);
+}
+END_TEST
+
+static Packet_Data *test_alloc(void *object)
+{
+    return malloc(CRYPTO_PACKET_DATA_SIZE);
+}
+
+static void test_free(void *object, Packet_Data *data)
+{
+    free(data);
+}
+
+static const Packet_Allocator test_allocator = {&test_alloc, &test_free, NULL};
+
+/* Put num packets sent at sent_time in send_array, and the ones marked with an x in received in
+ * recv_array, like the peer got them.
+ */
+static void fill_arrays(Packets_Array *send_array, Packets_Array *recv_array, uint32_t num, const char *received,
+                        uint64_t sent_time)
+{
+    memset(send_array, 0, sizeof(Packets_Array));
+    memset(recv_array, 0, sizeof(Packets_Array));
+    send_array->allocator = recv_array->allocator = &test_allocator;
+
+    Packet_Data dt = {0};
+    dt.length = 1;
+    dt.sent_time = sent_time;
+    uint32_t i;
+
+    for (i = 0; i < num; ++i)
+        ck_assert_msg(add_data_end_of_buffer(send_array, &dt) == i, "Failed to add packet %u", i);
+
+    for (i = 0; received[i] != 0; ++i) {
+        if (received[i] == 'x')
+            ck_assert_msg(add_data_to_buffer(recv_array, i, &dt) == 0, "Failed to receive packet %u", i);
+    }
+}
+
+/* Send the selective ack of recv_array to send_array.
+ *
+ * return the number of requested packets.
+ */
+static int sack_round_trip(Packets_Array *send_array, const Packets_Array *recv_array, uint64_t rtt_time)
+{
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    int length = generate_sack_packet(packet, sizeof(packet), recv_array);
+    ck_assert_msg(length > 0, "Failed to generate selective ack");
+
+    uint64_t latest_send_time = 0;
+    return handle_sack_packet(send_array, packet, length, &latest_send_time, rtt_time);
+}
+
+static uint64_t sent_time(const Packets_Array *array, uint32_t number)
+{
+    Packet_Data *dt;
+    ck_assert_msg(get_data_pointer(array, &dt, number) == 1, "Packet %u was freed", number);
+    return dt->sent_time;
+}
+
+START_TEST(test_sack_ranges)
+{
+    Packets_Array send_array, recv_array;
+    uint64_t now = current_time_monotonic();
+    const char *received = "..xx...x..xxxxxx";
+    fill_arrays(&send_array, &recv_array, 20, received, now);
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    const uint8_t expected[] = {PACKET_ID_SACK, 0, 2, 0, 2, 0, 3, 0, 1, 0, 2, 0, 6};
+    int length = generate_sack_packet(packet, sizeof(packet), &recv_array);
+    ck_assert_msg(length == sizeof(expected) && memcmp(packet, expected, sizeof(expected)) == 0,
+                  "Wrong selective ack of length %i", length);
+
+    uint64_t latest_send_time = 0;
+    ck_assert_msg(handle_sack_packet(&send_array, packet, length, &latest_send_time, 1000) == 7,
+                  "Wrong number of requested packets");
+    ck_assert_msg(latest_send_time == now, "Wrong send time of the acked packets");
+
+    uint32_t i;
+
+    for (i = 0; i < 20; ++i) {
+        Packet_Data *dt;
+        int ret = get_data_pointer(&send_array, &dt, i);
+
+        if (i < 16 && received[i] == 'x') {
+            ck_assert_msg(ret == 0, "Received packet %u not freed", i);
+        } else {
+            ck_assert_msg(ret == 1, "Packet %u freed", i);
+            /* The missing ones all have at least CRYPTO_FAST_RETRANSMIT_THRESHOLD received after them. */
+            ck_assert_msg(dt->sent_time == (i < 16 ? 0 : now), "Wrong send time of packet %u", i);
+        }
+    }
+
+    /* The acks of packets the other can't have received are invalid. */
+    packet[length - 1] = 11;
+    ck_assert_msg(handle_sack_packet(&send_array, packet, length, &latest_send_time, 1000) == -1,
+                  "Acked packets never sent");
+    ck_assert_msg(handle_sack_packet(&send_array, packet, length - 1, &latest_send_time, 1000) == -1,
+                  "Handled truncated ack");
+
+    clear_buffer(&send_array);
+    clear_buffer(&recv_array);
+}
+END_TEST
+
+START_TEST(test_sack_fast_retransmit)
+{
+    Packets_Array send_array, recv_array;
+    uint64_t now = current_time_monotonic();
+
+    /* Two packets received after a missing one isn't enough to send it again before the RTT. */
+    fill_arrays(&send_array, &recv_array, 8, "xxxxx.xx", now);
+    ck_assert_msg(sack_round_trip(&send_array, &recv_array, 1000) == 1, "Wrong number of requested packets");
+    ck_assert_msg(sent_time(&send_array, 5) == now, "Sent again with %u packets after it", 2);
+    clear_buffer(&send_array);
+    clear_buffer(&recv_array);
+
+    fill_arrays(&send_array, &recv_array, 9, "xxxxx.xxx", now);
+    ck_assert_msg(sack_round_trip(&send_array, &recv_array, 1000) == 1, "Wrong number of requested packets");
+    ck_assert_msg(sent_time(&send_array, 5) == 0, "Not sent again with %u packets after it",
+                  CRYPTO_FAST_RETRANSMIT_THRESHOLD);
+    clear_buffer(&send_array);
+    clear_buffer(&recv_array);
+
+    /* Not if it was sent again after the packets the other received. */
+    fill_arrays(&send_array, &recv_array, 9, "xxxxx.xxx", now - 10);
+    Packet_Data *dt;
+    get_data_pointer(&send_array, &dt, 5);
+    dt->sent_time = now;
+    ck_assert_msg(sack_round_trip(&send_array, &recv_array, 1000) == 1, "Wrong number of requested packets");
+    ck_assert_msg(sent_time(&send_array, 5) == now, "Sent again twice in one RTT");
+    clear_buffer(&send_array);
+    clear_buffer(&recv_array);
+
+    /* Any missing packet is sent again once the RTT passed. */
+    fill_arrays(&send_array, &recv_array, 7, "xxxxx.x", now - 2000);
+    ck_assert_msg(sack_round_trip(&send_array, &recv_array, 1000) == 1, "Wrong number of requested packets");
+    ck_assert_msg(sent_time(&send_array, 5) == 0, "Not sent again after the RTT");
+    clear_buffer(&send_array);
+    clear_buffer(&recv_array);
+}
+END_TEST
+
+/* A Net_Crypto instance with a direct connection to another one, that looks at the data packets it
+ * receives before handling them.
+ */
+typedef struct {
+    Net_Crypto *c;
+    int id; /* The connection to the other peer. */
+    uint32_t received[256]; /* Data packets received, by packet id. */
+    uint32_t lossless_received; /* Lossless packets handed to the data handler. */
+    uint16_t longest_received; /* Length of the longest of them. */
+
+    /* Drop the packets that peers from before selective acks don't send or understand, so that two
+     * peers with this set act like a new and an old one. */
+    _Bool old_peer;
+    unsigned int drop_interval; /* Drop every this many lossless packets received, 0 to drop none. */
+    unsigned int lossless_seen;
+    _Bool drop_jumbo; /* Drop the packets bigger than MAX_CRYPTO_PACKET_SIZE, like a path that doesn't carry them. */
+    _Bool replay; /* Handle each data packet twice, like a copy sent on the other path. */
+    uint32_t lossy_received; /* Lossy packets handed to the lossy data handler. */
+
+    /* The contents of the last data packet received with this id, if not 0. */
+    uint8_t capture_id;
+    uint8_t captured[MAX_CRYPTO_DATA_SIZE];
+    uint16_t captured_length;
+} Test_Peer;
+
+static int handle_test_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    Test_Peer *peer = object;
+    ++peer->lossless_received;
+
+    if (length > peer->longest_received)
+        peer->longest_received = length;
+
+    return 0;
+}
+
+static int handle_test_lossy_data(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    Test_Peer *peer = object;
+    ++peer->lossy_received;
+    return 0;
+}
+
+static int accept_test_connection(void *object, New_Connection *n_c)
+{
+    Test_Peer *peer = object;
+    peer->id = accept_crypto_connection(peer->c, n_c);
+
+    if (peer->id == -1)
+        return -1;
+
+    set_direct_ip_port(peer->c, peer->id, n_c->source, 1);
+    connection_data_handler(peer->c, peer->id, &handle_test_data, peer, 0);
+    connection_lossy_data_handler(peer->c, peer->id, &handle_test_lossy_data, peer, 0);
+    return 0;
+}
+
+static int filter_data_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Test_Peer *peer = object;
+    Crypto_Connection *conn = get_crypto_connection(peer->c, peer->id);
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+    int len = -1;
+
+    if (conn)
+        len = decrypt_data_packet(conn->shared_key, conn->recv_nonce, data, packet, length);
+
+    if (peer->drop_jumbo && length > MAX_CRYPTO_PACKET_SIZE)
+        return 1;
+
+    if (len > (int)(sizeof(uint32_t) * 2)) {
+        uint8_t *real_data = data + sizeof(uint32_t) * 2;
+
+        while (real_data < data + len - 1 && real_data[0] == PACKET_ID_PADDING)
+            ++real_data;
+
+        ++peer->received[real_data[0]];
+
+        if (peer->capture_id && real_data[0] == peer->capture_id && data + len - real_data <= MAX_CRYPTO_DATA_SIZE) {
+            peer->captured_length = data + len - real_data;
+            memcpy(peer->captured, real_data, peer->captured_length);
+        }
+
+        if (peer->old_peer && (real_data[0] == PACKET_ID_SACK || real_data[0] == PACKET_ID_CAPABILITIES))
+            return 1;
+
+        if (peer->drop_interval && real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START
+                && ++peer->lossless_seen % peer->drop_interval == 0)
+            return 1;
+    }
+
+    if (peer->replay)
+        udp_handle_packet(peer->c, source, packet, length);
+
+    return udp_handle_packet(peer->c, source, packet, length);
+}
+
+static void new_test_peer(Test_Peer *peer, uint16_t port)
+{
+    memset(peer, 0, sizeof(Test_Peer));
+    peer->c = new_test_net_crypto(port);
+    peer->id = -1;
+    new_connection_handler(peer->c, &accept_test_connection, peer);
+    networking_registerhandler(peer->c->dht->net, NET_PACKET_CRYPTO_DATA, &filter_data_packet, peer);
+}
+
+static void do_test_peers(Test_Peer *a, Test_Peer *b)
+{
+    networking_poll(a->c->dht->net);
+    do_net_crypto(a->c);
+    networking_poll(b->c->dht->net);
+    do_net_crypto(b->c);
+}
+
+/* Connect a to b directly and wait until the connection is established on both sides. */
+static void connect_test_peers(Test_Peer *a, Test_Peer *b)
+{
+    a->id = new_crypto_connection(a->c, b->c->self_public_key, b->c->dht->self_public_key);
+    ck_assert_msg(a->id != -1, "Failed to create connection");
+    connection_data_handler(a->c, a->id, &handle_test_data, a, 0);
+    connection_lossy_data_handler(a->c, a->id, &handle_test_lossy_data, a, 0);
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = b->c->dht->net->port;
+    set_direct_ip_port(a->c, a->id, ip_port, 0);
+
+    uint64_t start = unix_time();
+
+    while (b->id == -1 || a->c->crypto_connections[a->id].status != CRYPTO_CONN_ESTABLISHED
+            || b->c->crypto_connections[b->id].status != CRYPTO_CONN_ESTABLISHED) {
+        ck_assert_msg(!is_timeout(start, 10), "Peers failed to connect");
+        do_test_peers(a, b);
+        c_sleep(1);
+    }
+}
+
+/* Send num lossless packets each way and wait until all of them arrived. */
+static void exchange_packets(Test_Peer *a, Test_Peer *b, uint32_t num)
+{
+    uint8_t packet[100] = {160};
+    uint32_t a_sent = 0, b_sent = 0;
+    uint64_t start = unix_time();
+
+    while (a->lossless_received < num || b->lossless_received < num) {
+        ck_assert_msg(!is_timeout(start, 20), "Only %u and %u of %u packets arrived", a->lossless_received,
+                      b->lossless_received, num);
+
+        while (a_sent < num && write_cryptpacket(a->c, a->id, packet, sizeof(packet), 1) != -1)
+            ++a_sent;
+
+        while (b_sent < num && write_cryptpacket(b->c, b->id, packet, sizeof(packet), 1) != -1)
+            ++b_sent;
+
+        do_test_peers(a, b);
+        c_sleep(1);
+    }
+}
+
+START_TEST(test_sack_peers)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34602);
+    new_test_peer(&b, 34603);
+    a.drop_interval = b.drop_interval = 10;
+    connect_test_peers(&a, &b);
+    exchange_packets(&a, &b, 200);
+
+    ck_assert_msg(a.c->crypto_connections[a.id].peer_sack && b.c->crypto_connections[b.id].peer_sack,
+                  "Peers didn't switch to selective acks");
+    ck_assert_msg(a.received[PACKET_ID_SACK] > CRYPTO_SACK_PROBES && b.received[PACKET_ID_SACK] > CRYPTO_SACK_PROBES,
+                  "Peers sent %u and %u selective acks", b.received[PACKET_ID_SACK], a.received[PACKET_ID_SACK]);
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+START_TEST(test_sack_old_peer)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34604);
+    new_test_peer(&b, 34605);
+    a.drop_interval = b.drop_interval = 10;
+    a.old_peer = b.old_peer = 1;
+    connect_test_peers(&a, &b);
+    exchange_packets(&a, &b, 200);
+
+    /* The old peer only ever gets a few probes, and requests it understands. */
+    ck_assert_msg(!a.c->crypto_connections[a.id].peer_sack, "Switched to selective acks with an old peer");
+    ck_assert_msg(b.received[PACKET_ID_SACK] <= CRYPTO_SACK_PROBES, "Sent %u selective acks to an old peer",
+                  b.received[PACKET_ID_SACK]);
+    ck_assert_msg(b.received[PACKET_ID_REQUEST] > CRYPTO_SACK_PROBES, "Old peer got %u request packets",
+                  b.received[PACKET_ID_REQUEST]);
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+START_TEST(test_coalesced_packets)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34606);
+    new_test_peer(&b, 34607);
+    net_crypto_set_coalescing(a.c, 1);
+    b.capture_id = PACKET_ID_CAPABILITIES;
+    connect_test_peers(&a, &b);
+
+    uint64_t start = unix_time();
+
+    while (!(a.c->crypto_connections[a.id].peer_capabilities & CRYPTO_CAPABILITY_COALESCED)
+            || b.captured_length == 0) {
+        ck_assert_msg(!is_timeout(start, 10), "Peers didn't exchange capabilities");
+        do_test_peers(&a, &b);
+        c_sleep(1);
+    }
+
+    /* A capabilities packet is its id, the capabilities and whether the sender knows ours. */
+    ck_assert_msg(b.captured_length == 3, "Capabilities packet of length %u", b.captured_length);
+    ck_assert_msg(b.captured[1] & CRYPTO_CAPABILITY_COALESCED, "Coalesced packets not announced");
+    ck_assert_msg(b.captured[2] <= 1, "Bad capabilities known flag %u", b.captured[2]);
+
+    /* Each packet in a coalesced one is its length followed by its data. */
+    const uint8_t packets[][4] = {{160, 1}, {161, 2, 3}, {162}};
+    const uint16_t lengths[] = {2, 3, 1};
+    const uint8_t expected[] = {PACKET_ID_COALESCED, 2, 160, 1, 3, 161, 2, 3, 1, 162};
+    uint32_t received = b.lossless_received;
+    unsigned int i;
+    b.capture_id = PACKET_ID_COALESCED;
+    b.captured_length = 0;
+
+    int64_t packet_num = write_cryptpacket(a.c, a.id, packets[0], lengths[0], 0);
+    ck_assert_msg(packet_num != -1, "Failed to write packet");
+
+    for (i = 1; i < 3; ++i)
+        ck_assert_msg(write_cryptpacket(a.c, a.id, packets[i], lengths[i], 0) == packet_num,
+                      "Packet %u not put in the same coalesced packet", i);
+
+    flush_coalesced_packets(a.c);
+    start = unix_time();
+
+    while (b.lossless_received < received + 3) {
+        ck_assert_msg(!is_timeout(start, 10), "Only %u coalesced packets arrived", b.lossless_received - received);
+        do_test_peers(&a, &b);
+        c_sleep(1);
+    }
+
+    ck_assert_msg(b.captured_length == sizeof(expected) && memcmp(b.captured, expected, sizeof(expected)) == 0,
+                  "Bad coalesced packet of length %u", b.captured_length);
+
+    /* Bigger packets are sent on their own. */
+    uint8_t big[CRYPTO_MAX_COALESCED_LENGTH + 1] = {160};
+    ck_assert_msg(write_cryptpacket(a.c, a.id, big, sizeof(big), 0) > packet_num, "Big packet not sent on its own");
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+START_TEST(test_handshake_workers)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34608);
+    new_test_peer(&b, 34609);
+    ck_assert_msg(net_crypto_set_handshake_workers(a.c, 2) == 0 && net_crypto_set_handshake_workers(b.c, 2) == 0,
+                  "Failed to start handshake workers");
+    connect_test_peers(&a, &b);
+    exchange_packets(&a, &b, 10);
+
+    Crypto_Workers_Stats stats;
+    net_crypto_handshake_stats(b.c, &stats);
+    ck_assert_msg(stats.workers == 2 && stats.processed != 0, "%u workers processed %llu handshakes", stats.workers,
+                  (unsigned long long)stats.processed);
+
+    /* A handshake received directly only counts as a direct packet once a worker found it valid. */
+    Crypto_Connection *conn = &b.c->crypto_connections[b.id];
+    IP_Port source = conn->ip_portv4;
+    ck_assert_msg(source.ip.family == AF_INET, "Peer not connected over IPv4");
+    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+    conn->direct_lastrecv_timev4 = 0;
+
+    uint8_t packet[HANDSHAKE_PACKET_LENGTH];
+    randombytes(packet, sizeof(packet));
+    packet[0] = NET_PACKET_CRYPTO_HS;
+    ck_assert_msg(udp_handle_packet(b.c, source, packet, sizeof(packet)) == 0, "Handshake not queued");
+    ck_assert_msg(conn->direct_lastrecv_timev4 == 0, "Handshake counted before it was checked");
+
+    uint64_t start = unix_time();
+
+    do {
+        ck_assert_msg(!is_timeout(start, 10), "Handshake workers didn't process the handshake");
+        c_sleep(1);
+        do_net_crypto(b.c);
+        net_crypto_handshake_stats(b.c, &stats);
+    } while (stats.queued != 0);
+
+    ck_assert_msg(conn->direct_lastrecv_timev4 == 0, "Invalid handshake counted as a direct packet");
+    conn->status = CRYPTO_CONN_ESTABLISHED;
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+START_TEST(test_decrypt_workers)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34610);
+    new_test_peer(&b, 34611);
+    ck_assert_msg(net_crypto_set_decrypt_workers(a.c, CRYPTO_MAX_DECRYPT_WORKERS + 1) == -1, "Started too many workers");
+    ck_assert_msg(net_crypto_set_decrypt_workers(a.c, 2) == 0 && net_crypto_set_decrypt_workers(b.c, 1) == 0,
+                  "Failed to start decrypt workers");
+    a.drop_interval = b.drop_interval = 10;
+    connect_test_peers(&a, &b);
+    exchange_packets(&a, &b, 200);
+
+    Crypto_Workers_Stats stats;
+    net_crypto_decrypt_stats(a.c, &stats);
+    ck_assert_msg(stats.workers == 2 && stats.processed >= 200, "%u workers decrypted %llu packets", stats.workers,
+                  (unsigned long long)stats.processed);
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+START_TEST(test_pmtu_fallback)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34612);
+    new_test_peer(&b, 34613);
+    connect_test_peers(&a, &b);
+
+    Crypto_Connection *conn = &a.c->crypto_connections[a.id];
+    uint64_t start = unix_time();
+
+    while (!(conn->peer_capabilities & CRYPTO_CAPABILITY_JUMBO)) {
+        ck_assert_msg(!is_timeout(start, 10), "Peer didn't send its capabilities");
+        do_test_peers(&a, &b);
+        c_sleep(1);
+    }
+
+    /* A packet sent as if path MTU discovery found bigger packets reach the peer, they don't. */
+    conn->max_packet_size = pmtu_probe_sizes[1];
+    b.drop_jumbo = 1;
+
+    uint8_t packet[3000] = {160};
+    uint8_t small[10] = {161};
+    uint32_t received = b.lossless_received;
+    ck_assert_msg(write_cryptpacket(a.c, a.id, packet, sizeof(packet), 0) != -1, "Failed to write big packet");
+    ck_assert_msg(write_cryptpacket(a.c, a.id, small, sizeof(small), 0) != -1, "Failed to write small packet");
+    ck_assert_msg(b.lossless_received == received, "Big packet arrived");
+
+    /* Discovery is disabled, so the maximum packet size falls back and the big packet is sent in parts. */
+    start = unix_time();
+
+    while (b.lossless_received < received + 2) {
+        ck_assert_msg(!is_timeout(start, 10), "Big packet not sent again");
+        do_test_peers(&a, &b);
+        c_sleep(1);
+    }
+
+    ck_assert_msg(conn->max_packet_size == MAX_CRYPTO_PACKET_SIZE, "Maximum packet size didn't fall back");
+    ck_assert_msg(b.longest_received == sizeof(packet), "Packet of %u bytes put together", b.longest_received);
+    ck_assert_msg(b.received[PACKET_ID_PART] >= (sizeof(packet) + CRYPTO_PART_DATA_SIZE - 1) / CRYPTO_PART_DATA_SIZE,
+                  "Big packet sent in %u parts", b.received[PACKET_ID_PART]);
+    ck_assert_msg(conn->status == CRYPTO_CONN_ESTABLISHED, "Connection lost");
+
+    /* It can still be written. */
+    ck_assert_msg(write_cryptpacket(a.c, a.id, packet, sizeof(packet), 0) != -1, "Failed to write big packet again");
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+#define SUBMIT_THREADS 4
+#define SUBMIT_PACKETS 100
+
+static void *submit_packets(void *arg)
+{
+    Test_Peer *peer = arg;
+    uint8_t packet[100] = {160};
+    unsigned int sent = 0;
+
+    while (sent < SUBMIT_PACKETS) {
+        if (submit_cryptpacket(peer->c, peer->id, packet, sizeof(packet), 0) == 0) {
+            ++sent;
+        } else {
+            c_sleep(1);
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST(test_submitted_packets)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34618);
+    new_test_peer(&b, 34619);
+    connect_test_peers(&a, &b);
+
+    pthread_t threads[SUBMIT_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < SUBMIT_THREADS; ++i)
+        ck_assert_msg(pthread_create(&threads[i], NULL, &submit_packets, &a) == 0, "Failed to start thread %u", i);
+
+    /* Connections made and killed meanwhile wait for the threads to stop using the array. */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES], dht_public_key[crypto_box_PUBLICKEYBYTES];
+    uint64_t start = unix_time();
+
+    while (b.lossless_received < SUBMIT_THREADS * SUBMIT_PACKETS) {
+        ck_assert_msg(!is_timeout(start, 20), "Only %u of %u submitted packets arrived", b.lossless_received,
+                      SUBMIT_THREADS * SUBMIT_PACKETS);
+        randombytes(public_key, sizeof(public_key));
+        randombytes(dht_public_key, sizeof(dht_public_key));
+        int id = new_crypto_connection(a.c, public_key, dht_public_key);
+        ck_assert_msg(id != -1 && crypto_kill(a.c, id) == 0, "Failed to make and kill a connection");
+        do_test_peers(&a, &b);
+        c_sleep(1);
+    }
+
+    for (i = 0; i < SUBMIT_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+/* Send num lossy packets from a to b, each of which b handles twice, and return how many of them the
+ * lossy handler of b got.
+ */
+static uint32_t replay_lossy_packets(Test_Peer *a, Test_Peer *b, uint32_t num)
+{
+    Crypto_Connection *conn = &a->c->crypto_connections[a->id];
+    uint64_t start = unix_time();
+
+    while (!(conn->peer_capabilities_known && b->c->crypto_connections[b->id].peer_capabilities_known)) {
+        ck_assert_msg(!is_timeout(start, 10), "Peers didn't exchange capabilities");
+        do_test_peers(a, b);
+        c_sleep(1);
+    }
+
+    uint8_t packet[10] = {PACKET_ID_LOSSY_RANGE_START};
+    uint32_t i, received = b->lossy_received;
+    b->replay = 1;
+
+    for (i = 0; i < num; ++i) {
+        ck_assert_msg(send_lossy_cryptpacket(a->c, a->id, packet, sizeof(packet)) == 0, "Failed to send lossy packet");
+        do_test_peers(a, b);
+        c_sleep(1);
+    }
+
+    for (i = 0; i < 20; ++i) {
+        do_test_peers(a, b);
+        c_sleep(1);
+    }
+
+    b->replay = 0;
+    return b->lossy_received - received;
+}
+
+START_TEST(test_multipath_duplicates)
+{
+    Test_Peer a, b;
+    new_test_peer(&a, 34614);
+    new_test_peer(&b, 34615);
+    connect_test_peers(&a, &b);
+
+    /* Without multipath no copies are sent, so none are dropped. */
+    ck_assert_msg(replay_lossy_packets(&a, &b, 10) == 20, "Packets dropped without multipath");
+    ck_assert_msg(!(b.c->crypto_connections[b.id].peer_capabilities & CRYPTO_CAPABILITY_MULTIPATH),
+                  "Multipath announced while disabled");
+    ck_assert_msg(b.c->crypto_connections[b.id].duplicates_received == 0, "Duplicates counted without multipath");
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+
+    new_test_peer(&a, 34616);
+    new_test_peer(&b, 34617);
+    ck_assert_msg(net_crypto_set_multipath(a.c, CRYPTO_MULTIPATH_REDUNDANT) == 0
+                  && net_crypto_set_multipath(b.c, CRYPTO_MULTIPATH_REDUNDANT) == 0, "Failed to enable multipath");
+    connect_test_peers(&a, &b);
+
+    ck_assert_msg(replay_lossy_packets(&a, &b, 10) == 10, "Copies not dropped with multipath");
+    ck_assert_msg(b.c->crypto_connections[b.id].duplicates_received >= 10, "Only %llu duplicates counted",
+                  (unsigned long long)b.c->crypto_connections[b.id].duplicates_received);
+
+    kill_test_net_crypto(a.c);
+    kill_test_net_crypto(b.c);
+}
+END_TEST
+
+/* Feed one sample of PACKET_COUNTER_AVERAGE_INTERVAL to the delay based congestion control. */
+static void delay_update(Crypto_Connection *conn, uint64_t time, uint32_t packets_sent, uint32_t packets_resent)
+{
+    Congestion_Sample sample = {0};
+    sample.time = time;
+    sample.packets_sent = packets_sent;
+    sample.packets_resent = packets_resent;
+    sample.direct_connected = 1;
+    delay_congestion_update(conn, &sample);
+}
+
+START_TEST(test_delay_congestion)
+{
+    Crypto_Connection *conn = calloc(1, sizeof(Crypto_Connection));
+    ck_assert_msg(conn != NULL, "Out of memory");
+
+    uint64_t time = 100000;
+    conn->packet_send_rate = 1000.0;
+    conn->last_delay_update = time;
+
+    /* The first sample on a new path only resets the RTT of the old one. */
+    conn->rtt_base[0] = 10;
+    delay_update(conn, time, 0, 0);
+    ck_assert_msg(conn->rtt_base_direct && conn->rtt_base[0] == 0, "RTT not reset on a new path");
+    ck_assert_msg(conn->packet_send_rate == 1000.0, "Rate changed on a new path: %f", conn->packet_send_rate);
+
+    /* No queuing delay: the rate doubles if it is what limited the connection. */
+    delay_rtt_sample(conn, 50, time + 10);
+    conn->last_rate_limited = time + 100;
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 1000, 0);
+    ck_assert_msg(conn->packet_send_rate == 2000.0, "Rate without delay: %f", conn->packet_send_rate);
+    ck_assert_msg(conn->packet_send_rate_requested == 2400.0, "Requested rate: %f", conn->packet_send_rate_requested);
+    ck_assert_msg(conn->rtt_current == 0, "RTT not reset after an update");
+
+    /* It doesn't grow if the connection didn't send as much as it could. */
+    delay_rtt_sample(conn, 50, time + 10);
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 1000, 0);
+    ck_assert_msg(conn->packet_send_rate == 2000.0, "Rate grew while not limited: %f", conn->packet_send_rate);
+
+    /* Nor past twice the rate at which the packets were delivered. */
+    delay_rtt_sample(conn, 50, time + 10);
+    conn->last_rate_limited = time + 100;
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 300, 0);
+    ck_assert_msg(conn->packet_send_rate == 3000.0, "Rate not capped by delivery: %f", conn->packet_send_rate);
+
+    /* Queuing delay far above the target halves the rate, once per update interval. */
+    delay_rtt_sample(conn, 50 + 3 * CONGESTION_DELAY_TARGET, time + 10);
+    delay_update(conn, time + CONGESTION_DELAY_UPDATE_INTERVAL / 2, 0, 0);
+    ck_assert_msg(conn->packet_send_rate == 3000.0, "Rate changed before the update interval: %f", conn->packet_send_rate);
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 0, 0);
+    ck_assert_msg(conn->packet_send_rate == 1500.0, "Rate with delay: %f", conn->packet_send_rate);
+
+    /* Half the target keeps half the room to grow. */
+    delay_rtt_sample(conn, 50 + CONGESTION_DELAY_TARGET / 2, time + 10);
+    conn->last_rate_limited = time + 100;
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 1000, 0);
+    ck_assert_msg(conn->packet_send_rate == 2250.0, "Rate with half the target delay: %f", conn->packet_send_rate);
+
+    /* Requested packets cut the rate, at most once per update interval. */
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 0, 5);
+    ck_assert_msg(conn->packet_send_rate == 2250.0 * CONGESTION_LOSS_FACTOR, "Rate after loss: %f", conn->packet_send_rate);
+    delay_update(conn, time + 1, 0, 5);
+    ck_assert_msg(conn->packet_send_rate == 2250.0 * CONGESTION_LOSS_FACTOR, "Rate cut twice: %f", conn->packet_send_rate);
+
+    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    time += CONGESTION_DELAY_UPDATE_INTERVAL;
+    delay_update(conn, time, 0, 5);
+    ck_assert_msg(conn->packet_send_rate == CRYPTO_PACKET_MIN_RATE, "Rate below minimum: %f", conn->packet_send_rate);
+
+    /* The base RTT is the lowest of the current and the previous window. */
+    delay_rtt_sample(conn, 80, time + CONGESTION_BASE_RTT_WINDOW + 1);
+    ck_assert_msg(delay_base_rtt(conn) == 50, "Base RTT forgot the previous window: %llu",
+                  (unsigned long long)delay_base_rtt(conn));
+    delay_rtt_sample(conn, 90, time + 2 * CONGESTION_BASE_RTT_WINDOW + 2);
+    ck_assert_msg(delay_base_rtt(conn) == 80, "Base RTT kept an old window: %llu",
+                  (unsigned long long)delay_base_rtt(conn));
+
+    free(conn);
+}
+END_TEST
+
+START_TEST(test_congestion_control_setting)
+{
+    Net_Crypto *c = new_test_net_crypto(34601);
+
+    ck_assert_msg(c->congestion_control == &congestion_controls[CRYPTO_CONGESTION_QUEUE], "Wrong default");
+    ck_assert_msg(net_crypto_set_congestion_control(c, CRYPTO_CONGESTION_DELAY) == 0, "Failed to set delay");
+    ck_assert_msg(c->congestion_control->update == &delay_congestion_update, "Delay not set");
+    ck_assert_msg(net_crypto_set_congestion_control(c, CRYPTO_CONGESTION_NUM) == -1, "Set invalid algorithm");
+    ck_assert_msg(c->congestion_control->update == &delay_congestion_update, "Invalid algorithm changed it");
+
+    kill_test_net_crypto(c);
+}
+END_TEST
+
+Suite *net_crypto_suite(void)
+{
+    Suite *s = suite_create("Net_Crypto");
+
+    DEFTESTCASE(connection_lookup);
+    DEFTESTCASE(delay_congestion);
+    DEFTESTCASE(congestion_control_setting);
+    DEFTESTCASE(sack_ranges);
+    DEFTESTCASE(sack_fast_retransmit);
+    DEFTESTCASE_SLOW(sack_peers, 30);
+    DEFTESTCASE_SLOW(sack_old_peer, 30);
+    DEFTESTCASE_SLOW(coalesced_packets, 30);
+    DEFTESTCASE_SLOW(handshake_workers, 30);
+    DEFTESTCASE_SLOW(decrypt_workers, 30);
+    DEFTESTCASE_SLOW(pmtu_fallback, 30);
+    DEFTESTCASE_SLOW(multipath_duplicates, 30);
+    DEFTESTCASE_SLOW(submitted_packets, 30);
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *net_crypto = net_crypto_suite();
+    SRunner *test_runner = srunner_create(net_crypto);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
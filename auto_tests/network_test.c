@@ -10,9 +10,18 @@
 #include <time.h>
 
 #include "../toxcore/network.h"
+#include "../toxcore/rate_limit.h"
+#include "../toxcore/dns_resolver.h"
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 START_TEST(test_addr_resolv_localhost)
 {
 #ifdef __CYGWIN__
@@ -134,12 +143,393 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+static unsigned int handled_packets;
+
+static int handle_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len)
+{
+    if (len == 100 && data[1] == (uint8_t)handled_packets)
+        ++handled_packets;
+
+    return 0;
+}
+
+START_TEST(test_networking_poll)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(ip, 33445);
+    ck_assert_msg(net != NULL, "Failed to create networking.");
+
+    networking_registerhandler(net, 254, &handle_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net->port;
+
+    uint8_t packet[100] = {254};
+    unsigned int num_packets = NET_RECV_BATCH_SIZE * 2 + 3;
+    unsigned int i;
+
+    for (i = 0; i < num_packets; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed.");
+    }
+
+    handled_packets = 0;
+    unsigned int received = 0;
+
+    for (i = 0; i < 50 && received < num_packets; ++i) {
+        networking_poll(net);
+        ck_assert_msg(net->poll_syscalls >= 1, "Poll made no syscalls.");
+        received += net->poll_packets;
+        c_sleep(10);
+    }
+
+    ck_assert_msg(received == num_packets, "Received %u packets, expected %u.", received, num_packets);
+    ck_assert_msg(handled_packets == num_packets, "Handled %u packets in order, expected %u.", handled_packets,
+                  num_packets);
+
+    kill_networking(net);
+}
+END_TEST
+
+static unsigned int failed_packets;
+
+static int handle_failed_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len)
+{
+    ++failed_packets;
+    return 0;
+}
+
+START_TEST(test_send_queue)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(ip, 33445);
+    ck_assert_msg(net != NULL, "Failed to create networking.");
+    ck_assert_msg(networking_enable_send_queue(net, 1) == 0, "Failed to enable send queue.");
+
+    networking_registerhandler(net, 254, &handle_test_packet, NULL);
+    networking_register_send_fail_handler(net, 254, &handle_failed_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net->port;
+
+    uint8_t packet[100] = {254};
+    unsigned int num_packets = 20;
+    unsigned int i;
+
+    networking_send_queue_begin(net);
+
+    for (i = 0; i < num_packets; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed.");
+    }
+
+    /* Port 0 is not a valid destination, this one must be reported as failed on flush. */
+    IP_Port bad_ip_port = ip_port;
+    bad_ip_port.port = 0;
+    ck_assert_msg(sendpacket(net, bad_ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed.");
+
+    c_sleep(10);
+    networking_poll(net);
+    ck_assert_msg(net->poll_packets == 0, "Queued packets were sent before the flush.");
+
+    failed_packets = 0;
+    unsigned int num_failed = networking_send_queue_flush(net);
+    ck_assert_msg(num_failed == 1 && failed_packets == 1, "Expected 1 failed packet, got %u (%u handled).", num_failed,
+                  failed_packets);
+
+    handled_packets = 0;
+    unsigned int received = 0;
+
+    for (i = 0; i < 50 && received < num_packets; ++i) {
+        c_sleep(10);
+        networking_poll(net);
+        received += net->poll_packets;
+    }
+
+    ck_assert_msg(handled_packets == num_packets, "Handled %u packets in order, expected %u.", handled_packets,
+                  num_packets);
+
+    /* Not deferring anymore, packets go out right away. */
+    packet[1] = 0;
+    ck_assert_msg(sendpacket(net, bad_ip_port, packet, sizeof(packet)) == -1, "sendpacket to port 0 succeeded.");
+
+    kill_networking(net);
+}
+END_TEST
+
+START_TEST(test_rate_limit)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(ip, 33445);
+    ck_assert_msg(net != NULL, "Failed to create networking.");
+    ck_assert_msg(networking_set_packet_budget(net, 254, 10, 5) == -1, "Set a budget without a rate limiter.");
+    ck_assert_msg(networking_enable_rate_limit(net, 1, 32, 64) == 0, "Failed to enable the rate limiter.");
+    ck_assert_msg(networking_set_packet_budget(net, 254, 10, 5) == 0, "Failed to set a budget.");
+
+    networking_registerhandler(net, 254, &handle_test_packet, NULL);
+    networking_registerhandler(net, 253, &handle_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net->port;
+
+    uint8_t packet[100] = {254};
+    unsigned int i;
+
+    for (i = 0; i < 20; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed.");
+    }
+
+    /* Packet ids without a budget are not limited. */
+    packet[0] = 253;
+
+    for (i = 0; i < 20; ++i) {
+        packet[1] = 5 + i;
+        ck_assert_msg(sendpacket(net, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed.");
+    }
+
+    handled_packets = 0;
+    c_sleep(10);
+    networking_poll(net);
+
+    ck_assert_msg(handled_packets == 25, "Handled %u packets in order, expected the burst of 5 and 20 unlimited ones.",
+                  handled_packets);
+    ck_assert_msg(networking_packets_dropped(net, 254) == 15, "Dropped %llu packets, expected 15.",
+                  (unsigned long long)networking_packets_dropped(net, 254));
+    ck_assert_msg(networking_packets_dropped(net, 253) == 0, "Dropped packets without a budget.");
+
+    kill_networking(net);
+
+    /* Every source has its own buckets, and sources in the same prefix share them. */
+    Rate_Limiter *limiter = new_rate_limiter(24, 64);
+    ck_assert_msg(limiter != NULL, "Failed to create the rate limiter.");
+    ck_assert_msg(rate_limiter_set_budget(limiter, 18, 1, 2) == 0, "Failed to set a budget.");
+
+    IP source;
+    ip_init(&source, 0);
+    unsigned int allowed = 0;
+
+    for (i = 0; i < 100; ++i) {
+        source.ip4.uint32 = htonl(0x0A000000 + (i << 8));
+        allowed += rate_limiter_allow(limiter, &source, 18);
+        source.ip4.uint32 = htonl(0x0A000001 + (i << 8));
+        allowed += rate_limiter_allow(limiter, &source, 18);
+        source.ip4.uint32 = htonl(0x0A0000FF + (i << 8));
+        allowed += rate_limiter_allow(limiter, &source, 18);
+    }
+
+    ck_assert_msg(allowed == 200, "Allowed %u packets from 100 prefixes, expected 200.", allowed);
+    ck_assert_msg(limiter->dropped[18] == 100, "Dropped %llu packets, expected 100.",
+                  (unsigned long long)limiter->dropped[18]);
+
+    ip_init(&source, 1);
+    source.ip6.uint32[0] = htonl(0x20010db8);
+    source.ip6.uint32[3] = htonl(1);
+    ck_assert_msg(rate_limiter_allow(limiter, &source, 18) == 1, "Dropped the first packet of a new IPv6 source.");
+    source.ip6.uint32[3] = htonl(2);
+    ck_assert_msg(rate_limiter_allow(limiter, &source, 18) == 1, "Dropped the second packet of an IPv6 prefix.");
+    source.ip6.uint32[1] = htonl(1);
+    ck_assert_msg(rate_limiter_allow(limiter, &source, 18) == 1, "Dropped the first packet of another IPv6 prefix.");
+    source.ip6.uint32[1] = 0;
+    ck_assert_msg(rate_limiter_allow(limiter, &source, 18) == 0, "Allowed more than the burst of an IPv6 prefix.");
+
+    kill_rate_limiter(limiter);
+}
+END_TEST
+
+/* Stub resolver: blocks until released, "bad.example" doesn't resolve, other names resolve to two addresses. */
+static volatile int stub_release, stub_lookups;
+static volatile uint32_t stub_ttl;
+
+static uint32_t stub_lookup(void *object, const char *host, IP *ips, uint32_t max_ips, uint32_t *ttl)
+{
+    while (!stub_release)
+        c_sleep(1);
+
+    ++stub_lookups;
+
+    if (strcmp(host, "bad.example") == 0)
+        return 0;
+
+    ip_init(&ips[0], 0);
+    ips[0].ip4.uint32 = htonl(0x0A000001);
+    ip_init(&ips[1], 0);
+    ips[1].ip4.uint32 = htonl(0x0A000002);
+    *ttl = stub_ttl;
+    return 2;
+}
+
+static unsigned int resolved_count;
+
+static void handle_resolved(void *object, IP_Port ip_port, const uint8_t *public_key)
+{
+    ck_assert_msg(ip_port.port == htons(33445), "Resolved with the wrong port.");
+    ck_assert_msg(public_key[0] == 0xAB, "Resolved with the wrong public key.");
+    ++resolved_count;
+}
+
+/* Run the resolver until no request waits anymore. */
+static void wait_resolved(DNS_Resolver *resolver)
+{
+    unsigned int i;
+
+    for (i = 0; i < 1000 && resolver->num_requests; ++i) {
+        do_dns_resolver(resolver);
+        c_sleep(1);
+    }
+
+    ck_assert_msg(resolver->num_requests == 0, "Lookups didn't finish.");
+}
+
+START_TEST(test_dns_resolver)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES] = {0xAB};
+    uint16_t port = htons(33445);
+
+    stub_release = 0;
+    stub_lookups = 0;
+    stub_ttl = 60;
+    resolved_count = 0;
+
+    DNS_Resolver *resolver = new_dns_resolver(stub_lookup, NULL);
+    ck_assert_msg(resolver != NULL, "Failed to create the resolver.");
+
+    ck_assert_msg(dns_resolve(resolver, "127.0.0.1", port, public_key, handle_resolved, NULL) == 1,
+                  "An IP address wasn't parsed right away.");
+    ck_assert_msg(resolved_count == 1 && !resolver->thread_started, "An IP address was looked up.");
+
+    /* Hostnames are looked up in the thread, once for all the requests waiting for them. */
+    resolved_count = 0;
+    ck_assert_msg(dns_resolve(resolver, "two.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    ck_assert_msg(dns_resolve(resolver, "two.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    c_sleep(50);
+    do_dns_resolver(resolver);
+    ck_assert_msg(resolved_count == 0, "Callback called before the lookup was done.");
+
+    stub_release = 1;
+    wait_resolved(resolver);
+    ck_assert_msg(resolved_count == 4, "Callbacks called %u times, expected 4.", resolved_count);
+    ck_assert_msg(stub_lookups == 1, "Looked the same host up %i times.", stub_lookups);
+
+    /* Cached names resolve right away. */
+    resolved_count = 0;
+    ck_assert_msg(dns_resolve(resolver, "two.example", port, public_key, handle_resolved, NULL) == 2,
+                  "Cached name wasn't resolved right away.");
+    ck_assert_msg(resolved_count == 2 && stub_lookups == 1, "Cached name was looked up.");
+
+    /* Until their TTL runs out. */
+    stub_ttl = 1;
+    ck_assert_msg(dns_resolve(resolver, "short.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    wait_resolved(resolver);
+    ck_assert_msg(dns_resolve(resolver, "short.example", port, public_key, handle_resolved, NULL) == 2,
+                  "Cached name wasn't resolved right away.");
+    c_sleep(1100);
+    ck_assert_msg(dns_resolve(resolver, "short.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Expired name wasn't looked up again.");
+    wait_resolved(resolver);
+    ck_assert_msg(stub_lookups == 3, "Looked up %i times, expected 3.", stub_lookups);
+
+    /* Failures are cached too. */
+    resolved_count = 0;
+    ck_assert_msg(dns_resolve(resolver, "bad.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    wait_resolved(resolver);
+    ck_assert_msg(resolved_count == 0, "Callback called for a name that doesn't resolve.");
+    ck_assert_msg(dns_resolve(resolver, "bad.example", port, public_key, handle_resolved, NULL) == -1,
+                  "Cached failure wasn't returned.");
+    ck_assert_msg(stub_lookups == 4, "Looked up %i times, expected 4.", stub_lookups);
+
+    /* Killing the resolver doesn't wait for the lookup it is doing. */
+    stub_release = 0;
+    ck_assert_msg(dns_resolve(resolver, "slow.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+
+    /* Requests past the limit are refused, not dropped, so the caller can look them up itself. */
+    unsigned int i;
+
+    for (i = 1; i < DNS_RESOLVER_MAX_REQUESTS; ++i)
+        ck_assert_msg(dns_resolve(resolver, "slow.example", port, public_key, handle_resolved, NULL) == 0,
+                      "Request %u wasn't queued.", i);
+
+    ck_assert_msg(dns_resolve(resolver, "slow.example", port, public_key, handle_resolved, NULL) == -2,
+                  "Request past the limit wasn't refused.");
+    c_sleep(10);
+    kill_dns_resolver(resolver);
+    stub_release = 1;
+    c_sleep(10);
+}
+END_TEST
+
+START_TEST(test_dns_resolver_full_cache)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES] = {0xAB};
+    uint16_t port = htons(33445);
+
+    stub_release = 1;
+    stub_lookups = 0;
+    stub_ttl = 60;
+
+    DNS_Resolver *resolver = new_dns_resolver(stub_lookup, NULL);
+    ck_assert_msg(resolver != NULL, "Failed to create the resolver.");
+
+    unsigned int i;
+
+    for (i = 0; i < DNS_RESOLVER_CACHE_SIZE; ++i) {
+        char host[32];
+        snprintf(host, sizeof(host), "fill%u.example", i);
+        ck_assert_msg(dns_resolve(resolver, host, port, public_key, handle_resolved, NULL) == 0, "Lookup wasn't queued.");
+        wait_resolved(resolver);
+    }
+
+    /* Both lookups finish in the same pass. The failure takes the entry that expires first and, expiring before
+     * all the others, is itself replaced by the second lookup. Each request must still get its own result. */
+    stub_release = 0;
+    ck_assert_msg(dns_resolve(resolver, "bad.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    ck_assert_msg(dns_resolve(resolver, "good.example", port, public_key, handle_resolved, NULL) == 0,
+                  "Lookup wasn't queued.");
+    stub_release = 1;
+
+    for (i = 0; i < 1000 && stub_lookups < DNS_RESOLVER_CACHE_SIZE + 2; ++i)
+        c_sleep(1);
+
+    c_sleep(10);
+    resolved_count = 0;
+    do_dns_resolver(resolver);
+    ck_assert_msg(resolver->num_requests == 0, "Lookups didn't finish in one pass.");
+    ck_assert_msg(resolved_count == 2, "Callbacks called %u times, expected 2.", resolved_count);
+
+    kill_dns_resolver(resolver);
+    c_sleep(10);
+}
+END_TEST
+
 Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(networking_poll);
+    DEFTESTCASE(send_queue);
+    DEFTESTCASE(rate_limit);
+    DEFTESTCASE(dns_resolver);
+    DEFTESTCASE(dns_resolver_full_cache);
 
     return s;
 }
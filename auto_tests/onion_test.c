@@ -12,6 +12,7 @@
 #include "../toxcore/onion.h"
 #include "../toxcore/onion_announce.h"
 #include "../toxcore/onion_client.h"
+#include "../toxcore/xor_distance.h"
 #include "../toxcore/util.h"
 
 #include "helpers.h"
@@ -76,17 +77,16 @@ static int handle_test_3(void *object, IP_Port source, const uint8_t *packet, ui
 {
     Onion *onion = object;
 
-    if (length != (1 + crypto_box_NONCEBYTES + ONION_ANNOUNCE_SENDBACK_DATA_LENGTH + 1 + crypto_hash_sha256_BYTES +
-                   crypto_box_MACBYTES))
+    if (length < ONION_ANNOUNCE_RESPONSE_MIN_SIZE || length > ONION_ANNOUNCE_RESPONSE_MAX_SIZE)
         return 1;
 
-    uint8_t plain[1 + crypto_hash_sha256_BYTES];
+    uint8_t plain[1 + ONION_PING_ID_SIZE + length - ONION_ANNOUNCE_RESPONSE_MIN_SIZE];
     //print_client_id(packet, length);
     int len = decrypt_data(test_3_pub_key, onion->dht->self_secret_key, packet + 1 + ONION_ANNOUNCE_SENDBACK_DATA_LENGTH,
                            packet + 1 + ONION_ANNOUNCE_SENDBACK_DATA_LENGTH + crypto_box_NONCEBYTES,
-                           1 + crypto_hash_sha256_BYTES + crypto_box_MACBYTES, plain);
+                           length - (1 + ONION_ANNOUNCE_SENDBACK_DATA_LENGTH + crypto_box_NONCEBYTES), plain);
 
-    if (len == -1)
+    if ((uint32_t)len != sizeof(plain))
         return 1;
 
 
@@ -172,8 +172,10 @@ START_TEST(test_basic)
         do_onion(onion2);
     }
 
-    Onion_Announce *onion1_a = new_onion_announce(onion1->dht);
-    Onion_Announce *onion2_a = new_onion_announce(onion2->dht);
+    GC_Announces_List *gca1 = new_gca_list();
+    GC_Announces_List *gca2 = new_gca_list();
+    Onion_Announce *onion1_a = new_onion_announce(onion1->dht, gca1);
+    Onion_Announce *onion2_a = new_onion_announce(onion2->dht, gca2);
     networking_registerhandler(onion1->net, NET_PACKET_ANNOUNCE_RESPONSE, &handle_test_3, onion1);
     ck_assert_msg((onion1_a != NULL) && (onion2_a != NULL), "Onion_Announce failed initializing.");
     uint8_t zeroes[64] = {0};
@@ -195,14 +197,14 @@ START_TEST(test_basic)
 
     randombytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
-    memcpy(onion2_a->entries[1].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    onion2_a->entries[1].time = unix_time();
+    uint8_t ret_path[ONION_RETURN_3] = {0};
+    ck_assert_msg(announce_store_add(&onion2_a->entries, onion2->dht->self_public_key, nodes[0].ip_port, ret_path,
+                                     onion2->dht->self_public_key) != NULL, "Failed to add an announcement.");
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3], onion1->dht->self_public_key, onion1->dht->self_secret_key,
                           test_3_ping_id, onion1->dht->self_public_key, onion1->dht->self_public_key, s);
 
-    while (memcmp(onion2_a->entries[ONION_ANNOUNCE_MAX_ENTRIES - 2].public_key, onion1->dht->self_public_key,
-                  crypto_box_PUBLICKEYBYTES) != 0) {
+    while (announce_store_find(&onion2_a->entries, onion1->dht->self_public_key) == NULL) {
         do_onion(onion1);
         do_onion(onion2);
         c_sleep(50);
@@ -227,6 +229,8 @@ START_TEST(test_basic)
 
     kill_onion_announce(onion1_a);
     kill_onion_announce(onion2_a);
+    kill_gca(gca1);
+    kill_gca(gca2);
 
     {
         Onion *onion = onion1;
@@ -262,6 +266,8 @@ END_TEST
 
 typedef struct {
     Onion *onion;
+    GC_Announces_List *gca;
+    GC_Session *gc_session;
     Onion_Announce *onion_a;
     Onion_Client *onion_c;
 } Onions;
@@ -274,9 +280,13 @@ Onions *new_onions(uint16_t port)
     Onions *on = malloc(sizeof(Onions));
     DHT *dht = new_DHT(new_networking(ip, port));
     on->onion = new_onion(dht);
-    on->onion_a = new_onion_announce(dht);
+    on->gca = new_gca_list();
+    on->onion_a = new_onion_announce(dht, on->gca);
+    /* No Messenger here, so the onion client gets a session without any group chats. */
+    on->gc_session = calloc(1, sizeof(GC_Session));
+    on->gc_session->announces_list = on->gca;
     TCP_Proxy_Info inf = {0};
-    on->onion_c = new_onion_client(new_net_crypto(dht, &inf));
+    on->onion_c = new_onion_client(new_net_crypto(dht, &inf), on->gc_session);
 
     if (on->onion && on->onion_a && on->onion_c)
         return on;
@@ -298,6 +308,8 @@ void kill_onions(Onions *on)
     Net_Crypto *c = on->onion_c->c;
     kill_onion_client(on->onion_c);
     kill_onion_announce(on->onion_a);
+    kill_gca(on->gca);
+    free(on->gc_session);
     kill_onion(on->onion);
     kill_net_crypto(c);
     kill_DHT(dht);
@@ -392,7 +404,7 @@ START_TEST(test_announce)
 
         for (i = 0; i < NUM_ONIONS; ++i) {
             do_onions(onions[i]);
-            connected += DHT_isconnected(onions[i]->onion->dht);
+            connected += DHT_isconnected(onions[i]->onion->dht) != 0;
         }
 
         c_sleep(50);
@@ -449,12 +461,90 @@ START_TEST(test_announce)
 }
 END_TEST
 
+#define STORE_KEYS 500
+#define STORE_CAPACITY 96 /* The index holds up to 96 keys without growing, but not 97. */
+
+START_TEST(test_announce_store)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES] = {0};
+    uint8_t keys[6][crypto_box_PUBLICKEYBYTES] = {{0}};
+    uint8_t ret[ONION_RETURN_3] = {0};
+    IP_Port ip_port = {{0}};
+    Announce_Store store;
+    unsigned int i;
+
+    /* The first byte of each key is its distance to self_public_key. */
+    for (i = 0; i < 6; ++i)
+        keys[i][0] = (i + 1) * 10;
+
+    unix_time_update();
+    ck_assert_msg(announce_store_init(&store, 4, 1, self_public_key) == 0, "Failed to init the store.");
+
+    for (i = 0; i < 4; ++i)
+        ck_assert_msg(announce_store_add(&store, keys[i], ip_port, ret, keys[i]) != NULL, "Failed to add %u.", i);
+
+    ck_assert_msg(announce_store_add(&store, keys[4], ip_port, ret, keys[4]) == NULL,
+                  "Full store took a key further than all its keys.");
+    ck_assert_msg(announce_store_find(&store, keys[4]) == NULL, "Found a key that was not added.");
+
+    /* A key closer than the others takes the place of the furthest one. */
+    uint8_t closer[crypto_box_PUBLICKEYBYTES] = {5};
+    ck_assert_msg(announce_store_add(&store, closer, ip_port, ret, closer) != NULL, "Failed to add a closer key.");
+    ck_assert_msg(announce_store_find(&store, keys[3]) == NULL, "Furthest key was not evicted.");
+    ck_assert_msg(announce_store_find(&store, closer) != NULL, "Closer key not found.");
+
+    for (i = 0; i < 3; ++i)
+        ck_assert_msg(announce_store_find(&store, keys[i]) != NULL, "Key %u not found.", i);
+
+    Onion_Announce_Entry *entry = announce_store_find(&store, keys[0]);
+    ck_assert_msg(announce_store_add(&store, keys[0], ip_port, ret, keys[5]) == entry, "Refresh moved the entry.");
+    ck_assert_msg(public_key_cmp(entry->data_public_key, keys[5]) == 0, "Refresh did not set the data key.");
+    ck_assert_msg(store.num_entries == 4, "Wrong number of entries: %u.", store.num_entries);
+
+    c_sleep(2000);
+    unix_time_update();
+    ck_assert_msg(announce_store_find(&store, keys[0]) == NULL, "Announcement did not expire.");
+    ck_assert_msg(store.num_entries == 0, "Expired entries left: %u.", store.num_entries);
+    ck_assert_msg(announce_store_add(&store, keys[4], ip_port, ret, keys[4]) != NULL, "Failed to add after expiry.");
+    announce_store_free(&store);
+
+    /* With random keys the store keeps the STORE_CAPACITY closest ones. */
+    uint8_t (*random_keys)[crypto_box_PUBLICKEYBYTES] = malloc(STORE_KEYS * crypto_box_PUBLICKEYBYTES);
+    randombytes(self_public_key, sizeof(self_public_key));
+    randombytes((uint8_t *)random_keys, STORE_KEYS * crypto_box_PUBLICKEYBYTES);
+    ck_assert_msg(announce_store_init(&store, STORE_CAPACITY, 300, self_public_key) == 0, "Failed to init the store.");
+    uint32_t index_capacity = store.index.capacity;
+
+    for (i = 0; i < STORE_KEYS; ++i)
+        announce_store_add(&store, random_keys[i], ip_port, ret, random_keys[i]);
+
+    ck_assert_msg(store.num_entries == STORE_CAPACITY, "Wrong number of entries: %u.", store.num_entries);
+    /* The key replacing an evicted one is added to the index first, which must not make it grow. */
+    ck_assert_msg(store.index.capacity == index_capacity, "Index grew from %u to %u slots.", index_capacity,
+                  store.index.capacity);
+
+    for (i = 0; i < STORE_KEYS; ++i) {
+        unsigned int j, closer_keys = 0;
+
+        for (j = 0; j < STORE_KEYS; ++j)
+            closer_keys += (id_closest(self_public_key, random_keys[j], random_keys[i]) == 1);
+
+        ck_assert_msg((announce_store_find(&store, random_keys[i]) != NULL) == (closer_keys < STORE_CAPACITY),
+                      "Key %u with %u closer keys wrongly kept or evicted.", i, closer_keys);
+    }
+
+    announce_store_free(&store);
+    free(random_keys);
+}
+END_TEST
+
 Suite *onion_suite(void)
 {
     Suite *s = suite_create("Onion");
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(announce, 70);
+    DEFTESTCASE_SLOW(announce_store, 5);
     return s;
 }
 
@@ -386,6 +386,19 @@ START_TEST(test_one)
     tox_self_get_public_key(tox2, pk);
     ck_assert_msg(memcmp(pk, address, TOX_PUBLIC_KEY_SIZE) == 0, "Wrong public key.");
 
+    tox_options_default(&options);
+    options.handshake_workers = 17;
+    ck_assert_msg(tox_new(&options, &err_n) == NULL && err_n == TOX_ERR_NEW_BAD_OPTION, "Bad handshake_workers accepted");
+    tox_options_default(&options);
+    options.decrypt_workers = 17;
+    ck_assert_msg(tox_new(&options, &err_n) == NULL && err_n == TOX_ERR_NEW_BAD_OPTION, "Bad decrypt_workers accepted");
+    tox_options_default(&options);
+    options.multipath = (TOX_MULTIPATH)100;
+    ck_assert_msg(tox_new(&options, &err_n) == NULL && err_n == TOX_ERR_NEW_BAD_OPTION, "Bad multipath accepted");
+    tox_options_default(&options);
+    options.congestion_control = (TOX_CONGESTION_CONTROL)100;
+    ck_assert_msg(tox_new(&options, &err_n) == NULL && err_n == TOX_ERR_NEW_BAD_OPTION, "Bad congestion_control accepted");
+
     tox_kill(tox1);
     tox_kill(tox2);
 }
@@ -480,6 +493,15 @@ START_TEST(test_few_clients)
 
     printf("tox clients messaging succeeded\n");
 
+    struct Tox_Connection_Stats stats;
+    TOX_ERR_FRIEND_QUERY err_q;
+    ck_assert_msg(tox_friend_get_connection_stats(tox2, 0, &stats, &err_q), "failed to get connection stats %u", err_q);
+    ck_assert_msg(stats.connection_status == TOX_CONNECTION_UDP, "wrong connection status in stats");
+    ck_assert_msg(stats.packets_sent != 0, "no sent packets in stats");
+    ck_assert_msg(stats.max_packet_size >= 1400, "wrong max packet size in stats %u", stats.max_packet_size);
+    ck_assert_msg(!tox_friend_get_connection_stats(tox2, 1, &stats, &err_q)
+                  && err_q == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "got connection stats of invalid friend");
+
     unsigned int save_size1 = tox_get_savedata_size(tox2);
     ck_assert_msg(save_size1 != 0 && save_size1 < 4096, "save is invalid size %u", save_size1);
     printf("%u\n", save_size1);
@@ -1090,187 +1112,6 @@ loop_top:
 }
 END_TEST
 
-
-#define NUM_GROUP_TOX 32
-
-void g_accept_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length, void *userdata)
-{
-    if (*((uint32_t *)userdata) != 234212)
-        return;
-
-    if (length == 7 && memcmp("Gentoo", data, 7) == 0) {
-        tox_friend_add_norequest(m, public_key, 0);
-    }
-}
-
-static Tox *invite_tox;
-static unsigned int invite_counter;
-
-void print_group_invite_callback(Tox *tox, int32_t friendnumber, uint8_t type, const uint8_t *data, uint16_t length,
-                                 void *userdata)
-{
-    if (*((uint32_t *)userdata) != 234212)
-        return;
-
-    if (type != TOX_GROUPCHAT_TYPE_TEXT)
-        return;
-
-    int g_num;
-
-    if ((g_num = tox_group_new_join(tox, friendnumber, data, length)) == -1)
-        return;
-
-    ck_assert_msg(g_num == 0, "Group number was not 0");
-    ck_assert_msg(tox_join_groupchat(tox, friendnumber, data, length) == -1,
-                  "Joining groupchat twice should be impossible.");
-
-    invite_tox = tox;
-    invite_counter = 4;
-}
-
-static unsigned int num_recv;
-
-void print_group_message(Tox *tox, int groupnumber, int peernumber, const uint8_t *message, uint16_t length,
-                         void *userdata)
-{
-    if (*((uint32_t *)userdata) != 234212)
-        return;
-
-    if (length == (sizeof("Install Gentoo") - 1) && memcmp(message, "Install Gentoo", sizeof("Install Gentoo") - 1) == 0) {
-        ++num_recv;
-    }
-}
-
-START_TEST(test_many_group)
-{
-    long long unsigned int cur_time = time(NULL);
-    Tox *toxes[NUM_GROUP_TOX];
-    unsigned int i, j, k;
-
-    uint32_t to_comp = 234212;
-
-    for (i = 0; i < NUM_GROUP_TOX; ++i) {
-        toxes[i] = tox_new(0, 0);
-        ck_assert_msg(toxes[i] != 0, "Failed to create tox instances %u", i);
-        tox_callback_friend_request(toxes[i], &g_accept_friend_request, &to_comp);
-        tox_callback_group_invite(toxes[i], &print_group_invite_callback, &to_comp);
-    }
-
-    {
-        TOX_ERR_GET_PORT error;
-        ck_assert_msg(tox_self_get_udp_port(toxes[0], &error) == 33445, "First Tox instance did not bind to udp port 33445.\n");
-        ck_assert_msg(error == TOX_ERR_GET_PORT_OK, "wrong error");
-    }
-
-    uint8_t address[TOX_ADDRESS_SIZE];
-    tox_self_get_address(toxes[NUM_GROUP_TOX - 1], address);
-
-    for (i = 0; i < NUM_GROUP_TOX; ++i) {
-        ck_assert_msg(tox_friend_add(toxes[i], address, (uint8_t *)"Gentoo", 7, 0) == 0, "Failed to add friend");
-
-        tox_self_get_address(toxes[i], address);
-    }
-
-    while (1) {
-        for (i = 0; i < NUM_GROUP_TOX; ++i) {
-            if (tox_friend_get_connection_status(toxes[i], 0, 0) != TOX_CONNECTION_UDP) {
-                break;
-            }
-        }
-
-        if (i == NUM_GROUP_TOX)
-            break;
-
-        for (i = 0; i < NUM_GROUP_TOX; ++i) {
-            tox_iterate(toxes[i]);
-        }
-
-        c_sleep(50);
-    }
-
-    printf("friends connected, took %llu seconds\n", time(NULL) - cur_time);
-
-    ck_assert_msg(tox_add_groupchat(toxes[0]) != -1, "Failed to create group");
-    ck_assert_msg(tox_invite_friend(toxes[0], 0, 0) == 0, "Failed to invite friend");
-    ck_assert_msg(tox_group_set_title(toxes[0], 0, "Gentoo", sizeof("Gentoo") - 1) == 0, "Failed to set group title");
-    invite_counter = ~0;
-
-    unsigned int done = ~0;
-    done -= 5;
-
-    while (1) {
-        for (i = 0; i < NUM_GROUP_TOX; ++i) {
-            tox_iterate(toxes[i]);
-        }
-
-        if (!invite_counter) {
-            ck_assert_msg(tox_invite_friend(invite_tox, 0, 0) == 0, "Failed to invite friend");
-        }
-
-        if (done == invite_counter) {
-            break;
-        }
-
-        --invite_counter;
-        c_sleep(50);
-    }
-
-    for (i = 0; i < NUM_GROUP_TOX; ++i) {
-        int num_peers = tox_group_number_peers(toxes[i], 0);
-        ck_assert_msg(num_peers == NUM_GROUP_TOX, "Bad number of group peers. expected: %u got: %i, tox %u", NUM_GROUP_TOX,
-                      num_peers, i);
-
-        uint8_t title[2048];
-        int ret = tox_group_get_title(toxes[i], 0, title, sizeof(title));
-        ck_assert_msg(ret == sizeof("Gentoo") - 1, "Wrong title length");
-        ck_assert_msg(memcmp("Gentoo", title, ret) == 0, "Wrong title");
-    }
-
-    printf("group connected\n");
-
-    for (i = 0; i < NUM_GROUP_TOX; ++i) {
-        tox_callback_group_message(toxes[i], &print_group_message, &to_comp);
-    }
-
-    ck_assert_msg(tox_group_message_send(toxes[rand() % NUM_GROUP_TOX], 0, (uint8_t *)"Install Gentoo",
-                                         sizeof("Install Gentoo") - 1) == 0, "Failed to send group message.");
-    num_recv = 0;
-
-    for (j = 0; j < 20; ++j) {
-        for (i = 0; i < NUM_GROUP_TOX; ++i) {
-            tox_iterate(toxes[i]);
-        }
-
-        c_sleep(50);
-    }
-
-    ck_assert_msg(num_recv == NUM_GROUP_TOX, "Failed to recv group messages.");
-
-    for (k = NUM_GROUP_TOX; k != 0 ; --k) {
-        tox_group_delete(toxes[k - 1], 0);
-
-        for (j = 0; j < 10; ++j) {
-            for (i = 0; i < NUM_GROUP_TOX; ++i) {
-                tox_iterate(toxes[i]);
-            }
-
-            c_sleep(50);
-        }
-
-        for (i = 0; i < (k - 1); ++i) {
-            int num_peers = tox_group_number_peers(toxes[i], 0);
-            ck_assert_msg(num_peers == (k - 1), "Bad number of group peers. expected: %u got: %i, tox %u", (k - 1), num_peers, i);
-        }
-    }
-
-    for (i = 0; i < NUM_GROUP_TOX; ++i) {
-        tox_kill(toxes[i]);
-    }
-
-    printf("test_many_group succeeded, took %llu seconds\n", time(NULL) - cur_time);
-}
-END_TEST
-
 Suite *tox_suite(void)
 {
     Suite *s = suite_create("Tox");
@@ -1280,7 +1121,6 @@ Suite *tox_suite(void)
     DEFTESTCASE_SLOW(many_clients, 80);
     DEFTESTCASE_SLOW(many_clients_tcp, 20);
     DEFTESTCASE_SLOW(many_clients_tcp_b, 20);
-    DEFTESTCASE_SLOW(many_group, 100);
     return s;
 }
 
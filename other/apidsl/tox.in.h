@@ -369,6 +369,64 @@ enum class SAVEDATA_TYPE {
   SECRET_KEY,
 }
 
+/**
+ * Congestion control algorithm used to pace the data sent to friends.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Slow down when the queue of packets waiting to be sent grows.
+   */
+  QUEUE,
+  /**
+   * Slow down when the round trip time grows above its minimum, and pace the
+   * packets. Keeps the latency low while sending files or calling.
+   */
+  DELAY,
+}
+
+/**
+ * Direct UDP connections on which the biggest packets the path carries are
+ * searched for, to send files faster on networks with jumbo frames.
+ *
+ * While it runs, all the UDP packets of the instance are sent with the don't
+ * fragment bit. It is not run on systems that can't set it.
+ */
+enum class PMTU_DISCOVERY {
+  /**
+   * Never send packets bigger than the ones every path carries.
+   */
+  DISABLED,
+  /**
+   * Connections to friends on the LAN.
+   */
+  LAN,
+  /**
+   * All direct connections, for networks with jumbo frames end to end.
+   */
+  ALL,
+}
+
+/**
+ * How friend connections use the direct UDP connection and a TCP relay when
+ * both are up. Only connections to friends that enabled it too use it.
+ */
+enum class MULTIPATH {
+  /**
+   * Send everything directly while the direct connection is up.
+   */
+  DISABLED,
+  /**
+   * Keep a TCP relay online and send on the path with the lowest round trip
+   * time.
+   */
+  FASTEST,
+  /**
+   * Like FASTEST, but also send lossy packets, typing notifications and call
+   * control on both paths, so they arrive when one path silently dies.
+   */
+  REDUNDANT,
+}
+
 
 static class options {
   /**
@@ -470,6 +528,55 @@ static class options {
        */
       size_t length;
     }
+
+    namespace node_cache {
+      /**
+       * A node cache obtained from ${tox.get_node_cache}, or NULL to start
+       * without one.
+       *
+       * The best ranked DHT nodes and TCP relays in it are all contacted as
+       * soon as the instance starts. A cache that can't be loaded is ignored.
+       */
+      const uint8_t[length] data;
+
+      /**
+       * The length of the node cache.
+       */
+      size_t length;
+    }
+
+    /**
+     * The congestion control algorithm used for all friend connections.
+     */
+    CONGESTION_CONTROL congestion_control;
+
+    /**
+     * Pack small lossless packets sent to friends that understand it into one
+     * packet, saving the overhead of sending each of them on its own.
+     */
+    bool coalesce_packets;
+
+    /**
+     * Number of threads that check the handshakes of peers connecting to us, at
+     * most 16. With 0 they are checked by the thread calling ${tox.iterate}.
+     */
+    uint32_t handshake_workers;
+
+    /**
+     * Number of threads that decrypt the data packets friends send us, at most
+     * 16. With 0 they are decrypted by the thread calling ${tox.iterate}.
+     */
+    uint32_t decrypt_workers;
+
+    /**
+     * The connections on which path MTU discovery runs.
+     */
+    PMTU_DISCOVERY pmtu_discovery;
+
+    /**
+     * How friend connections use both paths to friends.
+     */
+    MULTIPATH multipath;
   }
 
 
@@ -586,6 +693,11 @@ static this new(const options_t *options) {
      */
     BAD_FORMAT,
   }
+  /**
+   * congestion_control, pmtu_discovery or multipath was not one of its enum
+   * values, or handshake_workers or decrypt_workers was greater than 16.
+   */
+  BAD_OPTION,
 }
 
 
@@ -618,6 +730,31 @@ uint8_t[size] savedata {
   get();
 }
 
+uint8_t[size] node_cache {
+  /**
+   * Calculates the number of bytes required to store the node cache with
+   * $get.
+   *
+   * The node cache records the DHT nodes and TCP relays this instance talked to,
+   * with when they were last seen, how fast and how often they answered. It is
+   * not part of the savedata so that clients can keep it in its own file, share
+   * it between profiles and drop it without losing anything else.
+   *
+   * The result is 0 if the instance couldn't allocate a node cache.
+   */
+  size();
+
+  /**
+   * Store the node cache to a byte array, pass it in ${options.this.node_cache.data}
+   * on the next start.
+   *
+   * @param node_cache A memory region large enough to store the node cache.
+   *   Call $size to find the number of bytes required. If this
+   *   parameter is NULL, this function has no effect.
+   */
+  get();
+}
+
 
 /*******************************************************************************
  *
@@ -633,18 +770,27 @@ uint8_t[size] savedata {
  * This function will attempt to connect to the node using UDP. You must use
  * this function even if ${options.this.udp_enabled} was set to false.
  *
+ * A hostname is looked up without blocking: the function returns right away
+ * and the request is sent from ${tox.iterate} once the name is resolved. Results
+ * are cached, so bootstrapping from many nodes on the same host only looks it
+ * up once. When too many hostnames are already waiting to be looked up, the
+ * name is looked up before the function returns.
+ *
  * @param address The hostname or IP address (IPv4 or IPv6) of the node.
  * @param port The port on the host on which the bootstrap Tox instance is
  *   listening.
  * @param public_key The long term public key of the bootstrap node
  *   ($PUBLIC_KEY_SIZE bytes).
- * @return true on success.
+ * @return true on success, or if the hostname is still being looked up. If
+ *   that lookup fails later, no error is reported and the node is not used.
  */
 bool bootstrap(string address, uint16_t port, const uint8_t[PUBLIC_KEY_SIZE] public_key) {
   NULL,
   /**
    * The address could not be resolved to an IP address, or the IP address
-   * passed was invalid.
+   * passed was invalid. Hostnames that were recently looked up without
+   * result fail this way right away, for those that still need to be looked
+   * up the function succeeds and the failure is silent.
    */
   BAD_HOST,
   /**
@@ -661,11 +807,14 @@ bool bootstrap(string address, uint16_t port, const uint8_t[PUBLIC_KEY_SIZE] pub
  * the same bootstrap node, or to add TCP relays without using them as
  * bootstrap nodes.
  *
+ * Hostnames are looked up without blocking, like in $bootstrap.
+ *
  * @param address The hostname or IP address (IPv4 or IPv6) of the TCP relay.
  * @param port The port on the host on which the TCP relay is listening.
  * @param public_key The long term public key of the TCP relay
  *   ($PUBLIC_KEY_SIZE bytes).
- * @return true on success.
+ * @return true on success, or if the hostname is still being looked up. If
+ *   that lookup fails later, no error is reported and the relay is not used.
  */
 bool add_tcp_relay(string address, uint16_t port, const uint8_t[PUBLIC_KEY_SIZE] public_key)
     with error for bootstrap;
@@ -1306,6 +1455,91 @@ namespace friend {
     typedef void(uint32_t friend_number, CONNECTION connection_status);
   }
 
+}
+
+/**
+ * Transport statistics of the connection to a friend or group peer.
+ *
+ * Values that are not known for a connection are set to 0.
+ */
+static class connection_stats {
+  struct this {
+    /**
+     * How we are connected to the peer.
+     */
+    CONNECTION connection_status;
+
+    /**
+     * Estimated round trip time to the peer in milliseconds.
+     */
+    uint32_t rtt;
+
+    /**
+     * Number of lossless packets per second we may currently send to the peer.
+     */
+    uint32_t send_rate;
+
+    /**
+     * Number of lossless packets per second we currently receive from the peer.
+     */
+    uint32_t recv_rate;
+
+    /**
+     * Number of lossless packets sent to the peer, not counting packets sent
+     * again.
+     */
+    uint64_t packets_sent;
+
+    /**
+     * Number of lossless packets sent again because the peer did not receive
+     * them.
+     */
+    uint64_t packets_resent;
+
+    /**
+     * Number of lossless packets received from the peer.
+     */
+    uint64_t packets_received;
+
+    /**
+     * Number of lossless packets sent to the peer that it has not acknowledged
+     * yet.
+     */
+    uint32_t send_queue;
+
+    /**
+     * Number of lossless packets received from the peer that wait for missing
+     * packets before them.
+     */
+    uint32_t recv_queue;
+
+    /**
+     * Size in bytes of the biggest packets sent to the peer. Above 1400 when
+     * path MTU discovery found that the direct path to the peer carries bigger
+     * packets, see ${options.this.pmtu_discovery}.
+     */
+    uint16_t max_packet_size;
+  }
+}
+
+namespace friend {
+
+  /**
+   * Write the transport statistics of the connection to a friend to a
+   * $connection_stats struct.
+   *
+   * If the friend is offline, connection_status is set to ${CONNECTION.NONE} and
+   * all the other values to 0.
+   *
+   * @param friend_number The friend number for which to query the statistics.
+   * @param stats A valid $connection_stats struct. If this parameter is NULL,
+   *   the function fails with the NULL error.
+   *
+   * @return true on success.
+   */
+  bool get_connection_stats(uint32_t friend_number, connection_stats_t *stats)
+      with error for query;
+
 
   bool typing {
     /**
@@ -2528,6 +2762,10 @@ namespace group {
        * The ID passed did not designate a valid peer.
        */
       PEER_NOT_FOUND,
+      /**
+       * The pointer parameter for storing the query result was NULL.
+       */
+      NULL,
     }
 
     uint8_t[length <= MAX_NAME_LENGTH] name {
@@ -2600,6 +2838,25 @@ namespace group {
        get(uint32_t groupnumber, uint32_t peer_id) with error for query;
     }
 
+    /**
+     * Write the transport statistics of the connection to the peer designated by
+     * the given ID to a $connection_stats struct.
+     *
+     * connection_status is ${CONNECTION.UDP} while we receive packets directly from
+     * the peer, ${CONNECTION.TCP} while a TCP relay to the peer is online and
+     * ${CONNECTION.NONE} otherwise. send_rate and recv_rate are not measured for
+     * group peers and are set to 0.
+     *
+     * @param groupnumber The group number of the group we wish to query.
+     * @param peer_id The ID of the peer whose connection we want to query.
+     * @param stats A valid $connection_stats struct. If this parameter is NULL,
+     *   the function fails with the NULL error.
+     *
+     * @return true on success.
+     */
+    bool get_connection_stats(uint32_t groupnumber, uint32_t peer_id, connection_stats_t *stats)
+        with error for query;
+
     /**
      * This event is triggered when a peer changes their nickname.
      */
@@ -145,7 +145,7 @@ void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_ports, int
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6,
                        int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
-                       int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       int *tcp_relay_port_count, int *tcp_relay_workers, int *enable_motd, char **motd)
 {
     config_t cfg;
 
@@ -156,6 +156,7 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_IPV4_FALLBACK = "enable_ipv4_fallback";
     const char *NAME_ENABLE_LAN_DISCOVERY = "enable_lan_discovery";
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
+    const char *NAME_TCP_RELAY_WORKERS    = "tcp_relay_workers";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
 
@@ -236,6 +237,18 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         *tcp_relay_port_count = 0;
     }
 
+    // Get TCP relay worker count
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_WORKERS, tcp_relay_workers) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_WORKERS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_WORKERS, DEFAULT_TCP_RELAY_WORKERS);
+        *tcp_relay_workers = DEFAULT_TCP_RELAY_WORKERS;
+    } else if (*tcp_relay_workers < 0 || *tcp_relay_workers > MAX_TCP_RELAY_WORKERS) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be in [0, %d].\n", NAME_TCP_RELAY_WORKERS, *tcp_relay_workers,
+                  MAX_TCP_RELAY_WORKERS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_WORKERS, DEFAULT_TCP_RELAY_WORKERS);
+        *tcp_relay_workers = DEFAULT_TCP_RELAY_WORKERS;
+    }
+
     // Get MOTD option
     if (config_lookup_bool(&cfg, NAME_ENABLE_MOTD, enable_motd) == CONFIG_FALSE) {
         write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_MOTD);
@@ -285,6 +298,8 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
                 write_log(LOG_LEVEL_INFO, "Port #%d: %u\n", i, (*tcp_relay_ports)[i]);
             }
         }
+
+        write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_WORKERS, *tcp_relay_workers);
     }
 
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_MOTD,          *enable_motd          ? "true" : "false");
@@ -429,3 +444,222 @@ next:
 
     return 1;
 }
+
+int rate_limit_from_config(const char *cfg_file_path, Networking_Core *net, int *log_interval)
+{
+    const char *NAME_ENABLE_RATE_LIMIT       = "enable_rate_limit";
+    const char *NAME_RATE_LIMIT_IPV4_PREFIX  = "rate_limit_ipv4_prefix";
+    const char *NAME_RATE_LIMIT_IPV6_PREFIX  = "rate_limit_ipv6_prefix";
+    const char *NAME_RATE_LIMIT_LOG_INTERVAL = "rate_limit_log_interval";
+    const char *NAME_RATE_LIMIT_BUDGETS      = "rate_limit_budgets";
+
+    const char *NAME_PACKET_ID = "packet_id";
+    const char *NAME_RATE      = "rate";
+    const char *NAME_BURST     = "burst";
+
+    config_t cfg;
+
+    config_init(&cfg);
+
+    if (config_read_file(&cfg, cfg_file_path) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_ERROR, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return 0;
+    }
+
+    int enable_rate_limit;
+
+    if (config_lookup_bool(&cfg, NAME_ENABLE_RATE_LIMIT, &enable_rate_limit) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_RATE_LIMIT);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_ENABLE_RATE_LIMIT,
+                  DEFAULT_ENABLE_RATE_LIMIT ? "true" : "false");
+        enable_rate_limit = DEFAULT_ENABLE_RATE_LIMIT;
+    }
+
+    *log_interval = 0;
+
+    if (!enable_rate_limit) {
+        networking_enable_rate_limit(net, 0, 0, 0);
+        config_destroy(&cfg);
+        write_log(LOG_LEVEL_INFO, "'%s': false\n", NAME_ENABLE_RATE_LIMIT);
+        return 1;
+    }
+
+    int ipv4_prefix, ipv6_prefix;
+
+    if (config_lookup_int(&cfg, NAME_RATE_LIMIT_IPV4_PREFIX, &ipv4_prefix) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_RATE_LIMIT_IPV4_PREFIX);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_IPV4_PREFIX, DEFAULT_RATE_LIMIT_IPV4_PREFIX);
+        ipv4_prefix = DEFAULT_RATE_LIMIT_IPV4_PREFIX;
+    } else if (ipv4_prefix < 1 || ipv4_prefix > 32) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be in [1, 32].\n", NAME_RATE_LIMIT_IPV4_PREFIX, ipv4_prefix);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_IPV4_PREFIX, DEFAULT_RATE_LIMIT_IPV4_PREFIX);
+        ipv4_prefix = DEFAULT_RATE_LIMIT_IPV4_PREFIX;
+    }
+
+    if (config_lookup_int(&cfg, NAME_RATE_LIMIT_IPV6_PREFIX, &ipv6_prefix) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_RATE_LIMIT_IPV6_PREFIX);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_IPV6_PREFIX, DEFAULT_RATE_LIMIT_IPV6_PREFIX);
+        ipv6_prefix = DEFAULT_RATE_LIMIT_IPV6_PREFIX;
+    } else if (ipv6_prefix < 1 || ipv6_prefix > 128) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be in [1, 128].\n", NAME_RATE_LIMIT_IPV6_PREFIX, ipv6_prefix);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_IPV6_PREFIX, DEFAULT_RATE_LIMIT_IPV6_PREFIX);
+        ipv6_prefix = DEFAULT_RATE_LIMIT_IPV6_PREFIX;
+    }
+
+    if (config_lookup_int(&cfg, NAME_RATE_LIMIT_LOG_INTERVAL, log_interval) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_RATE_LIMIT_LOG_INTERVAL);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_LOG_INTERVAL,
+                  DEFAULT_RATE_LIMIT_LOG_INTERVAL);
+        *log_interval = DEFAULT_RATE_LIMIT_LOG_INTERVAL;
+    } else if (*log_interval < 0) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be at least 0.\n", NAME_RATE_LIMIT_LOG_INTERVAL, *log_interval);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT_LOG_INTERVAL,
+                  DEFAULT_RATE_LIMIT_LOG_INTERVAL);
+        *log_interval = DEFAULT_RATE_LIMIT_LOG_INTERVAL;
+    }
+
+    if (networking_enable_rate_limit(net, 1, ipv4_prefix, ipv6_prefix) != 0) {
+        write_log(LOG_LEVEL_ERROR, "Couldn't enable the rate limiter.\n");
+        config_destroy(&cfg);
+        return 0;
+    }
+
+    write_log(LOG_LEVEL_INFO, "'%s': true\n", NAME_ENABLE_RATE_LIMIT);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_RATE_LIMIT_IPV4_PREFIX, ipv4_prefix);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_RATE_LIMIT_IPV6_PREFIX, ipv6_prefix);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_RATE_LIMIT_LOG_INTERVAL, *log_interval);
+
+    config_setting_t *budget_list = config_lookup(&cfg, NAME_RATE_LIMIT_BUDGETS);
+
+    if (budget_list == NULL) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in the configuration file.\n", NAME_RATE_LIMIT_BUDGETS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s':\n", NAME_RATE_LIMIT_BUDGETS);
+
+        const int default_budgets[DEFAULT_RATE_LIMIT_BUDGETS_COUNT][3] = {DEFAULT_RATE_LIMIT_BUDGETS};
+
+        int i;
+
+        for (i = 0; i < DEFAULT_RATE_LIMIT_BUDGETS_COUNT; i ++) {
+            networking_set_packet_budget(net, default_budgets[i][0], default_budgets[i][1], default_budgets[i][2]);
+            write_log(LOG_LEVEL_INFO, "Packet id %d: %d packets per second, burst of %d\n", default_budgets[i][0],
+                      default_budgets[i][1], default_budgets[i][2]);
+        }
+
+        config_destroy(&cfg);
+        return 1;
+    }
+
+    int i;
+
+    for (i = 0; i < config_setting_length(budget_list); i ++) {
+        config_setting_t *budget = config_setting_get_elem(budget_list, i);
+
+        if (budget == NULL) {
+            write_log(LOG_LEVEL_WARNING, "Budget #%d: Something went wrong while parsing the budget. Stopping reading budgets.\n",
+                      i);
+            break;
+        }
+
+        int packet_id, rate, burst;
+
+        if (config_setting_lookup_int(budget, NAME_PACKET_ID, &packet_id) == CONFIG_FALSE
+                || config_setting_lookup_int(budget, NAME_RATE, &rate) == CONFIG_FALSE
+                || config_setting_lookup_int(budget, NAME_BURST, &burst) == CONFIG_FALSE) {
+            write_log(LOG_LEVEL_WARNING, "Budget #%d: Couldn't find '%s', '%s' or '%s' setting. Skipping the budget.\n", i,
+                      NAME_PACKET_ID, NAME_RATE, NAME_BURST);
+            continue;
+        }
+
+        if (packet_id < 0 || packet_id > 255 || rate < 0 || burst < 1
+                || networking_set_packet_budget(net, packet_id, rate, burst) != 0) {
+            write_log(LOG_LEVEL_WARNING, "Budget #%d: Invalid budget: packet id %d, rate %d, burst %d. Skipping the budget.\n",
+                      i, packet_id, rate, burst);
+            continue;
+        }
+
+        write_log(LOG_LEVEL_INFO, "Packet id %d: %d packets per second, burst of %d\n", packet_id, rate, burst);
+    }
+
+    config_destroy(&cfg);
+
+    return 1;
+}
+
+int onion_announce_from_config(const char *cfg_file_path, Onion_Announce *onion_a)
+{
+    const char *NAME_ONION_ANNOUNCE_CAPACITY = "onion_announce_capacity";
+
+    config_t cfg;
+
+    config_init(&cfg);
+
+    if (config_read_file(&cfg, cfg_file_path) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_ERROR, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return 0;
+    }
+
+    int capacity;
+
+    if (config_lookup_int(&cfg, NAME_ONION_ANNOUNCE_CAPACITY, &capacity) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ONION_ANNOUNCE_CAPACITY);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_ONION_ANNOUNCE_CAPACITY,
+                  DEFAULT_ONION_ANNOUNCE_CAPACITY);
+        capacity = DEFAULT_ONION_ANNOUNCE_CAPACITY;
+    } else if (capacity < 1 || capacity > MAX_ONION_ANNOUNCE_CAPACITY) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be in [1, %d].\n", NAME_ONION_ANNOUNCE_CAPACITY, capacity,
+                  MAX_ONION_ANNOUNCE_CAPACITY);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_ONION_ANNOUNCE_CAPACITY,
+                  DEFAULT_ONION_ANNOUNCE_CAPACITY);
+        capacity = DEFAULT_ONION_ANNOUNCE_CAPACITY;
+    }
+
+    config_destroy(&cfg);
+
+    if (onion_announce_set_capacity(onion_a, capacity) != 0) {
+        write_log(LOG_LEVEL_ERROR, "Couldn't allocate %d onion announcements.\n", capacity);
+        return 0;
+    }
+
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_ONION_ANNOUNCE_CAPACITY, capacity);
+    return 1;
+}
+
+int shared_keys_from_config(const char *cfg_file_path, DHT *dht)
+{
+    const char *NAME_SHARED_KEYS_SIZE = "shared_keys_size";
+
+    config_t cfg;
+
+    config_init(&cfg);
+
+    if (config_read_file(&cfg, cfg_file_path) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_ERROR, "%s:%d - %s\n", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return 0;
+    }
+
+    int size;
+
+    if (config_lookup_int(&cfg, NAME_SHARED_KEYS_SIZE, &size) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_SHARED_KEYS_SIZE);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEYS_SIZE, DEFAULT_SHARED_KEYS_SIZE);
+        size = DEFAULT_SHARED_KEYS_SIZE;
+    } else if (size < 1 || size > MAX_SHARED_KEYS_SIZE) {
+        write_log(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be in [1, %d].\n", NAME_SHARED_KEYS_SIZE, size,
+                  MAX_SHARED_KEYS_SIZE);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEYS_SIZE, DEFAULT_SHARED_KEYS_SIZE);
+        size = DEFAULT_SHARED_KEYS_SIZE;
+    }
+
+    config_destroy(&cfg);
+
+    if (DHT_set_shared_keys_size(dht, size) != 0) {
+        write_log(LOG_LEVEL_ERROR, "Couldn't allocate shared key caches of %d keys.\n", size);
+        return 0;
+    }
+
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_SHARED_KEYS_SIZE, size);
+    return 1;
+}
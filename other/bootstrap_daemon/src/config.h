@@ -26,6 +26,7 @@
 #define CONFIG_H
 
 #include "../../../toxcore/DHT.h"
+#include "../../../toxcore/onion_announce.h"
 
 /**
  * Gets general config options from the config file.
@@ -33,13 +34,14 @@
  * Important: You are responsible for freeing `pid_file_path` and `keys_file_path`
  *            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
  *            and also `motd` iff `enable_motd` is set.
+ *            `tcp_relay_workers` is the number of threads the TCP relay runs in, 0 to run it in the main loop.
  *
  * @return 1 on success,
  *         0 on failure, doesn't modify any data pointed by arguments.
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port, int *enable_ipv6,
                        int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
-                       int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       int *tcp_relay_port_count, int *tcp_relay_workers, int *enable_motd, char **motd);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -49,4 +51,31 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
  */
 int bootstrap_from_config(const char *cfg_file_path, DHT *dht, int enable_ipv6);
 
+/**
+ * Enables the rate limiter for received packets of `net` with the budgets listed in the config file.
+ *
+ * `log_interval` is set to the number of seconds between two log messages about dropped packets,
+ * 0 to never log them.
+ *
+ * @return 1 on success, the rate limiter is enabled or disabled as configured,
+ *         0 on failure, a error accured while parsing config file or enabling the rate limiter.
+ */
+int rate_limit_from_config(const char *cfg_file_path, Networking_Core *net, int *log_interval);
+
+/**
+ * Sets the number of announcements `onion_a` stores to the capacity in the config file.
+ *
+ * @return 1 on success,
+ *         0 on failure, a error accured while parsing config file or allocating the announcements.
+ */
+int onion_announce_from_config(const char *cfg_file_path, Onion_Announce *onion_a);
+
+/**
+ * Sets the number of keys each shared key cache of `dht` holds to the size in the config file.
+ *
+ * @return 1 on success,
+ *         0 on failure, a error accured while parsing config file or allocating the caches.
+ */
+int shared_keys_from_config(const char *cfg_file_path, DHT *dht);
+
 #endif // CONFIG_H
@@ -36,7 +36,25 @@
 #define DEFAULT_ENABLE_TCP_RELAY      1 // 1 - true, 0 - false
 #define DEFAULT_TCP_RELAY_PORTS       443, 3389, 33445 // comma-separated list of ports. make sure to adjust DEFAULT_TCP_RELAY_PORTS_COUNT accordingly
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
+#define DEFAULT_TCP_RELAY_WORKERS     0 // 0 - run the TCP relay in the main loop
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_ENABLE_RATE_LIMIT     1 // 1 - true, 0 - false
+#define DEFAULT_RATE_LIMIT_IPV4_PREFIX 32
+#define DEFAULT_RATE_LIMIT_IPV6_PREFIX 64
+#define DEFAULT_RATE_LIMIT_LOG_INTERVAL 60 // seconds, 0 - never log the dropped packets
+#define DEFAULT_ONION_ANNOUNCE_CAPACITY 160 // ONION_ANNOUNCE_MAX_ENTRIES
+#define DEFAULT_SHARED_KEYS_SIZE 1024 // SHARED_KEYS_DEFAULT_SIZE
+// {packet id, packets per second, burst} for each packet id that is limited. make sure to adjust DEFAULT_RATE_LIMIT_BUDGETS_COUNT accordingly
+#define DEFAULT_RATE_LIMIT_BUDGETS    {NET_PACKET_PING_REQUEST, 20, 40}, \
+                                      {NET_PACKET_GET_NODES, 20, 40}, \
+                                      {NET_PACKET_ONION_SEND_1, 2000, 4000}, \
+                                      {NET_PACKET_ONION_SEND_2, 2000, 4000}, \
+                                      {NET_PACKET_ONION_SEND_INITIAL, 50, 100}, \
+                                      {NET_PACKET_ANNOUNCE_REQUEST, 50, 100}, \
+                                      {NET_PACKET_ONION_DATA_REQUEST, 50, 100}, \
+                                      {NET_PACKET_GCA_ANNOUNCE, 20, 40}, \
+                                      {NET_PACKET_GCA_GET_NODES, 20, 40}
+#define DEFAULT_RATE_LIMIT_BUDGETS_COUNT 9
 
 #endif // CONFIG_DEFAULTS_H
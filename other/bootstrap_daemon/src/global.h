@@ -31,4 +31,10 @@
 #define MIN_ALLOWED_PORT 1
 #define MAX_ALLOWED_PORT 65535
 
+#define MAX_TCP_RELAY_WORKERS 64
+
+#define MAX_ONION_ANNOUNCE_CAPACITY 1000000
+
+#define MAX_SHARED_KEYS_SIZE 1000000
+
 #endif // GLOBAL_H
@@ -112,6 +112,24 @@ void print_public_key(const uint8_t *public_key)
     return;
 }
 
+// Logs the packets the rate limiter dropped per packet id since the last call
+// `logged_dropped` holds the drop counts of the last call and is updated
+
+void log_dropped_packets(const Networking_Core *net, uint64_t *logged_dropped, int interval)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        const uint64_t dropped = networking_packets_dropped(net, i);
+
+        if (dropped != logged_dropped[i]) {
+            write_log(LOG_LEVEL_INFO, "Rate limiter dropped %llu packets with id %d in the last %d seconds, %llu in total.\n",
+                      (unsigned long long)(dropped - logged_dropped[i]), i, interval, (unsigned long long)dropped);
+            logged_dropped[i] = dropped;
+        }
+    }
+}
+
 // Demonizes the process, appending PID to the PID file and closing file descriptors based on log backend
 // Terminates the application if the daemonization fails.
 
@@ -198,11 +216,13 @@ int main(int argc, char *argv[])
     int enable_tcp_relay;
     uint16_t *tcp_relay_ports;
     int tcp_relay_port_count;
+    int tcp_relay_workers;
     int enable_motd;
     char *motd;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &tcp_relay_workers,
+                           &enable_motd, &motd)) {
         write_log(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         write_log(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -250,6 +270,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (shared_keys_from_config(cfg_file_path, dht)) {
+        write_log(LOG_LEVEL_INFO, "Shared key cache config read successfully\n");
+    } else {
+        write_log(LOG_LEVEL_ERROR, "Couldn't set up the shared key caches from %s. Exiting.\n", cfg_file_path);
+        return 1;
+    }
+
     Onion *onion = new_onion(dht);
     GC_Announces_List *gc_announces_list = new_gca_list();
     Onion_Announce *onion_a = new_onion_announce(dht, gc_announces_list);
@@ -259,6 +286,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (onion_announce_from_config(cfg_file_path, onion_a)) {
+        write_log(LOG_LEVEL_INFO, "Onion announce config read successfully\n");
+    } else {
+        write_log(LOG_LEVEL_ERROR, "Couldn't set up the onion announcements from %s. Exiting.\n", cfg_file_path);
+        return 1;
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht->net, DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             write_log(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -287,13 +321,18 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+        tcp_server = new_TCP_server_workers(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion,
+                                            tcp_relay_workers);
 
         // tcp_relay_port_count != 0 at this point
         free(tcp_relay_ports);
 
         if (tcp_server != NULL) {
             write_log(LOG_LEVEL_INFO, "Initialized Tox TCP server successfully.\n");
+
+            if (tcp_relay_workers != TCP_server_num_workers(tcp_server)) {
+                write_log(LOG_LEVEL_WARNING, "TCP relay workers are not supported on this system, running it in the main loop.\n");
+            }
         } else {
             write_log(LOG_LEVEL_ERROR, "Couldn't initialize Tox TCP server. Exiting.\n");
             return 1;
@@ -307,9 +346,20 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    int rate_limit_log_interval;
+
+    if (rate_limit_from_config(cfg_file_path, dht->net, &rate_limit_log_interval)) {
+        write_log(LOG_LEVEL_INFO, "Rate limit config read successfully\n");
+    } else {
+        write_log(LOG_LEVEL_ERROR, "Couldn't set up the rate limiter from %s. Exiting.\n", cfg_file_path);
+        return 1;
+    }
+
     print_public_key(dht->self_public_key);
 
     uint64_t last_LANdiscovery = 0;
+    uint64_t last_rate_limit_log = unix_time();
+    uint64_t logged_dropped[256] = {0};
     const uint16_t htons_port = htons(port);
 
     int waiting_for_dht_connection = 1;
@@ -333,6 +383,11 @@ int main(int argc, char *argv[])
 
         networking_poll(dht->net);
 
+        if (rate_limit_log_interval && is_timeout(last_rate_limit_log, rate_limit_log_interval)) {
+            log_dropped_packets(dht->net, logged_dropped, rate_limit_log_interval);
+            last_rate_limit_log = unix_time();
+        }
+
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             write_log(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
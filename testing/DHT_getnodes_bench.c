@@ -0,0 +1,141 @@
+/* DHT_getnodes_bench.c
+ *
+ * Measures how many get nodes requests per second handle_getnodes() can answer.
+ *
+ * Fills the close list and the friend client lists of a DHT with random nodes,
+ * then feeds it get nodes requests for random public keys through its packet handler.
+ *
+ * Usage: DHT_getnodes_bench [number of friends]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+/* Number of random nodes the DHT hears about before the benchmark. */
+#define NUM_NODES 100000
+/* Number of different requests, they are sent again and again. */
+#define NUM_REQUESTS 1024
+#define NUM_ITERATIONS 200000
+
+#define GETNODES_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES \
+                       + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+static uint8_t requests[NUM_REQUESTS][GETNODES_SIZE];
+
+/* Create a get nodes request from public_key/secret_key to dht for a random public key. */
+static void create_getnodes(uint8_t *packet, const DHT *dht, const uint8_t *public_key, const uint8_t *secret_key)
+{
+    uint8_t plain[crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    randombytes(plain, sizeof(plain));
+    new_nonce(nonce);
+
+    packet[0] = NET_PACKET_GET_NODES;
+    memcpy(packet + 1, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, nonce, crypto_box_NONCEBYTES);
+    encrypt_data(dht->self_public_key, secret_key, nonce, plain, sizeof(plain),
+                 packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num_friends = 0, i;
+
+    if (argc > 1)
+        num_friends = atoi(argv[1]);
+
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(ip, 33445);
+    DHT *dht = new_DHT(net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    for (i = 0; i < num_friends; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(public_key, sizeof(public_key));
+        DHT_addfriend(dht, public_key, 0, 0, 0, 0);
+    }
+
+    unix_time_update();
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        IP_Port ip_port;
+
+        randombytes(public_key, sizeof(public_key));
+        ip_init(&ip_port.ip, 0);
+        /* Keep clear of the LAN ranges in the top byte. */
+        ip_port.ip.ip4.uint32 = rand();
+        ip_port.ip.ip4.uint8[0] = 1 + rand() % 9;
+        ip_port.port = htons(1 + rand() % UINT16_MAX);
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    unsigned int close_nodes = 0;
+
+    for (i = 0; i < LCLIENT_LIST; ++i)
+        close_nodes += (dht->close_clientlist[i].assoc4.timestamp != 0);
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(public_key, secret_key);
+
+    for (i = 0; i < NUM_REQUESTS; ++i)
+        create_getnodes(requests[i], dht, public_key, secret_key);
+
+    /* The responses go to a loopback port nobody listens on. */
+    IP_Port source;
+    ip_init(&source.ip, 0);
+    source.ip.ip4.uint8[0] = 127;
+    source.ip.ip4.uint8[3] = 1;
+    source.port = htons(9);
+
+    packet_handler_callback handle_getnodes = net->packethandlers[NET_PACKET_GET_NODES].function;
+    void *object = net->packethandlers[NET_PACKET_GET_NODES].object;
+    uint64_t start = current_time_monotonic();
+
+    for (i = 0; i < NUM_ITERATIONS; ++i) {
+        if (handle_getnodes(object, source, requests[i % NUM_REQUESTS], GETNODES_SIZE) != 0) {
+            printf("Request %u was not handled\n", i);
+            return 1;
+        }
+    }
+
+    uint64_t time = current_time_monotonic() - start;
+
+    printf("%u close nodes, %u friends: %u get nodes requests in %llu ms, %.0f requests/s\n", close_nodes,
+           dht->num_friends, NUM_ITERATIONS, (unsigned long long)time, NUM_ITERATIONS * 1000.0 / (time ? time : 1));
+
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* DHT_scan_bench.c
+ *
+ * Measures the memory used by a DHT and how long scanning its node lists takes.
+ *
+ * Fills the close list and the friend client lists of a DHT with random nodes, then times:
+ * -get_close_nodes() for random public keys
+ * -do_DHT() once every node was pinged, when it only checks the timeouts of the nodes
+ *
+ * Both are timed again with cold caches: before each call EVICT_SIZE bytes of other memory are
+ * written, like a client that does other work between two calls would.
+ *
+ * Usage: DHT_scan_bench [number of friends]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+/* Number of random nodes the DHT hears about before the benchmark. */
+#define NUM_NODES 100000
+#define NUM_SEARCHES 20000
+#define NUM_SCANS 20000
+#define NUM_COLD 500
+#define EVICT_SIZE (32 * 1024 * 1024)
+
+static void evict(uint8_t *buffer)
+{
+    size_t i;
+
+    for (i = 0; i < EVICT_SIZE; i += 64)
+        ++buffer[i];
+}
+
+/* return the number of addresses in list that have cold state. */
+static unsigned int count_cold(const Client_data *list, unsigned int length)
+{
+    unsigned int i, count = 0;
+
+    for (i = 0; i < length; ++i)
+        count += (list[i].assoc4.cold != NULL) + (list[i].assoc6.cold != NULL);
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num_friends = 0, i;
+
+    if (argc > 1)
+        num_friends = atoi(argv[1]);
+
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(ip, 33445);
+    DHT *dht = new_DHT(net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    for (i = 0; i < num_friends; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(public_key, sizeof(public_key));
+        DHT_addfriend(dht, public_key, 0, 0, 0, 0);
+    }
+
+    unix_time_update();
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        IP_Port ip_port;
+
+        randombytes(public_key, sizeof(public_key));
+        ip_init(&ip_port.ip, 0);
+        /* Keep clear of the LAN ranges in the top byte. */
+        ip_port.ip.ip4.uint32 = rand();
+        ip_port.ip.ip4.uint8[0] = 1 + rand() % 9;
+        ip_port.port = htons(1 + rand() % UINT16_MAX);
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    unsigned int close_nodes = 0, cold = count_cold(dht->close_clientlist, LCLIENT_LIST);
+
+    for (i = 0; i < LCLIENT_LIST; ++i)
+        close_nodes += (dht->close_clientlist[i].assoc4.timestamp != 0);
+
+    for (i = 0; i < dht->num_friends; ++i)
+        cold += count_cold(dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS);
+
+    printf("sizeof(Client_data) %u, sizeof(DHT_Friend) %u, sizeof(DHT) %u, %u bytes of cold state\n",
+           (unsigned int)sizeof(Client_data), (unsigned int)sizeof(DHT_Friend), (unsigned int)sizeof(DHT),
+           cold * (unsigned int)sizeof(IPPTs_Cold));
+
+    uint8_t (*targets)[crypto_box_PUBLICKEYBYTES] = malloc(NUM_SEARCHES * crypto_box_PUBLICKEYBYTES);
+    randombytes((uint8_t *)targets, NUM_SEARCHES * crypto_box_PUBLICKEYBYTES);
+
+    Node_format nodes[MAX_SENT_NODES];
+    uint64_t start = time_ns();
+
+    for (i = 0; i < NUM_SEARCHES; ++i)
+        get_close_nodes(dht, targets[i], nodes, 0, 1, 1);
+
+    uint64_t search_ns = time_ns() - start;
+
+    /* The first run pings every node, the next ones only look at the timeouts. */
+    do_DHT(dht);
+    start = time_ns();
+
+    for (i = 0; i < NUM_SCANS; ++i) {
+        dht->last_run = 0;
+        do_DHT(dht);
+    }
+
+    uint64_t scan_ns = time_ns() - start;
+
+    printf("%u close nodes, %u friends: get_close_nodes() %.0f ns, do_DHT() %.0f ns\n", close_nodes,
+           dht->num_friends, (double)search_ns / NUM_SEARCHES, (double)scan_ns / NUM_SCANS);
+
+    uint8_t *buffer = calloc(1, EVICT_SIZE);
+    uint64_t cold_search_ns = 0, cold_scan_ns = 0;
+
+    for (i = 0; i < NUM_COLD; ++i) {
+        evict(buffer);
+        start = time_ns();
+        get_close_nodes(dht, targets[i], nodes, 0, 1, 1);
+        cold_search_ns += time_ns() - start;
+
+        evict(buffer);
+        dht->last_run = 0;
+        start = time_ns();
+        do_DHT(dht);
+        cold_scan_ns += time_ns() - start;
+    }
+
+    printf("cold caches: get_close_nodes() %.0f ns, do_DHT() %.0f ns\n", (double)cold_search_ns / NUM_COLD,
+           (double)cold_scan_ns / NUM_COLD);
+
+    free(buffer);
+    free(targets);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
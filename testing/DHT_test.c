@@ -88,15 +88,20 @@ void print_assoc(IPPTsPng *assoc, uint8_t ours)
     printf("\nTimestamp: %llu", (long long unsigned int) assoc->timestamp);
     printf("\nLast pinged: %llu\n", (long long unsigned int) assoc->last_pinged);
 
-    ipp = &assoc->ret_ip_port;
+    if (assoc->cold == NULL) {
+        printf("No returned IP or hardening\n\n");
+        return;
+    }
+
+    ipp = &assoc->cold->ret_ip_port;
 
     if (ours)
         printf("OUR IP: %s Port: %u\n", ip_ntoa(&ipp->ip), ntohs(ipp->port));
     else
         printf("RET IP: %s Port: %u\n", ip_ntoa(&ipp->ip), ntohs(ipp->port));
 
-    printf("Timestamp: %llu\n", (long long unsigned int) assoc->ret_timestamp);
-    print_hardening(&assoc->hardening);
+    printf("Timestamp: %llu\n", (long long unsigned int) assoc->cold->ret_timestamp);
+    print_hardening(&assoc->cold->hardening);
 
 }
 
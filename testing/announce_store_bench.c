@@ -0,0 +1,204 @@
+/* announce_store_bench.c
+ *
+ * Measures how long storing and finding onion announcements takes with 160 to 100k of them, in
+ * two ways:
+ * -array: the entries in an array kept sorted by distance with qsort() after each insert and
+ *  searched linearly, like Onion_Announce used to do
+ * -store: an Announce_Store
+ *
+ * Both are first filled with random keys, then each add is for a new random key and each find is
+ * for a stored one. The array gets fewer adds with many entries, each one sorts all of them.
+ *
+ * Usage: announce_store_bench [operations per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/onion_announce.h"
+#include "../toxcore/xor_distance.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
+static int cmp_entry(const void *a, const void *b)
+{
+    const Onion_Announce_Entry *entry1 = a, *entry2 = b;
+    int t1 = is_timeout(entry1->time, ONION_ANNOUNCE_TIMEOUT);
+    int t2 = is_timeout(entry2->time, ONION_ANNOUNCE_TIMEOUT);
+
+    if (t1 && t2)
+        return 0;
+
+    if (t1)
+        return -1;
+
+    if (t2)
+        return 1;
+
+    int close = id_closest(cmp_public_key, entry1->public_key, entry2->public_key);
+
+    if (close == 1)
+        return 1;
+
+    if (close == 2)
+        return -1;
+
+    return 0;
+}
+
+static int array_find(const Onion_Announce_Entry *entries, uint32_t num, const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (!is_timeout(entries[i].time, ONION_ANNOUNCE_TIMEOUT)
+                && public_key_cmp(entries[i].public_key, public_key) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static int array_add(Onion_Announce_Entry *entries, uint32_t num, const uint8_t *self_public_key,
+                     const uint8_t *public_key)
+{
+    int pos = array_find(entries, num, public_key);
+    uint32_t i;
+
+    if (pos == -1) {
+        for (i = 0; i < num; ++i) {
+            if (is_timeout(entries[i].time, ONION_ANNOUNCE_TIMEOUT))
+                pos = i;
+        }
+    }
+
+    if (pos == -1 && id_closest(self_public_key, public_key, entries[0].public_key) == 1)
+        pos = 0;
+
+    if (pos == -1)
+        return -1;
+
+    memcpy(entries[pos].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    entries[pos].time = unix_time();
+
+    memcpy(cmp_public_key, self_public_key, crypto_box_PUBLICKEYBYTES);
+    qsort(entries, num, sizeof(Onion_Announce_Entry), cmp_entry);
+    return array_find(entries, num, public_key);
+}
+
+static void run(uint32_t num, unsigned int operations)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    randombytes(self_public_key, sizeof(self_public_key));
+
+    uint8_t (*keys)[crypto_box_PUBLICKEYBYTES] = malloc((size_t)(num + operations) * crypto_box_PUBLICKEYBYTES);
+    Onion_Announce_Entry *entries = calloc(num, sizeof(Onion_Announce_Entry));
+    Announce_Store store;
+
+    if (keys == NULL || entries == NULL
+            || announce_store_init(&store, num, ONION_ANNOUNCE_TIMEOUT, self_public_key) == -1) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    randombytes((uint8_t *)keys, (size_t)(num + operations) * crypto_box_PUBLICKEYBYTES);
+
+    IP_Port ip_port = {{0}};
+    uint8_t ret[ONION_RETURN_3] = {0};
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        memcpy(entries[i].public_key, keys[i], crypto_box_PUBLICKEYBYTES);
+        entries[i].time = unix_time();
+        announce_store_add(&store, keys[i], ip_port, ret, keys[i]);
+    }
+
+    memcpy(cmp_public_key, self_public_key, crypto_box_PUBLICKEYBYTES);
+    qsort(entries, num, sizeof(Onion_Announce_Entry), cmp_entry);
+
+    /* Sorting all the entries each time gets slow, fewer adds are enough to time them. */
+    unsigned int array_adds = operations;
+
+    if ((uint64_t)array_adds * num > 100000000)
+        array_adds = 100000000 / num + 1;
+
+    uint64_t start = time_ns();
+
+    for (i = 0; i < operations; ++i)
+        array_find(entries, num, keys[i % num]);
+
+    uint64_t array_find_ns = time_ns() - start;
+    start = time_ns();
+
+    for (i = 0; i < array_adds; ++i)
+        array_add(entries, num, self_public_key, keys[num + i]);
+
+    uint64_t array_add_ns = time_ns() - start;
+    start = time_ns();
+
+    for (i = 0; i < operations; ++i)
+        announce_store_find(&store, keys[i % num]);
+
+    uint64_t store_find_ns = time_ns() - start;
+    start = time_ns();
+
+    for (i = 0; i < operations; ++i)
+        announce_store_add(&store, keys[num + i], ip_port, ret, keys[num + i]);
+
+    uint64_t store_add_ns = time_ns() - start;
+
+    printf("%8u %12.0f %12.0f %12.0f %12.0f\n", num, (double)array_find_ns / operations,
+           (double)array_add_ns / array_adds, (double)store_find_ns / operations, (double)store_add_ns / operations);
+
+    announce_store_free(&store);
+    free(entries);
+    free(keys);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int operations = 20000;
+
+    if (argc > 1)
+        operations = atoi(argv[1]);
+
+    if (operations == 0)
+        operations = 1;
+
+    unix_time_update();
+
+    printf("mean ns per operation\n");
+    printf("%8s %25s %25s\n", "", "array", "store");
+    printf("%8s %12s %12s %12s %12s\n", "entries", "find", "add", "find", "add");
+
+    const uint32_t sizes[] = {ONION_ANNOUNCE_MAX_ENTRIES, 10000, 100000};
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        run(sizes[i], operations);
+
+    return 0;
+}
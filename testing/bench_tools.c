@@ -0,0 +1,126 @@
+/* bench_tools.c
+ *
+ * Functions the benchmarks share to time what they measure and to run net_crypto nodes.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t time_us(void)
+{
+    return time_ns() / 1000;
+}
+
+/* A Net_Crypto instance with its own DHT and socket. */
+typedef struct Node {
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *c;
+    int id; /* Last connection the node accepted, or the one the benchmark made. */
+    uint64_t received; /* Packets the handlers of the benchmark counted for the node. */
+
+    /* Called after the node accepted connection id from n_c, to set its handlers. May be NULL. */
+    void (*accepted)(struct Node *node, int id, const New_Connection *n_c);
+} Node;
+
+int accept_connection(void *object, New_Connection *n_c)
+{
+    Node *node = object;
+    int id = accept_crypto_connection(node->c, n_c);
+
+    if (id == -1)
+        return -1;
+
+    node->id = id;
+    set_direct_ip_port(node->c, id, n_c->source, 1);
+
+    if (node->accepted)
+        node->accepted(node, id, n_c);
+
+    return 0;
+}
+
+/* Start node on port, accepting the connections that come to it.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int new_node(Node *node, uint16_t port)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    node->net = new_networking(ip, port);
+
+    if (node->net == NULL)
+        return -1;
+
+    node->dht = new_DHT(node->net);
+
+    if (node->dht == NULL)
+        return -1;
+
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    proxy_info.proxy_type = TCP_PROXY_NONE;
+    node->c = new_net_crypto(node->dht, &proxy_info);
+
+    if (node->c == NULL)
+        return -1;
+
+    node->id = -1;
+    node->received = 0;
+    new_connection_handler(node->c, &accept_connection, node);
+    return 0;
+}
+
+void kill_node(Node *node)
+{
+    kill_net_crypto(node->c);
+    kill_DHT(node->dht);
+    kill_networking(node->net);
+}
+
+void do_node(Node *node)
+{
+    networking_poll(node->net);
+    do_net_crypto(node->c);
+}
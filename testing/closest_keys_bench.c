@@ -0,0 +1,205 @@
+/* closest_keys_bench.c
+ *
+ * Measures how long finding the CLOSEST keys closest to a random public key takes among 1k to
+ * 100k random keys, in three ways:
+ * -bytewise: keys in an array of structs, the closest kept with a byte by byte comparison of
+ *  the distances, like id_closest() used to do
+ * -id_closest: the same with id_closest()
+ * -key_array: keys in a Key_Array, with key_array_closest(), like get_close_nodes() searches the
+ *  close list
+ *
+ * Random keys mostly differ in their first byte. The runs are repeated with keys that share their
+ * first SHARED_PREFIX bytes, like the keys of nodes close to each other do in a large network.
+ *
+ * For each number of keys this prints the mean time in ns one search took and the time per key.
+ * Which kernels key_array_closest() and id_closest() use depends on the flags the library was
+ * compiled with, -mavx2 for AVX2, SSE2 is the default on x86_64.
+ *
+ * Usage: closest_keys_bench [searches per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/xor_distance.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define CLOSEST 8
+#define SHARED_PREFIX 12
+
+/* Keys with some other data next to them, the way Client_data stores them. */
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ip_port;
+    uint64_t timestamp;
+} Entry;
+
+static int bytewise_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    size_t i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        uint8_t distance1 = pk[i] ^ pk1[i];
+        uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2)
+            return 1;
+
+        if (distance1 > distance2)
+            return 2;
+    }
+
+    return 0;
+}
+
+typedef int closest_function(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* Keep the CLOSEST entries closest to public_key in closest, closest first.
+ *
+ * return the number of entries found.
+ */
+static uint32_t entries_closest(const Entry *entries, uint32_t num, const uint8_t *public_key,
+                                const Entry **closest, closest_function *function)
+{
+    uint32_t i, j, count = 0;
+
+    for (i = 0; i < num; ++i) {
+        const Entry *entry = &entries[i];
+
+        for (j = count; j > 0 && function(public_key, closest[j - 1]->public_key, entry->public_key) == 2; --j);
+
+        if (j == CLOSEST)
+            continue;
+
+        if (count < CLOSEST)
+            ++count;
+
+        memmove(closest + j + 1, closest + j, (count - j - 1) * sizeof(Entry *));
+        closest[j] = entry;
+    }
+
+    return count;
+}
+
+static void run(uint32_t num, unsigned int searches, unsigned int prefix)
+{
+    Entry *entries = calloc(num, sizeof(Entry));
+    Key_Array keys;
+
+    if (entries == NULL || key_array_init(&keys, num) == -1) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    uint8_t shared[crypto_box_PUBLICKEYBYTES];
+    randombytes(shared, sizeof(shared));
+
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        randombytes(entries[i].public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(entries[i].public_key, shared, prefix);
+        key_array_set(&keys, i, entries[i].public_key);
+    }
+
+    uint8_t (*targets)[crypto_box_PUBLICKEYBYTES] = malloc(searches * crypto_box_PUBLICKEYBYTES);
+    randombytes((uint8_t *)targets, searches * crypto_box_PUBLICKEYBYTES);
+
+    for (i = 0; i < searches; ++i)
+        memcpy(targets[i], shared, prefix);
+
+    const Entry *closest[CLOSEST];
+    uint32_t indexes[CLOSEST];
+    uint64_t start, bytewise_ns, id_closest_ns, key_array_ns;
+    unsigned int s;
+
+    start = time_ns();
+
+    for (s = 0; s < searches; ++s)
+        entries_closest(entries, num, targets[s], closest, bytewise_closest);
+
+    bytewise_ns = time_ns() - start;
+    start = time_ns();
+
+    for (s = 0; s < searches; ++s)
+        entries_closest(entries, num, targets[s], closest, id_closest);
+
+    id_closest_ns = time_ns() - start;
+
+    /* Check that both ways find the same keys. */
+    key_array_closest(&keys, 0, num, targets[0], indexes, CLOSEST, NULL, NULL);
+    entries_closest(entries, num, targets[0], closest, bytewise_closest);
+
+    for (i = 0; i < CLOSEST && i < num; ++i) {
+        if (closest[i] != &entries[indexes[i]]) {
+            printf("key_array_closest() found other keys\n");
+            exit(1);
+        }
+    }
+
+    start = time_ns();
+
+    for (s = 0; s < searches; ++s)
+        key_array_closest(&keys, 0, num, targets[s], indexes, CLOSEST, NULL, NULL);
+
+    key_array_ns = time_ns() - start;
+
+    printf("%8u %6u %12.0f %8.2f %12.0f %8.2f %12.0f %8.2f\n", num,
+           prefix, (double)bytewise_ns / searches, (double)bytewise_ns / searches / num,
+           (double)id_closest_ns / searches, (double)id_closest_ns / searches / num,
+           (double)key_array_ns / searches, (double)key_array_ns / searches / num);
+
+    free(targets);
+    key_array_free(&keys);
+    free(entries);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int searches = 200;
+
+    if (argc > 1)
+        searches = atoi(argv[1]);
+
+    if (searches == 0)
+        searches = 1;
+
+    printf("%u closest of n keys, mean of %u searches\n", CLOSEST, searches);
+    printf("%8s %6s %21s %21s %21s\n", "", "shared", "bytewise", "id_closest", "key_array");
+    printf("%8s %6s %12s %8s %12s %8s %12s %8s\n", "n", "bytes", "ns/search", "ns/key", "ns/search", "ns/key",
+           "ns/search", "ns/key");
+
+    const uint32_t sizes[] = {1000, 10000, 100000};
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        run(sizes[i], searches, 0);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        run(sizes[i], searches, SHARED_PREFIX);
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* hash_map_bench.c
+ *
+ * Compares the BS_LIST from list.h with the Hash_Map from hash_map.h.
+ *
+ * Runs add, find (hits and misses) and remove with random elements the size of
+ * a public key and of an ip_port key at 1k, 10k and 100k elements and prints the
+ * time per operation. Exits with an error if the two disagree on any result.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/list.h"
+#include "../toxcore/hash_map.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+
+#include <stdio.h>
+
+/* Number of adds and removes, and of finds, done for each list size so that
+ * small lists are timed accurately. */
+#define NUM_UPDATES 100000
+#define NUM_LOOKUPS 4000000
+
+typedef struct {
+    const char *name;
+    int (*init)(void *list, uint32_t element_size, uint32_t initial_capacity);
+    void (*free)(void *list);
+    int (*find)(const void *list, const uint8_t *data);
+    int (*add)(void *list, const uint8_t *data, int id);
+    int (*remove)(void *list, const uint8_t *data, int id);
+} List_Functions;
+
+static int bs_init(void *list, uint32_t element_size, uint32_t initial_capacity)
+{
+    return bs_list_init(list, element_size, initial_capacity);
+}
+static void bs_free(void *list)
+{
+    bs_list_free(list);
+}
+static int bs_find(const void *list, const uint8_t *data)
+{
+    return bs_list_find(list, data);
+}
+static int bs_add(void *list, const uint8_t *data, int id)
+{
+    return bs_list_add(list, data, id);
+}
+static int bs_remove(void *list, const uint8_t *data, int id)
+{
+    return bs_list_remove(list, data, id);
+}
+
+static int hm_init(void *list, uint32_t element_size, uint32_t initial_capacity)
+{
+    return hash_map_init(list, element_size, initial_capacity);
+}
+static void hm_free(void *list)
+{
+    hash_map_free(list);
+}
+static int hm_find(const void *list, const uint8_t *data)
+{
+    return hash_map_find(list, data);
+}
+static int hm_add(void *list, const uint8_t *data, int id)
+{
+    return hash_map_add(list, data, id);
+}
+static int hm_remove(void *list, const uint8_t *data, int id)
+{
+    return hash_map_remove(list, data, id);
+}
+
+static const List_Functions lists[] = {
+    {"BS_LIST", bs_init, bs_free, bs_find, bs_add, bs_remove},
+    {"Hash_Map", hm_init, hm_free, hm_find, hm_add, hm_remove},
+};
+
+/* Run the benchmark for one list with num elements from elements, the num elements
+ * after them are never added and are used for the misses.
+ *
+ * return -1 if the list returned a wrong result.
+ * return 0 on success.
+ */
+static int bench(const List_Functions *f, const uint8_t *elements, uint32_t element_size, uint32_t num)
+{
+    union {
+        BS_LIST bs_list;
+        Hash_Map hash_map;
+    } list;
+    const uint8_t *misses = elements + (size_t)element_size * num;
+    uint32_t rounds = NUM_UPDATES / num, passes = NUM_LOOKUPS / NUM_UPDATES;
+    uint64_t add_ms = 0, hit_ms = 0, miss_ms = 0, remove_ms = 0, start;
+    uint32_t i, j, r;
+
+    for (r = 0; r < rounds; ++r) {
+        if (!f->init(&list, element_size, 8))
+            return -1;
+
+        start = current_time_monotonic();
+
+        for (i = 0; i < num; ++i) {
+            if (!f->add(&list, elements + (size_t)element_size * i, i))
+                return -1;
+        }
+
+        add_ms += current_time_monotonic() - start;
+        start = current_time_monotonic();
+
+        for (j = 0; j < passes; ++j) {
+            for (i = 0; i < num; ++i) {
+                if (f->find(&list, elements + (size_t)element_size * i) != (int)i)
+                    return -1;
+            }
+        }
+
+        hit_ms += current_time_monotonic() - start;
+        start = current_time_monotonic();
+
+        for (j = 0; j < passes; ++j) {
+            for (i = 0; i < num; ++i) {
+                if (f->find(&list, misses + (size_t)element_size * i) != -1)
+                    return -1;
+            }
+        }
+
+        miss_ms += current_time_monotonic() - start;
+        start = current_time_monotonic();
+
+        for (i = 0; i < num; ++i) {
+            if (!f->remove(&list, elements + (size_t)element_size * i, i))
+                return -1;
+        }
+
+        remove_ms += current_time_monotonic() - start;
+        f->free(&list);
+    }
+
+    /* ms per NUM_UPDATES operations to ns per operation. */
+    double scale = 1000000.0 / NUM_UPDATES;
+    printf("%-9s %5u %7u %10.1f %10.1f %10.1f %10.1f\n", f->name, element_size, num, add_ms * scale,
+           hit_ms * scale / passes, miss_ms * scale / passes, remove_ms * scale);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t sizes[] = {1000, 10000, 100000};
+    /* A public key and a packed ip_port (family, IPv6 address, port). */
+    const uint32_t element_sizes[] = {crypto_box_PUBLICKEYBYTES, 1 + 16 + 2};
+    unsigned int i, j, k;
+
+    printf("%-9s %5s %7s %10s %10s %10s %10s\n", "list", "bytes", "n", "add ns", "hit ns", "miss ns", "remove ns");
+
+    for (i = 0; i < sizeof(element_sizes) / sizeof(element_sizes[0]); ++i) {
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+            size_t length = (size_t)element_sizes[i] * sizes[j] * 2;
+            uint8_t *elements = malloc(length);
+
+            if (elements == NULL)
+                return 1;
+
+            randombytes(elements, length);
+
+            for (k = 0; k < sizeof(lists) / sizeof(lists[0]); ++k) {
+                if (bench(&lists[k], elements, element_sizes[i], sizes[j]) == -1) {
+                    printf("%s returned a wrong result\n", lists[k].name);
+                    return 1;
+                }
+            }
+
+            free(elements);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/* net_crypto_coalescing_bench.c
+ *
+ * Measures how many packets a chatty bot sends with and without coalescing of lossless packets.
+ *
+ * Connects one Net_Crypto (the bot) to a number of peers over loopback. Every iteration the bot
+ * sends each peer what a chat bot sends a friend: a typing notification, a short message, the
+ * end of the typing notification and every few iterations a new status message. This runs once
+ * without and once with coalescing and prints the data packets per second the bot sent next to
+ * the messages per second the peers received.
+ *
+ * Usage: net_crypto_coalescing_bench [number of peers] [seconds per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define MAX_PEERS 256
+/* Seconds to wait for the connections and for the send buffers to empty. */
+#define TIMEOUT 60
+/* Time between two iterations of the bot in ms. */
+#define ITERATION_INTERVAL 20
+/* The bot changes its status message every this many iterations. */
+#define STATUS_INTERVAL 50
+
+/* Packet ids the bot uses, the same as Messenger. */
+#define BOT_PACKET_ID_STATUSMESSAGE 49
+#define BOT_PACKET_ID_TYPING 51
+#define BOT_PACKET_ID_MESSAGE 64
+
+static Node bot, peers[MAX_PEERS];
+/* Connections of the bot to each peer. */
+static int connections[MAX_PEERS];
+static unsigned int num_peers = 16;
+
+static int handle_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    Node *node = object;
+    ++node->received;
+    return 0;
+}
+
+static void set_handlers(Node *node, int id, const New_Connection *n_c)
+{
+    connection_data_handler(node->c, id, &handle_data, node, 0);
+}
+
+static void do_nodes(void)
+{
+    unsigned int i;
+
+    do_node(&bot);
+
+    for (i = 0; i < num_peers; ++i)
+        do_node(&peers[i]);
+}
+
+static uint64_t bot_packets_sent(void)
+{
+    uint64_t packets = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_peers; ++i) {
+        Crypto_Connection_Stats stats;
+
+        if (crypto_connection_stats(bot.c, connections[i], &stats) == 0)
+            packets += stats.packets_sent;
+    }
+
+    return packets;
+}
+
+static uint64_t peers_received(void)
+{
+    uint64_t received = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_peers; ++i)
+        received += peers[i].received;
+
+    return received;
+}
+
+static unsigned int queued_packets(void)
+{
+    unsigned int i, packets = 0;
+
+    for (i = 0; i < num_peers; ++i) {
+        Crypto_Connection_Stats stats;
+
+        if (crypto_connection_stats(bot.c, connections[i], &stats) == 0)
+            packets += stats.send_queue;
+    }
+
+    return packets;
+}
+
+static int write_bot_packet(int connection, uint8_t id, const char *text)
+{
+    uint8_t packet[64];
+    packet[0] = id;
+    size_t length = strlen(text);
+    memcpy(packet + 1, text, length);
+
+    return write_cryptpacket(bot.c, connection, packet, length + 1, 1) == -1 ? -1 : 0;
+}
+
+/* Run the bot for seconds and print what it sent.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run_bot(const char *name, unsigned int seconds)
+{
+    uint64_t packets_start = bot_packets_sent(), received_start = peers_received();
+    uint64_t start = current_time_monotonic(), end = start + seconds * 1000;
+    uint64_t messages = 0, dropped = 0;
+    unsigned int iteration, i;
+
+    for (iteration = 0; current_time_monotonic() < end; ++iteration) {
+        char text[32];
+        snprintf(text, sizeof(text), "ok %u", iteration);
+
+        for (i = 0; i < num_peers; ++i) {
+            uint8_t typing[2] = {BOT_PACKET_ID_TYPING, 1};
+            int ret = (write_cryptpacket(bot.c, connections[i], typing, sizeof(typing), 1) == -1);
+            ret += write_bot_packet(connections[i], BOT_PACKET_ID_MESSAGE, text) == -1;
+            typing[1] = 0;
+            ret += (write_cryptpacket(bot.c, connections[i], typing, sizeof(typing), 1) == -1);
+            messages += 3;
+
+            if (iteration % STATUS_INTERVAL == 0) {
+                ret += write_bot_packet(connections[i], BOT_PACKET_ID_STATUSMESSAGE, "Answering questions") == -1;
+                ++messages;
+            }
+
+            dropped += ret;
+        }
+
+        /* Same as the end of do_messenger(). */
+        flush_coalesced_packets(bot.c);
+        do_nodes();
+        c_sleep(ITERATION_INTERVAL);
+    }
+
+    uint64_t duration = current_time_monotonic() - start;
+    uint64_t timeout = unix_time();
+
+    while (queued_packets() != 0) {
+        if (is_timeout(timeout, TIMEOUT)) {
+            printf("%u packets still not acknowledged\n", queued_packets());
+            return -1;
+        }
+
+        do_nodes();
+        c_sleep(1);
+    }
+
+    uint64_t packets = bot_packets_sent() - packets_start, received = peers_received() - received_start;
+
+    if (received != messages - dropped) {
+        printf("%s: peers received %llu of %llu messages\n", name, (unsigned long long)received,
+               (unsigned long long)(messages - dropped));
+        return -1;
+    }
+
+    printf("%-12s %12.1f %12.1f %12llu\n", name, packets * 1000.0 / duration, received * 1000.0 / duration,
+           (unsigned long long)dropped);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 10, i;
+
+    if (argc > 1)
+        num_peers = atoi(argv[1]);
+
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+
+    if (num_peers == 0 || num_peers > MAX_PEERS) {
+        printf("Number of peers must be between 1 and %u\n", MAX_PEERS);
+        return 1;
+    }
+
+    if (new_node(&bot, 33445) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+
+    for (i = 0; i < num_peers; ++i) {
+        if (new_node(&peers[i], 33446 + i) == -1) {
+            printf("Failed to create node\n");
+            return 1;
+        }
+
+        peers[i].accepted = &set_handlers;
+
+        connections[i] = new_crypto_connection(bot.c, peers[i].c->self_public_key, peers[i].dht->self_public_key);
+        ip_port.port = peers[i].net->port;
+        set_direct_ip_port(bot.c, connections[i], ip_port, 0);
+    }
+
+    uint64_t start = unix_time();
+    unsigned int ready = 0;
+
+    /* Wait until the bot knows that all the peers understand coalesced packets. */
+    while (ready < num_peers) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("Only %u of %u peers connected\n", ready, num_peers);
+            return 1;
+        }
+
+        do_nodes();
+        ready = 0;
+
+        for (i = 0; i < num_peers; ++i) {
+            const Crypto_Connection *conn = &bot.c->crypto_connections[connections[i]];
+            ready += (conn->status == CRYPTO_CONN_ESTABLISHED && (conn->peer_capabilities & CRYPTO_CAPABILITY_COALESCED));
+        }
+
+        c_sleep(1);
+    }
+
+    printf("%u peers, %u ms between iterations, %u seconds per run\n", num_peers, ITERATION_INTERVAL, seconds);
+    printf("%-12s %12s %12s %12s\n", "", "packets/s", "messages/s", "dropped");
+
+    if (run_bot("separate", seconds) == -1)
+        return 1;
+
+    net_crypto_set_coalescing(bot.c, 1);
+
+    if (run_bot("coalesced", seconds) == -1)
+        return 1;
+
+    for (i = 0; i < num_peers; ++i)
+        kill_node(&peers[i]);
+
+    kill_node(&bot);
+    return 0;
+}
@@ -0,0 +1,244 @@
+/* net_crypto_decrypt_bench.c
+ *
+ * Measures how many bytes per second a Net_Crypto receives from many connections at once as the number
+ * of threads that decrypt the data packets grows.
+ *
+ * A number of senders, spread over a few threads, connect to one receiver over loopback and send it
+ * lossless packets of the maximum size as fast as congestion control lets them. The receiver runs
+ * once with packets decrypted inline and then with 1, 2, 4... decrypt workers, and for each run this
+ * prints the packets and megabytes per second its data callbacks got.
+ *
+ * Usage: net_crypto_decrypt_bench [maximum number of workers] [number of senders] [seconds per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define MAX_SENDERS 256
+#define SENDER_THREADS 4
+/* Seconds to wait for the connections. */
+#define TIMEOUT 60
+/* Microseconds the receiver sleeps between two iterations. */
+#define RECEIVER_SLEEP 200
+
+static Node receiver, senders[MAX_SENDERS];
+static unsigned int num_senders = 32;
+
+static uint64_t packets_received, bytes_received;
+static volatile int senders_running;
+
+static int handle_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    ++packets_received;
+    bytes_received += length;
+    return 0;
+}
+
+static void set_handlers(Node *node, int id, const New_Connection *n_c)
+{
+    connection_data_handler(node->c, id, &handle_data, node, 0);
+}
+
+/* Fill the send queue of each sender of the thread and run them. */
+static void *run_senders(void *arg)
+{
+    unsigned int first = (uintptr_t)arg, i;
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 160;
+
+    while (senders_running) {
+        for (i = first; i < num_senders; i += SENDER_THREADS) {
+            Node *sender = &senders[i];
+
+            while (crypto_num_free_sendqueue_slots(sender->c, sender->id) != 0) {
+                if (write_cryptpacket(sender->c, sender->id, packet, sizeof(packet), 1) == -1)
+                    break;
+            }
+
+            do_node(sender);
+        }
+
+        c_sleep(1);
+    }
+
+    return NULL;
+}
+
+/* (Re)connect all the senders to the receiver so that every run starts with fresh congestion control.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int connect_senders(void)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = receiver.net->port;
+
+    unsigned int i, ready = 0;
+
+    for (i = 0; i < num_senders; ++i) {
+        if (senders[i].id != -1)
+            crypto_kill(senders[i].c, senders[i].id);
+
+        senders[i].id = new_crypto_connection(senders[i].c, receiver.c->self_public_key, receiver.dht->self_public_key);
+
+        if (senders[i].id == -1 || set_direct_ip_port(senders[i].c, senders[i].id, ip_port, 0) == -1)
+            return -1;
+    }
+
+    uint64_t start = unix_time();
+
+    while (ready < num_senders) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("Only %u of %u senders connected\n", ready, num_senders);
+            return -1;
+        }
+
+        do_node(&receiver);
+        ready = 0;
+
+        for (i = 0; i < num_senders; ++i) {
+            do_node(&senders[i]);
+            ready += (crypto_connection_status(senders[i].c, senders[i].id, NULL, NULL) == CRYPTO_CONN_ESTABLISHED);
+        }
+
+        c_sleep(1);
+    }
+
+    return 0;
+}
+
+/* Run the receiver with workers decrypt workers for seconds and print what it received.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run_receiver(unsigned int workers, unsigned int seconds)
+{
+    if (net_crypto_set_decrypt_workers(receiver.c, workers) != 0) {
+        printf("Failed to start %u decrypt workers\n", workers);
+        return -1;
+    }
+
+    if (connect_senders() == -1)
+        return -1;
+
+    pthread_t threads[SENDER_THREADS];
+    unsigned int i;
+    senders_running = 1;
+
+    for (i = 0; i < SENDER_THREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, run_senders, (void *)(uintptr_t)i) != 0) {
+            printf("Failed to start the senders\n");
+            return -1;
+        }
+    }
+
+    Crypto_Workers_Stats stats;
+    net_crypto_decrypt_stats(receiver.c, &stats);
+    uint64_t packets_start = packets_received, bytes_start = bytes_received, dropped_start = stats.dropped;
+    uint64_t start = current_time_monotonic(), end = start + seconds * 1000;
+
+    while (current_time_monotonic() < end) {
+        do_node(&receiver);
+        usleep(RECEIVER_SLEEP);
+    }
+
+    uint64_t duration = current_time_monotonic() - start;
+    net_crypto_decrypt_stats(receiver.c, &stats);
+    senders_running = 0;
+
+    for (i = 0; i < SENDER_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    printf("%-8u %12.1f %12.2f %10llu\n", workers, (packets_received - packets_start) * 1000.0 / duration,
+           (bytes_received - bytes_start) * 1000.0 / duration / (1024 * 1024),
+           (unsigned long long)(stats.dropped - dropped_start));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int max_workers = 4, seconds = 10, workers, i;
+
+    if (argc > 1)
+        max_workers = atoi(argv[1]);
+
+    if (argc > 2)
+        num_senders = atoi(argv[2]);
+
+    if (argc > 3)
+        seconds = atoi(argv[3]);
+
+    if (max_workers > CRYPTO_MAX_DECRYPT_WORKERS) {
+        printf("Number of workers must be at most %u\n", CRYPTO_MAX_DECRYPT_WORKERS);
+        return 1;
+    }
+
+    if (num_senders == 0 || num_senders > MAX_SENDERS) {
+        printf("Number of senders must be between 1 and %u\n", MAX_SENDERS);
+        return 1;
+    }
+
+    if (new_node(&receiver, 33445) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    receiver.accepted = &set_handlers;
+
+    for (i = 0; i < num_senders; ++i) {
+        if (new_node(&senders[i], 33446 + i) == -1) {
+            printf("Failed to create node\n");
+            return 1;
+        }
+    }
+
+    printf("%u senders, %u seconds per run\n", num_senders, seconds);
+    printf("%-8s %12s %12s %10s\n", "workers", "packets/s", "MB/s", "dropped");
+
+    int ret = 0;
+
+    for (workers = 0; workers <= max_workers; workers = workers ? workers * 2 : 1) {
+        if (run_receiver(workers, seconds) == -1) {
+            ret = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < num_senders; ++i)
+        kill_node(&senders[i]);
+
+    kill_node(&receiver);
+    return ret;
+}
@@ -0,0 +1,268 @@
+/* net_crypto_handshake_bench.c
+ *
+ * Measures how long the main loop of a Net_Crypto takes per iteration while peers keep connecting to it,
+ * with handshakes processed inline and by handshake workers.
+ *
+ * A server Net_Crypto sends a packet to a few established peers every iteration. Another thread runs
+ * clients that connect to the server with new keys as fast as they can, like a crowd of friends
+ * reconnecting at once, and drop the connection as soon as it is established. For each run this prints
+ * the handshakes per second the server accepted and the mean, 99th percentile and maximum time one
+ * iteration of the server took.
+ *
+ * Usage: net_crypto_handshake_bench [number of workers] [number of clients] [seconds per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define MAX_CLIENTS 256
+#define NUM_PEERS 8
+#define PACKET_SIZE 512
+/* Seconds to wait for the peers to connect. */
+#define TIMEOUT 60
+/* Seconds after which a client gives up on a connection and starts a new one. */
+#define CLIENT_TIMEOUT 5
+/* Maximum number of iterations of the server recorded per run. */
+#define MAX_TICKS 1000000
+
+static Node server, peers[NUM_PEERS], clients[MAX_CLIENTS];
+static unsigned int num_clients = 32;
+/* Time each client started its connection to the server. */
+static uint64_t client_connect_time[MAX_CLIENTS];
+
+/* Connections the server accepted from the peers and from anyone. */
+static int peer_connections[NUM_PEERS];
+static uint64_t accepted;
+
+static volatile int clients_running = 1;
+
+static void server_accepted(Node *node, int id, const New_Connection *n_c)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_PEERS; ++i) {
+        if (public_key_cmp(n_c->public_key, peers[i].c->self_public_key) == 0)
+            peer_connections[i] = id;
+    }
+
+    ++accepted;
+}
+
+static int connect_to_server(Node *node)
+{
+    node->id = new_crypto_connection(node->c, server.c->self_public_key, server.dht->self_public_key);
+
+    if (node->id == -1)
+        return -1;
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = server.net->port;
+    return set_direct_ip_port(node->c, node->id, ip_port, 0);
+}
+
+/* Run the peers and the clients, each client reconnects with new keys as soon as it is connected. */
+static void *run_clients(void *arg)
+{
+    unsigned int i;
+
+    while (clients_running) {
+        for (i = 0; i < NUM_PEERS; ++i)
+            do_node(&peers[i]);
+
+        for (i = 0; i < num_clients; ++i) {
+            Node *client = &clients[i];
+            do_node(client);
+
+            unsigned int status = crypto_connection_status(client->c, client->id, NULL, NULL);
+
+            if (status == CRYPTO_CONN_ESTABLISHED || status == CRYPTO_CONN_NO_CONNECTION
+                    || is_timeout(client_connect_time[i], CLIENT_TIMEOUT)) {
+                crypto_kill(client->c, client->id);
+                new_keys(client->c);
+                client_connect_time[i] = unix_time();
+                connect_to_server(client);
+            }
+        }
+
+        c_sleep(1);
+    }
+
+    return NULL;
+}
+
+static int cmp_ticks(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Run the server for seconds and print how long its iterations took.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run_server(unsigned int workers, unsigned int seconds, uint64_t *ticks)
+{
+    if (net_crypto_set_handshake_workers(server.c, workers) != 0) {
+        printf("Failed to start %u handshake workers\n", workers);
+        return -1;
+    }
+
+    uint64_t accepted_start = accepted, total = 0;
+    uint64_t start = current_time_monotonic(), end = start + seconds * 1000;
+    unsigned int num_ticks = 0, i;
+    uint8_t packet[PACKET_SIZE] = {0};
+    packet[0] = 160;
+
+    while (current_time_monotonic() < end && num_ticks < MAX_TICKS) {
+        uint64_t tick_start = time_us();
+
+        for (i = 0; i < NUM_PEERS; ++i)
+            write_cryptpacket(server.c, peer_connections[i], packet, sizeof(packet), 0);
+
+        do_node(&server);
+
+        ticks[num_ticks] = time_us() - tick_start;
+        total += ticks[num_ticks];
+        ++num_ticks;
+        c_sleep(1);
+    }
+
+    uint64_t duration = current_time_monotonic() - start;
+    Crypto_Workers_Stats stats;
+    net_crypto_handshake_stats(server.c, &stats);
+    qsort(ticks, num_ticks, sizeof(uint64_t), cmp_ticks);
+
+    printf("%-8u %14.1f %12.1f %12llu %12llu %10llu\n", workers, (accepted - accepted_start) * 1000.0 / duration,
+           (double)total / num_ticks, (unsigned long long)ticks[(num_ticks * 99) / 100],
+           (unsigned long long)ticks[num_ticks - 1], (unsigned long long)stats.dropped);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int workers = 4, seconds = 10, i;
+
+    if (argc > 1)
+        workers = atoi(argv[1]);
+
+    if (argc > 2)
+        num_clients = atoi(argv[2]);
+
+    if (argc > 3)
+        seconds = atoi(argv[3]);
+
+    if (workers == 0 || workers > CRYPTO_MAX_HANDSHAKE_WORKERS) {
+        printf("Number of workers must be between 1 and %u\n", CRYPTO_MAX_HANDSHAKE_WORKERS);
+        return 1;
+    }
+
+    if (num_clients > MAX_CLIENTS) {
+        printf("Number of clients must be at most %u\n", MAX_CLIENTS);
+        return 1;
+    }
+
+    uint64_t *ticks = malloc(MAX_TICKS * sizeof(uint64_t));
+
+    if (ticks == NULL || new_node(&server, 33445) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    server.accepted = &server_accepted;
+
+    for (i = 0; i < NUM_PEERS; ++i) {
+        if (new_node(&peers[i], 33446 + i) == -1 || connect_to_server(&peers[i]) == -1) {
+            printf("Failed to create node\n");
+            return 1;
+        }
+
+        peer_connections[i] = -1;
+    }
+
+    uint64_t start = unix_time();
+    unsigned int ready = 0;
+
+    while (ready < NUM_PEERS) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("Only %u of %u peers connected\n", ready, NUM_PEERS);
+            return 1;
+        }
+
+        do_node(&server);
+        ready = 0;
+
+        for (i = 0; i < NUM_PEERS; ++i) {
+            do_node(&peers[i]);
+            ready += (crypto_connection_status(peers[i].c, peers[i].id, NULL, NULL) == CRYPTO_CONN_ESTABLISHED);
+        }
+
+        c_sleep(1);
+    }
+
+    for (i = 0; i < num_clients; ++i) {
+        client_connect_time[i] = unix_time();
+
+        if (new_node(&clients[i], 33446 + NUM_PEERS + i) == -1 || connect_to_server(&clients[i]) == -1) {
+            printf("Failed to create node\n");
+            return 1;
+        }
+    }
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, run_clients, NULL) != 0) {
+        printf("Failed to start the clients\n");
+        return 1;
+    }
+
+    printf("%u peers, %u reconnecting clients, %u seconds per run\n", NUM_PEERS, num_clients, seconds);
+    printf("%-8s %14s %12s %12s %12s %10s\n", "workers", "handshakes/s", "mean us", "p99 us", "max us", "dropped");
+
+    int ret = 0;
+
+    if (run_server(0, seconds, ticks) == -1 || run_server(workers, seconds, ticks) == -1)
+        ret = 1;
+
+    clients_running = 0;
+    pthread_join(thread, NULL);
+
+    for (i = 0; i < num_clients; ++i)
+        kill_node(&clients[i]);
+
+    for (i = 0; i < NUM_PEERS; ++i)
+        kill_node(&peers[i]);
+
+    kill_node(&server);
+    free(ticks);
+    return ret;
+}
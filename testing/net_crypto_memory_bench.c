@@ -0,0 +1,223 @@
+/* net_crypto_memory_bench.c
+ *
+ * Measures the memory the packet buffers of net_crypto connections use.
+ *
+ * Connects one Net_Crypto to a number of peers over loopback, queues a burst of lossless
+ * packets on every connection without letting the peers acknowledge them, then lets
+ * everything run until the send buffers are empty again. Prints the memory per connection
+ * at the peak of the burst and once the connections are back to a steady state, next to
+ * what the fixed size packet arrays with one malloc per packet used to take.
+ *
+ * Usage: net_crypto_memory_bench [number of peers] [packets per connection]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define MAX_PEERS 256
+#define PACKET_SIZE 1024
+/* Seconds to wait for the connections and for the send buffers to empty. */
+#define TIMEOUT 60
+
+static Node center, peers[MAX_PEERS];
+/* Connections of the center to each peer. */
+static int connections[MAX_PEERS];
+static unsigned int num_peers = 16;
+
+/* Counts the packets allocated from the default pool of the center. */
+typedef struct {
+    Mem_Pool *pool;
+    uint32_t packets;
+} Counting_Pool;
+
+static Packet_Data *counting_alloc(void *object)
+{
+    Counting_Pool *counting = object;
+    Packet_Data *data = mem_pool_alloc(counting->pool);
+
+    if (data)
+        ++counting->packets;
+
+    return data;
+}
+
+static void counting_free(void *object, Packet_Data *data)
+{
+    Counting_Pool *counting = object;
+
+    if (data)
+        --counting->packets;
+
+    mem_pool_free(counting->pool, data);
+}
+
+/* return the bytes used by the connections of the center and their packet buffers. */
+static size_t center_memory(void)
+{
+    size_t size = mem_pool_size(center.c->packet_pool) + sizeof(Crypto_Connection) * center.c->crypto_connections_length;
+    uint32_t i;
+
+    for (i = 0; i < center.c->crypto_connections_length; ++i) {
+        const Crypto_Connection *conn = &center.c->crypto_connections[i];
+        size += (conn->send_array.capacity + conn->recv_array.capacity) * sizeof(Packet_Data *);
+    }
+
+    return size;
+}
+
+/* return the bytes the same connections took with two arrays of CRYPTO_PACKET_BUFFER_SIZE
+ * pointers in each connection and one malloc per packet. */
+static size_t fixed_array_memory(uint32_t packets)
+{
+    size_t connection = sizeof(Crypto_Connection) - 2 * sizeof(Packets_Array)
+                        + 2 * (CRYPTO_PACKET_BUFFER_SIZE * sizeof(Packet_Data *) + 2 * sizeof(uint32_t));
+    return connection * center.c->crypto_connections_length + (size_t)packets * CRYPTO_PACKET_DATA_SIZE;
+}
+
+static unsigned int queued_packets(void)
+{
+    unsigned int i, packets = 0;
+
+    for (i = 0; i < num_peers; ++i)
+        packets += center.c->crypto_connections[connections[i]].send_array.buffer_end
+                   - center.c->crypto_connections[connections[i]].send_array.buffer_start;
+
+    return packets;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num_packets = 2048, i, j;
+
+    if (argc > 1)
+        num_peers = atoi(argv[1]);
+
+    if (argc > 2)
+        num_packets = atoi(argv[2]);
+
+    if (num_peers == 0 || num_peers > MAX_PEERS) {
+        printf("Number of peers must be between 1 and %u\n", MAX_PEERS);
+        return 1;
+    }
+
+    if (new_node(&center, 33445) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    Counting_Pool counting = {center.c->packet_pool, 0};
+    Packet_Allocator allocator = {&counting_alloc, &counting_free, &counting};
+    net_crypto_set_packet_allocator(center.c, &allocator);
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+
+    for (i = 0; i < num_peers; ++i) {
+        if (new_node(&peers[i], 33446 + i) == -1) {
+            printf("Failed to create node\n");
+            return 1;
+        }
+
+        connections[i] = new_crypto_connection(center.c, peers[i].c->self_public_key, peers[i].dht->self_public_key);
+        ip_port.port = peers[i].net->port;
+        set_direct_ip_port(center.c, connections[i], ip_port, 0);
+    }
+
+    uint64_t start = unix_time();
+    unsigned int connected = 0;
+
+    while (connected < num_peers) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("Only %u of %u peers connected\n", connected, num_peers);
+            return 1;
+        }
+
+        do_node(&center);
+        connected = 0;
+
+        for (i = 0; i < num_peers; ++i) {
+            do_node(&peers[i]);
+            connected += (crypto_connection_status(center.c, connections[i], NULL, NULL) == CRYPTO_CONN_ESTABLISHED);
+        }
+
+        c_sleep(1);
+    }
+
+    size_t idle = center_memory();
+
+    /* Nothing is acknowledged while the peers don't run. */
+    uint8_t packet[PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = CRYPTO_RESERVED_PACKETS;
+
+    for (j = 0; j < num_packets; ++j) {
+        for (i = 0; i < num_peers; ++i) {
+            if (write_cryptpacket(center.c, connections[i], packet, sizeof(packet), 0) == -1) {
+                printf("Failed to queue packet %u\n", j);
+                return 1;
+            }
+        }
+    }
+
+    size_t peak = center_memory();
+    size_t fixed_peak = fixed_array_memory(counting.packets);
+
+    start = unix_time();
+
+    while (queued_packets() != 0) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("%u packets still not acknowledged\n", queued_packets());
+            return 1;
+        }
+
+        do_node(&center);
+
+        for (i = 0; i < num_peers; ++i)
+            do_node(&peers[i]);
+
+        c_sleep(1);
+    }
+
+    size_t steady = center_memory();
+    size_t fixed_steady = fixed_array_memory(counting.packets);
+
+    printf("%u connections, burst of %u packets of %u bytes per connection\n", num_peers, num_packets, PACKET_SIZE);
+    printf("%-14s %12s %12s %12s\n", "bytes/conn", "idle", "peak", "steady");
+    printf("%-14s %12zu %12zu %12zu\n", "pooled", idle / num_peers, peak / num_peers, steady / num_peers);
+    printf("%-14s %12zu %12zu %12zu\n", "fixed arrays", fixed_array_memory(0) / num_peers, fixed_peak / num_peers,
+           fixed_steady / num_peers);
+
+    for (i = 0; i < num_peers; ++i)
+        kill_node(&peers[i]);
+
+    kill_node(&center);
+    return 0;
+}
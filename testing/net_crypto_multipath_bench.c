@@ -0,0 +1,230 @@
+/* net_crypto_multipath_bench.c
+ *
+ * Measures how much of a stream of lossy packets gets through when the direct UDP path between two
+ * Net_Crypto silently dies, with each multipath mode.
+ *
+ * A sender and a receiver connect to each other directly over loopback and through a TCP relay run in
+ * the same process. The sender sends a small lossy packet every FRAME_INTERVAL ms, like an audio call.
+ * After a few seconds the direct path of both stops delivering anything, as if a NAT mapping expired.
+ * For each run this prints the RTT of both paths before that, the packets sent and received, the
+ * longest time in ms without a packet received, the copies sent and dropped and the packets that
+ * arrived after a newer one.
+ *
+ * Usage: net_crypto_multipath_bench [seconds after the direct path died]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+/* Seconds to wait for the connection. */
+#define TIMEOUT 20
+/* Seconds both paths are up before the direct one dies. */
+#define WARMUP 5
+#define FRAME_INTERVAL 20
+#define FRAME_SIZE 100
+#define RELAY_PORT 33500
+/* Port nothing listens on, where the direct packets go once the path died. */
+#define DEAD_PORT 9
+
+static Node sender, receiver;
+static TCP_Server *relay;
+static uint8_t relay_pk[crypto_box_PUBLICKEYBYTES];
+
+static uint32_t frames_received, frames_late, next_frame;
+static uint64_t last_frame_time, max_gap;
+
+static IP_Port loopback(uint16_t port)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = port;
+    return ip_port;
+}
+
+static int handle_lossy(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    uint32_t frame;
+    memcpy(&frame, data + 1, sizeof(uint32_t));
+
+    if (frame < next_frame) {
+        ++frames_late;
+        return 0;
+    }
+
+    uint64_t temp_time = current_time_monotonic();
+
+    if (last_frame_time != 0 && temp_time - last_frame_time > max_gap)
+        max_gap = temp_time - last_frame_time;
+
+    last_frame_time = temp_time;
+    next_frame = frame + 1;
+    ++frames_received;
+    return 0;
+}
+
+static void set_handlers(Node *node, int id, const New_Connection *n_c)
+{
+    add_tcp_relay_peer(node->c, id, loopback(htons(RELAY_PORT)), relay_pk);
+    connection_lossy_data_handler(node->c, id, &handle_lossy, node, 0);
+}
+
+static int new_multipath_node(Node *node, uint16_t port, uint8_t mode)
+{
+    if (new_node(node, port) == -1)
+        return -1;
+
+    node->accepted = &set_handlers;
+    return net_crypto_set_multipath(node->c, mode);
+}
+
+static void do_nodes(void)
+{
+    do_TCP_server(relay);
+    do_node(&sender);
+    do_node(&receiver);
+}
+
+/* Send lossy packets from the sender to the receiver for ms.
+ *
+ * return the number of packets sent.
+ */
+static uint32_t send_frames(uint64_t ms, uint32_t first)
+{
+    uint64_t start = current_time_monotonic(), next_send = start;
+    uint32_t frame = first;
+    uint8_t packet[FRAME_SIZE] = {0};
+    packet[0] = PACKET_ID_LOSSY_RANGE_START;
+
+    while (current_time_monotonic() < start + ms) {
+        if (current_time_monotonic() >= next_send) {
+            memcpy(packet + 1, &frame, sizeof(uint32_t));
+            send_lossy_cryptpacket(sender.c, sender.id, packet, sizeof(packet));
+            ++frame;
+            next_send += FRAME_INTERVAL;
+        }
+
+        do_nodes();
+        c_sleep(1);
+    }
+
+    return frame - first;
+}
+
+static int run(uint8_t mode, const char *name, unsigned int seconds)
+{
+    if (new_multipath_node(&sender, 33446, mode) == -1 || new_multipath_node(&receiver, 33445, mode) == -1) {
+        printf("Failed to create node\n");
+        return -1;
+    }
+
+    sender.id = new_crypto_connection(sender.c, receiver.c->self_public_key, receiver.dht->self_public_key);
+
+    if (sender.id == -1 || set_direct_ip_port(sender.c, sender.id, loopback(receiver.net->port), 0) == -1
+            || add_tcp_relay_peer(sender.c, sender.id, loopback(htons(RELAY_PORT)), relay_pk) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    uint64_t start = unix_time();
+
+    while (receiver.id == -1 || crypto_connection_status(sender.c, sender.id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED
+            || crypto_connection_status(receiver.c, receiver.id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("Connection timed out\n");
+            return -1;
+        }
+
+        do_nodes();
+        c_sleep(1);
+    }
+
+    frames_received = frames_late = next_frame = 0;
+    last_frame_time = max_gap = 0;
+    uint32_t sent = send_frames(WARMUP * 1000, 0);
+
+    Crypto_Connection_Stats stats;
+    crypto_connection_stats(sender.c, sender.id, &stats);
+    uint64_t rtt_direct = stats.path_rtt[CRYPTO_PATH_DIRECT], rtt_tcp = stats.path_rtt[CRYPTO_PATH_TCP];
+
+    /* The direct path dies: packets on it go nowhere, in both directions. */
+    sender.c->crypto_connections[sender.id].ip_portv4.port = htons(DEAD_PORT);
+    receiver.c->crypto_connections[receiver.id].ip_portv4.port = htons(DEAD_PORT);
+
+    uint32_t received_before = frames_received;
+    max_gap = 0;
+    uint32_t sent_after = send_frames(seconds * 1000, sent);
+
+    crypto_connection_stats(sender.c, sender.id, &stats);
+    uint64_t copies_sent = stats.packets_duplicated;
+    crypto_connection_stats(receiver.c, receiver.id, &stats);
+
+    printf("%-10s %7llu %7llu %8u %8u %9u %8llu %8llu %8llu %8u\n", name, (unsigned long long)rtt_direct,
+           (unsigned long long)rtt_tcp, sent_after, frames_received - received_before,
+           sent_after - (frames_received - received_before), (unsigned long long)max_gap,
+           (unsigned long long)copies_sent, (unsigned long long)stats.duplicates_received, frames_late);
+
+    kill_node(&sender);
+    kill_node(&receiver);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 15;
+
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+
+    uint8_t relay_sk[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(relay_pk, relay_sk);
+    uint16_t port = RELAY_PORT;
+    relay = new_TCP_server(0, 1, &port, relay_sk, NULL);
+
+    if (relay == NULL) {
+        printf("Failed to create the relay\n");
+        return 1;
+    }
+
+    printf("lossy packet every %u ms, direct path dies after %u s, %u s measured after that\n", FRAME_INTERVAL, WARMUP,
+           seconds);
+    printf("%-10s %7s %7s %8s %8s %9s %8s %8s %8s %8s\n", "mode", "udp rtt", "tcp rtt", "sent", "received", "lost",
+           "max gap", "copies", "dropped", "late");
+
+    int ret = 0;
+
+    if (run(CRYPTO_MULTIPATH_DISABLED, "disabled", seconds) == -1 || run(CRYPTO_MULTIPATH_FASTEST, "fastest", seconds) == -1
+            || run(CRYPTO_MULTIPATH_REDUNDANT, "redundant", seconds) == -1)
+        ret = 1;
+
+    kill_TCP_server(relay);
+    return ret;
+}
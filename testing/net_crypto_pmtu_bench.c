@@ -0,0 +1,168 @@
+/* net_crypto_pmtu_bench.c
+ *
+ * Measures the throughput and the CPU time per megabyte of a lossless stream between two Net_Crypto
+ * over loopback with path MTU discovery disabled and enabled.
+ *
+ * A sender connects to a receiver and sends it lossless packets of the maximum data size of the
+ * connection as fast as congestion control lets it, both in the same thread. For each run this prints
+ * the maximum packet size of the connection, the packets and megabytes per second received and the
+ * milliseconds of CPU time the process used per megabyte.
+ *
+ * Usage: net_crypto_pmtu_bench [seconds per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "bench_tools.c"
+
+/* Seconds to wait for the connection and for path MTU discovery. */
+#define TIMEOUT 10
+
+static Node sender, receiver;
+
+static uint64_t packets_received, bytes_received;
+
+static int handle_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    ++packets_received;
+    bytes_received += length;
+    return 0;
+}
+
+static void set_handlers(Node *node, int id, const New_Connection *n_c)
+{
+    connection_data_handler(node->c, id, &handle_data, node, 0);
+}
+
+static void do_nodes(void)
+{
+    do_node(&sender);
+    do_node(&receiver);
+}
+
+static double cpu_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Connect the sender to the receiver with path MTU discovery in mode and send to it for seconds.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int run(uint8_t mode, const char *name, unsigned int seconds)
+{
+    net_crypto_set_pmtu_discovery(sender.c, mode);
+
+    if (sender.id != -1)
+        crypto_kill(sender.c, sender.id);
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = receiver.net->port;
+
+    sender.id = new_crypto_connection(sender.c, receiver.c->self_public_key, receiver.dht->self_public_key);
+
+    if (sender.id == -1 || set_direct_ip_port(sender.c, sender.id, ip_port, 0) == -1)
+        return -1;
+
+    uint64_t start = unix_time();
+
+    while (crypto_connection_status(sender.c, sender.id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED
+            || (mode != CRYPTO_PMTU_DISABLED && crypto_max_data_size(sender.c, sender.id) == MAX_CRYPTO_DATA_SIZE)) {
+        if (is_timeout(start, TIMEOUT)) {
+            printf("%s: connection failed or path MTU discovery found nothing\n", name);
+            return -1;
+        }
+
+        do_nodes();
+        c_sleep(1);
+    }
+
+    uint8_t packet[MAX_CRYPTO_JUMBO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 160;
+
+    uint64_t packets_start = packets_received, bytes_start = bytes_received;
+    uint64_t time_start = current_time_monotonic(), end = time_start + seconds * 1000;
+    double cpu_start = cpu_time_ms();
+
+    while (current_time_monotonic() < end) {
+        uint16_t length = crypto_max_data_size(sender.c, sender.id);
+
+        while (crypto_num_free_sendqueue_slots(sender.c, sender.id) != 0) {
+            if (write_cryptpacket(sender.c, sender.id, packet, length, 1) == -1)
+                break;
+        }
+
+        do_nodes();
+        usleep(200);
+    }
+
+    uint64_t duration = current_time_monotonic() - time_start;
+    double megabytes = (bytes_received - bytes_start) / (1024.0 * 1024.0);
+    Crypto_Connection_Stats stats;
+    crypto_connection_stats(sender.c, sender.id, &stats);
+
+    printf("%-10s %10u %12.1f %10.2f %12.2f\n", name, stats.max_packet_size,
+           (packets_received - packets_start) * 1000.0 / duration, megabytes * 1000.0 / duration,
+           megabytes ? (cpu_time_ms() - cpu_start) / megabytes : 0.0);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 10;
+
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+
+    if (new_node(&receiver, 33445) == -1 || new_node(&sender, 33446) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    receiver.accepted = &set_handlers;
+
+    printf("%u seconds per run\n", seconds);
+    printf("%-10s %10s %12s %10s %12s\n", "pmtu", "max packet", "packets/s", "MB/s", "cpu ms/MB");
+
+    int ret = 0;
+
+    if (run(CRYPTO_PMTU_DISABLED, "disabled", seconds) == -1 || run(CRYPTO_PMTU_LAN, "lan", seconds) == -1)
+        ret = 1;
+
+    kill_node(&sender);
+    kill_node(&receiver);
+    return ret;
+}
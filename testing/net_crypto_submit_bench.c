@@ -0,0 +1,266 @@
+/* net_crypto_submit_bench.c
+ *
+ * Measures how many packets per second threads other than the one running do_net_crypto() can send
+ * to a peer, with the application lock that write_cryptpacket() and send_lossy_cryptpacket() need
+ * and with submit_cryptpacket().
+ *
+ * A sender connects to a receiver over loopback. The main thread runs both of them while a number of
+ * producer threads send bursts of small lossy packets to the receiver every ms, like encoder threads of
+ * a call. The producers together always offer the same number of packets per second. With the lock, the producers and the main thread take the same mutex around every call into the
+ * sender. For each run this prints the packets per second the producers got accepted and the receiver
+ * received, the mean and maximum time in microseconds one call of a producer took and the maximum
+ * time one iteration of the main thread took.
+ *
+ * Usage: net_crypto_submit_bench [seconds per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define MAX_PRODUCERS 16
+#define PACKET_SIZE 100
+/* Packets all the producers together send per ms, spread evenly over them. */
+#define OFFERED_PER_MS 32
+/* Seconds to wait for the connection. */
+#define TIMEOUT 10
+/* Microseconds the main thread sleeps between two iterations. */
+#define MAIN_SLEEP 500
+
+typedef struct {
+    pthread_t thread;
+    uint64_t accepted;
+    uint64_t total_us, max_us, calls;
+} Producer;
+
+static Node sender, receiver;
+static Producer producers[MAX_PRODUCERS];
+
+static pthread_mutex_t app_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Bool use_lock;
+static volatile int producers_running;
+static uint64_t packets_received;
+
+static int handle_lossy(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    ++packets_received;
+    return 0;
+}
+
+static void set_handlers(Node *node, int id, const New_Connection *n_c)
+{
+    connection_lossy_data_handler(node->c, id, &handle_lossy, node, 0);
+}
+
+static void do_nodes(void)
+{
+    if (use_lock)
+        pthread_mutex_lock(&app_lock);
+
+    do_node(&sender);
+
+    if (use_lock)
+        pthread_mutex_unlock(&app_lock);
+
+    do_node(&receiver);
+}
+
+static unsigned int burst;
+
+static void *run_producer(void *arg)
+{
+    Producer *producer = arg;
+    uint8_t packet[PACKET_SIZE] = {0};
+    packet[0] = PACKET_ID_LOSSY_RANGE_START;
+
+    unsigned int i = 0;
+
+    while (producers_running) {
+        if (++i % burst == 0)
+            c_sleep(1);
+
+        uint64_t start = time_us();
+        int ret;
+
+        if (use_lock) {
+            pthread_mutex_lock(&app_lock);
+            ret = send_lossy_cryptpacket(sender.c, sender.id, packet, sizeof(packet));
+            pthread_mutex_unlock(&app_lock);
+        } else {
+            ret = submit_cryptpacket(sender.c, sender.id, packet, sizeof(packet), 0);
+        }
+
+        uint64_t duration = time_us() - start;
+        producer->total_us += duration;
+        ++producer->calls;
+
+        if (duration > producer->max_us)
+            producer->max_us = duration;
+
+        if (ret == 0)
+            ++producer->accepted;
+    }
+
+    return NULL;
+}
+
+/* (Re)connect the sender to the receiver so that a run can't inherit a connection the last one broke.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int connect_nodes(void)
+{
+    if (sender.id != -1)
+        crypto_kill(sender.c, sender.id);
+
+    if (receiver.id != -1)
+        crypto_kill(receiver.c, receiver.id);
+
+    receiver.id = -1;
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint8[0] = 127;
+    ip_port.ip.ip4.uint8[3] = 1;
+    ip_port.port = receiver.net->port;
+    sender.id = new_crypto_connection(sender.c, receiver.c->self_public_key, receiver.dht->self_public_key);
+
+    if (sender.id == -1 || set_direct_ip_port(sender.c, sender.id, ip_port, 0) == -1)
+        return -1;
+
+    uint64_t start = unix_time();
+
+    while (receiver.id == -1 || crypto_connection_status(sender.c, sender.id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED
+            || crypto_connection_status(receiver.c, receiver.id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED) {
+        if (is_timeout(start, TIMEOUT))
+            return -1;
+
+        do_nodes();
+        c_sleep(1);
+    }
+
+    return 0;
+}
+
+static int run(_Bool lock, unsigned int num_producers, unsigned int seconds)
+{
+    unsigned int i;
+    use_lock = 0;
+
+    if (connect_nodes() == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    use_lock = lock;
+    burst = OFFERED_PER_MS / num_producers;
+    producers_running = 1;
+    memset(producers, 0, sizeof(producers));
+
+    for (i = 0; i < num_producers; ++i) {
+        if (pthread_create(&producers[i].thread, NULL, run_producer, &producers[i]) != 0) {
+            printf("Failed to start the producers\n");
+            return -1;
+        }
+    }
+
+    uint64_t received_start = packets_received;
+    uint64_t start = current_time_monotonic(), end = start + seconds * 1000;
+
+    uint64_t main_max_us = 0;
+
+    while (current_time_monotonic() < end) {
+        uint64_t tick_start = time_us();
+        do_nodes();
+
+        if (time_us() - tick_start > main_max_us)
+            main_max_us = time_us() - tick_start;
+
+        usleep(MAIN_SLEEP);
+    }
+
+    uint64_t duration = current_time_monotonic() - start;
+    producers_running = 0;
+
+    uint64_t accepted = 0, total_us = 0, max_us = 0, calls = 0;
+
+    for (i = 0; i < num_producers; ++i) {
+        pthread_join(producers[i].thread, NULL);
+        accepted += producers[i].accepted;
+        total_us += producers[i].total_us;
+        calls += producers[i].calls;
+
+        if (producers[i].max_us > max_us)
+            max_us = producers[i].max_us;
+    }
+
+    /* Let the last packets arrive. */
+    for (i = 0; i < 100; ++i) {
+        do_nodes();
+        usleep(MAIN_SLEEP);
+    }
+
+    printf("%-8s %9u %12.1f %12.1f %10.2f %10llu %12llu\n", lock ? "lock" : "submit", num_producers,
+           accepted * 1000.0 / duration, (packets_received - received_start) * 1000.0 / duration,
+           calls ? (double)total_us / calls : 0.0, (unsigned long long)max_us, (unsigned long long)main_max_us);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 5;
+
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+
+    if (new_node(&sender, 33446) == -1 || new_node(&receiver, 33445) == -1) {
+        printf("Failed to create node\n");
+        return 1;
+    }
+
+    receiver.accepted = &set_handlers;
+
+    printf("%u byte lossy packets, %u per second offered, %u seconds per run\n", PACKET_SIZE, OFFERED_PER_MS * 1000,
+           seconds);
+    printf("%-8s %9s %12s %12s %10s %10s %12s\n", "send", "producers", "accepted/s", "received/s", "mean us", "max us",
+           "main max us");
+
+    const unsigned int counts[] = {1, 4, 16};
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]) && ret == 0; ++i) {
+        if (run(1, counts[i], seconds) == -1 || run(0, counts[i], seconds) == -1)
+            ret = 1;
+    }
+
+    kill_node(&sender);
+    kill_node(&receiver);
+    return ret;
+}
@@ -0,0 +1,202 @@
+/* rate_limit_bench.c
+ *
+ * Measures how much CPU a flood of spoofed get nodes requests costs a DHT node with and without
+ * the rate limiter, and how many of the requests of honest nodes still get through.
+ *
+ * Get nodes requests with a new random public key each come from a number of sources at FLOOD_RATE
+ * packets per second, mixed with HONEST_SOURCES nodes sending one request per second each. Every
+ * packet goes through the rate limiter (if any) and then the get nodes handler of the DHT, the way
+ * networking_poll() passes it on, with the clock of the limiter moved forward by the time between
+ * the packets. For each run this prints the flood packets the handler saw, the honest packets it
+ * saw, and the mean time in microseconds one packet took.
+ *
+ * Usage: rate_limit_bench [seconds of flood per run]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/rate_limit.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+
+#include "bench_tools.c"
+
+#define FLOOD_RATE 20000
+#define HONEST_SOURCES 100
+/* Budget of get nodes requests per source, the tox-bootstrapd default. */
+#define GETNODES_RATE 20
+#define GETNODES_BURST 40
+
+#define GETNODES_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES \
+                       + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+static DHT *dht;
+
+/* Create a get nodes request to the DHT from public_key for a random public key. */
+static void create_getnodes(uint8_t *packet, const uint8_t *public_key, const uint8_t *secret_key)
+{
+    uint8_t plain[crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    randombytes(plain, sizeof(plain));
+    new_nonce(nonce);
+
+    packet[0] = NET_PACKET_GET_NODES;
+    memcpy(packet + 1, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, nonce, crypto_box_NONCEBYTES);
+    encrypt_data(dht->self_public_key, secret_key, nonce, plain, sizeof(plain),
+                 packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+}
+
+/* Source number i of a flood from num_sources addresses, spread over 10.0.0.0/8 unless there are
+ * at most 256 of them, which then all are in 10.0.0.0/24. */
+static IP_Port flood_source(uint32_t i, uint32_t num_sources)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    uint32_t address = num_sources <= 256 ? i : i * 2654435761u;
+    ip_port.ip.ip4.uint32 = htonl(0x0A000000 | (address & 0xFFFFFF));
+    ip_port.port = htons(33445);
+    return ip_port;
+}
+
+static IP_Port honest_source(uint32_t i)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0xC0000001 | (i << 16));
+    ip_port.port = htons(33445);
+    return ip_port;
+}
+
+/* Pass a packet to the get nodes handler unless the limiter drops it.
+ *
+ * return 1 if the handler saw it.
+ */
+static int receive(Rate_Limiter *limiter, IP_Port source, const uint8_t *packet)
+{
+    if (limiter && !rate_limiter_allow(limiter, &source.ip, packet[0]))
+        return 0;
+
+    dht->net->packethandlers[NET_PACKET_GET_NODES].function(dht, source, packet, GETNODES_SIZE);
+    return 1;
+}
+
+static void run(uint32_t num_sources, uint8_t ipv4_prefix, unsigned int seconds)
+{
+    Rate_Limiter *limiter = NULL;
+
+    if (ipv4_prefix) {
+        limiter = new_rate_limiter(ipv4_prefix, 64);
+        rate_limiter_set_budget(limiter, NET_PACKET_GET_NODES, GETNODES_RATE, GETNODES_BURST);
+    }
+
+    uint8_t honest_pk[HONEST_SOURCES][crypto_box_PUBLICKEYBYTES], honest_sk[HONEST_SOURCES][crypto_box_SECRETKEYBYTES];
+    uint8_t packet[GETNODES_SIZE];
+    uint32_t i, flood_passed = 0, honest_sent = 0, honest_passed = 0;
+
+    for (i = 0; i < HONEST_SOURCES; ++i)
+        crypto_box_keypair(honest_pk[i], honest_sk[i]);
+
+    uint64_t total_us = 0, packets = 0, time = 0;
+    uint32_t total_flood = FLOOD_RATE * seconds;
+
+    for (i = 0; i < total_flood; ++i) {
+        /* Simulated time of this packet, the honest sources each send once a second in between. */
+        uint64_t packet_time = (uint64_t)i * 1000000 / FLOOD_RATE;
+
+        while (time + 1000000 / HONEST_SOURCES <= packet_time) {
+            time += 1000000 / HONEST_SOURCES;
+            uint32_t honest = honest_sent % HONEST_SOURCES;
+            create_getnodes(packet, honest_pk[honest], honest_sk[honest]);
+
+            if (limiter)
+                limiter->time = time;
+
+            uint64_t start = time_us();
+            honest_passed += receive(limiter, honest_source(honest), packet);
+            total_us += time_us() - start;
+            ++packets;
+            ++honest_sent;
+        }
+
+        /* Spoofed packets come with a fresh key, they can't be decrypted but a shared key is computed. */
+        packet[0] = NET_PACKET_GET_NODES;
+        randombytes(packet + 1, GETNODES_SIZE - 1);
+
+        if (limiter)
+            limiter->time = packet_time;
+
+        uint64_t start = time_us();
+        flood_passed += receive(limiter, flood_source(i % num_sources, num_sources), packet);
+        total_us += time_us() - start;
+        ++packets;
+    }
+
+    char limit[16];
+
+    if (ipv4_prefix) {
+        sprintf(limit, "/%u", ipv4_prefix);
+    } else {
+        sprintf(limit, "off");
+    }
+
+    printf("%8u %6s %10u %10u %8u/%-8u %10.2f\n", num_sources, limit, total_flood, flood_passed, honest_passed, honest_sent,
+           (double)total_us / packets);
+    kill_rate_limiter(limiter);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 2;
+
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+    dht = new_DHT(new_networking(ip, 33445));
+
+    if (dht == NULL) {
+        printf("Failed to create the DHT\n");
+        return 1;
+    }
+
+    printf("%u spoofed get nodes requests per second for %u s, %u honest nodes sending 1 per second\n", FLOOD_RATE,
+           seconds, HONEST_SOURCES);
+    printf("%8s %6s %10s %10s %17s %10s\n", "sources", "limit", "flood", "handled", "honest handled", "us/packet");
+
+    const uint32_t sources[] = {1, 256, 65536};
+    const uint8_t prefixes[] = {0, 32, 24};
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i) {
+        for (j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); ++j)
+            run(sources[i], prefixes[j], seconds);
+    }
+
+    return 0;
+}
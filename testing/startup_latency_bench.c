@@ -0,0 +1,297 @@
+/* startup_latency_bench.c
+ *
+ * Measures how long a client takes to reach TOX_CONNECTION_UDP when it starts from its profile
+ * alone and when it also has the node cache of its last session.
+ *
+ * A network of STABLE_NODES nodes that are always up and FLAKY_NODES nodes that keep leaving and
+ * coming back runs on loopback. The client first runs in it for LEARN_SECONDS and saves its profile
+ * and node cache while all the nodes are up. Then the flaky nodes leave for good, like most of the
+ * nodes of a real network do between two sessions, and the client is restarted a number of times
+ * with and without the node cache. Each time it also bootstraps from BOOTSTRAP_NODES random nodes
+ * of the network, like a client with a list of bootstrap nodes of which some are gone. For each
+ * start this prints the time in ms it took to connect, then the mean, minimum and maximum.
+ *
+ * The nodes use ports outside of the default range so that LAN discovery doesn't find them.
+ *
+ * Usage: startup_latency_bench [starts per mode]
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/tox.h"
+#include "../toxcore/crypto_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+#define STABLE_NODES 4
+#define FLAKY_NODES 28
+#define NUM_NODES (STABLE_NODES + FLAKY_NODES)
+#define BOOTSTRAP_NODES 4
+#define FIRST_PORT 34445
+#define CLIENT_PORT (FIRST_PORT + NUM_NODES)
+
+#define LEARN_SECONDS 60
+/* Every this many seconds during learning one flaky node after another leaves or comes back. */
+#define FLAKY_PERIOD 2
+/* Give up on a start after this many seconds. */
+#define TIMEOUT 120
+
+typedef struct {
+    Tox *tox;
+    uint8_t secret_key[TOX_SECRET_KEY_SIZE];
+    uint8_t dht_id[TOX_PUBLIC_KEY_SIZE];
+    uint16_t port;
+} Node;
+
+static Node nodes[NUM_NODES];
+
+static Tox *new_tox(uint16_t port, TOX_SAVEDATA_TYPE savedata_type, const uint8_t *savedata, size_t savedata_length,
+                    const uint8_t *node_cache, size_t node_cache_length)
+{
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.ipv6_enabled = 0;
+    options.start_port = port;
+    options.end_port = port;
+    options.savedata_type = savedata_type;
+    options.savedata_data = savedata;
+    options.savedata_length = savedata_length;
+    options.node_cache_data = node_cache;
+    options.node_cache_length = node_cache_length;
+    return tox_new(&options, NULL);
+}
+
+static void bootstrap(Tox *tox, unsigned int node)
+{
+    tox_bootstrap(tox, "127.0.0.1", nodes[node].port, nodes[node].dht_id, NULL);
+}
+
+static int start_node(unsigned int i)
+{
+    nodes[i].tox = new_tox(nodes[i].port, TOX_SAVEDATA_TYPE_SECRET_KEY, nodes[i].secret_key, TOX_SECRET_KEY_SIZE,
+                           NULL, 0);
+
+    if (nodes[i].tox == NULL)
+        return -1;
+
+    /* The DHT key changes on every start. */
+    tox_self_get_dht_id(nodes[i].tox, nodes[i].dht_id);
+
+    if (i != 0)
+        bootstrap(nodes[i].tox, rand() % (i < STABLE_NODES ? i : STABLE_NODES));
+
+    return 0;
+}
+
+static void stop_node(unsigned int i)
+{
+    tox_kill(nodes[i].tox);
+    nodes[i].tox = NULL;
+}
+
+static void iterate(Tox *client)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        if (nodes[i].tox)
+            tox_iterate(nodes[i].tox);
+    }
+
+    if (client)
+        tox_iterate(client);
+
+    c_sleep(20);
+}
+
+/* Start the client and return the time in ms it took to connect, 0 if it didn't within TIMEOUT. */
+static uint64_t measure_start(const uint8_t *savedata, size_t savedata_length, const uint8_t *node_cache,
+                              size_t node_cache_length)
+{
+    Tox *client = new_tox(CLIENT_PORT, TOX_SAVEDATA_TYPE_TOX_SAVE, savedata, savedata_length, node_cache,
+                          node_cache_length);
+
+    if (client == NULL)
+        return 0;
+
+    unsigned int i;
+
+    for (i = 0; i < BOOTSTRAP_NODES; ++i)
+        bootstrap(client, rand() % NUM_NODES);
+
+    uint64_t start = current_time_monotonic(), connected = 0;
+
+    while (current_time_monotonic() - start < TIMEOUT * 1000) {
+        iterate(client);
+
+        if (tox_self_get_connection_status(client) == TOX_CONNECTION_UDP) {
+            connected = current_time_monotonic() - start;
+            break;
+        }
+    }
+
+    tox_kill(client);
+
+    /* Let the network notice that the client is gone. */
+    for (i = 0; i < 50; ++i)
+        iterate(NULL);
+
+    return connected;
+}
+
+static void run(const char *mode, unsigned int starts, const uint8_t *savedata, size_t savedata_length,
+                const uint8_t *node_cache, size_t node_cache_length)
+{
+    uint64_t total = 0, min = UINT64_MAX, max = 0;
+    unsigned int i, connected = 0;
+
+    printf("%-8s", mode);
+
+    for (i = 0; i < starts; ++i) {
+        uint64_t time = measure_start(savedata, savedata_length, node_cache, node_cache_length);
+
+        if (time == 0) {
+            printf(" timeout");
+        } else {
+            printf(" %7llu", (unsigned long long)time);
+            total += time;
+            ++connected;
+
+            if (time < min)
+                min = time;
+
+            if (time > max)
+                max = time;
+        }
+
+        fflush(stdout);
+    }
+
+    if (connected) {
+        printf("  mean %llu min %llu max %llu ms\n", (unsigned long long)(total / connected), (unsigned long long)min,
+               (unsigned long long)max);
+    } else {
+        printf("  never connected\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int starts = 5, i;
+
+    if (argc > 1)
+        starts = atoi(argv[1]);
+
+    srand(current_time_monotonic());
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        randombytes(nodes[i].secret_key, sizeof(nodes[i].secret_key));
+        nodes[i].port = FIRST_PORT + i;
+
+        if (start_node(i) == -1) {
+            printf("Failed to create node %u\n", i);
+            return 1;
+        }
+    }
+
+    Tox *client = new_tox(CLIENT_PORT, TOX_SAVEDATA_TYPE_NONE, NULL, 0, NULL, 0);
+
+    if (client == NULL) {
+        printf("Failed to create the client\n");
+        return 1;
+    }
+
+    for (i = 0; i < BOOTSTRAP_NODES; ++i)
+        bootstrap(client, rand() % NUM_NODES);
+
+    printf("%u stable and %u flaky nodes, client learning for %u s\n", STABLE_NODES, FLAKY_NODES, LEARN_SECONDS);
+
+    uint64_t start = current_time_monotonic(), next_flaky = start + FLAKY_PERIOD * 1000;
+    unsigned int flaky = 0;
+
+    while (current_time_monotonic() - start < LEARN_SECONDS * 1000) {
+        iterate(client);
+
+        if (current_time_monotonic() >= next_flaky) {
+            unsigned int node = STABLE_NODES + flaky % FLAKY_NODES;
+
+            if (nodes[node].tox) {
+                stop_node(node);
+            } else if (start_node(node) == -1) {
+                printf("Failed to restart node %u\n", node);
+                return 1;
+            }
+
+            ++flaky;
+            next_flaky += FLAKY_PERIOD * 1000;
+        }
+    }
+
+    /* Save while all the nodes are up, the profile then has flaky nodes among its DHT nodes too. */
+    for (i = STABLE_NODES; i < NUM_NODES; ++i) {
+        if (nodes[i].tox == NULL && start_node(i) == -1) {
+            printf("Failed to restart node %u\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 250; ++i)
+        iterate(client);
+
+    size_t savedata_length = tox_get_savedata_size(client), node_cache_length = tox_get_node_cache_size(client);
+    uint8_t *savedata = malloc(savedata_length), *node_cache = malloc(node_cache_length);
+
+    if (savedata == NULL || node_cache == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    tox_get_savedata(client, savedata);
+    tox_get_node_cache(client, node_cache);
+    tox_kill(client);
+
+    for (i = STABLE_NODES; i < NUM_NODES; ++i)
+        stop_node(i);
+
+    printf("profile %zu bytes, node cache %zu bytes, flaky nodes gone\n", savedata_length, node_cache_length);
+    printf("ms to TOX_CONNECTION_UDP per start:\n");
+
+    run("profile", starts, savedata, savedata_length, NULL, 0);
+    run("cache", starts, savedata, savedata_length, node_cache, node_cache_length);
+
+    for (i = 0; i < STABLE_NODES; ++i)
+        stop_node(i);
+
+    free(savedata);
+    free(node_cache);
+    return 0;
+}
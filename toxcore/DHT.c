@@ -45,6 +45,7 @@
 #include "network.h"
 #include "LAN_discovery.h"
 #include "misc_tools.h"
+#include "node_cache.h"
 #include "util.h"
 
 /* The timeout after which a node is discarded completely. */
@@ -66,51 +67,134 @@
 /* Number of get node requests to send to quickly find close nodes. */
 #define MAX_BOOTSTRAP_TIMES 5
 
-/* Compares pk1 and pk2 with pk.
+/* Return index of first unequal bit number.
+ */
+static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i = key_first_difference(pk1, pk2), j = 0;
+
+    if (i != crypto_box_PUBLICKEYBYTES) {
+        uint8_t diff = pk1[i] ^ pk2[i];
+
+        while (!(diff & (0x80 >> j)))
+            ++j;
+    }
+
+    return i * 8 + j;
+}
+
+/* The close list is made of LCLIENT_LENGTH k-buckets of LCLIENT_NODES nodes each, bucket i
+ * holds the nodes whose public key shares exactly i leading bits with ours (the last bucket
+ * also holds the ones that share more).
  *
- *  return 0 if both are same distance.
- *  return 1 if pk1 is closer.
- *  return 2 if pk2 is closer.
+ * return the index of the bucket public_key belongs in.
  */
-int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+static unsigned int close_bucket(const uint8_t *self_public_key, const uint8_t *public_key)
 {
-    size_t   i;
-    uint8_t distance1, distance2;
+    unsigned int index = bit_by_bit_cmp(public_key, self_public_key);
 
-    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+    if (index >= LCLIENT_LENGTH)
+        index = LCLIENT_LENGTH - 1;
 
-        distance1 = pk[i] ^ pk1[i];
-        distance2 = pk[i] ^ pk2[i];
+    return index;
+}
 
-        if (distance1 < distance2)
-            return 1;
+/* return index of public_key in the close list.
+ * return -1 if it is not in it.
+ */
+static int close_client_index(const DHT *dht, const uint8_t *public_key)
+{
+    unsigned int first = close_bucket(dht->self_public_key, public_key) * LCLIENT_NODES;
+    return key_array_find(&dht->close_keys, first, LCLIENT_NODES, public_key);
+}
 
-        if (distance1 > distance2)
-            return 2;
+/* Initialize shared_keys to cache up to size keys.
+ * Frees what it held before, if anything.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size)
+{
+    shared_keys_free(shared_keys);
+
+    if (size == 0)
+        return -1;
+
+    uint32_t num_buckets = 1;
+
+    while (num_buckets < size) {
+        if (num_buckets >= (1UL << 31))
+            return -1;
+
+        num_buckets <<= 1;
     }
 
+    shared_keys->keys = calloc(size, sizeof(Shared_Key));
+    shared_keys->buckets = malloc(num_buckets * sizeof(uint32_t));
+
+    if (shared_keys->keys == NULL || shared_keys->buckets == NULL) {
+        shared_keys_free(shared_keys);
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_buckets; ++i)
+        shared_keys->buckets[i] = size;
+
+    shared_keys->size = size;
+    shared_keys->num_buckets = num_buckets;
+    shared_keys->hash_key = random_64b();
     return 0;
 }
 
-/* Return index of first unequal bit number.
+/* Free all the memory used by shared_keys. */
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    if (shared_keys->keys)
+        sodium_memzero(shared_keys->keys, shared_keys->size * sizeof(Shared_Key));
+
+    free(shared_keys->keys);
+    free(shared_keys->buckets);
+    memset(shared_keys, 0, sizeof(Shared_Keys));
+}
+
+static uint32_t shared_keys_bucket(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    uint64_t hash = keyed_hash(shared_keys->hash_key, public_key, crypto_box_PUBLICKEYBYTES);
+    return (uint32_t)hash & (shared_keys->num_buckets - 1);
+}
+
+/* Pick the key to replace with the CLOCK algorithm: keys requested since the hand last
+ * passed get a second chance, keys not requested for KEYS_TIMEOUT don't.
+ *
+ * return index of the key removed from the table.
  */
-static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+static uint32_t shared_keys_evict(Shared_Keys *shared_keys)
 {
-    unsigned int i, j = 0;
+    uint32_t index;
 
-    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
-        if (pk1[i] == pk2[i])
-            continue;
+    while (1) {
+        index = shared_keys->clock_hand;
+        shared_keys->clock_hand = (shared_keys->clock_hand + 1) % shared_keys->size;
 
-        for (j = 0; j < 8; ++j) {
-            if ((pk1[i] & (1 << (7 - j))) != (pk2[i] & (1 << (7 - j))))
-                break;
-        }
+        Shared_Key *key = &shared_keys->keys[index];
 
-        break;
+        if (!key->referenced || is_timeout(key->time_last_requested, KEYS_TIMEOUT))
+            break;
+
+        key->referenced = 0;
     }
 
-    return i * 8 + j;
+    uint32_t *link = &shared_keys->buckets[shared_keys_bucket(shared_keys, shared_keys->keys[index].public_key)];
+
+    while (*link != index)
+        link = &shared_keys->keys[*link].next;
+
+    *link = shared_keys->keys[index].next;
+    ++shared_keys->evictions;
+    return index;
 }
 
 /* Shared key generations are costly, it is therefor smart to store commonly used
@@ -121,45 +205,60 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
  */
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
 {
-    uint32_t i, num = ~0, curr = 0;
+    if (shared_keys->size == 0) {
+        encrypt_precompute(public_key, secret_key, shared_key);
+        return;
+    }
 
-    for (i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
+    uint32_t bucket = shared_keys_bucket(shared_keys, public_key);
+    uint32_t index;
 
-        if (shared_keys->keys[index].stored) {
-            if (public_key_cmp(public_key, shared_keys->keys[index].public_key) == 0) {
-                memcpy(shared_key, shared_keys->keys[index].shared_key, crypto_box_BEFORENMBYTES);
-                ++shared_keys->keys[index].times_requested;
-                shared_keys->keys[index].time_last_requested = unix_time();
-                return;
-            }
+    for (index = shared_keys->buckets[bucket]; index != shared_keys->size; index = shared_keys->keys[index].next) {
+        Shared_Key *key = &shared_keys->keys[index];
 
-            if (num != 0) {
-                if (is_timeout(shared_keys->keys[index].time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > shared_keys->keys[index].times_requested) {
-                    num = shared_keys->keys[index].times_requested;
-                    curr = index;
-                }
-            }
-        } else {
-            if (num != 0) {
-                num = 0;
-                curr = index;
-            }
+        if (public_key_cmp(public_key, key->public_key) == 0) {
+            memcpy(shared_key, key->shared_key, crypto_box_BEFORENMBYTES);
+            key->referenced = 1;
+            key->time_last_requested = unix_time();
+            ++shared_keys->hits;
+            return;
         }
     }
 
+    ++shared_keys->misses;
     encrypt_precompute(public_key, secret_key, shared_key);
 
-    if (num != (uint32_t)~0) {
-        shared_keys->keys[curr].stored = 1;
-        shared_keys->keys[curr].times_requested = 1;
-        memcpy(shared_keys->keys[curr].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-        memcpy(shared_keys->keys[curr].shared_key, shared_key, crypto_box_BEFORENMBYTES);
-        shared_keys->keys[curr].time_last_requested = unix_time();
+    if (shared_keys->num_stored < shared_keys->size) {
+        index = shared_keys->num_stored;
+        ++shared_keys->num_stored;
+    } else {
+        index = shared_keys_evict(shared_keys);
     }
+
+    Shared_Key *key = &shared_keys->keys[index];
+    memcpy(key->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(key->shared_key, shared_key, crypto_box_BEFORENMBYTES);
+    key->time_last_requested = unix_time();
+    key->referenced = 1;
+    key->next = shared_keys->buckets[bucket];
+    shared_keys->buckets[bucket] = index;
+}
+
+/* Resize the shared key caches of the DHT so that each can hold size keys.
+ * Keys cached so far are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size)
+{
+    if (shared_keys_init(&dht->shared_keys_recv, size) == -1)
+        return -1;
+
+    if (shared_keys_init(&dht->shared_keys_sent, size) == -1)
+        return -1;
+
+    return 0;
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -394,6 +493,64 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
     return num;
 }
 
+IPPTs_Cold *ipptsp_cold(IPPTsPng *ipptp)
+{
+    if (ipptp->cold == NULL)
+        ipptp->cold = calloc(1, sizeof(IPPTs_Cold));
+
+    return ipptp->cold;
+}
+
+void ipptsp_clear(IPPTsPng *ipptp)
+{
+    free(ipptp->cold);
+    memset(ipptp, 0, sizeof(IPPTsPng));
+}
+
+void client_data_clear(Client_data *client)
+{
+    ipptsp_clear(&client->assoc4);
+    ipptsp_clear(&client->assoc6);
+    memset(client, 0, sizeof(Client_data));
+}
+
+/* Forget the ip_port ipptp returned, a new node is now at its address. */
+static void ipptsp_reset_ret(IPPTsPng *ipptp)
+{
+    if (ipptp->cold == NULL)
+        return;
+
+    ip_reset(&ipptp->cold->ret_ip_port.ip);
+    ipptp->cold->ret_ip_port.port = 0;
+    ipptp->cold->ret_timestamp = 0;
+}
+
+/* Set the ip_port ipptp returned to us.
+ * Not setting it when the cold state can't be allocated only loses a hint.
+ */
+static void ipptsp_set_ret(IPPTsPng *ipptp, IP_Port ip_port, uint64_t time)
+{
+    IPPTs_Cold *cold = ipptsp_cold(ipptp);
+
+    if (cold) {
+        cold->ret_ip_port = ip_port;
+        cold->ret_timestamp = time;
+    }
+}
+
+/* return the ip_port ipptp returned to us if it is set and not timed out.
+ * return NULL if not.
+ */
+static const IP_Port *ipptsp_ret(const IPPTsPng *ipptp)
+{
+    const IPPTs_Cold *cold = ipptp->cold;
+
+    if (cold && ip_isset(&cold->ret_ip_port.ip) && !is_timeout(cold->ret_timestamp, BAD_NODE_TIMEOUT))
+        return &cold->ret_ip_port;
+
+    return NULL;
+}
+
 /* Check if client with public_key is already in list of length length.
  * If it is then set its corresponding timestamp to current time.
  * If the id is already in the list with a different ip_port, update it.
@@ -457,7 +614,7 @@ static int client_or_ip_port_in_list(Client_data *list, uint16_t length, const u
             LOGGER_DEBUG("coipil[%u]: switching public_key (ipv4)", i);
 
             /* kill the other address, if it was set */
-            memset(&list[i].assoc6, 0, sizeof(list[i].assoc6));
+            ipptsp_clear(&list[i].assoc6);
             return 1;
         } else if ((ip_port.ip.family == AF_INET6) && ipport_equal(&list[i].assoc6.ip_port, &ip_port)) {
             /* Initialize client timestamp. */
@@ -467,7 +624,7 @@ static int client_or_ip_port_in_list(Client_data *list, uint16_t length, const u
             LOGGER_DEBUG("coipil[%u]: switching public_key (ipv6)", i);
 
             /* kill the other address, if it was set */
-            memset(&list[i].assoc4, 0, sizeof(list[i].assoc4));
+            ipptsp_clear(&list[i].assoc4);
             return 1;
         }
     }
@@ -542,10 +699,54 @@ _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *p
  * return 4 if it can test other nodes correctly
  * return HARDENING_ALL_OK if all ok.
  */
-static uint8_t hardening_correct(const Hardening *h)
+static uint8_t hardening_correct(const IPPTsPng *ipptp)
 {
+    if (ipptp->cold == NULL)
+        return 0;
+
+    const Hardening *h = &ipptp->cold->hardening;
     return h->routes_requests_ok + (h->send_nodes_ok << 1) + (h->testing_requests << 2);
 }
+/* return the association of client to send for a send nodes request for public_key.
+ * return NULL if client shouldn't be sent.
+ */
+static const IPPTsPng *close_node_assoc(const Client_data *client, const uint8_t *public_key,
+                                        const Node_format *nodes_list, sa_family_t sa_family, uint8_t is_LAN,
+                                        uint8_t want_good)
+{
+    const IPPTsPng *ipptp = NULL;
+
+    if (sa_family == AF_INET) {
+        ipptp = &client->assoc4;
+    } else if (sa_family == AF_INET6) {
+        ipptp = &client->assoc6;
+    } else {
+        if (client->assoc4.timestamp >= client->assoc6.timestamp) {
+            ipptp = &client->assoc4;
+        } else {
+            ipptp = &client->assoc6;
+        }
+    }
+
+    /* node not in a good condition? */
+    if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT))
+        return NULL;
+
+    /* don't send LAN ips to non LAN peers */
+    if (LAN_ip(ipptp->ip_port.ip) == 0 && !is_LAN)
+        return NULL;
+
+    if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && hardening_correct(ipptp) != HARDENING_ALL_OK
+            && !id_equal(public_key, client->public_key))
+        return NULL;
+
+    /* node already in list? */
+    if (client_in_nodelist(nodes_list, MAX_SENT_NODES, client->public_key))
+        return NULL;
+
+    return ipptp;
+}
+
 /*
  * helper for get_close_nodes(). argument list is a monster :D
  */
@@ -561,35 +762,9 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
 
     for (i = 0; i < client_list_length; i++) {
         const Client_data *client = &client_list[i];
+        const IPPTsPng *ipptp = close_node_assoc(client, public_key, nodes_list, sa_family, is_LAN, want_good);
 
-        /* node already in list? */
-        if (client_in_nodelist(nodes_list, MAX_SENT_NODES, client->public_key))
-            continue;
-
-        const IPPTsPng *ipptp = NULL;
-
-        if (sa_family == AF_INET) {
-            ipptp = &client->assoc4;
-        } else if (sa_family == AF_INET6) {
-            ipptp = &client->assoc6;
-        } else {
-            if (client->assoc4.timestamp >= client->assoc6.timestamp) {
-                ipptp = &client->assoc4;
-            } else {
-                ipptp = &client->assoc6;
-            }
-        }
-
-        /* node not in a good condition? */
-        if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT))
-            continue;
-
-        /* don't send LAN ips to non LAN peers */
-        if (LAN_ip(ipptp->ip_port.ip) == 0 && !is_LAN)
-            continue;
-
-        if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && hardening_correct(&ipptp->hardening) != HARDENING_ALL_OK
-                && !id_equal(public_key, client->public_key))
+        if (ipptp == NULL)
             continue;
 
         if (num_nodes < MAX_SENT_NODES) {
@@ -607,6 +782,78 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
     *num_nodes_ptr = num_nodes;
 }
 
+/* What close_list_node_ok() checks the nodes of the close list against. */
+typedef struct {
+    const DHT *dht;
+    const uint8_t *public_key;
+    const Node_format *nodes_list;
+    sa_family_t sa_family;
+    uint8_t is_LAN;
+} Close_Node_Filter;
+
+static _Bool close_list_node_ok(const void *object, uint32_t index)
+{
+    const Close_Node_Filter *filter = object;
+    return close_node_assoc(&filter->dht->close_clientlist[index], filter->public_key, filter->nodes_list,
+                            filter->sa_family, filter->is_LAN, 0) != NULL;
+}
+
+/* Add the nodes closest to public_key among the num nodes of the close list starting at first to
+ * nodes_list, until it is full.
+ *
+ * The close list is mostly empty slots, which close_list_node_ok() skips like the nodes that can't be sent.
+ */
+static void get_close_list_range_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       sa_family_t sa_family, uint32_t first, uint32_t num, uint32_t *num_nodes_ptr,
+                                       uint8_t is_LAN)
+{
+    Close_Node_Filter filter = {dht, public_key, nodes_list, sa_family, is_LAN};
+    uint32_t indexes[MAX_SENT_NODES];
+    uint32_t count = key_array_closest(&dht->close_keys, first, num, public_key, indexes,
+                                       MAX_SENT_NODES - *num_nodes_ptr, close_list_node_ok, &filter);
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        const Client_data *client = &dht->close_clientlist[indexes[i]];
+        const IPPTsPng *ipptp = close_node_assoc(client, public_key, nodes_list, sa_family, is_LAN, 0);
+
+        memcpy(nodes_list[*num_nodes_ptr].public_key, client->public_key, crypto_box_PUBLICKEYBYTES);
+        nodes_list[*num_nodes_ptr].ip_port = ipptp->ip_port;
+        ++*num_nodes_ptr;
+    }
+}
+
+/* Put the nodes of the close list closest to public_key in nodes_list.
+ *
+ * Only looks at as many k-buckets as needed: if public_key belongs in bucket i, the nodes
+ * of bucket i are closer to it than all the others, the nodes of the buckets after it all
+ * share i leading bits with it and the ones of each bucket j before it share j. So the
+ * closest nodes of each of these ranges in turn are the closest ones overall.
+ */
+static void get_close_list_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                 sa_family_t sa_family, uint32_t *num_nodes_ptr, uint8_t is_LAN)
+{
+    if ((sa_family != AF_INET) && (sa_family != AF_INET6) && (sa_family != 0))
+        return;
+
+    unsigned int bucket = close_bucket(dht->self_public_key, public_key);
+
+    get_close_list_range_nodes(dht, public_key, nodes_list, sa_family, bucket * LCLIENT_NODES, LCLIENT_NODES,
+                               num_nodes_ptr, is_LAN);
+
+    if (*num_nodes_ptr >= MAX_SENT_NODES)
+        return;
+
+    get_close_list_range_nodes(dht, public_key, nodes_list, sa_family, (bucket + 1) * LCLIENT_NODES,
+                               (LCLIENT_LENGTH - bucket - 1) * LCLIENT_NODES, num_nodes_ptr, is_LAN);
+
+    while (bucket != 0 && *num_nodes_ptr < MAX_SENT_NODES) {
+        --bucket;
+        get_close_list_range_nodes(dht, public_key, nodes_list, sa_family, bucket * LCLIENT_NODES, LCLIENT_NODES,
+                                   num_nodes_ptr, is_LAN);
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -619,8 +866,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     sa_family_t sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0, i;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_list_nodes(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN);
 
     /*TODO uncomment this when hardening is added to close friend clients
         for (i = 0; i < dht->num_friends; ++i)
@@ -696,14 +942,17 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
 #endif
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_dht_entry(const void *a, const void *b)
+/* Compare two client list entries for sorting:
+ * bad nodes first, then possibly bad ones, then the rest by decreasing distance to comp_public_key.
+ *
+ * return < 0 if entry1 goes before entry2.
+ * return > 0 if entry1 goes after entry2.
+ * return 0 if it does not matter.
+ */
+static int cmp_dht_entry(const Client_data *entry1, const Client_data *entry2, const uint8_t *comp_public_key)
 {
-    Client_data entry1, entry2;
-    memcpy(&entry1, a, sizeof(Client_data));
-    memcpy(&entry2, b, sizeof(Client_data));
-    int t1 = is_timeout(entry1.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry1.assoc6.timestamp, BAD_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry2.assoc6.timestamp, BAD_NODE_TIMEOUT);
+    int t1 = is_timeout(entry1->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry1->assoc6.timestamp, BAD_NODE_TIMEOUT);
+    int t2 = is_timeout(entry2->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry2->assoc6.timestamp, BAD_NODE_TIMEOUT);
 
     if (t1 && t2)
         return 0;
@@ -714,10 +963,10 @@ static int cmp_dht_entry(const void *a, const void *b)
     if (t2)
         return 1;
 
-    t1 = hardening_correct(&entry1.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry1.assoc6.hardening) != HARDENING_ALL_OK;
-    t2 = hardening_correct(&entry2.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry2.assoc6.hardening) != HARDENING_ALL_OK;
+    t1 = hardening_correct(&entry1->assoc4) != HARDENING_ALL_OK
+         && hardening_correct(&entry1->assoc6) != HARDENING_ALL_OK;
+    t2 = hardening_correct(&entry2->assoc4) != HARDENING_ALL_OK
+         && hardening_correct(&entry2->assoc6) != HARDENING_ALL_OK;
 
     if (t1 != t2) {
         if (t1)
@@ -727,7 +976,7 @@ static int cmp_dht_entry(const void *a, const void *b)
             return 1;
     }
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    int close = id_closest(comp_public_key, entry1->public_key, entry2->public_key);
 
     if (close == 1)
         return 1;
@@ -753,10 +1002,24 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *publ
     }
 }
 
+/* Sort the list with cmp_dht_entry().
+ * Insertion sort: the lists sorted here are MAX_FRIEND_CLIENTS long and mostly sorted already.
+ */
 static void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    memcpy(cmp_public_key, comp_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(list, length, sizeof(Client_data), cmp_dht_entry);
+    unsigned int i, j;
+
+    for (i = 1; i < length; ++i) {
+        if (cmp_dht_entry(&list[i - 1], &list[i], comp_public_key) <= 0)
+            continue;
+
+        Client_data entry = list[i];
+
+        for (j = i; j > 0 && cmp_dht_entry(&list[j - 1], &entry, comp_public_key) > 0; --j)
+            list[j] = list[j - 1];
+
+        list[j] = entry;
+    }
 }
 
 /* Replace a first bad (or empty) node with this one
@@ -801,12 +1064,10 @@ static int replace_all(   Client_data    *list,
         ipptp_write->ip_port = ip_port;
         ipptp_write->timestamp = unix_time();
 
-        ip_reset(&ipptp_write->ret_ip_port.ip);
-        ipptp_write->ret_ip_port.port = 0;
-        ipptp_write->ret_timestamp = 0;
+        ipptsp_reset_ret(ipptp_write);
 
         /* zero out other address */
-        memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+        ipptsp_clear(ipptp_clear);
 
         return 1;
     }
@@ -814,6 +1075,65 @@ static int replace_all(   Client_data    *list,
     return 0;
 }
 
+/* return index of the close list entry with ip_port.
+ * return -1 if there is none.
+ */
+static int close_ip_port_index(const DHT *dht, IP_Port ip_port)
+{
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &ip_port);
+    return hash_map_find(&dht->close_ip_ports, key);
+}
+
+/* Remove the addresses of close list entry index from close_ip_ports, before they change. */
+static void close_ip_ports_remove(DHT *dht, unsigned int index)
+{
+    const Client_data *client = &dht->close_clientlist[index];
+    uint8_t key[IP_PORT_KEY_SIZE];
+
+    if (ipport_isset(&client->assoc4.ip_port)) {
+        ip_port_key(key, &client->assoc4.ip_port);
+        hash_map_remove(&dht->close_ip_ports, key, index);
+    }
+
+    if (ipport_isset(&client->assoc6.ip_port)) {
+        ip_port_key(key, &client->assoc6.ip_port);
+        hash_map_remove(&dht->close_ip_ports, key, index);
+    }
+}
+
+/* Add the address assoc of close list entry index to close_ip_ports.
+ *
+ * A node is reachable at one address only: an older entry with the same address loses it.
+ */
+static void close_ip_ports_add_assoc(DHT *dht, unsigned int index, IPPTsPng *assoc)
+{
+    if (!ipport_isset(&assoc->ip_port))
+        return;
+
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &assoc->ip_port);
+    int other = hash_map_find(&dht->close_ip_ports, key);
+
+    if (other == (int)index)
+        return;
+
+    if (other != -1) {
+        Client_data *client = &dht->close_clientlist[other];
+        hash_map_remove(&dht->close_ip_ports, key, other);
+        ipptsp_clear(assoc->ip_port.ip.family == AF_INET ? &client->assoc4 : &client->assoc6);
+    }
+
+    hash_map_add(&dht->close_ip_ports, key, index);
+}
+
+/* Add the addresses of close list entry index to close_ip_ports, after they changed. */
+static void close_ip_ports_add(DHT *dht, unsigned int index)
+{
+    close_ip_ports_add_assoc(dht, index, &dht->close_clientlist[index].assoc4);
+    close_ip_ports_add_assoc(dht, index, &dht->close_clientlist[index].assoc6);
+}
+
 /* Add node to close list.
  *
  * simulate is set to 1 if we want to check if a node can be added to the list without adding it.
@@ -825,13 +1145,11 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
 {
     unsigned int i;
 
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index > LCLIENT_LENGTH)
-        index = LCLIENT_LENGTH - 1;
+    unsigned int index = close_bucket(dht->self_public_key, public_key);
 
     for (i = 0; i < LCLIENT_NODES; ++i) {
-        Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
+        unsigned int client_index = (index * LCLIENT_NODES) + i;
+        Client_data *client = &dht->close_clientlist[client_index];
 
         if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             if (!simulate) {
@@ -846,16 +1164,17 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
                     ipptp_clear = &client->assoc4;
                 }
 
+                close_ip_ports_remove(dht, client_index);
                 id_copy(client->public_key, public_key);
+                key_array_set(&dht->close_keys, client_index, public_key);
                 ipptp_write->ip_port = ip_port;
                 ipptp_write->timestamp = unix_time();
 
-                ip_reset(&ipptp_write->ret_ip_port.ip);
-                ipptp_write->ret_ip_port.port = 0;
-                ipptp_write->ret_timestamp = 0;
+                ipptsp_reset_ret(ipptp_write);
 
                 /* zero out other address */
-                memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+                ipptsp_clear(ipptp_clear);
+                close_ip_ports_add(dht, client_index);
             }
 
             return 0;
@@ -876,6 +1195,16 @@ _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip
     return 0;
 }
 
+const Client_data *get_close_client(const DHT *dht, const uint8_t *public_key)
+{
+    int index = close_client_index(dht, public_key);
+
+    if (index == -1)
+        return NULL;
+
+    return &dht->close_clientlist[index];
+}
+
 static _Bool is_pk_in_client_list(Client_data *list, unsigned int client_list_length, const uint8_t *public_key,
                                   IP_Port ip_port)
 {
@@ -968,11 +1297,27 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    if (!client_or_ip_port_in_list(dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
-        if (add_to_close(dht, public_key, ip_port, 0))
-            used++;
-    } else
+    int close_index = close_client_index(dht, public_key);
+
+    if (close_index != -1) {
+        close_ip_ports_remove(dht, close_index);
+        client_or_ip_port_in_list(&dht->close_clientlist[close_index], 1, public_key, ip_port);
+        close_ip_ports_add(dht, close_index);
         used++;
+    } else {
+        int ip_index = close_ip_port_index(dht, ip_port);
+
+        if (ip_index != -1) {
+            /* New public_key for a known ip_port: kill the old public_key and put the
+             * new one in its own bucket instead of overwriting it in place. */
+            close_ip_ports_remove(dht, ip_index);
+            client_data_clear(&dht->close_clientlist[ip_index]);
+            key_array_clear(&dht->close_keys, ip_index);
+        }
+
+        if (add_to_close(dht, public_key, ip_port, 0) == 0)
+            used++;
+    }
 
     DHT_Friend *friend_foundip = 0;
 
@@ -1043,19 +1388,16 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        for (i = 0; i < LCLIENT_LIST; ++i) {
-            if (id_equal(nodepublic_key, dht->close_clientlist[i].public_key)) {
-                if (ip_port.ip.family == AF_INET) {
-                    dht->close_clientlist[i].assoc4.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc4.ret_timestamp = temp_time;
-                } else if (ip_port.ip.family == AF_INET6) {
-                    dht->close_clientlist[i].assoc6.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc6.ret_timestamp = temp_time;
-                }
+        int index = close_client_index(dht, nodepublic_key);
 
-                ++used;
-                break;
+        if (index != -1) {
+            if (ip_port.ip.family == AF_INET) {
+                ipptsp_set_ret(&dht->close_clientlist[index].assoc4, ip_port, temp_time);
+            } else if (ip_port.ip.family == AF_INET6) {
+                ipptsp_set_ret(&dht->close_clientlist[index].assoc6, ip_port, temp_time);
             }
+
+            ++used;
         }
     } else {
         for (i = 0; i < dht->num_friends; ++i) {
@@ -1063,11 +1405,9 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
                 for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
                     if (id_equal(nodepublic_key, dht->friends_list[i].client_list[j].public_key)) {
                         if (ip_port.ip.family == AF_INET) {
-                            dht->friends_list[i].client_list[j].assoc4.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc4.ret_timestamp = temp_time;
+                            ipptsp_set_ret(&dht->friends_list[i].client_list[j].assoc4, ip_port, temp_time);
                         } else if (ip_port.ip.family == AF_INET6) {
-                            dht->friends_list[i].client_list[j].assoc6.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc6.ret_timestamp = temp_time;
+                            ipptsp_set_ret(&dht->friends_list[i].client_list[j].assoc6, ip_port, temp_time);
                         }
 
                         ++used;
@@ -1103,20 +1443,23 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     if (id_equal(public_key, dht->self_public_key))
         return -1;
 
-    uint8_t plain_message[sizeof(Node_format) * 2] = {0};
+    /* The receiver, the sendback node if any and the time the request was sent, for the round trip time. */
+    uint8_t plain_message[sizeof(Node_format) * 2 + sizeof(uint64_t)] = {0};
 
     Node_format receiver;
     memcpy(receiver.public_key, public_key, crypto_box_PUBLICKEYBYTES);
     receiver.ip_port = ip_port;
     memcpy(plain_message, &receiver, sizeof(receiver));
 
-    uint64_t ping_id = 0;
+    uint64_t ping_id = 0, send_time = current_time_monotonic();
 
     if (sendback_node != NULL) {
         memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
+        memcpy(plain_message + sizeof(Node_format) * 2, &send_time, sizeof(send_time));
         ping_id = ping_array_add(&dht->dht_harden_ping_array, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver));
+        memcpy(plain_message + sizeof(receiver), &send_time, sizeof(send_time));
+        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver) + sizeof(send_time));
     }
 
     if (ping_id == 0)
@@ -1149,6 +1492,9 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     memcpy(data + 1 + crypto_box_PUBLICKEYBYTES, nonce, crypto_box_NONCEBYTES);
     memcpy(data + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, encrypt, len);
 
+    if (dht->node_cache)
+        node_cache_attempt(dht->node_cache, NODE_CACHE_TYPE_DHT, public_key);
+
     return sendpacket(dht->net, ip_port, data, sizeof(data));
 }
 
@@ -1234,17 +1580,20 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
 
     return 0;
 }
-/* return 0 if no
+/* send_time is set to the current_time_monotonic() at which the request was sent.
+   return 0 if no
    return 1 if yes */
 static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port node_ip_port, uint64_t ping_id,
-                                    Node_format *sendback_node)
+                                    Node_format *sendback_node, uint64_t *send_time)
 {
-    uint8_t data[sizeof(Node_format) * 2];
+    uint8_t data[sizeof(Node_format) * 2 + sizeof(uint64_t)];
 
-    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format) + sizeof(uint64_t)) {
         memset(sendback_node, 0, sizeof(Node_format));
+        memcpy(send_time, data + sizeof(Node_format), sizeof(uint64_t));
     } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, ping_id) == sizeof(data)) {
         memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
+        memcpy(send_time, data + sizeof(Node_format) * 2, sizeof(uint64_t));
     } else {
         return 0;
     }
@@ -1297,10 +1646,10 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
 
     Node_format sendback_node;
 
-    uint64_t ping_id;
+    uint64_t ping_id, send_time;
     memcpy(&ping_id, plain + 1 + data_size, sizeof(ping_id));
 
-    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node))
+    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node, &send_time))
         return 1;
 
     uint16_t length_nodes = 0;
@@ -1318,6 +1667,13 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     /* store the address the *request* was sent to */
     addto_lists(dht, source, packet + 1);
 
+    if (dht->node_cache) {
+        Node_format node;
+        memcpy(node.public_key, packet + 1, crypto_box_PUBLICKEYBYTES);
+        node.ip_port = source;
+        node_cache_success(dht->node_cache, NODE_CACHE_TYPE_DHT, &node, current_time_monotonic() - send_time);
+    }
+
     *num_nodes_out = num_nodes;
 
     send_hardening_getnode_res(dht, &sendback_node, packet + 1, plain + 1, data_size);
@@ -1425,6 +1781,10 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
     }
 
     DHT_Friend *temp;
+    uint32_t i;
+
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i)
+        client_data_clear(&friend->client_list[i]);
 
     --dht->num_friends;
 
@@ -1660,20 +2020,17 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    uint32_t i;
+    int index = close_client_index(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
+    if (index == -1)
+        return -1;
 
-            if (ip_isset(&client->assoc6.ip_port.ip))
-                return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
-            else if (ip_isset(&client->assoc4.ip_port.ip))
-                return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
-            else
-                break;
-        }
-    }
+    const Client_data *client = &dht->close_clientlist[index];
+
+    if (ip_isset(&client->assoc6.ip_port.ip))
+        return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
+    else if (ip_isset(&client->assoc4.ip_port.ip))
+        return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
 
     return -1;
 }
@@ -1702,13 +2059,17 @@ static int friend_iplist(const DHT *dht, IP_Port *ip_portlist, uint16_t friend_n
         client = &(friend->client_list[i]);
 
         /* If ip is not zero and node is good. */
-        if (ip_isset(&client->assoc4.ret_ip_port.ip) && !is_timeout(client->assoc4.ret_timestamp, BAD_NODE_TIMEOUT)) {
-            ipv4s[num_ipv4s] = client->assoc4.ret_ip_port;
+        const IP_Port *ret_ip_port = ipptsp_ret(&client->assoc4);
+
+        if (ret_ip_port) {
+            ipv4s[num_ipv4s] = *ret_ip_port;
             ++num_ipv4s;
         }
 
-        if (ip_isset(&client->assoc6.ret_ip_port.ip) && !is_timeout(client->assoc6.ret_timestamp, BAD_NODE_TIMEOUT)) {
-            ipv6s[num_ipv6s] = client->assoc6.ret_ip_port;
+        ret_ip_port = ipptsp_ret(&client->assoc6);
+
+        if (ret_ip_port) {
+            ipv6s[num_ipv6s] = *ret_ip_port;
             ++num_ipv6s;
         }
 
@@ -1790,8 +2151,7 @@ int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *pack
                 assoc = &client->assoc6;
 
             /* If ip is not zero and node is good. */
-            if (ip_isset(&assoc->ret_ip_port.ip) &&
-                    !is_timeout(assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
+            if (ipptsp_ret(assoc)) {
                 int retval = sendpacket(dht->net, assoc->ip_port, packet, length);
 
                 if ((unsigned int)retval == length) {
@@ -1837,7 +2197,7 @@ static int routeone_tofriend(DHT *dht, const uint8_t *friend_id, const uint8_t *
                 assoc = &client->assoc6;
 
             /* If ip is not zero and node is good. */
-            if (ip_isset(&assoc->ret_ip_port.ip) && !is_timeout(assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
+            if (ipptsp_ret(assoc)) {
                 ip_list[n] = assoc->ip_port;
                 ++n;
             }
@@ -2118,17 +2478,15 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
 /* TODO: improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, sa_family_t sa_family)
 {
-    uint32_t i;
+    int index = close_client_index(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (public_key_cmp(dht->close_clientlist[i].public_key, public_key) != 0)
-            continue;
+    if (index == -1)
+        return NULL;
 
-        if (sa_family == AF_INET)
-            return &dht->close_clientlist[i].assoc4;
-        else if (sa_family == AF_INET6)
-            return &dht->close_clientlist[i].assoc6;
-    }
+    if (sa_family == AF_INET)
+        return &dht->close_clientlist[index].assoc4;
+    else if (sa_family == AF_INET6)
+        return &dht->close_clientlist[index].assoc6;
 
     return NULL;
 }
@@ -2212,17 +2570,20 @@ static int handle_hardening(void *object, IP_Port source, const uint8_t *source_
 
             IPPTsPng *temp = get_closelist_IPPTsPng(dht, packet + 1, nodes[0].ip_port.ip.family);
 
-            if (temp == NULL)
+            /* No cold state, no hardening request was sent to it. */
+            if (temp == NULL || temp->cold == NULL)
                 return 1;
 
-            if (is_timeout(temp->hardening.send_nodes_timestamp, HARDENING_INTERVAL))
+            Hardening *hardening = &temp->cold->hardening;
+
+            if (is_timeout(hardening->send_nodes_timestamp, HARDENING_INTERVAL))
                 return 1;
 
-            if (public_key_cmp(temp->hardening.send_nodes_pingedid, source_pubkey) != 0)
+            if (public_key_cmp(hardening->send_nodes_pingedid, source_pubkey) != 0)
                 return 1;
 
             /* If Nodes look good and the request checks out */
-            temp->hardening.send_nodes_ok = 1;
+            hardening->send_nodes_ok = 1;
             return 0;/* success*/
         }
     }
@@ -2344,8 +2705,13 @@ void do_hardening(DHT *dht)
         if (is_timeout(cur_iptspng->timestamp, BAD_NODE_TIMEOUT))
             continue;
 
-        if (cur_iptspng->hardening.send_nodes_ok == 0) {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
+        IPPTs_Cold *cold = ipptsp_cold(cur_iptspng);
+
+        if (cold == NULL)
+            continue;
+
+        if (cold->hardening.send_nodes_ok == 0) {
+            if (is_timeout(cold->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
                 Node_format rand_node = random_node(dht, sa_family);
 
                 if (!ipport_isset(&rand_node.ip_port))
@@ -2360,13 +2726,13 @@ void do_hardening(DHT *dht)
 
                 //TODO: The search id should maybe not be ours?
                 if (send_hardening_getnode_req(dht, &rand_node, &to_test, dht->self_public_key) > 0) {
-                    memcpy(cur_iptspng->hardening.send_nodes_pingedid, rand_node.public_key, crypto_box_PUBLICKEYBYTES);
-                    cur_iptspng->hardening.send_nodes_timestamp = unix_time();
+                    memcpy(cold->hardening.send_nodes_pingedid, rand_node.public_key, crypto_box_PUBLICKEYBYTES);
+                    cold->hardening.send_nodes_timestamp = unix_time();
                 }
             }
         } else {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDEN_TIMEOUT)) {
-                cur_iptspng->hardening.send_nodes_ok = 0;
+            if (is_timeout(cold->hardening.send_nodes_timestamp, HARDEN_TIMEOUT)) {
+                cold->hardening.send_nodes_ok = 0;
             }
         }
 
@@ -2432,6 +2798,29 @@ DHT *new_DHT(Networking_Core *net)
         return NULL;
 
     dht->net = net;
+
+    if (DHT_set_shared_keys_size(dht, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        shared_keys_free(&dht->shared_keys_recv);
+        shared_keys_free(&dht->shared_keys_sent);
+        free(dht);
+        return NULL;
+    }
+
+    if (key_array_init(&dht->close_keys, LCLIENT_LIST) == -1) {
+        shared_keys_free(&dht->shared_keys_recv);
+        shared_keys_free(&dht->shared_keys_sent);
+        free(dht);
+        return NULL;
+    }
+
+    if (!hash_map_init(&dht->close_ip_ports, IP_PORT_KEY_SIZE, LCLIENT_LIST)) {
+        key_array_free(&dht->close_keys);
+        shared_keys_free(&dht->shared_keys_recv);
+        shared_keys_free(&dht->shared_keys_sent);
+        free(dht);
+        return NULL;
+    }
+
     dht->ping = new_ping(dht);
 
     if (dht->ping == NULL) {
@@ -2468,6 +2857,97 @@ DHT *new_DHT(Networking_Core *net)
     return dht;
 }
 
+/* return the unix_time() at which do_ping_and_sendnode_requests() next has something to do for list.
+ * return 0 if it has something to do now.
+ */
+static uint64_t ping_and_sendnode_deadline(const Client_data *list, uint32_t list_count, uint64_t lastgetnode,
+        uint32_t bootstrap_times)
+{
+    uint64_t deadline = UINT64_MAX;
+    _Bool good = 0;
+    uint32_t i;
+
+    for (i = 0; i < list_count; ++i) {
+        const IPPTsPng *assoc;
+        uint32_t a;
+
+        for (a = 0, assoc = &list[i].assoc6; a < 2; a++, assoc = &list[i].assoc4) {
+            if (is_timeout(assoc->timestamp, KILL_NODE_TIMEOUT))
+                continue;
+
+            deadline = MIN(deadline, assoc->last_pinged + PING_INTERVAL);
+            /* The node is dead then and the list may change. */
+            deadline = MIN(deadline, assoc->timestamp + KILL_NODE_TIMEOUT);
+
+            if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT))
+                good = 1;
+        }
+    }
+
+    if (good) {
+        if (bootstrap_times < MAX_BOOTSTRAP_TIMES)
+            return 0;
+
+        deadline = MIN(deadline, lastgetnode + GET_NODE_INTERVAL);
+    }
+
+    return deadline;
+}
+
+/* return the unix_time() at which do_NAT() next has something to do for friend_num. */
+static uint64_t NAT_deadline(const DHT *dht, uint16_t friend_num)
+{
+    IP_Port ip_list[MAX_FRIEND_CLIENTS];
+
+    if (friend_iplist(dht, ip_list, friend_num) < MAX_FRIEND_CLIENTS / 2)
+        return UINT64_MAX;
+
+    const DHT_Friend *friend = &dht->friends_list[friend_num];
+    uint64_t deadline = friend->nat.NATping_timestamp + PUNCH_INTERVAL + 1;
+
+    if (friend->nat.hole_punching == 1 && friend->nat.recvNATping_timestamp + PUNCH_INTERVAL * 2 >= unix_time())
+        deadline = MIN(deadline, friend->nat.punching_timestamp + PUNCH_INTERVAL + 1);
+
+    return deadline;
+}
+
+uint64_t DHT_deadline(const DHT *dht)
+{
+    /* do_DHT() runs at most once a second. */
+    uint64_t next_run = dht->last_run + 1;
+
+    if (dht->loaded_num_nodes || dht->num_to_bootstrap)
+        return next_run;
+
+    uint64_t deadline = ping_and_sendnode_deadline(dht->close_clientlist, LCLIENT_LIST, dht->close_lastgetnodes,
+                        dht->close_bootstrap_times);
+    deadline = MIN(deadline, to_ping_deadline(dht->ping));
+    uint16_t i;
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        const DHT_Friend *friend = &dht->friends_list[i];
+
+        if (friend->num_to_bootstrap)
+            return next_run;
+
+        deadline = MIN(deadline, ping_and_sendnode_deadline(friend->client_list, MAX_FRIEND_CLIENTS, friend->lastgetnode,
+                                 friend->bootstrap_times));
+        deadline = MIN(deadline, NAT_deadline(dht, i));
+    }
+
+#ifdef ENABLE_ASSOC_DHT
+
+    if (dht->assoc)
+        return next_run;
+
+#endif
+
+    if (deadline < next_run)
+        return next_run;
+
+    return deadline;
+}
+
 void do_DHT(DHT *dht)
 {
     unix_time_update();
@@ -2506,6 +2986,20 @@ void kill_DHT(DHT *dht)
     ping_array_free_all(&dht->dht_ping_array);
     ping_array_free_all(&dht->dht_harden_ping_array);
     kill_ping(dht->ping);
+    shared_keys_free(&dht->shared_keys_recv);
+    shared_keys_free(&dht->shared_keys_sent);
+    key_array_free(&dht->close_keys);
+    hash_map_free(&dht->close_ip_ports);
+
+    uint32_t i, j;
+
+    for (i = 0; i < LCLIENT_LIST; ++i)
+        client_data_clear(&dht->close_clientlist[i]);
+
+    for (i = 0; i < dht->num_friends; ++i)
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j)
+            client_data_clear(&dht->friends_list[i].client_list[j]);
+
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
@@ -2745,13 +3239,16 @@ int ipport_self_copy(const DHT *dht, IP_Port *dest)
     size_t i;
 
     for (i = 0; i < LCLIENT_LIST; i++) {
-        if (ipport_isset(&dht->close_clientlist[i].assoc4.ret_ip_port)) {
-            ipport_copy(dest, &dht->close_clientlist[i].assoc4.ret_ip_port);
+        const IPPTs_Cold *cold4 = dht->close_clientlist[i].assoc4.cold;
+        const IPPTs_Cold *cold6 = dht->close_clientlist[i].assoc6.cold;
+
+        if (cold4 && ipport_isset(&cold4->ret_ip_port)) {
+            ipport_copy(dest, &cold4->ret_ip_port);
             break;
         }
 
-        if (ipport_isset(&dht->close_clientlist[i].assoc6.ret_ip_port)) {
-            ipport_copy(dest, &dht->close_clientlist[i].assoc6.ret_ip_port);
+        if (cold6 && ipport_isset(&cold6->ret_ip_port)) {
+            ipport_copy(dest, &cold6->ret_ip_port);
             break;
         }
     }
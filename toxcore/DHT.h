@@ -27,6 +27,8 @@
 #include "crypto_core.h"
 #include "network.h"
 #include "ping_array.h"
+#include "xor_distance.h"
+#include "hash_map.h"
 
 /* Encryption and signature keys definition */
 #define ENC_PUBLIC_KEY crypto_box_PUBLICKEYBYTES
@@ -50,7 +52,9 @@
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* A list of the clients mathematically closest to ours.
+ * LCLIENT_LENGTH k-buckets of LCLIENT_NODES clients, bucket i is for the public keys
+ * that share i leading bits with ours. */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
@@ -110,15 +114,21 @@ typedef struct {
     uint8_t     testing_pingedid[crypto_box_PUBLICKEYBYTES];
 } Hardening;
 
+/* The state of an address that is only set for some nodes and that the scans of the node lists don't need. */
 typedef struct {
-    IP_Port     ip_port;
-    uint64_t    timestamp;
-    uint64_t    last_pinged;
-
     Hardening hardening;
     /* Returned by this node. Either our friend or us. */
     IP_Port     ret_ip_port;
     uint64_t    ret_timestamp;
+} IPPTs_Cold;
+
+typedef struct {
+    IP_Port     ip_port;
+    uint64_t    timestamp;
+    uint64_t    last_pinged;
+
+    /* NULL until ipptsp_cold() is first called for this address. */
+    IPPTs_Cold *cold;
 } IPPTsPng;
 
 typedef struct {
@@ -127,6 +137,17 @@ typedef struct {
     IPPTsPng    assoc6;
 } Client_data;
 
+/* return the cold state of ipptp, allocated and zeroed if it had none.
+ * return NULL on failure.
+ */
+IPPTs_Cold *ipptsp_cold(IPPTsPng *ipptp);
+
+/* Free the cold state of ipptp and zero it. */
+void ipptsp_clear(IPPTsPng *ipptp);
+
+/* Clear both addresses of client and zero it. */
+void client_data_clear(Client_data *client);
+
 /*----------------------------------------------------------------------------------*/
 
 typedef struct {
@@ -214,18 +235,41 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 /*----------------------------------------------------------------------------------*/
 /* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
+#define SHARED_KEYS_DEFAULT_SIZE 1024
 #define KEYS_TIMEOUT 600
 typedef struct {
-    struct {
-        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-        uint8_t shared_key[crypto_box_BEFORENMBYTES];
-        uint32_t times_requested;
-        uint8_t  stored; /* 0 if not, 1 if is */
-        uint64_t time_last_requested;
-    } keys[256 * MAX_KEYS_PER_SLOT];
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint64_t time_last_requested;
+    uint32_t next; /* Index of the next key in the same hash bucket, size of the table if none. */
+    uint8_t  referenced; /* Set when requested, cleared when the eviction clock hand passes. */
+} Shared_Key;
+
+typedef struct {
+    Shared_Key *keys;
+    uint32_t   *buckets;
+    uint32_t    size;
+    uint32_t    num_buckets;
+    uint32_t    num_stored;
+    uint32_t    clock_hand;
+    uint64_t    hash_key;
+
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
 } Shared_Keys;
 
+/* Initialize shared_keys to cache up to size keys.
+ * Frees what it held before, if anything.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size);
+
+/* Free all the memory used by shared_keys. */
+void shared_keys_free(Shared_Keys *shared_keys);
+
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -236,10 +280,16 @@ typedef struct {
     void *object;
 } Cryptopacket_Handles;
 
+typedef struct Node_Cache Node_Cache;
+
 typedef struct {
     Networking_Core *net;
 
     Client_data    close_clientlist[LCLIENT_LIST];
+    /* Public keys of close_clientlist, same indexes. */
+    Key_Array      close_keys;
+    /* Index in close_clientlist of the entry with each ip_port, see ip_port_key(). */
+    Hash_Map       close_ip_ports;
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
@@ -271,6 +321,9 @@ typedef struct {
 
     Node_format to_bootstrap[MAX_CLOSE_TO_BOOTSTRAP_NODES];
     unsigned int num_to_bootstrap;
+
+    /* Records which nodes answer our get nodes requests, NULL if not kept. Not owned by the DHT. */
+    Node_Cache *node_cache;
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
@@ -283,6 +336,14 @@ typedef struct {
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
                     const uint8_t *public_key);
 
+/* Resize the shared key caches of the DHT so that each can hold size keys.
+ * Keys cached so far are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size);
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -331,13 +392,7 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count);
  */
 int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port);
 
-/* Compares pk1 and pk2 with pk.
- *
- *  return 0 if both are same distance.
- *  return 1 if pk1 is closer.
- *  return 2 if pk2 is closer.
- */
-int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+/* id_closest() is in xor_distance.h. */
 
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
  */
@@ -348,6 +403,10 @@ _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *p
  */
 _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port);
 
+/* Return the close list entry of public_key, NULL if it isn't in the close list.
+ */
+const Client_data *get_close_client(const DHT *dht, const uint8_t *public_key);
+
 /* Get the (maximum MAX_SENT_NODES) closest nodes to public_key we know
  * and put them in nodes_list (must be MAX_SENT_NODES big).
  *
@@ -377,6 +436,9 @@ uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num);
 /* Run this function at least a couple times per second (It's the main loop). */
 void do_DHT(DHT *dht);
 
+/* return the unix_time() at which do_DHT() next has something to do. */
+uint64_t DHT_deadline(const DHT *dht);
+
 /*
  *  Use these two functions to bootstrap the client.
  */
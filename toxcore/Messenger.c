@@ -38,6 +38,7 @@
 #include "group_moderation.h"
 #include "onion_client.h"
 #include "DHT.h"
+#include "node_cache.h"
 
 static void set_friend_status(Messenger *m, int32_t friendnumber, uint8_t status);
 static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t packet_id, const uint8_t *data,
@@ -481,6 +482,21 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     }
 }
 
+int m_get_friend_connection_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber))
+        return -1;
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return 0;
+
+    if (crypto_connection_stats(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                m->friendlist[friendnumber].friendcon_id), stats) != 0)
+        return 0;
+
+    return 1;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber))
@@ -1148,6 +1164,7 @@ long int new_filesender(const Messenger *m, int32_t friendnumber, uint32_t file_
     ft->transferred = 0;
     ft->requested = 0;
     ft->slots_allocated = 0;
+    ft->max_chunk_size = 0;
     ft->paused = FILE_PAUSE_NOT;
     memcpy(ft->id, file_id, FILE_ID_LENGTH);
 
@@ -1355,8 +1372,29 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
                              m->friendlist[friendnumber].friendcon_id), packet, sizeof(packet), 1);
 }
 
+/* Size of the file data in a full chunk, a smaller chunk ends a transfer. */
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
 #define MIN_SLOTS_FREE (CRYPTO_MIN_QUEUE_LENGTH / 4)
+
+/* return the size of the file data in the chunks of ft sent to the friend right now.
+ *
+ * Chunks of files of known size are bigger when path MTU discovery raised the maximum packet size
+ * of the connection, the receiver knows they end when all the data arrived. Streams end with a
+ * chunk smaller than MAX_FILE_DATA_SIZE so their chunks are never bigger.
+ */
+static uint16_t file_chunk_size(const Messenger *m, int32_t friendnumber, const struct File_Transfers *ft)
+{
+    if (ft->size == UINT64_MAX)
+        return MAX_FILE_DATA_SIZE;
+
+    uint16_t size = crypto_max_data_size(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                         m->friendlist[friendnumber].friendcon_id));
+
+    if (size < MAX_CRYPTO_DATA_SIZE)
+        return MAX_FILE_DATA_SIZE;
+
+    return size - 2;
+}
 /* Send file data.
  *
  *  return 0 on success
@@ -1385,14 +1423,15 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
     if (ft->status != FILESTATUS_TRANSFERRING)
         return -4;
 
-    if (length > MAX_FILE_DATA_SIZE)
+    /* Chunks requested before the maximum packet size fell back can still be sent. */
+    if (length > file_chunk_size(m, friendnumber, ft) && length > ft->max_chunk_size)
         return -5;
 
     if (ft->size - ft->transferred < length) {
         return -5;
     }
 
-    if (ft->size != UINT64_MAX && length != MAX_FILE_DATA_SIZE && (ft->transferred + length) != ft->size) {
+    if (ft->size != UINT64_MAX && length < MAX_FILE_DATA_SIZE && (ft->transferred + length) != ft->size) {
         return -5;
     }
 
@@ -1415,7 +1454,7 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
             --ft->slots_allocated;
         }
 
-        if (length != MAX_FILE_DATA_SIZE || ft->size == ft->transferred) {
+        if (length < MAX_FILE_DATA_SIZE || ft->size == ft->transferred) {
             ft->status = FILESTATUS_FINISHED;
             ft->last_packet_number = ret;
         }
@@ -1504,7 +1543,7 @@ static void do_reqchunk_filecb(Messenger *m, int32_t friendnumber)
             if (free_slots == 0)
                 break;
 
-            uint16_t length = MAX_FILE_DATA_SIZE;
+            uint16_t length = file_chunk_size(m, friendnumber, ft);
 
             if (ft->size == 0) {
                 /* Send 0 data to friend if file is 0 length. */
@@ -1525,6 +1564,9 @@ static void do_reqchunk_filecb(Messenger *m, int32_t friendnumber)
             uint64_t position = ft->requested;
             ft->requested += length;
 
+            if (length > ft->max_chunk_size)
+                ft->max_chunk_size = length;
+
             if (m->file_reqchunk)
                 (*m->file_reqchunk)(m, friendnumber, i, position, length, m->file_reqchunk_userdata);
 
@@ -1662,7 +1704,21 @@ void m_callback_msi_packet(Messenger *m, void (*function)(Messenger *m, uint32_t
  */
 int m_msi_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint16_t length)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_MSI, data, length, 0);
+    if (friend_not_valid(m, friendnumber))
+        return 0;
+
+    if (length >= MAX_CRYPTO_DATA_SIZE || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return 0;
+
+    uint8_t packet[length + 1];
+    packet[0] = PACKET_ID_MSI;
+
+    if (length != 0)
+        memcpy(packet + 1, data, length);
+
+    /* toxav sends these from its own threads, do_messenger() sends them in the order they came. */
+    return submit_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                              m->friendlist[friendnumber].friendcon_id), packet, length + 1, 0) != -1;
 }
 
 static int handle_custom_lossy_packet(void *object, int friend_num, const uint8_t *packet, uint16_t length)
@@ -1730,8 +1786,9 @@ int send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const uin
     if (m->friendlist[friendnumber].status != FRIEND_ONLINE)
         return -4;
 
-    if (send_lossy_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                               m->friendlist[friendnumber].friendcon_id), data, length) == -1) {
+    /* Audio and video come from the threads of toxav, the next do_messenger() sends them. */
+    if (submit_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                           m->friendlist[friendnumber].friendcon_id), data, length, 0) == -1) {
         return -5;
     } else {
         return 0;
@@ -1820,6 +1877,10 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         IP ip;
         ip_init(&ip, options->ipv6enabled);
         m->net = new_networking_ex(ip, options->port_range[0], options->port_range[1], &net_err);
+
+        /* Batch the packets sent during each do_messenger() call, it works without it if this fails. */
+        if (m->net)
+            networking_enable_send_queue(m->net, 1);
     }
 
     if (m->net == NULL) {
@@ -1849,6 +1910,32 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         return NULL;
     }
 
+    if (net_crypto_set_congestion_control(m->net_crypto, options->congestion_control) == -1) {
+        kill_net_crypto(m->net_crypto);
+        kill_DHT(m->dht);
+        kill_networking(m->net);
+        free(m);
+        return NULL;
+    }
+
+    if (net_crypto_set_handshake_workers(m->net_crypto, options->handshake_workers) == -1
+            || net_crypto_set_decrypt_workers(m->net_crypto, options->decrypt_workers) == -1
+            || net_crypto_set_multipath(m->net_crypto, options->multipath) == -1) {
+        kill_net_crypto(m->net_crypto);
+        kill_DHT(m->dht);
+        kill_networking(m->net);
+        free(m);
+        return NULL;
+    }
+
+    net_crypto_set_coalescing(m->net_crypto, options->coalesce_packets);
+    /* Stays disabled where the don't fragment bit can't be set. */
+    net_crypto_set_pmtu_discovery(m->net_crypto, options->pmtu_discovery);
+
+    /* Typing notifications and call control are small and of little use late, send them on both paths. */
+    net_crypto_set_redundant_packet_id(m->net_crypto, PACKET_ID_TYPING, 1);
+    net_crypto_set_redundant_packet_id(m->net_crypto, PACKET_ID_MSI, 1);
+
     m->group_announce = new_gca_list();
 
     if (m->group_announce == NULL) {
@@ -1908,6 +1995,16 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         }
     }
 
+    /* Remember the nodes and relays that answer so that the next start can use the best ones, it
+     * works without it if this fails. */
+    m->node_cache = new_node_cache();
+    m->dht->node_cache = m->node_cache;
+    m->net_crypto->tcp_c->node_cache = m->node_cache;
+
+    /* Look the hostnames of bootstrap nodes and relays up in a thread, without it only IP addresses
+     * can be used. */
+    m->dns_resolver = new_dns_resolver(NULL, NULL);
+
     m->options = *options;
     friendreq_init(&(m->fr), m->fr_c);
     set_nospam(&(m->fr), random_int());
@@ -1938,6 +2035,8 @@ void kill_messenger(Messenger *m)
     kill_net_crypto(m->net_crypto);
     kill_DHT(m->dht);
     kill_networking(m->net);
+    kill_node_cache(m->node_cache);
+    kill_dns_resolver(m->dns_resolver);
 
     for (i = 0; i < m->numfriends; ++i) {
         clear_receipts(m, i);
@@ -2203,7 +2302,7 @@ static int handle_packet(void *object, int i, uint8_t *temp, uint16_t len)
 
             ft->transferred += file_data_length;
 
-            if (file_data_length && (ft->transferred >= ft->size || file_data_length != MAX_FILE_DATA_SIZE)) {
+            if (file_data_length && (ft->transferred >= ft->size || file_data_length < MAX_FILE_DATA_SIZE)) {
                 file_data_length = 0;
                 file_data = NULL;
                 position = ft->transferred;
@@ -2344,19 +2443,95 @@ static char *ID2String(const uint8_t *pk)
    TODO: A/V */
 #define MIN_RUN_INTERVAL 50
 
+/* return the unix_time() at which do_friends() next has something to do.
+ * return 0 if it has something to do on every call (online friends or friend requests to send).
+ */
+static uint64_t friends_deadline(const Messenger *m)
+{
+    uint64_t deadline = UINT64_MAX;
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        const Friend *f = &m->friendlist[i];
+
+        if (f->status == FRIEND_ONLINE || f->status == FRIEND_ADDED)
+            return 0;
+
+        if (f->status == FRIEND_REQUESTED)
+            deadline = MIN(deadline, f->friendrequest_lastsent + f->friendrequest_timeout + 1);
+    }
+
+    return deadline;
+}
+
+/* return the unix_time() at which task of do_messenger() next has something to do.
+ * return 0 if it has something to do on every call.
+ * return UINT64_MAX if it has nothing to do.
+ */
+static uint64_t task_deadline(const Messenger *m, unsigned int task)
+{
+    switch (task) {
+        case MESSENGER_TASK_DHT:
+            return m->options.udp_disabled ? UINT64_MAX : DHT_deadline(m->dht);
+
+        case MESSENGER_TASK_ONION_CLIENT:
+            return onion_client_deadline(m->onion_c);
+
+        case MESSENGER_TASK_FRIEND_CONNECTIONS:
+            return friend_connections_deadline(m->fr_c);
+
+        case MESSENGER_TASK_GROUPS:
+            /* Groups have no deadlines of their own, they run every time while there are any. */
+            return m->group_handler->num_chats != 0 ? 0 : UINT64_MAX;
+
+        case MESSENGER_TASK_GROUP_ANNOUNCES:
+            return gca_deadline(m->group_announce);
+
+        case MESSENGER_TASK_FRIENDS:
+            return friends_deadline(m);
+    }
+
+    return 0;
+}
+
+static _Bool task_due(const Messenger *m, unsigned int task)
+{
+    return task_deadline(m, task) <= unix_time();
+}
+
 /* Return the time in milliseconds before do_messenger() should be called again
- * for optimal performance.
+ * for optimal performance, this is the earliest deadline of its tasks.
  *
  * returns time (in ms) before the next do_messenger() needs to be run on success.
  */
 uint32_t messenger_run_interval(const Messenger *m)
 {
-    uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+    uint32_t interval = crypto_run_interval(m->net_crypto);
+    /* Packets of connections are only read in do_messenger(), keep polling for them. */
+    _Bool busy = m->net_crypto->crypto_connections_length != 0 || m->tcp_server != NULL;
+    unsigned int i;
+
+    for (i = 0; i < MESSENGER_NUM_TASKS; ++i) {
+        uint64_t deadline = task_deadline(m, i);
+
+        if (deadline == 0) {
+            busy = 1;
+            continue;
+        }
+
+        uint64_t until = unix_time_until(deadline);
+
+        if (until == 0)
+            return 0;
+
+        if (until < interval)
+            interval = until;
+    }
 
-    if (crypto_interval > MIN_RUN_INTERVAL) {
+    if (busy && interval > MIN_RUN_INTERVAL) {
         return MIN_RUN_INTERVAL;
     } else {
-        return crypto_interval;
+        return interval;
     }
 }
 
@@ -2384,6 +2559,8 @@ static void update_gc_friends_data(const Messenger *m)
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m)
 {
+    unix_time_update();
+
     // Add the TCP relays, but only if this is the first time calling do_messenger
     if (m->has_added_relays == 0) {
         m->has_added_relays = 1;
@@ -2394,6 +2571,24 @@ void do_messenger(Messenger *m)
             add_tcp_relay(m->net_crypto, m->loaded_relays[i].ip_port, m->loaded_relays[i].public_key);
         }
 
+        if (m->node_cache) {
+            /* Contact the best known nodes and relays all at once, the saved DHT nodes are only tried a few at a time. */
+            Node_format nodes[NODE_CACHE_BOOTSTRAP_NODES];
+            int num = node_cache_best(m->node_cache, NODE_CACHE_TYPE_TCP, nodes, NODE_CACHE_BOOTSTRAP_RELAYS);
+
+            for (i = 0; i < num; ++i) {
+                add_tcp_relay(m->net_crypto, nodes[i].ip_port, nodes[i].public_key);
+            }
+
+            if (!m->options.udp_disabled) {
+                num = node_cache_best(m->node_cache, NODE_CACHE_TYPE_DHT, nodes, NODE_CACHE_BOOTSTRAP_NODES);
+
+                for (i = 0; i < num; ++i) {
+                    DHT_bootstrap(m->dht, nodes[i].ip_port, nodes[i].public_key);
+                }
+            }
+        }
+
         if (m->tcp_server) {
             /* Add self tcp server. */
             IP_Port local_ip_port;
@@ -2404,10 +2599,17 @@ void do_messenger(Messenger *m)
         }
     }
 
-    unix_time_update();
+    if (m->dns_resolver) {
+        do_dns_resolver(m->dns_resolver);
+    }
+
+    networking_send_queue_begin(m->net);
 
     if (!m->options.udp_disabled) {
         networking_poll(m->net);
+    }
+
+    if (task_due(m, MESSENGER_TASK_DHT)) {
         do_DHT(m->dht);
     }
 
@@ -2416,14 +2618,33 @@ void do_messenger(Messenger *m)
     }
 
     do_net_crypto(m->net_crypto);
-    do_onion_client(m->onion_c);
-    do_friend_connections(m->fr_c);
-    do_gc(m->group_handler);
-    do_gca(m->group_announce);
-    do_friends(m);
+
+    if (task_due(m, MESSENGER_TASK_ONION_CLIENT)) {
+        do_onion_client(m->onion_c);
+    }
+
+    if (task_due(m, MESSENGER_TASK_FRIEND_CONNECTIONS)) {
+        do_friend_connections(m->fr_c);
+    }
+
+    if (task_due(m, MESSENGER_TASK_GROUPS)) {
+        do_gc(m->group_handler);
+    }
+
+    if (task_due(m, MESSENGER_TASK_GROUP_ANNOUNCES)) {
+        do_gca(m->group_announce);
+    }
+
+    if (task_due(m, MESSENGER_TASK_FRIENDS)) {
+        do_friends(m);
+    }
+
     update_gc_friends_data(m);
     connection_status_cb(m);
 
+    flush_coalesced_packets(m->net_crypto);
+    networking_send_queue_flush(m->net);
+
 #ifdef TOX_LOGGER
 
     if (unix_time() > lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
@@ -30,6 +30,7 @@
 #include "friend_connection.h"
 #include "group_chats.h"
 #include "group_announce.h"
+#include "dns_resolver.h"
 
 #define MAX_NAME_LENGTH 128
 /* TODO: this must depend on other variable. */
@@ -69,6 +70,12 @@ typedef struct {
     TCP_Proxy_Info proxy_info;
     uint16_t port_range[2];
     uint16_t tcp_server_port;
+    uint8_t congestion_control; /* One of CRYPTO_CONGESTION_* */
+    uint8_t coalesce_packets;
+    unsigned int handshake_workers;
+    unsigned int decrypt_workers;
+    uint8_t pmtu_discovery; /* One of CRYPTO_PMTU_* */
+    uint8_t multipath; /* One of CRYPTO_MULTIPATH_* */
 } Messenger_Options;
 
 
@@ -139,6 +146,7 @@ struct File_Transfers {
     uint32_t last_packet_number; /* number of the last packet sent. */
     uint64_t requested; /* total data requested by the request chunk callback */
     unsigned int slots_allocated; /* number of slots allocated to this transfer. */
+    uint16_t max_chunk_size; /* size of the biggest chunk requested. */
     uint8_t id[FILE_ID_LENGTH];
 };
 enum {
@@ -213,6 +221,16 @@ typedef struct {
     CONTACT_TYPE type;
 } Friend;
 
+/* The parts of do_messenger() that only run once they have something to do, see task_deadline(). */
+enum {
+    MESSENGER_TASK_DHT,
+    MESSENGER_TASK_ONION_CLIENT,
+    MESSENGER_TASK_FRIEND_CONNECTIONS,
+    MESSENGER_TASK_GROUPS,
+    MESSENGER_TASK_GROUP_ANNOUNCES,
+    MESSENGER_TASK_FRIENDS,
+    MESSENGER_NUM_TASKS
+};
 
 struct Messenger {
 
@@ -227,6 +245,8 @@ struct Messenger {
     Friend_Connections *fr_c;
 
     TCP_Server *tcp_server;
+    Node_Cache *node_cache; /* NULL if it couldn't be allocated. */
+    DNS_Resolver *dns_resolver; /* NULL if it couldn't be allocated. */
     Friend_Requests fr;
     uint8_t name[MAX_NAME_LENGTH];
     uint16_t name_length;
@@ -244,6 +264,7 @@ struct Messenger {
 
 #define NUM_SAVED_TCP_RELAYS 8
     uint8_t has_added_relays; // If the first connection has occurred in do_messenger
+
     Node_format loaded_relays[NUM_SAVED_TCP_RELAYS]; // Relays loaded from config
 
     void (*friend_message)(struct Messenger *m, uint32_t, unsigned int, const uint8_t *, size_t, void *);
@@ -369,6 +390,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Fill stats with the transport statistics of the connection to the friend.
+ *
+ *  return 1 if the friend is online and stats was filled.
+ *  return 0 if the friend is offline.
+ *  return -1 on failure.
+ */
+int m_get_friend_connection_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -694,6 +723,7 @@ void m_callback_msi_packet(Messenger *m, void (*function)(Messenger *m, uint32_t
                            void *userdata);
 
 /* Send an msi packet.
+ * It is queued with submit_cryptpacket() and sent by the next do_messenger().
  *
  *  return 1 on success
  *  return 0 on failure
@@ -717,6 +747,7 @@ void custom_lossy_packet_registerhandler(Messenger *m, void (*packet_handler_cal
         uint32_t friendnumber, const uint8_t *data, size_t len, void *object), void *object);
 
 /* High level function to send custom lossy packets.
+ * They are queued with submit_cryptpacket() and sent by the next do_messenger().
  *
  * return -1 if friend invalid.
  * return -2 if length wrong.
@@ -767,11 +798,13 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error);
  */
 void kill_messenger(Messenger *m);
 
-/* The main loop that needs to be run at least 20 times per second. */
+/* The main loop, run it again after messenger_run_interval() ms.
+ * Only the tasks whose deadline was reached are run.
+ */
 void do_messenger(Messenger *m);
 
 /* Return the time in milliseconds before do_messenger() should be called again
- * for optimal performance.
+ * for optimal performance, this is the earliest deadline of its tasks.
  *
  * returns time (in ms) before the next do_messenger() needs to be run on success.
  */
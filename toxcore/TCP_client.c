@@ -84,17 +84,14 @@ static int proxy_http_generate_connection_request(TCP_Client_Connection *TCP_con
     }
 
     const uint16_t port = ntohs(TCP_conn->ip_port.port);
-    const int written = snprintf((char *)TCP_conn->last_packet, MAX_PACKET_SIZE, "%s%s:%hu%s%s:%hu%s", one, ip, port, two,
-                                 ip, port, three);
+    char request[MAX_PACKET_SIZE + 1];
+    const int written = snprintf(request, sizeof(request), "%s%s:%hu%s%s:%hu%s", one, ip, port, two, ip, port, three);
 
     if (written < 0 || MAX_PACKET_SIZE < written) {
         return 0;
     }
 
-    TCP_conn->last_packet_length = written;
-    TCP_conn->last_packet_sent = 0;
-
-    return 1;
+    return tcp_send_queue_add(&TCP_conn->send_queue, (const uint8_t *)request, written, 0);
 }
 
 /* return 1 on success.
@@ -129,14 +126,17 @@ static int proxy_http_read_connection_response(TCP_Client_Connection *TCP_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_handshake(TCP_Client_Connection *TCP_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_handshake(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* number of authentication methods supported */
-    TCP_conn->last_packet[2] = 0; /* No authentication */
+    uint8_t packet[3];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* number of authentication methods supported */
+    packet[2] = 0; /* No authentication */
 
-    TCP_conn->last_packet_length = 3;
-    TCP_conn->last_packet_sent = 0;
+    return tcp_send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet), 0);
 }
 
 /* return 1 on success.
@@ -157,30 +157,33 @@ static int socks5_read_handshake_response(TCP_Client_Connection *TCP_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_connection_request(TCP_Client_Connection *TCP_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_connection_request(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* command code: establish a TCP/IP stream connection */
-    TCP_conn->last_packet[2] = 0; /* reserved, must be 0 */
+    uint8_t packet[4 + sizeof(IP6) + sizeof(uint16_t)];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* command code: establish a TCP/IP stream connection */
+    packet[2] = 0; /* reserved, must be 0 */
     uint16_t length = 3;
 
     if (TCP_conn->ip_port.ip.family == AF_INET) {
-        TCP_conn->last_packet[3] = 1; /* IPv4 address */
+        packet[3] = 1; /* IPv4 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
         length += sizeof(IP4);
     } else {
-        TCP_conn->last_packet[3] = 4; /* IPv6 address */
+        packet[3] = 4; /* IPv6 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
         length += sizeof(IP6);
     }
 
-    memcpy(TCP_conn->last_packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
+    memcpy(packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
     length += sizeof(uint16_t);
 
-    TCP_conn->last_packet_length = length;
-    TCP_conn->last_packet_sent = 0;
+    return tcp_send_queue_add(&TCP_conn->send_queue, packet, length, 0);
 }
 
 /* return 1 on success.
@@ -222,16 +225,18 @@ static int generate_handshake(TCP_Client_Connection *TCP_conn)
     crypto_box_keypair(plain, TCP_conn->temp_secret_key);
     random_nonce(TCP_conn->sent_nonce);
     memcpy(plain + crypto_box_PUBLICKEYBYTES, TCP_conn->sent_nonce, crypto_box_NONCEBYTES);
-    memcpy(TCP_conn->last_packet, TCP_conn->self_public_key, crypto_box_PUBLICKEYBYTES);
-    new_nonce(TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES);
-    int len = encrypt_data_symmetric(TCP_conn->shared_key, TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES, plain,
-                                     sizeof(plain), TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+    uint8_t packet[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(packet, TCP_conn->self_public_key, crypto_box_PUBLICKEYBYTES);
+    new_nonce(packet + crypto_box_PUBLICKEYBYTES);
+    int len = encrypt_data_symmetric(TCP_conn->shared_key, packet + crypto_box_PUBLICKEYBYTES, plain, sizeof(plain),
+                                     packet + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
 
     if (len != sizeof(plain) + crypto_box_MACBYTES)
         return -1;
 
-    TCP_conn->last_packet_length = crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + sizeof(plain) + crypto_box_MACBYTES;
-    TCP_conn->last_packet_sent = 0;
+    if (!tcp_send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet), 0))
+        return -1;
+
     return 0;
 }
 
@@ -255,107 +260,12 @@ static int handle_handshake(TCP_Client_Connection *TCP_conn, const uint8_t *data
     return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Client_Connection *con)
-{
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
-
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return -1;
-
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
-
-    con->last_packet_sent += len;
-    return -1;
-}
-
 /* return 0 if pending data was sent completely
  * return -1 if it wasn't
  */
 static int send_pending_data(TCP_Client_Connection *con)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
-
-    if (!new) {
-        return 0;
-    }
-
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
-
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
-    }
-
-    con->priority_queue_end = new;
-    return 1;
-}
-
-static void wipe_priority_list(TCP_Client_Connection *con)
-{
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
+    return tcp_send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -380,6 +290,12 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
 
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
 
+    /* Drop the packet before it uses up a nonce. */
+    if (!sendpriority && !tcp_send_queue_fits(&con->send_queue, sizeof(packet))) {
+        ++con->send_queue.dropped;
+        return 0;
+    }
+
     uint16_t c_length = htons(length + crypto_box_MACBYTES);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -400,7 +316,7 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
             return 1;
         }
 
-        return add_priority(con, packet, sizeof(packet), len);
+        return tcp_send_queue_add(&con->send_queue, packet, sizeof(packet), len);
     }
 
     len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
@@ -413,10 +329,8 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
     if ((unsigned int)len == sizeof(packet))
         return 1;
 
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
-    return 1;
+    /* The rest of a packet that was partly sent must always be queued. */
+    return tcp_send_queue_add(&con->send_queue, packet, sizeof(packet), len);
 }
 
 /* return 1 on success.
@@ -660,30 +574,34 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
     encrypt_precompute(temp->public_key, self_secret_key, temp->shared_key);
     temp->ip_port = ip_port;
     temp->proxy_info = *proxy_info;
+    tcp_send_queue_init(&temp->send_queue, TCP_SEND_QUEUE_MAX_BYTES);
+
+    int ret = -1;
 
     switch (proxy_info->proxy_type) {
         case TCP_PROXY_HTTP:
             temp->status = TCP_CLIENT_PROXY_HTTP_CONNECTING;
-            proxy_http_generate_connection_request(temp);
+            ret = proxy_http_generate_connection_request(temp) ? 0 : -1;
             break;
 
         case TCP_PROXY_SOCKS5:
             temp->status = TCP_CLIENT_PROXY_SOCKS5_CONNECTING;
-            proxy_socks5_generate_handshake(temp);
+            ret = proxy_socks5_generate_handshake(temp) ? 0 : -1;
             break;
 
         case TCP_PROXY_NONE:
             temp->status = TCP_CLIENT_CONNECTING;
-
-            if (generate_handshake(temp) == -1) {
-                kill_sock(sock);
-                free(temp);
-                return NULL;
-            }
-
+            ret = generate_handshake(temp);
             break;
     }
 
+    if (ret == -1) {
+        tcp_send_queue_free(&temp->send_queue);
+        kill_sock(sock);
+        free(temp);
+        return NULL;
+    }
+
     temp->kill_at = unix_time() + TCP_CONNECTION_TIMEOUT;
 
     return temp;
@@ -960,7 +878,7 @@ void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
     if (TCP_connection == NULL)
         return;
 
-    wipe_priority_list(TCP_connection);
+    tcp_send_queue_free(&TCP_connection->send_queue);
     kill_sock(TCP_connection->sock);
     sodium_memzero(TCP_connection, sizeof(TCP_Client_Connection));
     free(TCP_connection);
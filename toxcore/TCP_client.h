@@ -64,11 +64,7 @@ typedef struct  {
 
     uint8_t temp_secret_key[crypto_box_SECRETKEYBYTES];
 
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t kill_at;
 
@@ -28,6 +28,7 @@
 #include "TCP_connection.h"
 #include "util.h"
 #include "TCP_client.h"
+#include "node_cache.h"
 
 /* Set the size of the array to num.
  *
@@ -720,6 +721,15 @@ int kill_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections_number
     return wipe_tcp_connection(tcp_c, tcp_connections_number);
 }
 
+/* Note that a connection to the relay of tcp_con was just started. */
+static void tcp_relay_connecting(TCP_Connections *tcp_c, TCP_con *tcp_con)
+{
+    tcp_con->connect_start = current_time_monotonic();
+
+    if (tcp_c->node_cache)
+        node_cache_attempt(tcp_c->node_cache, NODE_CACHE_TYPE_TCP, tcp_con->connection->public_key);
+}
+
 static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections_number)
 {
     TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_connections_number);
@@ -742,6 +752,8 @@ static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connec
         return -1;
     }
 
+    tcp_relay_connecting(tcp_c, tcp_con);
+
     unsigned int i;
 
     for (i = 0; i < tcp_c->connections_length; ++i) {
@@ -827,6 +839,7 @@ static int unsleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connecti
         return -1;
     }
 
+    tcp_relay_connecting(tcp_c, tcp_con);
     tcp_con->lock_count = 0;
     tcp_con->sleep_count = 0;
     tcp_con->connected_time = 0;
@@ -1036,6 +1049,14 @@ static int tcp_relay_on_online(TCP_Connections *tcp_c, int tcp_connections_numbe
     tcp_relay_set_callbacks(tcp_c, tcp_connections_number);
     tcp_con->status = TCP_CONN_CONNECTED;
 
+    if (tcp_c->node_cache) {
+        Node_format relay;
+        memcpy(relay.public_key, tcp_con->connection->public_key, crypto_box_PUBLICKEYBYTES);
+        relay.ip_port = tcp_con->connection->ip_port;
+        node_cache_success(tcp_c->node_cache, NODE_CACHE_TYPE_TCP, &relay,
+                           current_time_monotonic() - tcp_con->connect_start);
+    }
+
     /* If this connection isn't used by any connection, we don't need to wait for them to come online. */
     if (sent) {
         tcp_con->connected_time = unix_time();
@@ -1076,6 +1097,7 @@ static int add_tcp_relay_instance(TCP_Connections *tcp_c, IP_Port ip_port, const
     if (!tcp_con->connection)
         return -1;
 
+    tcp_relay_connecting(tcp_c, tcp_con);
     tcp_con->status = TCP_CONN_VALID;
 
     return tcp_connections_number;
@@ -69,6 +69,7 @@ typedef struct {
     uint8_t status;
     TCP_Client_Connection *connection;
     uint64_t connected_time;
+    uint64_t connect_start; /* current_time_monotonic() at which the connection to the relay was started. */
     uint32_t lock_count;
     uint32_t sleep_count;
     _Bool onion;
@@ -105,6 +106,9 @@ typedef struct {
 
     _Bool onion_status;
     uint16_t onion_num_conns;
+
+    /* Records which relays we could connect to, NULL if not kept. Not owned by the TCP_Connections. */
+    Node_Cache *node_cache;
 } TCP_Connections;
 
 
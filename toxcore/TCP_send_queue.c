@@ -0,0 +1,226 @@
+/* TCP_send_queue.c
+ *
+ * Queue of the bytes a TCP connection could not send yet
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "TCP_send_queue.h"
+#include "TCP_server.h"
+
+#if !(defined(_WIN32) || defined(__WIN32__) || defined (WIN32))
+#include <sys/uio.h>
+#endif
+
+#if TCP_SEND_QUEUE_BUFFER_SIZE < 2 + MAX_PACKET_SIZE
+#error "TCP_SEND_QUEUE_BUFFER_SIZE must fit the largest TCP packet"
+#endif
+
+#define MIN_CAPACITY 4
+
+/* Number of buffers that keep their memory once the queue is empty. */
+#define POOL_SIZE 2
+
+/* Maximum number of buffers passed to one sendmsg(). */
+#define MAX_IOV 64
+
+void tcp_send_queue_init(TCP_Send_Queue *queue, uint32_t max_bytes)
+{
+    memset(queue, 0, sizeof(TCP_Send_Queue));
+    queue->max_bytes = max_bytes;
+}
+
+void tcp_send_queue_free(TCP_Send_Queue *queue)
+{
+    uint32_t i;
+
+    for (i = 0; i < queue->capacity; ++i)
+        free(queue->buffers[i].data);
+
+    free(queue->buffers);
+    queue->buffers = NULL;
+    queue->capacity = 0;
+    queue->start = 0;
+    queue->count = 0;
+    queue->bytes = 0;
+}
+
+int tcp_send_queue_fits(const TCP_Send_Queue *queue, uint16_t length)
+{
+    if (queue->max_bytes == 0)
+        return 1;
+
+    return queue->bytes + length <= queue->max_bytes;
+}
+
+/* Double the size of the ring, the used buffers are moved to the start of the new ring
+ * followed by the unused ones so that their memory is not lost.
+ *
+ * return 1 on success.
+ * return 0 on failure.
+ */
+static int grow(TCP_Send_Queue *queue)
+{
+    uint32_t new_capacity = queue->capacity ? queue->capacity * 2 : MIN_CAPACITY;
+    TCP_Send_Buffer *buffers = calloc(new_capacity, sizeof(TCP_Send_Buffer));
+
+    if (buffers == NULL)
+        return 0;
+
+    uint32_t i;
+
+    for (i = 0; i < queue->capacity; ++i)
+        buffers[i] = queue->buffers[(queue->start + i) & (queue->capacity - 1)];
+
+    free(queue->buffers);
+    queue->buffers = buffers;
+    queue->capacity = new_capacity;
+    queue->start = 0;
+    return 1;
+}
+
+int tcp_send_queue_add(TCP_Send_Queue *queue, const uint8_t *packet, uint16_t length, uint16_t sent)
+{
+    if (sent >= length)
+        return 1;
+
+    packet += sent;
+    length -= sent;
+
+    if (queue->count != 0) {
+        TCP_Send_Buffer *last = &queue->buffers[(queue->start + queue->count - 1) & (queue->capacity - 1)];
+
+        if (last->size + length <= TCP_SEND_QUEUE_BUFFER_SIZE) {
+            memcpy(last->data + last->size, packet, length);
+            last->size += length;
+            queue->bytes += length;
+            return 1;
+        }
+    }
+
+    if (queue->count == queue->capacity && !grow(queue))
+        return 0;
+
+    TCP_Send_Buffer *buffer = &queue->buffers[(queue->start + queue->count) & (queue->capacity - 1)];
+
+    if (buffer->data == NULL) {
+        buffer->data = malloc(TCP_SEND_QUEUE_BUFFER_SIZE);
+
+        if (buffer->data == NULL)
+            return 0;
+    }
+
+    memcpy(buffer->data, packet, length);
+    buffer->size = length;
+    buffer->sent = 0;
+    ++queue->count;
+    queue->bytes += length;
+    return 1;
+}
+
+/* Remove length sent bytes from the front of the queue. */
+static void consume(TCP_Send_Queue *queue, uint32_t length)
+{
+    while (length != 0) {
+        TCP_Send_Buffer *buffer = &queue->buffers[queue->start];
+        uint16_t left = buffer->size - buffer->sent;
+
+        if (length < left) {
+            buffer->sent += length;
+            queue->bytes -= length;
+            return;
+        }
+
+        length -= left;
+        queue->bytes -= left;
+        buffer->size = 0;
+        buffer->sent = 0;
+        queue->start = (queue->start + 1) & (queue->capacity - 1);
+        --queue->count;
+    }
+}
+
+/* Free the memory of all but POOL_SIZE buffers of an empty queue so that one burst
+ * doesn't keep the memory of a connection high for the rest of its life.
+ */
+static void trim(TCP_Send_Queue *queue)
+{
+    uint32_t i, kept = 0;
+
+    for (i = 0; i < queue->capacity; ++i) {
+        if (queue->buffers[i].data == NULL)
+            continue;
+
+        if (kept < POOL_SIZE) {
+            ++kept;
+        } else {
+            free(queue->buffers[i].data);
+            queue->buffers[i].data = NULL;
+        }
+    }
+}
+
+int tcp_send_queue_flush(TCP_Send_Queue *queue, sock_t sock)
+{
+    if (queue->count == 0)
+        return 0;
+
+    while (queue->count != 0) {
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+        TCP_Send_Buffer *buffer = &queue->buffers[queue->start];
+        uint32_t left = buffer->size - buffer->sent;
+        int len = send(sock, (const char *)buffer->data + buffer->sent, left, MSG_NOSIGNAL);
+#else
+        struct iovec iov[MAX_IOV];
+        uint32_t i, num = queue->count < MAX_IOV ? queue->count : MAX_IOV, left = 0;
+
+        for (i = 0; i < num; ++i) {
+            TCP_Send_Buffer *buffer = &queue->buffers[(queue->start + i) & (queue->capacity - 1)];
+            iov[i].iov_base = buffer->data + buffer->sent;
+            iov[i].iov_len = buffer->size - buffer->sent;
+            left += iov[i].iov_len;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num;
+
+        /* sendmsg() instead of writev() because writev() can't be told not to raise SIGPIPE. */
+        ssize_t len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+
+        if (len <= 0)
+            return -1;
+
+        consume(queue, len);
+
+        if ((uint32_t)len != left)
+            return -1;
+    }
+
+    if (queue->capacity > POOL_SIZE)
+        trim(queue);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* TCP_send_queue.h
+ *
+ * Queue of the bytes a TCP connection could not send yet
+ * -The bytes are kept in a ring of fixed size buffers that are reused instead of freed
+ * -Small packets are packed into the same buffer and a whole ring is flushed with one system call
+ * -The number of queued bytes can be capped, packets that would go over the cap are dropped
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TCP_SEND_QUEUE_H
+#define TCP_SEND_QUEUE_H
+
+#include "network.h"
+
+/* Size of each buffer, must fit the largest packet written to a TCP connection. */
+#define TCP_SEND_QUEUE_BUFFER_SIZE 4096
+
+/* Default maximum number of bytes queued on one connection. */
+#define TCP_SEND_QUEUE_MAX_BYTES (64 * 1024)
+
+typedef struct {
+    uint8_t *data; /* Kept when the buffer is emptied so that it can be reused. */
+    uint16_t size; /* Number of bytes in data. */
+    uint16_t sent; /* Number of bytes of data that were already sent. */
+} TCP_Send_Buffer;
+
+typedef struct {
+    TCP_Send_Buffer *buffers; /* Ring of capacity buffers, the count used ones start at start. */
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t count;
+
+    uint32_t bytes; /* Number of bytes not sent yet. */
+    uint32_t max_bytes; /* 0 for no limit. */
+    uint64_t dropped; /* Number of packets that were dropped because the queue was full. */
+} TCP_Send_Queue;
+
+/* Initialize an empty queue that holds at most max_bytes bytes, 0 for no limit.
+ */
+void tcp_send_queue_init(TCP_Send_Queue *queue, uint32_t max_bytes);
+
+/* Free all the buffers of the queue.
+ */
+void tcp_send_queue_free(TCP_Send_Queue *queue);
+
+/* return 1 if a packet of length bytes can be added without going over the limit.
+ * return 0 if it can't.
+ */
+int tcp_send_queue_fits(const TCP_Send_Queue *queue, uint16_t length);
+
+/* Add the part of the length bytes long packet that wasn't sent yet to the end of the queue.
+ * The limit is not checked, use tcp_send_queue_fits() first.
+ *
+ * return 1 on success.
+ * return 0 on failure (only if malloc fails).
+ */
+int tcp_send_queue_add(TCP_Send_Queue *queue, const uint8_t *packet, uint16_t length, uint16_t sent);
+
+/* Send as much of the queue on sock as it accepts.
+ *
+ * return 0 if the queue is empty.
+ * return -1 if some data could not be sent.
+ */
+int tcp_send_queue_flush(TCP_Send_Queue *queue, sock_t sock);
+
+#endif
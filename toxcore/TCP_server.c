@@ -30,8 +30,170 @@
 #include <sys/ioctl.h>
 #endif
 
+#ifdef TCP_SERVER_USE_WORKERS
+#include <sys/eventfd.h>
+#endif
+
 #include "util.h"
 
+/* Longest a worker waits for events before it pings its connections, in milliseconds. */
+#define TCP_WORKER_WAIT_TIMEOUT 500
+
+enum {
+    TCP_HANDOFF_LINK, /* Sender wants to be routed to target. */
+    TCP_HANDOFF_LINKED, /* Target accepted the link request of the sender. */
+    TCP_HANDOFF_UNLINK, /* Sender is no longer routed to target. */
+    TCP_HANDOFF_DATA, /* Packet routed from sender to target. */
+    TCP_HANDOFF_OOB, /* OOB packet from sender to target. */
+    TCP_HANDOFF_KILL, /* Target connected to another worker. */
+    TCP_HANDOFF_ONION_REQUEST, /* Onion request from a connection of a worker, sent to the parent. */
+    TCP_HANDOFF_ONION_RESPONSE, /* Onion response for the connection with index and identifier. */
+};
+
+/* Message passed from one worker to another through the handoff queue of the receiver,
+ * the receiver frees it.
+ *
+ * Connections are looked up by public key on the receiving side, a link between two
+ * connections on different workers is only used if both ends still point to each other.
+ */
+typedef struct {
+    Mpsc_Node node;
+    uint8_t type;
+    uint16_t sender_worker;
+    uint8_t target_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t target_id;
+    uint8_t sender_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t sender_id;
+    uint32_t index;
+    uint64_t identifier;
+    uint16_t length;
+    uint8_t data[];
+} TCP_Handoff;
+
+/* Stats are read by other threads with TCP_server_stats() but only written by the thread
+ * running the server, so a plain read followed by an atomic store is enough.
+ */
+static void stat_add(uint64_t *stat, uint64_t value)
+{
+    atomic_store_u64(stat, *stat + value, ATOMIC_RELAXED);
+}
+
+static void stat_set(uint64_t *stat, uint64_t value)
+{
+    atomic_store_u64(stat, value, ATOMIC_RELAXED);
+}
+
+/* return new message with length bytes of data on success.
+ * return NULL on failure.
+ */
+static TCP_Handoff *new_handoff(uint8_t type, const uint8_t *data, uint16_t length)
+{
+    TCP_Handoff *handoff = calloc(1, sizeof(TCP_Handoff) + length);
+
+    if (handoff == NULL)
+        return NULL;
+
+    handoff->type = type;
+    handoff->length = length;
+
+    if (length)
+        memcpy(handoff->data, data, length);
+
+    return handoff;
+}
+
+/* Push handoff to the queue of worker and wake it up if it isn't already being woken up.
+ */
+static void post_handoff(TCP_Server *worker, TCP_Handoff *handoff)
+{
+    mpsc_queue_push(&worker->handoff_queue, &handoff->node);
+
+#ifdef TCP_SERVER_USE_WORKERS
+
+    if (atomic_exchange_u8(&worker->wake_pending, 1, ATOMIC_SEQ_CST) == 0) {
+        uint64_t one = 1;
+
+        if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* Only fails if the counter would overflow, the worker is woken up anyway. */
+        }
+    }
+
+#endif
+}
+
+/* Send a message from the worker TCP_server to the connection with target_public_key on worker.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int send_handoff(TCP_Server *TCP_server, uint16_t worker, uint8_t type, const uint8_t *target_public_key,
+                        uint8_t target_id, const uint8_t *sender_public_key, uint8_t sender_id, const uint8_t *data, uint16_t length)
+{
+    if (TCP_server->parent == NULL || worker >= TCP_server->parent->num_workers)
+        return -1;
+
+    TCP_Handoff *handoff = new_handoff(type, data, length);
+
+    if (handoff == NULL)
+        return -1;
+
+    handoff->sender_worker = TCP_server->worker_id;
+    memcpy(handoff->target_public_key, target_public_key, crypto_box_PUBLICKEYBYTES);
+    handoff->target_id = target_id;
+    memcpy(handoff->sender_public_key, sender_public_key, crypto_box_PUBLICKEYBYTES);
+    handoff->sender_id = sender_id;
+    post_handoff(TCP_server->parent->workers[worker], handoff);
+    stat_add(&TCP_server->stats.handoffs_sent, 1);
+    return 0;
+}
+
+/* return worker holding the connection with public_key.
+ * return -1 if no worker has it.
+ */
+static int directory_find(TCP_Server *parent, const uint8_t *public_key)
+{
+    pthread_mutex_lock(&parent->directory_mutex);
+    int worker = hash_map_find(&parent->directory, public_key);
+    pthread_mutex_unlock(&parent->directory_mutex);
+    return worker;
+}
+
+/* Record that the worker TCP_server holds the connection with public_key and tell the
+ * worker that held it before to kill its connection.
+ */
+static void directory_add(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Server *parent = TCP_server->parent;
+
+    pthread_mutex_lock(&parent->directory_mutex);
+    int worker = hash_map_find(&parent->directory, public_key);
+
+    if (worker != TCP_server->worker_id) {
+        if (worker != -1)
+            hash_map_remove(&parent->directory, public_key, worker);
+
+        hash_map_add(&parent->directory, public_key, TCP_server->worker_id);
+    }
+
+    pthread_mutex_unlock(&parent->directory_mutex);
+
+    if (worker != -1 && worker != TCP_server->worker_id) {
+        send_handoff(TCP_server, worker, TCP_HANDOFF_KILL, public_key, 0, public_key, 0, NULL, 0);
+    }
+}
+
+/* Forget that the worker TCP_server holds the connection with public_key, does nothing if
+ * another worker took it over.
+ */
+static void directory_remove(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Server *parent = TCP_server->parent;
+
+    pthread_mutex_lock(&parent->directory_mutex);
+    hash_map_remove(&parent->directory, public_key, TCP_server->worker_id);
+    pthread_mutex_unlock(&parent->directory_mutex);
+}
+
 /* return 1 on success
  * return 0 on failure
  */
@@ -99,7 +261,7 @@ static int realloc_connection(TCP_Server *TCP_server, uint32_t num)
  */
 static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t *public_key)
 {
-    return bs_list_find(&TCP_server->accepted_key_list, public_key);
+    return hash_map_find(&TCP_server->accepted_key_list, public_key);
 }
 
 
@@ -140,7 +302,7 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         return -1;
     }
 
-    if (!bs_list_add(&TCP_server->accepted_key_list, con->public_key, index))
+    if (!hash_map_add(&TCP_server->accepted_key_list, con->public_key, index))
         return -1;
 
     memcpy(&TCP_server->accepted_connection_array[index], con, sizeof(TCP_Secure_Connection));
@@ -149,7 +311,14 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
     TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
     TCP_server->accepted_connection_array[index].last_pinged = unix_time();
     TCP_server->accepted_connection_array[index].ping_id = 0;
+    tcp_send_queue_init(&TCP_server->accepted_connection_array[index].send_queue,
+                        atomic_load_u32(&TCP_server->send_queue_max_bytes, ATOMIC_RELAXED));
+
+    if (TCP_server->parent)
+        directory_add(TCP_server, con->public_key);
 
+    stat_add(&TCP_server->stats.connections_accepted, 1);
+    stat_set(&TCP_server->stats.connections, TCP_server->num_accepted_connections);
     return index;
 }
 
@@ -166,11 +335,17 @@ static int del_accepted(TCP_Server *TCP_server, int index)
     if (TCP_server->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS)
         return -1;
 
-    if (!bs_list_remove(&TCP_server->accepted_key_list, TCP_server->accepted_connection_array[index].public_key, index))
+    if (!hash_map_remove(&TCP_server->accepted_key_list, TCP_server->accepted_connection_array[index].public_key, index))
         return -1;
 
+    if (TCP_server->parent)
+        directory_remove(TCP_server, TCP_server->accepted_connection_array[index].public_key);
+
+    stat_add(&TCP_server->stats.packets_dropped, TCP_server->accepted_connection_array[index].send_queue.dropped);
+    tcp_send_queue_free(&TCP_server->accepted_connection_array[index].send_queue);
     sodium_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
+    stat_set(&TCP_server->stats.connections, TCP_server->num_accepted_connections);
 
     if (TCP_server->num_accepted_connections == 0)
         realloc_connection(TCP_server, 0);
@@ -289,96 +464,12 @@ int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length,
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
-{
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
-
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return -1;
-
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
-
-    con->last_packet_sent += len;
-    return -1;
-
-}
-
 /* return 0 if pending data was sent completely
  * return -1 if it wasn't
  */
 static int send_pending_data(TCP_Secure_Connection *con)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
-
-    if (!new) {
-        return 0;
-    }
-
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
-
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
-    }
-
-    con->priority_queue_end = new;
-    return 1;
+    return tcp_send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -403,6 +494,12 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
 
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
 
+    /* Drop the packet before it uses up a nonce. */
+    if (!sendpriority && !tcp_send_queue_fits(&con->send_queue, sizeof(packet))) {
+        ++con->send_queue.dropped;
+        return 0;
+    }
+
     uint16_t c_length = htons(length + crypto_box_MACBYTES);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -423,7 +520,7 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
             return 1;
         }
 
-        return add_priority(con, packet, sizeof(packet), len);
+        return tcp_send_queue_add(&con->send_queue, packet, sizeof(packet), len);
     }
 
     len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
@@ -436,10 +533,8 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
     if ((unsigned int)len == sizeof(packet))
         return 1;
 
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
-    return 1;
+    /* The rest of a packet that was partly sent must always be queued. */
+    return tcp_send_queue_add(&con->send_queue, packet, sizeof(packet), len);
 }
 
 /* Kill a TCP_Secure_Connection
@@ -447,6 +542,7 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
 static void kill_TCP_connection(TCP_Secure_Connection *con)
 {
     kill_sock(con->sock);
+    tcp_send_queue_free(&con->send_queue);
     sodium_memzero(con, sizeof(TCP_Secure_Connection));
 }
 
@@ -573,6 +669,50 @@ static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
     return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
 }
 
+/* Link connection number index of the connection con_id to the connection it wants to be
+ * routed to if that one also wants to be routed to it.
+ */
+static void link_connection(TCP_Server *TCP_server, uint32_t con_id, uint32_t index)
+{
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
+    const uint8_t *public_key = con->connections[index].public_key;
+    uint32_t i;
+    int other_index = get_TCP_connection_index(TCP_server, public_key);
+
+    if (other_index != -1) {
+        uint32_t other_id = ~0;
+        TCP_Secure_Connection *other_conn = &TCP_server->accepted_connection_array[other_index];
+
+        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+            if (other_conn->connections[i].status == 1
+                    && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
+                other_id = i;
+                break;
+            }
+        }
+
+        if (other_id != (uint32_t)~0) {
+            con->connections[index].status = 2;
+            con->connections[index].index = other_index;
+            con->connections[index].other_id = other_id;
+            con->connections[index].worker = TCP_server->worker_id;
+            other_conn->connections[other_id].status = 2;
+            other_conn->connections[other_id].index = con_id;
+            other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].worker = TCP_server->worker_id;
+            //TODO: return values?
+            send_connect_notification(con, index);
+            send_connect_notification(other_conn, other_id);
+        }
+    } else if (TCP_server->parent) {
+        int worker = directory_find(TCP_server->parent, public_key);
+
+        if (worker != -1 && worker != TCP_server->worker_id) {
+            send_handoff(TCP_server, worker, TCP_HANDOFF_LINK, public_key, 0, con->public_key, index, NULL, 0);
+        }
+    }
+}
+
 /* return 0 on success.
  * return -1 on failure (connection must be killed).
  */
@@ -621,33 +761,7 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
 
     con->connections[index].status = 1;
     memcpy(con->connections[index].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-    int other_index = get_TCP_connection_index(TCP_server, public_key);
-
-    if (other_index != -1) {
-        uint32_t other_id = ~0;
-        TCP_Secure_Connection *other_conn = &TCP_server->accepted_connection_array[other_index];
-
-        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-            if (other_conn->connections[i].status == 1
-                    && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
-                other_id = i;
-                break;
-            }
-        }
-
-        if (other_id != (uint32_t)~0) {
-            con->connections[index].status = 2;
-            con->connections[index].index = other_index;
-            con->connections[index].other_id = other_id;
-            other_conn->connections[other_id].status = 2;
-            other_conn->connections[other_id].index = con_id;
-            other_conn->connections[other_id].other_id = index;
-            //TODO: return values?
-            send_connect_notification(con, index);
-            send_connect_notification(other_conn, other_id);
-        }
-    }
-
+    link_connection(TCP_server, con_id, index);
     return 0;
 }
 
@@ -671,6 +785,12 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
         memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, data, length);
         write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[other_index], resp_packet,
                                            sizeof(resp_packet), 0);
+    } else if (TCP_server->parent) {
+        int worker = directory_find(TCP_server->parent, public_key);
+
+        if (worker != -1 && worker != TCP_server->worker_id) {
+            send_handoff(TCP_server, worker, TCP_HANDOFF_OOB, public_key, 0, con->public_key, 0, data, length);
+        }
     }
 
     return 0;
@@ -690,7 +810,10 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].worker != TCP_server->worker_id) {
+            send_handoff(TCP_server, con->connections[con_number].worker, TCP_HANDOFF_UNLINK,
+                         con->connections[con_number].public_key, other_id, con->public_key, con_number, NULL, 0);
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= TCP_server->size_accepted_connections)
                 return -1;
@@ -704,6 +827,7 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
 
         con->connections[con_number].index = 0;
         con->connections[con_number].other_id = 0;
+        con->connections[con_number].worker = 0;
         con->connections[con_number].status = 0;
         return 0;
     } else {
@@ -711,17 +835,18 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
     }
 }
 
-static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+/* return 0 if the onion response was sent to the connection with index and identifier.
+ * return 1 if it wasn't.
+ */
+static int write_onion_response(TCP_Server *TCP_server, uint32_t index, uint64_t identifier, const uint8_t *data,
+                                uint16_t length)
 {
-    TCP_Server *TCP_server = object;
-    uint32_t index = dest.ip.ip6.uint32[0];
-
     if (index >= TCP_server->size_accepted_connections)
         return 1;
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
 
-    if (con->identifier != dest.ip.ip6.uint64[1])
+    if (con->identifier != identifier)
         return 1;
 
     uint8_t packet[1 + length];
@@ -734,6 +859,32 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
+static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *TCP_server = object;
+    uint32_t index = dest.ip.ip6.uint32[0];
+
+    if (TCP_server->num_workers) {
+        /* Called from the thread running do_TCP_server(), the connection belongs to a worker. */
+        uint32_t worker = dest.ip.ip6.uint32[1];
+
+        if (worker >= TCP_server->num_workers)
+            return 1;
+
+        TCP_Handoff *handoff = new_handoff(TCP_HANDOFF_ONION_RESPONSE, data, length);
+
+        if (handoff == NULL)
+            return 1;
+
+        handoff->index = index;
+        handoff->identifier = dest.ip.ip6.uint64[1];
+        post_handoff(TCP_server->workers[worker], handoff);
+        return 0;
+    }
+
+    return write_onion_response(TCP_server, index, dest.ip.ip6.uint64[1], data, length);
+}
+
 /* return 0 on success
  * return -1 on failure
  */
@@ -808,6 +959,20 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
                 if (length <= 1 + crypto_box_NONCEBYTES + ONION_SEND_BASE * 2)
                     return -1;
 
+                if (TCP_server->parent) {
+                    /* The onion is not thread safe, the parent sends the request. */
+                    TCP_Handoff *handoff = new_handoff(TCP_HANDOFF_ONION_REQUEST, data + 1, length - 1);
+
+                    if (handoff == NULL)
+                        return 0;
+
+                    handoff->sender_worker = TCP_server->worker_id;
+                    handoff->index = con_id;
+                    handoff->identifier = con->identifier;
+                    mpsc_queue_push(&TCP_server->parent->onion_queue, &handoff->node);
+                    return 0;
+                }
+
                 IP_Port source;
                 source.port = 0;  // dummy initialise
                 source.ip.family = TCP_ONION_FAMILY;
@@ -840,6 +1005,15 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             if (con->connections[c_id].status != 2)
                 return 0;
 
+            if (con->connections[c_id].worker != TCP_server->worker_id) {
+                if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
+                    return -1;
+
+                send_handoff(TCP_server, con->connections[c_id].worker, TCP_HANDOFF_DATA, con->connections[c_id].public_key,
+                             con->connections[c_id].other_id, con->public_key, c_id, data, length);
+                return 0;
+            }
+
             uint32_t index = con->connections[c_id].index;
             uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
             uint8_t new_data[length];
@@ -850,6 +1024,7 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             if (ret == -1)
                 return -1;
 
+            stat_add(&TCP_server->stats.packets_routed, 1);
             return 0;
         }
     }
@@ -858,6 +1033,152 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
 }
 
 
+#ifdef TCP_SERVER_USE_EPOLL
+/* return 1 if connection number id of con is routed to connection number other_id of the
+ * connection with public_key on worker.
+ * return 0 if it isn't.
+ */
+static _Bool is_linked(const TCP_Secure_Connection *con, uint8_t id, const uint8_t *public_key, uint16_t worker,
+                       uint8_t other_id)
+{
+    if (id >= NUM_CLIENT_CONNECTIONS)
+        return 0;
+
+    return con->connections[id].status == 2 && con->connections[id].worker == worker
+           && con->connections[id].other_id == other_id
+           && public_key_cmp(con->connections[id].public_key, public_key) == 0;
+}
+
+/* return 0 if the message from another worker was delivered.
+ * return -1 if it wasn't.
+ */
+static int handle_handoff(TCP_Server *TCP_server, TCP_Handoff *handoff)
+{
+    if (handoff->type == TCP_HANDOFF_ONION_RESPONSE) {
+        if (write_onion_response(TCP_server, handoff->index, handoff->identifier, handoff->data, handoff->length) != 0)
+            return -1;
+
+        return 0;
+    }
+
+    int con_id = get_TCP_connection_index(TCP_server, handoff->target_public_key);
+
+    if (con_id == -1)
+        return -1;
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
+    uint8_t id = handoff->target_id;
+
+    switch (handoff->type) {
+        case TCP_HANDOFF_LINK: {
+            uint32_t i;
+
+            for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+                if (con->connections[i].status == 1
+                        && public_key_cmp(con->connections[i].public_key, handoff->sender_public_key) == 0) {
+                    break;
+                }
+            }
+
+            if (i == NUM_CLIENT_CONNECTIONS)
+                return -1;
+
+            con->connections[i].status = 2;
+            con->connections[i].index = 0;
+            con->connections[i].other_id = handoff->sender_id;
+            con->connections[i].worker = handoff->sender_worker;
+            send_connect_notification(con, i);
+            return send_handoff(TCP_server, handoff->sender_worker, TCP_HANDOFF_LINKED, handoff->sender_public_key,
+                                handoff->sender_id, con->public_key, i, NULL, 0);
+        }
+
+        case TCP_HANDOFF_LINKED: {
+            if (is_linked(con, id, handoff->sender_public_key, handoff->sender_worker, handoff->sender_id))
+                return 0;
+
+            if (id >= NUM_CLIENT_CONNECTIONS || con->connections[id].status != 1
+                    || public_key_cmp(con->connections[id].public_key, handoff->sender_public_key) != 0) {
+                /* The connection that asked for the link is gone, undo the other side. */
+                send_handoff(TCP_server, handoff->sender_worker, TCP_HANDOFF_UNLINK, handoff->sender_public_key,
+                             handoff->sender_id, con->public_key, id, NULL, 0);
+                return -1;
+            }
+
+            con->connections[id].status = 2;
+            con->connections[id].index = 0;
+            con->connections[id].other_id = handoff->sender_id;
+            con->connections[id].worker = handoff->sender_worker;
+            send_connect_notification(con, id);
+            return 0;
+        }
+
+        case TCP_HANDOFF_UNLINK: {
+            if (!is_linked(con, id, handoff->sender_public_key, handoff->sender_worker, handoff->sender_id))
+                return -1;
+
+            con->connections[id].status = 1;
+            con->connections[id].index = 0;
+            con->connections[id].other_id = 0;
+            con->connections[id].worker = 0;
+            send_disconnect_notification(con, id);
+
+            /* The other side may already have reconnected to another worker. */
+            link_connection(TCP_server, con_id, id);
+            return 0;
+        }
+
+        case TCP_HANDOFF_DATA: {
+            if (!is_linked(con, id, handoff->sender_public_key, handoff->sender_worker, handoff->sender_id))
+                return -1;
+
+            handoff->data[0] = id + NUM_RESERVED_PORTS;
+            write_packet_TCP_secure_connection(con, handoff->data, handoff->length, 0);
+            return 0;
+        }
+
+        case TCP_HANDOFF_OOB: {
+            uint8_t resp_packet[1 + crypto_box_PUBLICKEYBYTES + handoff->length];
+            resp_packet[0] = TCP_PACKET_OOB_RECV;
+            memcpy(resp_packet + 1, handoff->sender_public_key, crypto_box_PUBLICKEYBYTES);
+            memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, handoff->data, handoff->length);
+            write_packet_TCP_secure_connection(con, resp_packet, sizeof(resp_packet), 0);
+            return 0;
+        }
+
+        case TCP_HANDOFF_KILL: {
+            /* The public key may have connected to us again since. */
+            if (directory_find(TCP_server->parent, handoff->target_public_key) == TCP_server->worker_id)
+                return 0;
+
+            kill_accepted(TCP_server, con_id);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Handle all the messages from the other workers.
+ */
+static void do_TCP_handoffs(TCP_Server *TCP_server)
+{
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&TCP_server->handoff_queue))) {
+        TCP_Handoff *handoff = (TCP_Handoff *)node;
+
+        if (handle_handoff(TCP_server, handoff) == 0) {
+            stat_add(&TCP_server->stats.handoffs_received, 1);
+        } else {
+            stat_add(&TCP_server->stats.handoffs_dropped, 1);
+        }
+
+        free(handoff);
+    }
+}
+#endif
+
+
 static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data,
                                   uint16_t length)
 {
@@ -911,7 +1232,7 @@ static int accept_connection(TCP_Server *TCP_server, sock_t sock)
     return index;
 }
 
-static sock_t new_listening_TCP_socket(int family, uint16_t port)
+static sock_t new_listening_TCP_socket(int family, uint16_t port, _Bool reuseport)
 {
     sock_t sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
 
@@ -929,6 +1250,10 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
         ok = set_socket_reuseaddr(sock);
     }
 
+    if (ok && reuseport) {
+        ok = set_socket_reuseport(sock);
+    }
+
     ok = ok && bind_to_port(sock, family, port) && (listen(sock, TCP_MAX_BACKLOG) == 0);
 
     if (!ok) {
@@ -939,8 +1264,10 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
     return sock;
 }
 
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion)
+/* Create a server with its own listening sockets and connections, without an onion.
+ */
+static TCP_Server *new_TCP_server_instance(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+        const uint8_t *secret_key, _Bool reuseport)
 {
     if (num_sockets == 0 || ports == NULL)
         return NULL;
@@ -961,6 +1288,8 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
     }
 
+    temp->send_queue_max_bytes = TCP_SEND_QUEUE_MAX_BYTES;
+
 #ifdef TCP_SERVER_USE_EPOLL
     temp->efd = epoll_create(8);
 
@@ -986,7 +1315,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 #endif
 
     for (i = 0; i < num_sockets; ++i) {
-        sock_t sock = new_listening_TCP_socket(family, ports[i]);
+        sock_t sock = new_listening_TCP_socket(family, ports[i], reuseport);
 
         if (sock_valid(sock)) {
 #ifdef TCP_SERVER_USE_EPOLL
@@ -1005,21 +1334,38 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+#endif
         free(temp->socks_listening);
         free(temp);
         return NULL;
     }
 
+    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
+    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
+
+    hash_map_init(&temp->accepted_key_list, crypto_box_PUBLICKEYBYTES, 8);
+    mpsc_queue_init(&temp->onion_queue);
+    mpsc_queue_init(&temp->handoff_queue);
+    temp->wake_fd = -1;
+
+    return temp;
+}
+
+TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                           Onion *onion)
+{
+    TCP_Server *temp = new_TCP_server_instance(ipv6_enabled, num_sockets, ports, secret_key, 0);
+
+    if (temp == NULL)
+        return NULL;
+
     if (onion) {
         temp->onion = onion;
         set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
     }
 
-    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
-    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
-
-    bs_list_init(&temp->accepted_key_list, crypto_box_PUBLICKEYBYTES, 8);
-
     return temp;
 }
 
@@ -1171,6 +1517,11 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
 
         send_pending_data(conn);
 
+        if (conn->send_queue.dropped) {
+            stat_add(&TCP_server->stats.packets_dropped, conn->send_queue.dropped);
+            conn->send_queue.dropped = 0;
+        }
+
 #ifndef TCP_SERVER_USE_EPOLL
 
         do_confirmed_recv(TCP_server, i);
@@ -1180,14 +1531,17 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
-static void do_TCP_epoll(TCP_Server *TCP_server)
+/* Handle the events of TCP_server, waits up to timeout milliseconds for the first ones.
+ */
+static void do_TCP_epoll(TCP_Server *TCP_server, int timeout)
 {
 #define MAX_EVENTS 16
     struct epoll_event events[MAX_EVENTS];
     int nfds;
 
-    while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, 0)) > 0) {
+    while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, timeout)) > 0) {
         int n;
+        timeout = 0;
 
         for (n = 0; n < nfds; ++n) {
             sock_t sock = events[n].data.u64 & 0xFFFFFFFF;
@@ -1294,6 +1648,19 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     do_confirmed_recv(TCP_server, index);
                     break;
                 }
+
+                case TCP_SOCKET_HANDOFF: {
+                    uint64_t count;
+
+                    if (read(sock, &count, sizeof(count)) != sizeof(count)) {
+                        /* Already reset by an earlier event. */
+                    }
+
+                    /* Messages pushed after this wake us up again. */
+                    atomic_exchange_u8(&TCP_server->wake_pending, 0, ATOMIC_SEQ_CST);
+                    do_TCP_handoffs(TCP_server);
+                    break;
+                }
             }
         }
     }
@@ -1302,12 +1669,226 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
 }
 #endif
 
+#ifdef TCP_SERVER_USE_WORKERS
+static void *run_TCP_worker(void *arg)
+{
+    TCP_Server *worker = arg;
+
+    while (atomic_load_u8(&worker->running, ATOMIC_ACQUIRE)) {
+        do_TCP_epoll(worker, TCP_WORKER_WAIT_TIMEOUT);
+        do_TCP_handoffs(worker);
+        do_TCP_confirmed(worker);
+    }
+
+    return NULL;
+}
+
+static TCP_Server *new_TCP_server_with_workers(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+        const uint8_t *secret_key, Onion *onion, uint16_t num_workers)
+{
+    if (num_sockets == 0 || ports == NULL)
+        return NULL;
+
+    if (networking_at_startup() != 0) {
+        return NULL;
+    }
+
+    TCP_Server *temp = calloc(1, sizeof(TCP_Server));
+
+    if (temp == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&temp->directory_mutex, NULL) != 0) {
+        free(temp);
+        return NULL;
+    }
+
+    temp->workers = calloc(num_workers, sizeof(TCP_Server *));
+
+    if (temp->workers == NULL) {
+        pthread_mutex_destroy(&temp->directory_mutex);
+        free(temp);
+        return NULL;
+    }
+
+    temp->efd = -1;
+    temp->wake_fd = -1;
+    temp->send_queue_max_bytes = TCP_SEND_QUEUE_MAX_BYTES;
+    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
+    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
+    hash_map_init(&temp->directory, crypto_box_PUBLICKEYBYTES, 8);
+    mpsc_queue_init(&temp->onion_queue);
+    mpsc_queue_init(&temp->handoff_queue);
+
+    uint16_t i;
+
+    for (i = 0; i < num_workers; ++i) {
+        TCP_Server *worker = new_TCP_server_instance(ipv6_enabled, num_sockets, ports, secret_key, 1);
+
+        if (worker == NULL) {
+            kill_TCP_server(temp);
+            return NULL;
+        }
+
+        worker->onion = onion;
+        worker->parent = temp;
+        worker->worker_id = i;
+        temp->workers[i] = worker;
+        ++temp->num_workers;
+
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLET,
+            .data.u64 = worker->wake_fd | ((uint64_t)TCP_SOCKET_HANDOFF << 32)
+        };
+
+        if (worker->wake_fd == -1 || epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->wake_fd, &ev) == -1) {
+            kill_TCP_server(temp);
+            return NULL;
+        }
+    }
+
+    /* Only start the threads once all the workers exist, they post messages to each other. */
+    for (i = 0; i < num_workers; ++i) {
+        TCP_Server *worker = temp->workers[i];
+        worker->running = 1;
+
+        if (pthread_create(&worker->thread, NULL, run_TCP_worker, worker) != 0) {
+            worker->running = 0;
+            kill_TCP_server(temp);
+            return NULL;
+        }
+    }
+
+    if (onion) {
+        temp->onion = onion;
+        set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
+    }
+
+    return temp;
+}
+
+/* Stop the threads of the workers of TCP_server and kill them.
+ */
+static void kill_TCP_workers(TCP_Server *TCP_server)
+{
+    uint16_t i;
+
+    for (i = 0; i < TCP_server->num_workers; ++i) {
+        TCP_Server *worker = TCP_server->workers[i];
+
+        if (!worker->running)
+            continue;
+
+        atomic_store_u8(&worker->running, 0, ATOMIC_RELEASE);
+        uint64_t one = 1;
+
+        if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* The worker still wakes up after TCP_WORKER_WAIT_TIMEOUT. */
+        }
+
+        pthread_join(worker->thread, NULL);
+    }
+
+    /* Workers post to each other so none can be freed before they all stopped. */
+    for (i = 0; i < TCP_server->num_workers; ++i) {
+        kill_TCP_server(TCP_server->workers[i]);
+    }
+}
+#endif
+
+TCP_Server *new_TCP_server_workers(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                   const uint8_t *secret_key, Onion *onion, uint16_t num_workers)
+{
+#ifdef TCP_SERVER_USE_WORKERS
+
+    if (num_workers != 0)
+        return new_TCP_server_with_workers(ipv6_enabled, num_sockets, ports, secret_key, onion, num_workers);
+
+#endif
+    return new_TCP_server(ipv6_enabled, num_sockets, ports, secret_key, onion);
+}
+
+uint16_t TCP_server_num_workers(const TCP_Server *TCP_server)
+{
+    return TCP_server->num_workers;
+}
+
+int TCP_server_stats(const TCP_Server *TCP_server, uint16_t worker, TCP_Server_Stats *stats)
+{
+    if (TCP_server->num_workers) {
+        if (worker >= TCP_server->num_workers)
+            return -1;
+
+        TCP_server = TCP_server->workers[worker];
+    } else if (worker != 0) {
+        return -1;
+    }
+
+    const TCP_Server_Stats *server_stats = &TCP_server->stats;
+    stats->connections = atomic_load_u64(&server_stats->connections, ATOMIC_RELAXED);
+    stats->connections_accepted = atomic_load_u64(&server_stats->connections_accepted, ATOMIC_RELAXED);
+    stats->packets_routed = atomic_load_u64(&server_stats->packets_routed, ATOMIC_RELAXED);
+    stats->handoffs_sent = atomic_load_u64(&server_stats->handoffs_sent, ATOMIC_RELAXED);
+    stats->handoffs_received = atomic_load_u64(&server_stats->handoffs_received, ATOMIC_RELAXED);
+    stats->handoffs_dropped = atomic_load_u64(&server_stats->handoffs_dropped, ATOMIC_RELAXED);
+    stats->packets_dropped = atomic_load_u64(&server_stats->packets_dropped, ATOMIC_RELAXED);
+    return 0;
+}
+
+void TCP_server_set_send_queue_size(TCP_Server *TCP_server, uint32_t max_bytes)
+{
+    uint16_t i;
+
+    atomic_store_u32(&TCP_server->send_queue_max_bytes, max_bytes, ATOMIC_RELAXED);
+
+    for (i = 0; i < TCP_server->num_workers; ++i)
+        atomic_store_u32(&TCP_server->workers[i]->send_queue_max_bytes, max_bytes, ATOMIC_RELAXED);
+}
+
+/* Send the onion requests the workers received.
+ */
+static void do_TCP_onion_requests(TCP_Server *TCP_server)
+{
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&TCP_server->onion_queue))) {
+        TCP_Handoff *handoff = (TCP_Handoff *)node;
+
+        IP_Port source;
+        source.port = 0;  // dummy initialise
+        source.ip.family = TCP_ONION_FAMILY;
+        source.ip.ip6.uint32[0] = handoff->index;
+        source.ip.ip6.uint32[1] = handoff->sender_worker;
+        source.ip.ip6.uint64[1] = handoff->identifier;
+        onion_send_1(TCP_server->onion, handoff->data + crypto_box_NONCEBYTES, handoff->length - crypto_box_NONCEBYTES,
+                     source, handoff->data);
+        free(handoff);
+    }
+}
+
+/* Free the messages left in queue.
+ */
+static void free_handoffs(Mpsc_Queue *queue)
+{
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(queue))) {
+        free((TCP_Handoff *)node);
+    }
+}
+
 void do_TCP_server(TCP_Server *TCP_server)
 {
     unix_time_update();
 
+    if (TCP_server->num_workers) {
+        do_TCP_onion_requests(TCP_server);
+        return;
+    }
+
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(TCP_server);
+    do_TCP_epoll(TCP_server, 0);
 
 #else
     do_TCP_accept_new(TCP_server);
@@ -1322,20 +1903,43 @@ void kill_TCP_server(TCP_Server *TCP_server)
 {
     uint32_t i;
 
+#ifdef TCP_SERVER_USE_WORKERS
+
+    if (TCP_server->workers) {
+        kill_TCP_workers(TCP_server);
+        pthread_mutex_destroy(&TCP_server->directory_mutex);
+    }
+
+    if (TCP_server->wake_fd != -1)
+        close(TCP_server->wake_fd);
+
+#endif
+
     for (i = 0; i < TCP_server->num_listening_socks; ++i) {
         kill_sock(TCP_server->socks_listening[i]);
     }
 
-    if (TCP_server->onion) {
+    if (TCP_server->onion && TCP_server->parent == NULL) {
         set_callback_handle_recv_1(TCP_server->onion, NULL, NULL);
     }
 
-    bs_list_free(&TCP_server->accepted_key_list);
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        tcp_send_queue_free(&TCP_server->accepted_connection_array[i].send_queue);
+    }
+
+    hash_map_free(&TCP_server->accepted_key_list);
+    hash_map_free(&TCP_server->directory);
+    free_handoffs(&TCP_server->onion_queue);
+    free_handoffs(&TCP_server->handoff_queue);
 
 #ifdef TCP_SERVER_USE_EPOLL
-    close(TCP_server->efd);
+
+    if (TCP_server->efd != -1)
+        close(TCP_server->efd);
+
 #endif
 
+    free(TCP_server->workers);
     free(TCP_server->socks_listening);
     free(TCP_server->accepted_connection_array);
     free(TCP_server);
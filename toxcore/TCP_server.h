@@ -25,10 +25,19 @@
 
 #include "crypto_core.h"
 #include "onion.h"
-#include "list.h"
+#include "hash_map.h"
+#include "mpsc_queue.h"
+#include "TCP_send_queue.h"
+
+#include <pthread.h>
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include "sys/epoll.h"
+
+#ifdef SO_REUSEPORT
+/* Each worker binds its own listening sockets to the same ports. */
+#define TCP_SERVER_USE_WORKERS
+#endif
 #endif
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(__MACH__)
@@ -71,6 +80,7 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_HANDOFF 4
 #endif
 
 enum {
@@ -80,14 +90,6 @@ enum {
     TCP_STATUS_CONFIRMED,
 };
 
-typedef struct TCP_Priority_List TCP_Priority_List;
-
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size, sent;
-    uint8_t data[];
-};
-
 typedef struct TCP_Secure_Connection {
     uint8_t status;
     sock_t  sock;
@@ -101,12 +103,9 @@ typedef struct TCP_Secure_Connection {
         uint8_t public_key[crypto_box_PUBLICKEYBYTES];
         uint32_t index;
         uint8_t other_id;
+        uint16_t worker; /* Worker holding the other connection, if it isn't ours index is unused. */
     } connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t identifier;
 
@@ -114,8 +113,19 @@ typedef struct TCP_Secure_Connection {
     uint64_t ping_id;
 } TCP_Secure_Connection;
 
-
 typedef struct {
+    uint64_t connections; /* Number of confirmed connections. */
+    uint64_t connections_accepted; /* Total number of connections that were confirmed. */
+    uint64_t packets_routed; /* Packets routed between two connections of the same worker. */
+    uint64_t handoffs_sent; /* Messages sent to other workers. */
+    uint64_t handoffs_received; /* Messages from other workers that were delivered. */
+    uint64_t handoffs_dropped; /* Messages from other workers that could not be delivered. */
+    uint64_t packets_dropped; /* Packets dropped because the send queue of their connection was full. */
+} TCP_Server_Stats;
+
+typedef struct TCP_Server TCP_Server;
+
+struct TCP_Server {
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -138,14 +148,78 @@ typedef struct {
 
     uint64_t counter;
 
-    BS_LIST accepted_key_list;
-} TCP_Server;
+    Hash_Map accepted_key_list;
+
+    /* Maximum number of bytes queued on each connection. */
+    uint32_t send_queue_max_bytes;
+
+    /* Only written by the thread running the server. */
+    TCP_Server_Stats stats;
+
+    /* Set on a server with workers, each worker is a server with its own listening
+     * sockets and connections that runs its own event loop in its own thread.
+     */
+    TCP_Server **workers;
+    uint16_t num_workers;
+
+    /* Worker holding the connection of each public key. */
+    Hash_Map directory;
+    pthread_mutex_t directory_mutex;
+
+    /* Onion requests from the workers, sent by do_TCP_server(). */
+    Mpsc_Queue onion_queue;
+
+    /* Set on the workers. */
+    TCP_Server *parent;
+    uint16_t worker_id;
+    pthread_t thread;
+    uint8_t running;
+
+    /* Messages from the other workers and from the parent. */
+    Mpsc_Queue handoff_queue;
+    int wake_fd;
+    uint8_t wake_pending;
+};
 
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Create new TCP server instance that runs num_workers event loops in their own threads.
+ *
+ * Each worker listens on all the ports with SO_REUSEPORT sockets so that the kernel spreads
+ * the incoming connections over the workers. Packets between connections on different
+ * workers are passed through lock-free queues.
+ *
+ * do_TCP_server() must still be called regularly, it updates the time for the workers and
+ * sends the onion requests they received.
+ *
+ * If num_workers is 0 or if workers are not supported (they need epoll and SO_REUSEPORT)
+ * this is the same as new_TCP_server().
+ */
+TCP_Server *new_TCP_server_workers(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                   const uint8_t *secret_key, Onion *onion, uint16_t num_workers);
+
+/* return the number of workers of the TCP server, 0 if it runs in the thread calling do_TCP_server().
+ */
+uint16_t TCP_server_num_workers(const TCP_Server *TCP_server);
+
+/* Copy the stats of worker number worker into stats, worker must be 0 for a TCP server without workers.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_server_stats(const TCP_Server *TCP_server, uint16_t worker, TCP_Server_Stats *stats);
+
+/* Set the maximum number of bytes that can be queued on each connection of the TCP server when the
+ * socket doesn't accept them, 0 for no limit. Packets that don't fit are dropped and counted in the
+ * packets_dropped stat. Only applies to connections confirmed after the call.
+ *
+ * Default is TCP_SEND_QUEUE_MAX_BYTES.
+ */
+void TCP_server_set_send_queue_size(TCP_Server *TCP_server, uint32_t max_bytes);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
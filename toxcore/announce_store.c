@@ -0,0 +1,265 @@
+/* announce_store.c
+ *
+ * Announcements stored by an onion announce node
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "announce_store.h"
+#include "xor_distance.h"
+#include "util.h"
+
+int announce_store_init(Announce_Store *store, uint32_t capacity, uint32_t timeout, const uint8_t *self_public_key)
+{
+    memset(store, 0, sizeof(Announce_Store));
+
+    /* Entry indexes are the ids of the hash map, an int. */
+    if (capacity == 0 || capacity > INT32_MAX || timeout == 0)
+        return -1;
+
+    store->self_public_key = self_public_key;
+    store->timeout = timeout;
+    store->capacity = capacity;
+    store->num_slots = timeout + 1;
+    store->entries = calloc(capacity, sizeof(Onion_Announce_Entry));
+    store->heap = calloc(capacity, sizeof(uint32_t));
+    store->wheel = calloc(store->num_slots, sizeof(uint32_t));
+
+    if (store->entries == NULL || store->heap == NULL || store->wheel == NULL
+            || !hash_map_init(&store->index, crypto_box_PUBLICKEYBYTES, capacity + 1)) {
+        announce_store_free(store);
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < capacity; ++i)
+        store->entries[i].next = i + 1;
+
+    for (i = 0; i < store->num_slots; ++i)
+        store->wheel[i] = capacity;
+
+    store->wheel_time = unix_time();
+    return 0;
+}
+
+void announce_store_free(Announce_Store *store)
+{
+    hash_map_free(&store->index);
+    free(store->entries);
+    free(store->heap);
+    free(store->wheel);
+    memset(store, 0, sizeof(Announce_Store));
+}
+
+/* return 1 if entry i is further from self_public_key than entry j. */
+static _Bool further(const Announce_Store *store, uint32_t i, uint32_t j)
+{
+    return id_closest(store->self_public_key, store->entries[i].public_key, store->entries[j].public_key) == 2;
+}
+
+static void heap_set(Announce_Store *store, uint32_t heap_index, uint32_t index)
+{
+    store->heap[heap_index] = index;
+    store->entries[index].heap_index = heap_index;
+}
+
+static void heap_up(Announce_Store *store, uint32_t heap_index)
+{
+    uint32_t index = store->heap[heap_index];
+
+    while (heap_index > 0) {
+        uint32_t parent = (heap_index - 1) / 2;
+
+        if (!further(store, index, store->heap[parent]))
+            break;
+
+        heap_set(store, heap_index, store->heap[parent]);
+        heap_index = parent;
+    }
+
+    heap_set(store, heap_index, index);
+}
+
+static void heap_down(Announce_Store *store, uint32_t heap_index)
+{
+    uint32_t index = store->heap[heap_index];
+
+    while (1) {
+        uint32_t child = heap_index * 2 + 1;
+
+        if (child >= store->num_entries)
+            break;
+
+        if (child + 1 < store->num_entries && further(store, store->heap[child + 1], store->heap[child]))
+            ++child;
+
+        if (!further(store, store->heap[child], index))
+            break;
+
+        heap_set(store, heap_index, store->heap[child]);
+        heap_index = child;
+    }
+
+    heap_set(store, heap_index, index);
+}
+
+/* Put entry index in the wheel slot of the second it expires in. */
+static void wheel_link(Announce_Store *store, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &store->entries[index];
+    uint32_t *slot = &store->wheel[(entry->time + store->timeout) % store->num_slots];
+
+    entry->prev = store->capacity;
+    entry->next = *slot;
+
+    if (*slot != store->capacity)
+        store->entries[*slot].prev = index;
+
+    *slot = index;
+}
+
+static void wheel_unlink(Announce_Store *store, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &store->entries[index];
+
+    if (entry->prev != store->capacity) {
+        store->entries[entry->prev].next = entry->next;
+    } else {
+        store->wheel[(entry->time + store->timeout) % store->num_slots] = entry->next;
+    }
+
+    if (entry->next != store->capacity)
+        store->entries[entry->next].prev = entry->prev;
+}
+
+static void remove_entry(Announce_Store *store, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &store->entries[index];
+    uint32_t heap_index = entry->heap_index;
+
+    hash_map_remove(&store->index, entry->public_key, index);
+    wheel_unlink(store, index);
+
+    --store->num_entries;
+
+    /* The last entry of the heap takes its place. */
+    if (heap_index != store->num_entries) {
+        uint32_t last = store->heap[store->num_entries];
+        heap_set(store, heap_index, last);
+        heap_up(store, heap_index);
+        heap_down(store, store->entries[last].heap_index);
+    }
+
+    sodium_memzero(entry, sizeof(Onion_Announce_Entry));
+    entry->next = store->first_unused;
+    store->first_unused = index;
+}
+
+/* Remove the entries that expired since the last call. */
+static void expire_entries(Announce_Store *store)
+{
+    uint64_t now = unix_time();
+
+    if (now <= store->wheel_time)
+        return;
+
+    /* After a whole turn every slot was looked at. */
+    uint64_t time = store->wheel_time;
+
+    if (now - time > store->num_slots)
+        time = now - store->num_slots;
+
+    for (++time; time <= now; ++time) {
+        uint32_t index = store->wheel[time % store->num_slots];
+
+        while (index != store->capacity) {
+            uint32_t next = store->entries[index].next;
+
+            if (is_timeout(store->entries[index].time, store->timeout))
+                remove_entry(store, index);
+
+            index = next;
+        }
+    }
+
+    store->wheel_time = now;
+}
+
+Onion_Announce_Entry *announce_store_find(Announce_Store *store, const uint8_t *public_key)
+{
+    expire_entries(store);
+
+    int index = hash_map_find(&store->index, public_key);
+
+    if (index == -1)
+        return NULL;
+
+    return &store->entries[index];
+}
+
+Onion_Announce_Entry *announce_store_add(Announce_Store *store, const uint8_t *public_key, IP_Port ret_ip_port,
+        const uint8_t *ret, const uint8_t *data_public_key)
+{
+    Onion_Announce_Entry *entry = announce_store_find(store, public_key);
+    uint32_t index;
+
+    if (entry) {
+        index = entry - store->entries;
+        wheel_unlink(store, index);
+    } else {
+        uint32_t furthest = store->capacity;
+
+        if (store->num_entries == store->capacity) {
+            furthest = store->heap[0];
+
+            if (id_closest(store->self_public_key, public_key, store->entries[furthest].public_key) != 1)
+                return NULL;
+        }
+
+        /* The new entry takes the place of the furthest one, which is only removed once the index
+         * holds the new key so that nothing is lost if it can't. The index has room for one more key
+         * than the store, adding it doesn't allocate. */
+        index = furthest != store->capacity ? furthest : store->first_unused;
+
+        if (!hash_map_add(&store->index, public_key, index))
+            return NULL;
+
+        if (furthest != store->capacity)
+            remove_entry(store, furthest);
+
+        entry = &store->entries[index];
+        store->first_unused = entry->next;
+        memcpy(entry->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        heap_set(store, store->num_entries, index);
+        ++store->num_entries;
+        heap_up(store, entry->heap_index);
+    }
+
+    entry->ret_ip_port = ret_ip_port;
+    memcpy(entry->ret, ret, ONION_RETURN_3);
+    memcpy(entry->data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
+    entry->time = unix_time();
+    wheel_link(store, index);
+    return entry;
+}
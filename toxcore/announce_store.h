@@ -0,0 +1,94 @@
+/* announce_store.h
+ *
+ * Announcements stored by an onion announce node
+ * -Found by public key in a hash map
+ * -When the store is full, announcements closer to the key of the store replace the one that
+ *  is furthest from it, a heap keeps that one at hand
+ * -Announcements expire timeout seconds after they were last refreshed, a timer wheel with one
+ *  slot per second finds them without looking at the others
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ANNOUNCE_STORE_H
+#define ANNOUNCE_STORE_H
+
+#include "onion.h"
+#include "hash_map.h"
+
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ret_ip_port;
+    uint8_t ret[ONION_RETURN_3];
+    uint8_t data_public_key[crypto_box_PUBLICKEYBYTES];
+    uint64_t time;
+
+    /* Position in the heap, links in the wheel slot (or the list of unused entries). */
+    uint32_t heap_index;
+    uint32_t next;
+    uint32_t prev;
+} Onion_Announce_Entry;
+
+typedef struct {
+    /* Distances are measured to this key, it must not change while announcements are stored. */
+    const uint8_t *self_public_key;
+    uint32_t timeout;
+
+    Onion_Announce_Entry *entries;
+    uint32_t capacity;
+    uint32_t num_entries;
+    uint32_t first_unused; /* capacity if all entries are used. */
+
+    /* public key -> index of its entry. */
+    Hash_Map index;
+
+    /* Indexes of the used entries, the one furthest from self_public_key first. */
+    uint32_t *heap;
+
+    /* wheel[t % num_slots] is the first entry that expires in second t, capacity if none. */
+    uint32_t *wheel;
+    uint32_t num_slots;
+    uint64_t wheel_time; /* Entries that expire up to this second were removed. */
+} Announce_Store;
+
+/* Make store hold up to capacity announcements, each for timeout seconds after it was last
+ * refreshed. The store keeps a pointer to self_public_key.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int announce_store_init(Announce_Store *store, uint32_t capacity, uint32_t timeout, const uint8_t *self_public_key);
+
+/* Free all the memory used by store. */
+void announce_store_free(Announce_Store *store);
+
+/* return the announcement of public_key.
+ * return NULL if it has none or it expired.
+ */
+Onion_Announce_Entry *announce_store_find(Announce_Store *store, const uint8_t *public_key);
+
+/* Add the announcement of public_key or refresh it if it is already stored.
+ *
+ * return the announcement.
+ * return NULL if the store is full of announcements closer to self_public_key than public_key.
+ */
+Onion_Announce_Entry *announce_store_add(Announce_Store *store, const uint8_t *public_key, IP_Port ret_ip_port,
+        const uint8_t *ret, const uint8_t *data_public_key);
+
+#endif
@@ -386,8 +386,12 @@ static void candidates_update_assoc(const Assoc *assoc, Client_entry *entry, uin
     if (ipp_recv) {
         ipptsp->ip_port = ippts_send->ip_port;
         ipptsp->timestamp = ippts_send->timestamp;
-        ipptsp->ret_ip_port = *ipp_recv;
-        ipptsp->ret_timestamp = unix_time();
+        IPPTs_Cold *cold = ipptsp_cold(ipptsp);
+
+        if (cold) {
+            cold->ret_ip_port = *ipp_recv;
+            cold->ret_timestamp = unix_time();
+        }
 
         entry->seen_at = unix_time();
         entry->seen_family = ippts_send->ip_port.ip.family;
@@ -469,6 +473,7 @@ static uint8_t candidates_create_new(const Assoc *assoc, hash_t hash, const uint
 
     candidates_bucket *cnd_bckt = &assoc->candidates[bucket];
     Client_entry *entry = &cnd_bckt->list[pos];
+    client_data_clear(&entry->client);
     memset(entry, 0, sizeof(*entry));
     IPPTsPng *ipptsp = entry_assoc(entry, &ippts_send->ip_port);
 
@@ -490,8 +495,13 @@ static uint8_t candidates_create_new(const Assoc *assoc, hash_t hash, const uint
 
         ipptsp->ip_port = ippts_send->ip_port;
         ipptsp->timestamp = ippts_send->timestamp;
-        ipptsp->ret_ip_port = *ipp_recv;
-        ipptsp->ret_timestamp = unix_time();
+
+        IPPTs_Cold *cold = ipptsp_cold(ipptsp);
+
+        if (cold) {
+            cold->ret_ip_port = *ipp_recv;
+            cold->ret_timestamp = unix_time();
+        }
     } else {
         IP_Port *heard = entry_heard_get(entry, &ippts_send->ip_port);
 
@@ -828,7 +838,8 @@ Assoc *new_Assoc(size_t bits, size_t entries, const uint8_t *public_id)
 
     /* allocation: preferably few blobs */
     size_t bckt, cix;
-    Client_entry *clients = malloc(sizeof(*clients) * assoc->candidates_bucket_count * assoc->candidates_bucket_size);
+    /* zeroed, the cold state of the entries is freed when they are reused */
+    Client_entry *clients = calloc(assoc->candidates_bucket_count * assoc->candidates_bucket_size, sizeof(*clients));
 
     if (!clients) {
         free(assoc);
@@ -968,6 +979,11 @@ void do_Assoc(Assoc *assoc, DHT *dht)
 void kill_Assoc(Assoc *assoc)
 {
     if (assoc) {
+        size_t i, count = assoc->candidates_bucket_count * assoc->candidates_bucket_size;
+
+        for (i = 0; i < count; i++)
+            client_data_clear(&assoc->candidates->list[i].client);
+
         free(assoc->candidates->list);
         free(assoc->candidates);
         free(assoc);
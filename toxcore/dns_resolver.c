@@ -0,0 +1,359 @@
+/* dns_resolver.c
+ *
+ * Resolves the hostnames of DHT nodes and TCP relays without blocking the caller
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dns_resolver.h"
+#include "util.h"
+
+static uint32_t getaddrinfo_lookup(void *object, const char *host, IP *ips, uint32_t max_ips, uint32_t *ttl)
+{
+    if (networking_at_startup() != 0)
+        return 0;
+
+    struct addrinfo hints, *root, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM; /* Every address once. */
+
+    if (getaddrinfo(host, NULL, &hints, &root) != 0)
+        return 0;
+
+    uint32_t num_ips = 0, i;
+
+    for (info = root; info && num_ips < max_ips; info = info->ai_next) {
+        IP ip;
+        ip_reset(&ip);
+        ip.family = info->ai_family;
+
+        if (info->ai_family == AF_INET) {
+            ip.ip4.in_addr = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+        } else if (info->ai_family == AF_INET6) {
+            ip.ip6.in6_addr = ((struct sockaddr_in6 *)info->ai_addr)->sin6_addr;
+        } else {
+            continue;
+        }
+
+        for (i = 0; i < num_ips; ++i) {
+            if (ip_equal(&ips[i], &ip))
+                break;
+        }
+
+        if (i == num_ips)
+            ips[num_ips++] = ip;
+    }
+
+    freeaddrinfo(root);
+    *ttl = DNS_RESOLVER_DEFAULT_TTL;
+    return num_ips;
+}
+
+static void free_dns_resolver(DNS_Resolver *resolver)
+{
+    pthread_cond_destroy(&resolver->cond);
+    pthread_mutex_destroy(&resolver->mutex);
+    free(resolver);
+}
+
+DNS_Resolver *new_dns_resolver(dns_lookup_cb *lookup_function, void *lookup_object)
+{
+    DNS_Resolver *resolver = calloc(1, sizeof(DNS_Resolver));
+
+    if (resolver == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&resolver->mutex, NULL) != 0) {
+        free(resolver);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&resolver->cond, NULL) != 0) {
+        pthread_mutex_destroy(&resolver->mutex);
+        free(resolver);
+        return NULL;
+    }
+
+    resolver->lookup_function = lookup_function ? lookup_function : getaddrinfo_lookup;
+    resolver->lookup_object = lookup_object;
+    resolver->refs = 1;
+    return resolver;
+}
+
+/* Drop a reference, the last one frees the resolver. Must be called with the mutex locked, it is unlocked. */
+static void unref_dns_resolver(DNS_Resolver *resolver)
+{
+    _Bool last = (--resolver->refs == 0);
+    pthread_mutex_unlock(&resolver->mutex);
+
+    if (last)
+        free_dns_resolver(resolver);
+}
+
+void kill_dns_resolver(DNS_Resolver *resolver)
+{
+    if (resolver == NULL)
+        return;
+
+    pthread_mutex_lock(&resolver->mutex);
+    resolver->stop = 1;
+    pthread_cond_signal(&resolver->cond);
+    unref_dns_resolver(resolver);
+}
+
+static void *run_dns_resolver(void *arg)
+{
+    DNS_Resolver *resolver = arg;
+
+    pthread_mutex_lock(&resolver->mutex);
+
+    while (!resolver->stop) {
+        DNS_Lookup *lookup = NULL;
+        uint32_t i;
+
+        for (i = 0; i < DNS_RESOLVER_MAX_LOOKUPS; ++i) {
+            if (resolver->lookups[i].state == DNS_LOOKUP_QUEUED) {
+                lookup = &resolver->lookups[i];
+                break;
+            }
+        }
+
+        if (lookup == NULL) {
+            pthread_cond_wait(&resolver->cond, &resolver->mutex);
+            continue;
+        }
+
+        char host[DNS_RESOLVER_MAX_HOST_LENGTH + 1];
+        memcpy(host, lookup->host, sizeof(host));
+        lookup->state = DNS_LOOKUP_RUNNING;
+        pthread_mutex_unlock(&resolver->mutex);
+
+        IP ips[DNS_RESOLVER_MAX_ADDRESSES];
+        uint32_t ttl = DNS_RESOLVER_DEFAULT_TTL;
+        uint32_t num_ips = resolver->lookup_function(resolver->lookup_object, host, ips, DNS_RESOLVER_MAX_ADDRESSES, &ttl);
+
+        if (num_ips > DNS_RESOLVER_MAX_ADDRESSES)
+            num_ips = DNS_RESOLVER_MAX_ADDRESSES;
+
+        pthread_mutex_lock(&resolver->mutex);
+        memcpy(lookup->ips, ips, num_ips * sizeof(IP));
+        lookup->num_ips = num_ips;
+        lookup->ttl = num_ips ? ttl : DNS_RESOLVER_NEGATIVE_TTL;
+        lookup->state = DNS_LOOKUP_DONE;
+    }
+
+    unref_dns_resolver(resolver);
+    return NULL;
+}
+
+/* Start the thread if it isn't running. Must be called with the mutex locked.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int start_dns_thread(DNS_Resolver *resolver)
+{
+    if (resolver->thread_started)
+        return 0;
+
+    pthread_t thread;
+    ++resolver->refs;
+
+    if (pthread_create(&thread, NULL, run_dns_resolver, resolver) != 0) {
+        --resolver->refs;
+        return -1;
+    }
+
+    pthread_detach(thread);
+    resolver->thread_started = 1;
+    return 0;
+}
+
+static DNS_Cache_Entry *find_cache_entry(DNS_Resolver *resolver, const char *host)
+{
+    uint64_t now = current_time_monotonic();
+    uint32_t i;
+
+    for (i = 0; i < DNS_RESOLVER_CACHE_SIZE; ++i) {
+        DNS_Cache_Entry *entry = &resolver->cache[i];
+
+        if (entry->expires > now && strcmp(entry->host, host) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Put the result of lookup in the cache, in place of an entry for the same host or the one that expires first. */
+static DNS_Cache_Entry *cache_lookup(DNS_Resolver *resolver, const DNS_Lookup *lookup)
+{
+    DNS_Cache_Entry *entry = &resolver->cache[0];
+    uint32_t i;
+
+    for (i = 0; i < DNS_RESOLVER_CACHE_SIZE; ++i) {
+        if (strcmp(resolver->cache[i].host, lookup->host) == 0) {
+            entry = &resolver->cache[i];
+            break;
+        }
+
+        if (resolver->cache[i].expires < entry->expires)
+            entry = &resolver->cache[i];
+    }
+
+    memcpy(entry->host, lookup->host, sizeof(entry->host));
+    memcpy(entry->ips, lookup->ips, sizeof(entry->ips));
+    entry->num_ips = lookup->num_ips;
+    entry->expires = current_time_monotonic() + (uint64_t)lookup->ttl * 1000;
+    return entry;
+}
+
+static void call_request(const DNS_Request *request, const IP *ips, uint32_t num_ips)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_ips; ++i) {
+        IP_Port ip_port;
+        ip_port.ip = ips[i];
+        ip_port.port = request->port;
+        request->callback(request->object, ip_port, request->public_key);
+    }
+}
+
+int dns_resolve(DNS_Resolver *resolver, const char *host, uint16_t port, const uint8_t *public_key,
+                dns_resolved_cb *callback, void *object)
+{
+    if (strlen(host) > DNS_RESOLVER_MAX_HOST_LENGTH)
+        return -1;
+
+    DNS_Request request;
+    request.port = port;
+    memcpy(request.public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    request.callback = callback;
+    request.object = object;
+
+    IP ip;
+
+    if (addr_parse_ip(host, &ip)) {
+        call_request(&request, &ip, 1);
+        return 1;
+    }
+
+    const DNS_Cache_Entry *entry = find_cache_entry(resolver, host);
+
+    if (entry) {
+        if (entry->num_ips == 0)
+            return -1;
+
+        call_request(&request, entry->ips, entry->num_ips);
+        return entry->num_ips;
+    }
+
+    if (resolver->num_requests == DNS_RESOLVER_MAX_REQUESTS)
+        return -2;
+
+    uint32_t i, free_slot = DNS_RESOLVER_MAX_LOOKUPS;
+
+    pthread_mutex_lock(&resolver->mutex);
+
+    /* Requests for a host that is already being looked up wait for that lookup. */
+    for (i = 0; i < DNS_RESOLVER_MAX_LOOKUPS; ++i) {
+        if (resolver->lookups[i].state == DNS_LOOKUP_FREE) {
+            if (free_slot == DNS_RESOLVER_MAX_LOOKUPS)
+                free_slot = i;
+        } else if (strcmp(resolver->lookups[i].host, host) == 0) {
+            break;
+        }
+    }
+
+    if (i == DNS_RESOLVER_MAX_LOOKUPS) {
+        if (free_slot == DNS_RESOLVER_MAX_LOOKUPS || start_dns_thread(resolver) == -1) {
+            pthread_mutex_unlock(&resolver->mutex);
+            return -2;
+        }
+
+        i = free_slot;
+        DNS_Lookup *lookup = &resolver->lookups[i];
+        memset(lookup->host, 0, sizeof(lookup->host));
+        memcpy(lookup->host, host, strlen(host));
+        lookup->state = DNS_LOOKUP_QUEUED;
+        pthread_cond_signal(&resolver->cond);
+    }
+
+    pthread_mutex_unlock(&resolver->mutex);
+
+    request.lookup = i;
+    resolver->requests[resolver->num_requests] = request;
+    ++resolver->num_requests;
+    return 0;
+}
+
+void do_dns_resolver(DNS_Resolver *resolver)
+{
+    if (resolver->num_requests == 0)
+        return;
+
+    /* Copy the results while the lookups are taken, a later lookup of this pass can reuse the cache entry
+     * of an earlier one and the callbacks can make new requests that change the cache. */
+    DNS_Cache_Entry entries[DNS_RESOLVER_MAX_LOOKUPS];
+    _Bool results[DNS_RESOLVER_MAX_LOOKUPS] = {0};
+    _Bool done = 0;
+    uint32_t i;
+
+    pthread_mutex_lock(&resolver->mutex);
+
+    for (i = 0; i < DNS_RESOLVER_MAX_LOOKUPS; ++i) {
+        DNS_Lookup *lookup = &resolver->lookups[i];
+
+        if (lookup->state == DNS_LOOKUP_DONE) {
+            entries[i] = *cache_lookup(resolver, lookup);
+            results[i] = 1;
+            lookup->state = DNS_LOOKUP_FREE;
+            done = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&resolver->mutex);
+
+    if (!done)
+        return;
+
+    /* Take the finished requests out first, the callbacks can make new ones. */
+    DNS_Request finished[DNS_RESOLVER_MAX_REQUESTS];
+    uint32_t num_finished = 0, num_requests = 0;
+
+    for (i = 0; i < resolver->num_requests; ++i) {
+        if (results[resolver->requests[i].lookup]) {
+            finished[num_finished++] = resolver->requests[i];
+        } else {
+            resolver->requests[num_requests++] = resolver->requests[i];
+        }
+    }
+
+    resolver->num_requests = num_requests;
+
+    for (i = 0; i < num_finished; ++i) {
+        const DNS_Cache_Entry *entry = &entries[finished[i].lookup];
+        call_request(&finished[i], entry->ips, entry->num_ips);
+    }
+}
@@ -0,0 +1,131 @@
+/* dns_resolver.h
+ *
+ * Resolves the hostnames of DHT nodes and TCP relays without blocking the caller
+ * -Lookups run in a thread, their results are handed back in do_dns_resolver()
+ * -Results (and failures) are cached until their TTL runs out
+ * -The lookup function can be replaced, by a stub resolver in tests
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
+#include "crypto_core.h"
+
+#include <pthread.h>
+
+#define DNS_RESOLVER_MAX_HOST_LENGTH 255
+/* Addresses kept per hostname. */
+#define DNS_RESOLVER_MAX_ADDRESSES 8
+#define DNS_RESOLVER_CACHE_SIZE 32
+/* Hostnames looked up at the same time and requests waiting for them. */
+#define DNS_RESOLVER_MAX_LOOKUPS 16
+#define DNS_RESOLVER_MAX_REQUESTS 64
+
+/* Seconds results of the default lookup are cached, getaddrinfo() doesn't tell the TTL of the records. */
+#define DNS_RESOLVER_DEFAULT_TTL 300
+/* Seconds a name that didn't resolve is cached. */
+#define DNS_RESOLVER_NEGATIVE_TTL 30
+
+/* Look up host, put up to max_ips of its addresses in ips and the seconds they can be cached in ttl.
+ * Called in the thread of the resolver, it can block.
+ *
+ * return the number of addresses, 0 if host doesn't resolve.
+ */
+typedef uint32_t dns_lookup_cb(void *object, const char *host, IP *ips, uint32_t max_ips, uint32_t *ttl);
+
+/* Called for every address a request resolved to. */
+typedef void dns_resolved_cb(void *object, IP_Port ip_port, const uint8_t *public_key);
+
+#define DNS_LOOKUP_FREE 0
+#define DNS_LOOKUP_QUEUED 1
+#define DNS_LOOKUP_RUNNING 2
+#define DNS_LOOKUP_DONE 3
+
+typedef struct {
+    uint8_t state;
+    char host[DNS_RESOLVER_MAX_HOST_LENGTH + 1];
+    IP ips[DNS_RESOLVER_MAX_ADDRESSES];
+    uint32_t num_ips;
+    uint32_t ttl;
+} DNS_Lookup;
+
+typedef struct {
+    char host[DNS_RESOLVER_MAX_HOST_LENGTH + 1];
+    IP ips[DNS_RESOLVER_MAX_ADDRESSES];
+    uint32_t num_ips; /* 0 if the name didn't resolve. */
+    uint64_t expires; /* current_time_monotonic() after which the entry is no longer used. */
+} DNS_Cache_Entry;
+
+typedef struct {
+    uint32_t lookup; /* Index in lookups. */
+    uint16_t port;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    dns_resolved_cb *callback;
+    void *object;
+} DNS_Request;
+
+typedef struct DNS_Resolver {
+    dns_lookup_cb *lookup_function;
+    void *lookup_object;
+
+    /* Shared with the thread, protected by mutex. The thread is detached so that killing the resolver
+     * never waits for a slow lookup, whichever of the two finishes last frees the resolver. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    DNS_Lookup lookups[DNS_RESOLVER_MAX_LOOKUPS];
+    _Bool thread_started;
+    _Bool stop;
+    unsigned int refs;
+
+    /* Only touched by the thread running do_dns_resolver(). */
+    DNS_Cache_Entry cache[DNS_RESOLVER_CACHE_SIZE];
+    DNS_Request requests[DNS_RESOLVER_MAX_REQUESTS];
+    uint32_t num_requests;
+} DNS_Resolver;
+
+/* Create a resolver that looks names up with lookup_function, or getaddrinfo() if it is NULL.
+ * The thread is only started by the first lookup.
+ *
+ * return NULL on failure.
+ */
+DNS_Resolver *new_dns_resolver(dns_lookup_cb *lookup_function, void *lookup_object);
+
+/* Drop all requests and free the resolver once its thread finished the lookup it is doing. */
+void kill_dns_resolver(DNS_Resolver *resolver);
+
+/* Resolve host and call callback with each of its addresses, port (in network byte order) and public_key.
+ *
+ * If host is an IP address or in the cache, callback is called before this returns. Otherwise the
+ * lookup is queued and callback is called by do_dns_resolver() once it is done.
+ *
+ * return -1 if host doesn't resolve (as far as the cache knows).
+ * return -2 if the lookup can't be queued because too many requests or lookups are waiting, callback
+ *   is never called for it.
+ * return 0 if the lookup was queued.
+ * return the number of addresses callback was called with otherwise.
+ */
+int dns_resolve(DNS_Resolver *resolver, const char *host, uint16_t port, const uint8_t *public_key,
+                dns_resolved_cb *callback, void *object);
+
+/* Cache the lookups that are done and call the callbacks of the requests waiting for them. */
+void do_dns_resolver(DNS_Resolver *resolver);
+
+#endif
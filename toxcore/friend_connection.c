@@ -832,6 +832,34 @@ void do_friend_connections(Friend_Connections *fr_c)
     LANdiscovery(fr_c);
 }
 
+uint64_t friend_connections_deadline(const Friend_Connections *fr_c)
+{
+    uint64_t deadline = fr_c->last_LANdiscovery + LAN_DISCOVERY_INTERVAL + 1;
+    uint32_t i;
+
+    for (i = 0; i < fr_c->num_cons; ++i) {
+        const Friend_Conn *friend_con = &fr_c->conns[i];
+
+        if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+            /* A new connection is made as soon as the DHT public key is known. */
+            if (friend_con->dht_lock && friend_con->crypt_connection_id == -1)
+                return 0;
+
+            if (friend_con->dht_lock)
+                deadline = MIN(deadline, friend_con->dht_pk_lastrecv + FRIEND_DHT_TIMEOUT + 1);
+
+            if (friend_con->dht_ip_port.ip.family != 0)
+                deadline = MIN(deadline, friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT + 1);
+        } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+            deadline = MIN(deadline, friend_con->ping_lastsent + FRIEND_PING_INTERVAL + 1);
+            deadline = MIN(deadline, friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL + 1);
+            deadline = MIN(deadline, friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT + 1);
+        }
+    }
+
+    return deadline;
+}
+
 /* Free everything related with friend_connections. */
 void kill_friend_connections(Friend_Connections *fr_c)
 {
@@ -203,6 +203,9 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c);
 /* main friend_connections loop. */
 void do_friend_connections(Friend_Connections *fr_c);
 
+/* return the unix_time() at which do_friend_connections() next has something to do. */
+uint64_t friend_connections_deadline(const Friend_Connections *fr_c);
+
 /* Free everything related with friend_connections. */
 void kill_friend_connections(Friend_Connections *fr_c);
 
@@ -57,6 +57,23 @@ void do_gca(GC_Announces_List *gc_announces_list) {
     }
 }
 
+uint64_t gca_deadline(const GC_Announces_List *gc_announces_list)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    if (!gc_announces_list) {
+        return deadline;
+    }
+
+    const GC_Announces *announces = gc_announces_list->announces;
+    while (announces) {
+        deadline = MIN(deadline, announces->last_announce_received_timestamp + GC_ANNOUNCE_SAVING_TIMEOUT);
+        announces = announces->next_announce;
+    }
+
+    return deadline;
+}
+
 /* Pack number of nodes into data of maxlength length.
  *
  * return length of packed nodes on success.
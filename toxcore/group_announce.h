@@ -66,6 +66,9 @@ void kill_gca(GC_Announces_List *announces_list);
 
 void do_gca(GC_Announces_List *gc_announces_list);
 
+/* return the unix_time() at which do_gca() next has something to do, UINT64_MAX if never. */
+uint64_t gca_deadline(const GC_Announces_List *gc_announces_list);
+
 bool cleanup_gca(GC_Announces_List *announces_list, const uint8_t *chat_id);
 
 /* Pack number of nodes into data of maxlength length.
@@ -1771,6 +1771,24 @@ uint8_t gc_get_role(const GC_Chat *chat, uint32_t peer_id)
     return chat->group[peernumber].role;
 }
 
+/* Fills stats with the transport statistics of the connection to peer_id.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int gc_get_peer_connection_stats(const GC_Chat *chat, uint32_t peer_id, GC_Connection_Stats *stats)
+{
+    int peernumber = get_peernumber_of_peer_id(chat, peer_id);
+    GC_Connection *gconn = gcc_get_connection(chat, peernumber);
+
+    if (gconn == NULL) {
+        return -1;
+    }
+
+    gcc_get_connection_stats(chat, gconn, stats);
+    return 0;
+}
+
 /* Copies the chat_id to dest. */
 void gc_get_chat_id(const GC_Chat *chat, uint8_t *dest)
 {
@@ -3912,6 +3930,7 @@ static int handle_gc_message_ack(GC_Chat *chat, GC_Connection *gconn, const uint
     if (gconn->send_ary[idx].message_id == request_id
             && (gconn->send_ary[idx].last_send_try != tm || gconn->send_ary[idx].time_added == tm)) {
         gconn->send_ary[idx].last_send_try = tm;
+        gcc_packet_resent(gconn, request_id);
         return sendpacket(chat->net, gconn->addr.ip_port, gconn->send_ary[idx].data, gconn->send_ary[idx].data_length);
     }
 
@@ -223,6 +223,18 @@ typedef struct {
     uint32_t    version;
 } GC_TopicInfo;
 
+/* Transport statistics of the connection to a group peer */
+typedef struct GC_Connection_Stats {
+    bool        direct_connected;
+    bool        tcp_connected;   /* true if a TCP relay to the peer is online */
+    uint64_t    rtt;   /* smoothed round trip time in ms, 0 if it hasn't been measured yet */
+    uint64_t    packets_sent;   /* lossless packets sent, not counting resends */
+    uint64_t    packets_resent;
+    uint64_t    packets_received;
+    uint32_t    send_queue;   /* lossless packets the peer hasn't acked yet */
+    uint32_t    recv_queue;   /* lossless packets waiting for missing ones before them */
+} GC_Connection_Stats;
+
 typedef struct GC_Connection GC_Connection;
 
 typedef struct GC_Chat {
@@ -484,6 +496,13 @@ uint8_t gc_get_status(const GC_Chat *chat, uint32_t peer_id);
  */
 uint8_t gc_get_role(const GC_Chat *chat, uint32_t peer_id);
 
+/* Fills stats with the transport statistics of the connection to peer_id.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int gc_get_peer_connection_stats(const GC_Chat *chat, uint32_t peer_id, GC_Connection_Stats *stats);
+
 int gc_get_peer_public_key(const GC_Chat *chat, uint32_t peernumber, uint8_t *public_key);
 
 /* Sets the role of peer_id. role must be one of: GR_MODERATOR, GR_USER, GR_OBSERVER
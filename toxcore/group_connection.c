@@ -48,7 +48,7 @@ GC_Connection *gcc_get_connection(const GC_Chat *chat, int peernumber)
 }
 
 /* Returns true if ary entry does not contain an active packet. */
-static bool ary_entry_is_empty(struct GC_Message_Ary_Entry *ary_entry)
+static bool ary_entry_is_empty(const struct GC_Message_Ary_Entry *ary_entry)
 {
     return ary_entry->time_added == 0;
 }
@@ -123,7 +123,13 @@ int gcc_add_send_ary(GC_Connection *gconn, const uint8_t *data, uint32_t length,
         return -1;
     }
 
+    if (gconn->rtt_probe_time == 0) {
+        gconn->rtt_probe_id = gconn->send_message_id;
+        gconn->rtt_probe_time = current_time_monotonic();
+    }
+
     ++gconn->send_message_id;
+    ++gconn->packets_sent;
 
     return 0;
 }
@@ -146,6 +152,12 @@ int gcc_handle_ack(GC_Connection *gconn, uint64_t message_id)
         return -1;
     }
 
+    if (gconn->rtt_probe_time != 0 && gconn->rtt_probe_id == message_id) {
+        uint64_t rtt = current_time_monotonic() - gconn->rtt_probe_time;
+        gconn->rtt = gconn->rtt == 0 ? rtt : (gconn->rtt * 7 + rtt) / 8;
+        gconn->rtt_probe_time = 0;
+    }
+
     clear_ary_entry(ary_entry);
 
     /* Put send_ary_start in proper position */
@@ -161,6 +173,38 @@ int gcc_handle_ack(GC_Connection *gconn, uint64_t message_id)
     return 0;
 }
 
+/* Updates gconn's statistics after the send_ary item with message_id was sent again. */
+void gcc_packet_resent(GC_Connection *gconn, uint64_t message_id)
+{
+    ++gconn->packets_resent;
+
+    /* the ack could be for either copy */
+    if (gconn->rtt_probe_id == message_id) {
+        gconn->rtt_probe_time = 0;
+    }
+}
+
+/* Fills stats with the transport statistics of gconn. */
+void gcc_get_connection_stats(const GC_Chat *chat, const GC_Connection *gconn, GC_Connection_Stats *stats)
+{
+    stats->direct_connected = gcc_connection_is_direct(gconn);
+    stats->tcp_connected = tcp_connection_to_online_tcp_relays(chat->tcp_conn, gconn->tcp_connection_num) != 0;
+    stats->rtt = gconn->rtt;
+    stats->packets_sent = gconn->packets_sent;
+    stats->packets_resent = gconn->packets_resent;
+    stats->packets_received = gconn->packets_received;
+    stats->send_queue = (gconn->send_message_id - gconn->send_ary_start) % GCC_BUFFER_SIZE;
+    stats->recv_queue = 0;
+
+    uint16_t i;
+
+    for (i = 0; i < GCC_BUFFER_SIZE; ++i) {
+        if (!ary_entry_is_empty(&gconn->recv_ary[i])) {
+            ++stats->recv_queue;
+        }
+    }
+}
+
 /* Decides if message need to be put in recv_ary or immediately handled.
  *
  * Return 2 if message is in correct sequence and may be handled immediately.
@@ -195,10 +239,12 @@ int gcc_handle_recv_message(GC_Chat *chat, uint32_t peernumber, const uint8_t *d
             return -1;
         }
 
+        ++gconn->packets_received;
         return 1;
     }
 
     ++gconn->recv_message_id;
+    ++gconn->packets_received;
 
     return 2;
 }
@@ -295,6 +341,7 @@ void gcc_resend_packets(Messenger *m, GC_Chat *chat, uint32_t peernumber)
         /* if this occurrs less than once per second this won't be reliable */
         if (delta > 1 && POWER_OF_2(delta)) {
             gcc_send_group_packet(chat, gconn, ary_entry->data, ary_entry->data_length, ary_entry->packet_type);
+            gcc_packet_resent(gconn, ary_entry->message_id);
             continue;
         }
 
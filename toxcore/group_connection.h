@@ -88,6 +88,13 @@ typedef struct GC_Connection {
     bool        confirmed;  /* true if this peer has given us their info */
     uint32_t    friend_shared_state_version;
     uint32_t    self_sent_shared_state_version;
+
+    uint64_t    packets_sent;   /* lossless packets added to send_ary */
+    uint64_t    packets_resent;   /* lossless packets sent again because the peer didn't ack them */
+    uint64_t    packets_received;   /* lossless packets received that weren't duplicates */
+    uint64_t    rtt;   /* smoothed round trip time in ms, 0 if it hasn't been measured yet */
+    uint64_t    rtt_probe_id;   /* message_id of the message we measure the round trip time with */
+    uint64_t    rtt_probe_time;   /* time in ms that message was added to send_ary, 0 if there is none */
 } GC_Connection;
 
 /* Return connection object for peernumber.
@@ -122,6 +129,12 @@ uint16_t get_ary_index(uint64_t message_id);
  */
 int gcc_handle_ack(GC_Connection *gconn, uint64_t message_id);
 
+/* Updates gconn's statistics after the send_ary item with message_id was sent again. */
+void gcc_packet_resent(GC_Connection *gconn, uint64_t message_id);
+
+/* Fills stats with the transport statistics of gconn. */
+void gcc_get_connection_stats(const GC_Chat *chat, const GC_Connection *gconn, GC_Connection_Stats *stats);
+
 /* Checks for and handles messages that are in proper sequence in gconn's recv_ary.
  * This should always be called after a new packet is successfully handled.
  *
@@ -0,0 +1,250 @@
+/* hash_map.c
+ *
+ * Hash map which associates ids with fixed size data
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "hash_map.h"
+#include "crypto_core.h"
+#include "util.h"
+
+/* Open addressing with linear probing:
+ * -an element lives in the first free slot at or after hash & (capacity - 1)
+ * -the slots only hold the hash and the id so that probing touches one small array,
+ *  the element itself is only compared when the hashes match
+ * -removing an element shifts the following elements of the probe sequence back
+ *  so that no tombstones are needed
+ * -the map grows when it is 3/4 full and shrinks when it is 1/8 full
+ */
+
+#define MIN_CAPACITY 8
+#define EMPTY_ID -1
+
+static uint32_t hash_data(const Hash_Map *map, const uint8_t *data)
+{
+    return (uint32_t)keyed_hash(map->hash_key, data, map->element_size);
+}
+
+/* Find data in map
+ *
+ * return value:
+ *  >= 0 : index of the slot containing data
+ *  -1   : no match
+ */
+static int64_t find(const Hash_Map *map, const uint8_t *data, uint32_t hash)
+{
+    if (map->n == 0)
+        return -1;
+
+    uint32_t mask = map->capacity - 1;
+    uint32_t i;
+
+    for (i = hash & mask; map->slots[i].id != EMPTY_ID; i = (i + 1) & mask) {
+        if (map->slots[i].hash != hash)
+            continue;
+
+        if (memcmp(map->data + (size_t)map->element_size * i, data, map->element_size) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Put an element that is not in the map yet in the first free slot. */
+static void insert(Hash_Map *map, const uint8_t *data, uint32_t hash, int id)
+{
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = hash & mask;
+
+    while (map->slots[i].id != EMPTY_ID)
+        i = (i + 1) & mask;
+
+    map->slots[i].hash = hash;
+    map->slots[i].id = id;
+    memcpy(map->data + (size_t)map->element_size * i, data, map->element_size);
+}
+
+/* Move all the elements to a new set of new_capacity slots.
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+static int resize(Hash_Map *map, uint32_t new_capacity)
+{
+    Hash_Map new_map = *map;
+
+    new_map.capacity = new_capacity;
+    new_map.slots = NULL;
+    new_map.data = NULL;
+
+    if (new_capacity != 0) {
+        new_map.slots = malloc(sizeof(Hash_Map_Slot) * new_capacity);
+        new_map.data = malloc((size_t)map->element_size * new_capacity);
+
+        if (new_map.slots == NULL || new_map.data == NULL) {
+            free(new_map.slots);
+            free(new_map.data);
+            return 0;
+        }
+
+        uint32_t i;
+
+        for (i = 0; i < new_capacity; ++i)
+            new_map.slots[i].id = EMPTY_ID;
+
+        for (i = 0; i < map->capacity; ++i) {
+            if (map->slots[i].id != EMPTY_ID)
+                insert(&new_map, map->data + (size_t)map->element_size * i, map->slots[i].hash, map->slots[i].id);
+        }
+    }
+
+    free(map->slots);
+    free(map->data);
+    *map = new_map;
+    return 1;
+}
+
+/* return the smallest capacity that fits n elements without going over 3/4 full. */
+static uint32_t capacity_for(uint32_t n)
+{
+    uint32_t capacity = MIN_CAPACITY;
+
+    while (capacity - capacity / 4 < n)
+        capacity *= 2;
+
+    return capacity;
+}
+
+int hash_map_init(Hash_Map *map, uint32_t element_size, uint32_t initial_capacity)
+{
+    map->n = 0;
+    map->capacity = 0;
+    map->element_size = element_size;
+    map->hash_key = random_64b();
+    map->slots = NULL;
+    map->data = NULL;
+
+    if (initial_capacity != 0) {
+        if (!resize(map, capacity_for(initial_capacity)))
+            return 0;
+    }
+
+    return 1;
+}
+
+void hash_map_free(Hash_Map *map)
+{
+    free(map->slots);
+    free(map->data);
+    map->slots = NULL;
+    map->data = NULL;
+    map->n = 0;
+    map->capacity = 0;
+}
+
+int hash_map_find(const Hash_Map *map, const uint8_t *data)
+{
+    int64_t i = find(map, data, hash_data(map, data));
+
+    if (i < 0)
+        return -1;
+
+    return map->slots[i].id;
+}
+
+int hash_map_add(Hash_Map *map, const uint8_t *data, int id)
+{
+    if (id < 0)
+        return 0;
+
+    uint32_t hash = hash_data(map, data);
+
+    if (find(map, data, hash) >= 0)
+        return 0;
+
+    if (map->n + 1 > map->capacity - map->capacity / 4) {
+        if (!resize(map, capacity_for(map->n + 1)))
+            return 0;
+    }
+
+    insert(map, data, hash, id);
+    ++map->n;
+    return 1;
+}
+
+int hash_map_remove(Hash_Map *map, const uint8_t *data, int id)
+{
+    int64_t found = find(map, data, hash_data(map, data));
+
+    if (found < 0)
+        return 0;
+
+    uint32_t i = found;
+
+    if (map->slots[i].id != id)
+        return 0;
+
+    uint32_t mask = map->capacity - 1;
+    uint32_t j = i;
+
+    /* Shift back every following element of the probe sequence whose home slot
+     * is not between the hole and its current slot. */
+    while (1) {
+        j = (j + 1) & mask;
+
+        if (map->slots[j].id == EMPTY_ID)
+            break;
+
+        uint32_t home = map->slots[j].hash & mask;
+
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        map->slots[i] = map->slots[j];
+        memcpy(map->data + (size_t)map->element_size * i, map->data + (size_t)map->element_size * j, map->element_size);
+        i = j;
+    }
+
+    map->slots[i].id = EMPTY_ID;
+    --map->n;
+
+    if (map->capacity > MIN_CAPACITY && map->n < map->capacity / 8)
+        resize(map, map->capacity / 2);
+
+    return 1;
+}
+
+int hash_map_trim(Hash_Map *map)
+{
+    if (map->n == 0)
+        return resize(map, 0);
+
+    uint32_t capacity = capacity_for(map->n);
+
+    if (capacity >= map->capacity)
+        return 1;
+
+    return resize(map, capacity);
+}
@@ -0,0 +1,92 @@
+/* hash_map.h
+ *
+ * Hash map which associates ids with fixed size data
+ * -Same interface as the BS_LIST in list.h
+ * -Constant time find/add/remove, use it for lists that are looked up on every packet
+ *  or that change often
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HASH_MAP_H
+#define HASH_MAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    uint32_t hash; //hash of the element in this slot
+    int id; //id of the element in this slot, -1 if the slot is empty
+} Hash_Map_Slot;
+
+typedef struct {
+    uint32_t n; //number of elements
+    uint32_t capacity; //number of slots, 0 or a power of 2
+    uint32_t element_size; //size of the elements
+    uint64_t hash_key; //random key for the hash function
+    Hash_Map_Slot *slots; //array of slots
+    uint8_t *data; //array of elements, element i belongs to slot i
+} Hash_Map;
+
+/* Initialize a map, element_size is the size of the elements in the map and
+ * initial_capacity is the number of elements the memory will be initially allocated for
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+int hash_map_init(Hash_Map *map, uint32_t element_size, uint32_t initial_capacity);
+
+/* Free a map initiated with hash_map_init */
+void hash_map_free(Hash_Map *map);
+
+/* Retrieve the id of an element in the map
+ *
+ * return value:
+ *  >= 0 : id associated with data
+ *  -1   : failure
+ */
+int hash_map_find(const Hash_Map *map, const uint8_t *data);
+
+/* Add an element with associated id to the map, id must be >= 0
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (data already in map)
+ */
+int hash_map_add(Hash_Map *map, const uint8_t *data, int id);
+
+/* Remove element from the map
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (element not found or id does not match)
+ */
+int hash_map_remove(Hash_Map *map, const uint8_t *data, int id);
+
+/* Removes the memory overhead
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+int hash_map_trim(Hash_Map *map);
+
+#endif
@@ -0,0 +1,242 @@
+/* mem_pool.c
+ *
+ * Allocator for many objects of the same size
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mem_pool.h"
+
+#include <pthread.h>
+
+/* Each object is preceded by a header that points to its slab so that freeing is O(1).
+ * The slabs that have free objects are kept in a list, slabs are only carved into
+ * objects as they are needed so that the memory of a new slab isn't touched up front.
+ */
+
+typedef struct Mem_Pool_Slab Mem_Pool_Slab;
+
+typedef union {
+    Mem_Pool_Slab *slab;
+    uint64_t align;
+} Object_Header;
+
+typedef struct Free_Object Free_Object;
+
+struct Free_Object {
+    Free_Object *next;
+};
+
+struct Mem_Pool_Slab {
+    Mem_Pool_Slab *prev, *next; /* In the list of slabs with free objects. */
+    Free_Object *free; /* Objects that were freed. */
+    uint32_t used; /* Number of allocated objects. */
+    uint32_t carved; /* Number of objects that were ever allocated. */
+};
+
+/* Round size up so that the objects after it stay aligned. */
+#define ALIGN_SIZE(size) (((size) + sizeof(Object_Header) - 1) / sizeof(Object_Header) * sizeof(Object_Header))
+
+#define SLAB_HEADER_SIZE ALIGN_SIZE(sizeof(Mem_Pool_Slab))
+
+struct Mem_Pool {
+    pthread_mutex_t mutex;
+
+    uint32_t object_size;
+    uint32_t stride; /* Object size with header and padding. */
+    uint32_t objects_per_slab;
+
+    Mem_Pool_Slab *available;
+    uint32_t num_slabs;
+    uint32_t num_empty; /* Number of slabs without allocated objects. */
+    uint32_t objects;
+};
+
+/* Number of slabs without allocated objects that are kept instead of freed. */
+#define SPARE_SLABS 1
+
+Mem_Pool *new_mem_pool(uint32_t object_size, uint32_t objects_per_slab)
+{
+    if (object_size == 0 || objects_per_slab == 0)
+        return NULL;
+
+    Mem_Pool *pool = calloc(1, sizeof(Mem_Pool));
+
+    if (pool == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    if (object_size < sizeof(Free_Object))
+        object_size = sizeof(Free_Object);
+
+    pool->object_size = object_size;
+    pool->stride = sizeof(Object_Header) + ALIGN_SIZE(object_size);
+    pool->objects_per_slab = objects_per_slab;
+    return pool;
+}
+
+void kill_mem_pool(Mem_Pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    /* Once all the objects are free every slab is in the list. */
+    Mem_Pool_Slab *slab = pool->available;
+
+    while (slab) {
+        Mem_Pool_Slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+static void link_slab(Mem_Pool *pool, Mem_Pool_Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->available;
+
+    if (pool->available)
+        pool->available->prev = slab;
+
+    pool->available = slab;
+}
+
+static void unlink_slab(Mem_Pool *pool, Mem_Pool_Slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        pool->available = slab->next;
+    }
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static _Bool slab_full(const Mem_Pool *pool, const Mem_Pool_Slab *slab)
+{
+    return slab->free == NULL && slab->carved == pool->objects_per_slab;
+}
+
+void *mem_pool_alloc(Mem_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    Mem_Pool_Slab *slab = pool->available;
+
+    if (slab == NULL) {
+        slab = malloc(SLAB_HEADER_SIZE + (size_t)pool->stride * pool->objects_per_slab);
+
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+
+        slab->free = NULL;
+        slab->used = 0;
+        slab->carved = 0;
+        link_slab(pool, slab);
+        ++pool->num_slabs;
+        ++pool->num_empty;
+    }
+
+    void *object;
+
+    if (slab->free) {
+        object = slab->free;
+        slab->free = slab->free->next;
+    } else {
+        uint8_t *base = (uint8_t *)slab + SLAB_HEADER_SIZE + (size_t)pool->stride * slab->carved;
+        ((Object_Header *)base)->slab = slab;
+        object = base + sizeof(Object_Header);
+        ++slab->carved;
+    }
+
+    if (slab->used == 0)
+        --pool->num_empty;
+
+    ++slab->used;
+    ++pool->objects;
+
+    if (slab_full(pool, slab))
+        unlink_slab(pool, slab);
+
+    pthread_mutex_unlock(&pool->mutex);
+    return object;
+}
+
+void mem_pool_free(Mem_Pool *pool, void *object)
+{
+    if (object == NULL)
+        return;
+
+    Mem_Pool_Slab *slab = ((Object_Header *)((uint8_t *)object - sizeof(Object_Header)))->slab;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (slab_full(pool, slab))
+        link_slab(pool, slab);
+
+    Free_Object *free_object = object;
+    free_object->next = slab->free;
+    slab->free = free_object;
+    --slab->used;
+    --pool->objects;
+
+    if (slab->used == 0) {
+        if (pool->num_empty < SPARE_SLABS) {
+            ++pool->num_empty;
+        } else {
+            unlink_slab(pool, slab);
+            free(slab);
+            --pool->num_slabs;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+uint32_t mem_pool_objects(Mem_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    uint32_t objects = pool->objects;
+    pthread_mutex_unlock(&pool->mutex);
+    return objects;
+}
+
+size_t mem_pool_size(Mem_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    size_t size = sizeof(Mem_Pool) + (SLAB_HEADER_SIZE + (size_t)pool->stride * pool->objects_per_slab) * pool->num_slabs;
+    pthread_mutex_unlock(&pool->mutex);
+    return size;
+}
@@ -0,0 +1,63 @@
+/* mem_pool.h
+ *
+ * Allocator for many objects of the same size
+ * -Objects are carved out of slabs of a fixed number of objects
+ * -Freed objects are reused, a slab is released once all its objects are free
+ *  (except for one spare slab)
+ * -Can be used from several threads
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct Mem_Pool Mem_Pool;
+
+/* Create a pool of objects of object_size bytes that are allocated objects_per_slab at a time.
+ *
+ * return NULL on failure.
+ */
+Mem_Pool *new_mem_pool(uint32_t object_size, uint32_t objects_per_slab);
+
+/* Free the pool and all its slabs, all the objects must have been freed.
+ */
+void kill_mem_pool(Mem_Pool *pool);
+
+/* return a new object on success.
+ * return NULL on failure.
+ */
+void *mem_pool_alloc(Mem_Pool *pool);
+
+/* Give an object allocated from pool back to it.
+ */
+void mem_pool_free(Mem_Pool *pool, void *object);
+
+/* return the number of objects currently allocated from the pool.
+ */
+uint32_t mem_pool_objects(Mem_Pool *pool);
+
+/* return the number of bytes of memory held by the pool.
+ */
+size_t mem_pool_size(Mem_Pool *pool);
+
+#endif
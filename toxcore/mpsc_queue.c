@@ -0,0 +1,84 @@
+/* mpsc_queue.c
+ *
+ * Lock-free intrusive queue with many producer threads and a single consumer thread
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mpsc_queue.h"
+#include "util.h"
+
+/* Producers only swap the head pointer and then link the previous head to their node,
+ * the consumer follows the next pointers from the tail. Between those two steps of a
+ * push the chain is broken and the consumer sees the queue as empty up to that node.
+ *
+ * The stub node is pushed back whenever the consumer is about to take the last node
+ * so that the tail never has to be set to NULL.
+ */
+
+void mpsc_queue_init(Mpsc_Queue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(Mpsc_Queue *queue, Mpsc_Node *node)
+{
+    atomic_store_ptr(&node->next, NULL, ATOMIC_RELAXED);
+    Mpsc_Node *prev = atomic_exchange_ptr(&queue->head, node, ATOMIC_ACQ_REL);
+    atomic_store_ptr(&prev->next, node, ATOMIC_RELEASE);
+}
+
+Mpsc_Node *mpsc_queue_pop(Mpsc_Queue *queue)
+{
+    Mpsc_Node *tail = queue->tail;
+    Mpsc_Node *next = atomic_load_ptr(&tail->next, ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_ptr(&tail->next, ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_ptr(&queue->head, ATOMIC_ACQUIRE))
+        return NULL;
+
+    mpsc_queue_push(queue, &queue->stub);
+    next = atomic_load_ptr(&tail->next, ATOMIC_ACQUIRE);
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
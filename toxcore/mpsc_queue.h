@@ -0,0 +1,60 @@
+/* mpsc_queue.h
+ *
+ * Lock-free intrusive queue with many producer threads and a single consumer thread
+ * -Push never blocks and never allocates, the node is embedded in the element
+ * -Only one thread may pop from a queue at a time
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct Mpsc_Node Mpsc_Node;
+
+struct Mpsc_Node {
+    Mpsc_Node *next;
+};
+
+typedef struct {
+    Mpsc_Node *head; //last pushed node, written by the producers
+    Mpsc_Node *tail; //next node to pop, only touched by the consumer
+    Mpsc_Node stub; //dummy node that keeps the queue from ever being empty
+} Mpsc_Queue;
+
+/* Initialize an empty queue. */
+void mpsc_queue_init(Mpsc_Queue *queue);
+
+/* Add node to the end of the queue, can be called from any thread.
+ * The node must stay valid until it is popped.
+ */
+void mpsc_queue_push(Mpsc_Queue *queue, Mpsc_Node *node);
+
+/* Remove the node at the front of the queue, must only be called from the consumer thread.
+ *
+ * return the node on success.
+ * return NULL if the queue is empty or if the next node is still being pushed,
+ * in which case it can be popped once the push returns.
+ */
+Mpsc_Node *mpsc_queue_pop(Mpsc_Queue *queue);
+
+#endif
@@ -31,6 +31,7 @@
 #include "util.h"
 #include "math.h"
 #include "logger.h"
+#include "mpsc_queue.h"
 
 static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_connection_id)
 {
@@ -56,6 +57,19 @@ static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_conn
 #define COOKIE_REQUEST_LENGTH (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + COOKIE_REQUEST_PLAIN_LENGTH + crypto_box_MACBYTES)
 #define COOKIE_RESPONSE_LENGTH (1 + crypto_box_NONCEBYTES + COOKIE_LENGTH + sizeof(uint64_t) + crypto_box_MACBYTES)
 
+/* Packets processed by the handshake workers. */
+#define HANDSHAKE_JOB_COOKIE_REQUEST 0 /* Cookie request received over UDP. */
+#define HANDSHAKE_JOB_NEW_CONNECTION 1 /* Handshake from a peer we have no connection with. */
+#define HANDSHAKE_JOB_CONNECTION 2 /* Handshake received on a connection. */
+
+typedef struct Handshake_Workers Handshake_Workers;
+typedef struct Decrypt_Workers Decrypt_Workers;
+
+static int queue_handshake_job(Net_Crypto *c, uint8_t type, IP_Port source, const uint8_t *packet, uint16_t length,
+                               const Crypto_Connection *conn);
+static int queue_connection_handshake(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                                      uint16_t length);
+
 /* Create a cookie request packet and put it in packet.
  * dht_public_key is the dht public key of the other
  *
@@ -164,6 +178,24 @@ static int create_cookie_response(const Net_Crypto *c, uint8_t *packet, const ui
     return COOKIE_RESPONSE_LENGTH;
 }
 
+/* Decrypt the cookie request packet of length COOKIE_REQUEST_LENGTH with shared_key.
+ * Put what was in the request in request_plain (must be of size COOKIE_REQUEST_PLAIN_LENGTH)
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int open_cookie_request(uint8_t *request_plain, const uint8_t *shared_key, const uint8_t *packet)
+{
+    int len = decrypt_data_symmetric(shared_key, packet + 1 + crypto_box_PUBLICKEYBYTES,
+                                     packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, COOKIE_REQUEST_PLAIN_LENGTH + crypto_box_MACBYTES,
+                                     request_plain);
+
+    if (len != COOKIE_REQUEST_PLAIN_LENGTH)
+        return -1;
+
+    return 0;
+}
+
 /* Handle the cookie request packet of length length.
  * Put what was in the request in request_plain (must be of size COOKIE_REQUEST_PLAIN_LENGTH)
  * Put the key used to decrypt the request into shared_key (of size crypto_box_BEFORENMBYTES) for use in the response.
@@ -179,14 +211,7 @@ static int handle_cookie_request(const Net_Crypto *c, uint8_t *request_plain, ui
 
     memcpy(dht_public_key, packet + 1, crypto_box_PUBLICKEYBYTES);
     DHT_get_shared_key_sent(c->dht, shared_key, dht_public_key);
-    int len = decrypt_data_symmetric(shared_key, packet + 1 + crypto_box_PUBLICKEYBYTES,
-                                     packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, COOKIE_REQUEST_PLAIN_LENGTH + crypto_box_MACBYTES,
-                                     request_plain);
-
-    if (len != COOKIE_REQUEST_PLAIN_LENGTH)
-        return -1;
-
-    return 0;
+    return open_cookie_request(request_plain, shared_key, packet);
 }
 
 /* Handle the cookie request packet (for raw UDP)
@@ -194,6 +219,17 @@ static int handle_cookie_request(const Net_Crypto *c, uint8_t *request_plain, ui
 static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     Net_Crypto *c = object;
+
+    if (c->handshake_workers) {
+        if (length != COOKIE_REQUEST_LENGTH)
+            return 1;
+
+        if (queue_handshake_job(c, HANDSHAKE_JOB_COOKIE_REQUEST, source, packet, length, NULL) != 0)
+            return 1;
+
+        return 0;
+    }
+
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
@@ -284,6 +320,40 @@ static int handle_cookie_response(uint8_t *cookie, uint64_t *number, const uint8
 
 #define HANDSHAKE_PACKET_LENGTH (1 + COOKIE_LENGTH + crypto_box_NONCEBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_hash_sha512_BYTES + COOKIE_LENGTH + crypto_box_MACBYTES)
 
+/* A packet processed by a handshake worker and what the worker made of it. */
+typedef struct Handshake_Job {
+    Mpsc_Node node; /* In the done queue once processed. */
+    struct Handshake_Job *next; /* Next job waiting for a worker. */
+    uint8_t type; /* One of HANDSHAKE_JOB_* */
+    int result; /* 0 if the packet was valid. */
+    IP_Port source; /* Family 0 for HANDSHAKE_JOB_CONNECTION packets relayed over TCP. */
+    uint8_t packet[HANDSHAKE_PACKET_LENGTH];
+    uint16_t length;
+
+    /* Cookie requests: our response. */
+    uint8_t response[COOKIE_RESPONSE_LENGTH];
+
+    /* Handshakes: what was in the packet. For HANDSHAKE_JOB_CONNECTION public_key is the real public key
+     * of the connection and the shared key is only precomputed if dht_public_key is the one of the connection.
+     */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t connection_dht_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t recv_nonce[crypto_box_NONCEBYTES];
+    uint8_t peersessionpublic_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t cookie[COOKIE_LENGTH];
+
+    /* Handshakes: our session, made by the worker for new connections and copied from the connection otherwise. */
+    uint8_t sent_nonce[crypto_box_NONCEBYTES];
+    uint8_t sessionpublic_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t sessionsecret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+
+    _Bool create_handshake; /* If the worker has to make our handshake. */
+    _Bool handshake_created;
+    uint8_t handshake[HANDSHAKE_PACKET_LENGTH];
+} Handshake_Job;
+
 /* Create a handshake packet and put it in packet.
  * cookie must be COOKIE_LENGTH bytes.
  * packet must be of size HANDSHAKE_PACKET_LENGTH or bigger.
@@ -384,6 +454,113 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     return &c->crypto_connections[crypt_connection_id];
 }
 
+/* Stop counting the calling thread in connection_use_counter, waking lock_connections() if it was the
+ * last one it waits for.
+ */
+static void release_connections(Net_Crypto *c)
+{
+    if (atomic_sub_fetch_u32(&c->connection_use_counter, 1, ATOMIC_SEQ_CST) == 0
+            && atomic_load_u8(&c->connections_changing, ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&c->connections_mutex);
+        pthread_cond_broadcast(&c->connections_cond);
+        pthread_mutex_unlock(&c->connections_mutex);
+    }
+}
+
+/* Use the connections array from a thread other than the one running do_net_crypto().
+ *
+ * Only waits while a connection is being created or killed.
+ */
+static void use_connections(Net_Crypto *c)
+{
+    while (1) {
+        atomic_add_fetch_u32(&c->connection_use_counter, 1, ATOMIC_SEQ_CST);
+
+        if (!atomic_load_u8(&c->connections_changing, ATOMIC_SEQ_CST))
+            return;
+
+        release_connections(c);
+
+        /* Held until the change is done. */
+        pthread_mutex_lock(&c->connections_mutex);
+
+        while (atomic_load_u8(&c->connections_changing, ATOMIC_SEQ_CST))
+            pthread_cond_wait(&c->connections_cond, &c->connections_mutex);
+
+        pthread_mutex_unlock(&c->connections_mutex);
+    }
+}
+
+/* Wait until no other thread uses the connections array and keep them from using it until
+ * unlock_connections() is called.
+ */
+static void lock_connections(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+    atomic_store_u8(&c->connections_changing, 1, ATOMIC_SEQ_CST);
+
+    while (atomic_load_u32(&c->connection_use_counter, ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&c->connections_cond, &c->connections_mutex);
+}
+
+static void unlock_connections(Net_Crypto *c)
+{
+    atomic_store_u8(&c->connections_changing, 0, ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&c->connections_cond);
+    pthread_mutex_unlock(&c->connections_mutex);
+}
+
+/* A packet submitted with submit_cryptpacket(). */
+typedef struct Submitted_Packet {
+    Mpsc_Node node; /* Must be first. */
+    struct Submitted_Packet *next; /* Next packet in the blocked list. */
+    uint16_t length;
+    uint8_t congestion_control;
+    uint8_t data[];
+} Submitted_Packet;
+
+typedef struct Submit_Queue {
+    Mpsc_Queue queue;
+    uint32_t size; /* Packets submitted and not sent yet, changed atomically. */
+
+    /* Lossless packets taken from the queue the send queue had no room for yet, in order. */
+    Submitted_Packet *blocked;
+    Submitted_Packet *blocked_last;
+} Submit_Queue;
+
+static Submit_Queue *new_submit_queue(void)
+{
+    Submit_Queue *queue = calloc(1, sizeof(Submit_Queue));
+
+    if (queue == NULL)
+        return NULL;
+
+    mpsc_queue_init(&queue->queue);
+    return queue;
+}
+
+/* Free queue with the packets still in it.
+ * No other thread may submit packets to it anymore.
+ */
+static void kill_submit_queue(Submit_Queue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&queue->queue)))
+        free(node);
+
+    while (queue->blocked) {
+        Submitted_Packet *packet = queue->blocked;
+        queue->blocked = packet->next;
+        free(packet);
+    }
+
+    free(queue);
+}
+
 
 /* Associate an ip_port to a connection.
  *
@@ -397,21 +574,26 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
     if (conn == 0)
         return -1;
 
+    uint8_t key[IP_PORT_KEY_SIZE], old_key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &ip_port);
+
     if (ip_port.ip.family == AF_INET) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && LAN_ip(conn->ip_portv4.ip) != 0) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id))
+            if (!hash_map_add(&c->ip_port_list, key, crypt_connection_id))
                 return -1;
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            ip_port_key(old_key, &conn->ip_portv4);
+            hash_map_remove(&c->ip_port_list, old_key, crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (ip_port.ip.family == AF_INET6) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id))
+            if (!hash_map_add(&c->ip_port_list, key, crypt_connection_id))
                 return -1;
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            ip_port_key(old_key, &conn->ip_portv6);
+            hash_map_remove(&c->ip_port_list, old_key, crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -457,19 +639,62 @@ IP_Port return_ip_port_connection(Net_Crypto *c, int crypt_connection_id)
     }
 }
 
-/* Sends a packet to the peer using the fastest route.
+/* Paths send_packet_to() sends a packet on. */
+enum {
+    SEND_PATH_DEFAULT, /* The direct UDP connection if it's up, TCP otherwise. */
+    SEND_PATH_TCP, /* TCP even if the direct UDP connection is up, because TCP is faster. */
+    SEND_PATH_ALL, /* Both, so that the packet gets through if one of them silently died. */
+    SEND_PATH_PING_DIRECT, /* Only the direct UDP connection, for path pings. */
+    SEND_PATH_PING_TCP /* Only TCP, for path pings. */
+};
+
+/* Send a packet to the peer through TCP.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_packet_tcp(Net_Crypto *c, Crypto_Connection *conn, const uint8_t *data, uint16_t length,
+                           _Bool update_last_sent)
+{
+    /* Packets bigger than that only ever take the direct path. */
+    if (length > MAX_CRYPTO_PACKET_SIZE)
+        return -1;
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    if (ret == 0 && update_last_sent) {
+        pthread_mutex_lock(&conn->mutex);
+        conn->last_tcp_sent = current_time_monotonic();
+        pthread_mutex_unlock(&conn->mutex);
+    }
+
+    return ret;
+}
+
+/* Sends a packet to the peer on path (SEND_PATH_*).
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length, uint8_t path)
 {
-//TODO TCP, etc...
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
+    if (path == SEND_PATH_TCP || path == SEND_PATH_PING_TCP) {
+        return send_packet_tcp(c, conn, data, length, path == SEND_PATH_TCP);
+    }
+
+    /* A copy sent through TCP doesn't mean the packets are now going through TCP. */
+    int tcp_ret = -1;
+
+    if (path == SEND_PATH_ALL)
+        tcp_ret = send_packet_tcp(c, conn, data, length, 0);
+
     int direct_send_attempt = 0;
 
     pthread_mutex_lock(&conn->mutex);
@@ -480,13 +705,16 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
         _Bool direct_connected = 0;
         crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
 
-        if (direct_connected) {
+        if (direct_connected || path == SEND_PATH_PING_DIRECT) {
             if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
+                if (tcp_ret == 0)
+                    ++conn->packets_duplicated;
+
                 pthread_mutex_unlock(&conn->mutex);
                 return 0;
             } else {
                 pthread_mutex_unlock(&conn->mutex);
-                return -1;
+                return tcp_ret;
             }
         }
 
@@ -503,19 +731,22 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     }
 
     pthread_mutex_unlock(&conn->mutex);
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
-    pthread_mutex_unlock(&c->tcp_mutex);
 
-    pthread_mutex_lock(&conn->mutex);
+    if (path == SEND_PATH_PING_DIRECT)
+        return -1;
 
-    if (ret == 0) {
-        conn->last_tcp_sent = current_time_monotonic();
+    /* Without the direct connection the copy was the packet. */
+    if (path == SEND_PATH_ALL) {
+        if (tcp_ret == 0) {
+            pthread_mutex_lock(&conn->mutex);
+            conn->last_tcp_sent = current_time_monotonic();
+            pthread_mutex_unlock(&conn->mutex);
+        }
+    } else {
+        tcp_ret = send_packet_tcp(c, conn, data, length, 1);
     }
 
-    pthread_mutex_unlock(&conn->mutex);
-
-    if (ret == 0 || direct_send_attempt) {
+    if (tcp_ret == 0 || direct_send_attempt) {
         return 0;
     }
 
@@ -533,6 +764,94 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* return the slot of packet number in the ring of array. */
+static Packet_Data **packet_slot(const Packets_Array *array, uint32_t number)
+{
+    return &array->buffer[number & (array->capacity - 1)];
+}
+
+static Packet_Data *alloc_packet(const Packets_Array *array, const Packet_Data *data)
+{
+    Packet_Data *new_d;
+
+    if (data->length > MAX_CRYPTO_DATA_SIZE) {
+        new_d = malloc(PACKET_DATA_SIZE(data->length));
+    } else {
+        new_d = array->allocator->alloc(array->allocator->object);
+    }
+
+    if (new_d == NULL)
+        return NULL;
+
+    memcpy(new_d, data, PACKET_DATA_SIZE(data->length));
+    return new_d;
+}
+
+static void free_packet(const Packets_Array *array, Packet_Data **slot)
+{
+    if ((*slot)->length > MAX_CRYPTO_DATA_SIZE) {
+        free(*slot);
+    } else {
+        array->allocator->free(array->allocator->object, *slot);
+    }
+
+    *slot = NULL;
+}
+
+/* Move the packets of array to a ring of capacity pointers.
+ * capacity must be a power of 2 that fits all the packet numbers in the array.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int resize_packets_array(Packets_Array *array, uint32_t capacity)
+{
+    Packet_Data **buffer = calloc(capacity, sizeof(Packet_Data *));
+
+    if (buffer == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = array->buffer_start; i != array->buffer_end; ++i)
+        buffer[i & (capacity - 1)] = *packet_slot(array, i);
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->capacity = capacity;
+    return 0;
+}
+
+/* Grow the ring of array so that it fits num_spots packet numbers starting at buffer_start.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int reserve_packets_array(Packets_Array *array, uint32_t num_spots)
+{
+    if (num_spots <= array->capacity || array->capacity == CRYPTO_PACKET_BUFFER_SIZE)
+        return 0;
+
+    uint32_t capacity = array->capacity ? array->capacity : CRYPTO_MIN_PACKET_BUFFER_SIZE;
+
+    while (capacity < num_spots && capacity < CRYPTO_PACKET_BUFFER_SIZE)
+        capacity *= 2;
+
+    return resize_packets_array(array, capacity);
+}
+
+/* Shrink the ring of array once it is mostly empty so that a burst doesn't keep it big. */
+static void shrink_packets_array(Packets_Array *array)
+{
+    uint32_t capacity = array->capacity;
+
+    while (capacity > CRYPTO_MIN_PACKET_BUFFER_SIZE && num_packets_array(array) < capacity / 8)
+        capacity /= 2;
+
+    if (capacity != array->capacity)
+        resize_packets_array(array, capacity);
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
@@ -543,18 +862,20 @@ static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packe
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (reserve_packets_array(array, number - array->buffer_start + 1) != 0)
+        return -1;
+
+    Packet_Data **slot = packet_slot(array, number);
 
-    if (array->buffer[num])
+    if (*slot)
         return -1;
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = alloc_packet(array, data);
 
     if (new_d == NULL)
         return -1;
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
+    *slot = new_d;
 
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start))
         array->buffer_end = number + 1;
@@ -575,12 +896,12 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
     if (array->buffer_end - number > num_spots || number - array->buffer_start >= num_spots)
         return -1;
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data *slot = *packet_slot(array, number);
 
-    if (!array->buffer[num])
+    if (!slot)
         return 0;
 
-    *data = array->buffer[num];
+    *data = slot;
     return 1;
 }
 
@@ -594,14 +915,16 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
     if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
+    if (reserve_packets_array(array, num_packets_array(array) + 1) != 0)
+        return -1;
+
+    Packet_Data *new_d = alloc_packet(array, data);
 
     if (new_d == NULL)
         return -1;
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    *packet_slot(array, id) = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -616,16 +939,16 @@ static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
     if (array->buffer_end == array->buffer_start)
         return -1;
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data **slot = packet_slot(array, array->buffer_start);
 
-    if (!array->buffer[num])
+    if (!*slot)
         return -1;
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    memcpy(data, *slot, PACKET_DATA_SIZE((*slot)->length));
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = NULL;
+    free_packet(array, slot);
+    shrink_packets_array(array);
     return id;
 }
 
@@ -644,32 +967,36 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packet_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (*slot) {
+            free_packet(array, slot);
         }
     }
 
     array->buffer_start = i;
+    shrink_packets_array(array);
     return 0;
 }
 
+/* Delete all packets in array and free its ring.
+ */
 static int clear_buffer(Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packet_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (*slot) {
+            free_packet(array, slot);
         }
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = NULL;
+    array->capacity = 0;
     return 0;
 }
 
@@ -686,6 +1013,9 @@ static int set_buffer_end(Packets_Array *array, uint32_t number)
     if ((number - array->buffer_end) > CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
+    if (reserve_packets_array(array, number - array->buffer_start) != 0)
+        return -1;
+
     array->buffer_end = number;
     return 0;
 }
@@ -714,9 +1044,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (!recv_array->buffer[num]) {
+        if (!*packet_slot(recv_array, i)) {
             data[cur_len] = n;
             n = 0;
             ++cur_len;
@@ -764,20 +1092,20 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     uint32_t requested = 0;
 
     uint64_t temp_time = current_time_monotonic();
-    uint64_t l_sent_time = ~0;
+    uint64_t l_sent_time = 0;
 
     for (i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
         if (length == 0)
             break;
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packet_slot(send_array, i);
 
         if (n == data[0]) {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if ((sent_time + rtt_time) < temp_time) {
-                    send_array->buffer[num]->sent_time = 0;
+                    (*slot)->sent_time = 0;
                 }
             }
 
@@ -786,14 +1114,13 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             n = 0;
             ++requested;
         } else {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if (l_sent_time < sent_time)
                     l_sent_time = sent_time;
 
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = NULL;
+                free_packet(send_array, slot);
             }
         }
 
@@ -816,109 +1143,179 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     return requested;
 }
 
-/** END: Array Related functions **/
-
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
-
-/* Creates and sends a data packet to the peer using the fastest route.
+/* Create a selective ack packet from recv_array into data of length.
+ *
+ * After the packet id the packet is a list of (missing, received) pairs of big endian uint16_t
+ * starting at recv_array->buffer_start: the number of packets we are missing followed by the
+ * number of packets we received after them.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return length of packet on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int generate_sack_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
 {
-    if (length == 0 || length + (1 + sizeof(uint16_t) + crypto_box_MACBYTES) > MAX_CRYPTO_PACKET_SIZE)
+    if (length == 0)
         return -1;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    data[0] = PACKET_ID_SACK;
 
-    if (conn == 0)
-        return -1;
+    uint16_t cur_len = 1;
+    uint32_t i = recv_array->buffer_start;
 
-    pthread_mutex_lock(&conn->mutex);
-    uint8_t packet[1 + sizeof(uint16_t) + length + crypto_box_MACBYTES];
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    while (i != recv_array->buffer_end && length >= cur_len + sizeof(uint16_t) * 2) {
+        uint16_t missing = 0, received = 0;
 
-    if (len + 1 + sizeof(uint16_t) != sizeof(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
-        return -1;
-    }
+        while (i != recv_array->buffer_end && !*packet_slot(recv_array, i)) {
+            ++missing;
+            ++i;
+        }
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
+        while (i != recv_array->buffer_end && *packet_slot(recv_array, i)) {
+            ++received;
+            ++i;
+        }
+
+        missing = htons(missing);
+        received = htons(received);
+        memcpy(data + cur_len, &missing, sizeof(uint16_t));
+        memcpy(data + cur_len + sizeof(uint16_t), &received, sizeof(uint16_t));
+        cur_len += sizeof(uint16_t) * 2;
+    }
 
-    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet));
+    return cur_len;
 }
 
-/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+/* A missing packet is sent again without waiting for the RTT to pass once the other received
+ * a packet this many numbers after it that we sent after it.
+ */
+#define CRYPTO_FAST_RETRANSMIT_THRESHOLD 3
+
+/* Handle a selective ack packet.
+ * Remove all the packets the other received from the array.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return number of requested packets on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int handle_sack_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
+                              uint64_t *latest_send_time, uint64_t rtt_time)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+    if (length < 1)
         return -1;
 
-    num = htonl(num);
-    buffer_start = htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length];
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
-
-    return send_data_packet(c, crypt_connection_id, packet, sizeof(packet));
-}
+    if (data[0] != PACKET_ID_SACK)
+        return -1;
 
-static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    ++data;
+    --length;
 
-    if (conn == 0)
+    if (length % (sizeof(uint16_t) * 2) != 0)
         return -1;
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    if (conn->maximum_speed_reached) {
-        Packet_Data *dt = NULL;
-        uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    uint16_t pos;
+    uint32_t num_listed = 0;
 
-        uint8_t send_failed = 0;
+    for (pos = 0; pos < length; pos += sizeof(uint16_t)) {
+        uint16_t count;
+        memcpy(&count, data + pos, sizeof(uint16_t));
+        num_listed += ntohs(count);
+    }
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
-                }
+    if (num_listed > num_packets_array(send_array))
+        return -1;
+
+    uint64_t temp_time = current_time_monotonic();
+    uint64_t l_sent_time = 0;
+    uint32_t requested = 0;
+    uint32_t end = send_array->buffer_start + num_listed;
+    /* Highest packet number the other received, valid if received_after is set. */
+    uint32_t highest_received = 0;
+    _Bool received_after = 0;
+
+    /* Go over the pairs backwards so that we know what was received after each missing packet. */
+    while (length != 0) {
+        uint16_t missing, received;
+        memcpy(&missing, data + length - sizeof(uint16_t) * 2, sizeof(uint16_t));
+        memcpy(&received, data + length - sizeof(uint16_t), sizeof(uint16_t));
+        missing = ntohs(missing);
+        received = ntohs(received);
+        length -= sizeof(uint16_t) * 2;
+
+        uint32_t i;
+
+        for (i = end - received; i != end; ++i) {
+            Packet_Data **slot = packet_slot(send_array, i);
+
+            if (*slot) {
+                if (l_sent_time < (*slot)->sent_time)
+                    l_sent_time = (*slot)->sent_time;
+
+                free_packet(send_array, slot);
             }
         }
 
-        if (!send_failed) {
-            conn->maximum_speed_reached = 0;
-        } else {
-            return -1;
+        if (received != 0 && !received_after) {
+            highest_received = end - 1;
+            received_after = 1;
+        }
+
+        end -= received;
+
+        for (i = end - missing; i != end; ++i) {
+            Packet_Data **slot = packet_slot(send_array, i);
+
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
+
+                if ((sent_time + rtt_time) < temp_time) {
+                    (*slot)->sent_time = 0;
+                } else if (sent_time != 0 && received_after && highest_received - i >= CRYPTO_FAST_RETRANSMIT_THRESHOLD
+                           && l_sent_time >= sent_time) {
+                    (*slot)->sent_time = 0;
+                }
+            }
+
+            ++requested;
         }
+
+        end -= missing;
     }
 
-    return 0;
+    if (*latest_send_time < l_sent_time)
+        *latest_send_time = l_sent_time;
+
+    return requested;
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/** END: Array Related functions **/
+
+/* Get pointer of data with packet number in the send array of conn.
+ *
+ * Adding a packet to the send array may move its ring, so every look into the ring of the send
+ * array takes conn->mutex. Packets in it are only freed by do_net_crypto().
+ *
+ * return -1 on failure.
+ * return 0 if data at number is empty.
+ * return 1 if data pointer was put in data.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int get_send_packet(Crypto_Connection *conn, Packet_Data **data, uint32_t number)
+{
+    pthread_mutex_lock(&conn->mutex);
+    int ret = get_data_pointer(&conn->send_array, data, number);
+    pthread_mutex_unlock(&conn->mutex);
+    return ret;
+}
+
+#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_JUMBO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
+
+/* Creates and sends a data packet to the peer on path (SEND_PATH_*).
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                            uint8_t path)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+    if (length == 0 || length + (1 + sizeof(uint16_t) + crypto_box_MACBYTES) > MAX_CRYPTO_JUMBO_PACKET_SIZE)
         return -1;
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
@@ -926,790 +1323,2705 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
     if (conn == 0)
         return -1;
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    reset_max_speed_reached(c, crypt_connection_id);
+    pthread_mutex_lock(&conn->mutex);
+    uint8_t packet[1 + sizeof(uint16_t) + length + crypto_box_MACBYTES];
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
 
-    if (conn->maximum_speed_reached && congestion_control) {
+    if (len + 1 + sizeof(uint16_t) != sizeof(packet)) {
+        pthread_mutex_unlock(&conn->mutex);
         return -1;
     }
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
-    pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    increment_nonce(conn->sent_nonce);
     pthread_mutex_unlock(&conn->mutex);
 
-    if (packet_num == -1)
-        return -1;
+    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet), path);
+}
 
-    if (!congestion_control && conn->maximum_speed_reached) {
-        return packet_num;
-    }
+/* Interval in ms between two PACKET_ID_PATH_PING packets on each path. */
+#define CRYPTO_PATH_PING_INTERVAL 500
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = NULL;
+/* TCP must have a lower RTT than the direct UDP connection by that many ms to be used instead of it. */
+#define CRYPTO_PATH_RTT_MARGIN 10
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1)
-            dt1->sent_time = current_time_monotonic();
-    } else {
-        conn->maximum_speed_reached = 1;
-        LOGGER_ERROR("send_data_packet failed\n");
-    }
+/* return the RTT of path in ms, at least the age of its oldest PACKET_ID_PATH_PING packet that wasn't answered.
+ */
+static uint64_t path_rtt(const Crypto_Connection *conn, unsigned int path, uint64_t temp_time)
+{
+    uint64_t rtt = conn->path_rtt[path];
 
-    return packet_num;
+    if (conn->path_ping_sent[path] != 0 && temp_time > conn->path_ping_sent[path] + rtt)
+        rtt = temp_time - conn->path_ping_sent[path];
+
+    return rtt;
 }
 
-/* Get the lowest 2 bytes from the nonce and convert
- * them to host byte format before returning them.
+/* return 1 if packets starting with packet_id go on both paths in CRYPTO_MULTIPATH_REDUNDANT mode.
+ * return 0 if they don't.
  */
-static uint16_t get_nonce_uint16(const uint8_t *nonce)
+static _Bool redundant_packet_id(const Net_Crypto *c, uint8_t packet_id)
 {
-    uint16_t num;
-    memcpy(&num, nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
-    return ntohs(num);
+    if (packet_id >= PACKET_ID_LOSSY_RANGE_START && packet_id < PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)
+        return 1;
+
+    return (c->redundant_packet_ids[packet_id / 8] >> (packet_id % 8)) & 1;
 }
 
-#define DATA_NUM_THRESHOLD 21845
+/* return 1 if the connection uses both paths.
+ * return 0 if it doesn't.
+ */
+static _Bool multipath_enabled(const Net_Crypto *c, const Crypto_Connection *conn)
+{
+    return c->multipath != CRYPTO_MULTIPATH_DISABLED && (conn->peer_capabilities & CRYPTO_CAPABILITY_MULTIPATH);
+}
 
-/* Handle a data packet.
- * Decrypt packet of length and put it into data.
- * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
- *
- * return -1 on failure.
- * return length of data on success.
+/* return the SEND_PATH_* on which a data packet with length bytes of data starting with packet_id goes.
  */
-static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
-                              uint16_t length)
+static uint8_t data_packet_path(const Net_Crypto *c, const Crypto_Connection *conn, uint8_t packet_id,
+                                uint16_t length)
 {
-    if (length <= (1 + sizeof(uint16_t) + crypto_box_MACBYTES) || length > MAX_CRYPTO_PACKET_SIZE)
-        return -1;
+    /* Only the direct path carries jumbo packets. */
+    if (!multipath_enabled(c, conn) || length > MAX_CRYPTO_DATA_SIZE)
+        return SEND_PATH_DEFAULT;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    /* The TCP path is not up, or not for long enough to know. */
+    if (conn->path_rtt[CRYPTO_PATH_TCP] == 0)
+        return SEND_PATH_DEFAULT;
 
-    if (conn == 0)
-        return -1;
+    if (c->multipath == CRYPTO_MULTIPATH_REDUNDANT && redundant_packet_id(c, packet_id))
+        return SEND_PATH_ALL;
 
-    uint8_t nonce[crypto_box_NONCEBYTES];
-    memcpy(nonce, conn->recv_nonce, crypto_box_NONCEBYTES);
-    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
-    uint16_t num;
-    memcpy(&num, packet + 1, sizeof(uint16_t));
-    num = ntohs(num);
-    uint16_t diff = num - num_cur_nonce;
-    increment_nonce_number(nonce, diff);
-    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
-                                     length - (1 + sizeof(uint16_t)), data);
+    /* Without the direct path the packet goes through TCP anyway. */
+    if (conn->path_rtt[CRYPTO_PATH_DIRECT] == 0)
+        return SEND_PATH_DEFAULT;
 
-    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
-        return -1;
+    uint64_t temp_time = current_time_monotonic();
 
-    if (diff > DATA_NUM_THRESHOLD * 2) {
-        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
-    }
+    if (path_rtt(conn, CRYPTO_PATH_TCP, temp_time) + CRYPTO_PATH_RTT_MARGIN < path_rtt(conn, CRYPTO_PATH_DIRECT, temp_time))
+        return SEND_PATH_TCP;
 
-    return len;
+    return SEND_PATH_DEFAULT;
 }
 
-/* Send a request packet.
+/* Creates and sends a data packet with buffer_start and num to the peer on path (SEND_PATH_*).
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+static int send_data_packet_path(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                 const uint8_t *data, uint16_t length, uint8_t path)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0)
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_DATA_SIZE)
         return -1;
 
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(data, sizeof(data), &conn->recv_array);
-
-    if (len == -1)
-        return -1;
+    num = htonl(num);
+    buffer_start = htonl(buffer_start);
+    /* Same padding as with MAX_CRYPTO_DATA_SIZE, never makes the packet bigger than the maximum
+     * packet size its length fits in. */
+    uint16_t padding_length = (MAX_CRYPTO_JUMBO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length];
+    memcpy(packet, &buffer_start, sizeof(uint32_t));
+    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
 
-    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
-                                   len);
+    return send_data_packet(c, crypt_connection_id, packet, sizeof(packet), path);
 }
 
-/* Send up to max num previously requested data packets.
+/* Size of the header of PACKET_ID_PART packets and of the data of a lossless packet each carries. */
+#define CRYPTO_PART_HEADER_SIZE (1 + sizeof(uint16_t) + sizeof(uint16_t))
+#define CRYPTO_PART_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - CRYPTO_PART_HEADER_SIZE)
+
+/* Send lossless packet num of length in PACKET_ID_PART packets that fit in MAX_CRYPTO_PACKET_SIZE.
+ *
+ * Each part is its id, the offset of its data in the packet and the length of the packet, both
+ * 2 bytes in network byte order, followed by CRYPTO_PART_DATA_SIZE bytes of data, fewer in the last part.
  *
  * return -1 on failure.
- * return number of packets sent on success.
+ * return 0 on success.
  */
-static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num)
+static int send_data_packet_parts(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                  const uint8_t *data, uint16_t length)
 {
-    if (max_num == 0)
-        return -1;
-
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    uint64_t temp_time = current_time_monotonic();
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    uint8_t part[MAX_CRYPTO_DATA_SIZE];
+    uint16_t packet_length = htons(length);
+    uint32_t offset;
 
-    for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        uint32_t packet_num = (i + conn->send_array.buffer_start);
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    part[0] = PACKET_ID_PART;
+    memcpy(part + 1 + sizeof(uint16_t), &packet_length, sizeof(uint16_t));
 
-        if (ret == -1) {
-            return -1;
-        } else if (ret == 0) {
-            continue;
-        }
+    for (offset = 0; offset < length; offset += CRYPTO_PART_DATA_SIZE) {
+        uint16_t part_length = length - offset;
 
-        if (dt->sent_time) {
-            continue;
-        }
+        if (part_length > CRYPTO_PART_DATA_SIZE)
+            part_length = CRYPTO_PART_DATA_SIZE;
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
-        }
+        uint16_t part_offset = htons(offset);
+        memcpy(part + 1, &part_offset, sizeof(uint16_t));
+        memcpy(part + CRYPTO_PART_HEADER_SIZE, data + offset, part_length);
 
-        if (num_sent >= max_num)
-            break;
+        if (send_data_packet_path(c, crypt_connection_id, buffer_start, num, part, CRYPTO_PART_HEADER_SIZE + part_length,
+                                  data_packet_path(c, conn, data[0], CRYPTO_PART_HEADER_SIZE + part_length)) != 0)
+            return -1;
     }
 
-    return num_sent;
+    return 0;
 }
 
-
-/* Add a new temp packet to send repeatedly.
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE)
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0 || length == 0)
         return -1;
 
+    /* Lossless packets queued before the maximum packet size fell back are sent in parts. */
+    if (length > conn->max_packet_size - CRYPTO_DATA_PACKET_MIN_SIZE && data[0] >= CRYPTO_RESERVED_PACKETS
+            && data[0] < PACKET_ID_LOSSY_RANGE_START)
+        return send_data_packet_parts(c, crypt_connection_id, buffer_start, num, data, length);
+
+    return send_data_packet_path(c, crypt_connection_id, buffer_start, num, data, length,
+                                 data_packet_path(c, conn, data[0], length));
+}
+
+static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+{
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    uint8_t *temp_packet = malloc(length);
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    if (conn->maximum_speed_reached) {
+        Packet_Data *dt = NULL;
+        pthread_mutex_lock(&conn->mutex);
+        uint32_t packet_num = conn->send_array.buffer_end - 1;
+        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        pthread_mutex_unlock(&conn->mutex);
 
-    if (temp_packet == 0)
-        return -1;
+        uint8_t send_failed = 0;
 
-    if (conn->temp_packet)
-        free(conn->temp_packet);
+        if (ret == 1) {
+            if (!dt->sent_time) {
+                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                            dt->length) != 0) {
+                    send_failed = 1;
+                } else {
+                    dt->sent_time = current_time_monotonic();
+                }
+            }
+        }
+
+        if (!send_failed) {
+            conn->maximum_speed_reached = 0;
+        } else {
+            return -1;
+        }
+    }
 
-    memcpy(temp_packet, packet, length);
-    conn->temp_packet = temp_packet;
-    conn->temp_packet_length = length;
-    conn->temp_packet_sent_time = 0;
-    conn->temp_packet_num_sent = 0;
     return 0;
 }
 
-/* Clear the temp packet.
+/* return the largest length of the lossless packets that can be written to conn.
  *
- * return -1 on failure.
- * return 0 on success.
+ * Peers that accept jumbo packets also put together PACKET_ID_PART packets, so packets sized for a
+ * maximum packet size that fell back since can still be sent to them.
  */
-static int clear_temp_packet(const Net_Crypto *c, int crypt_connection_id)
+static uint16_t crypto_max_lossless_size(const Crypto_Connection *conn)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0)
-        return -1;
+    if (conn->peer_capabilities & CRYPTO_CAPABILITY_JUMBO)
+        return MAX_CRYPTO_JUMBO_DATA_SIZE;
 
-    if (conn->temp_packet)
-        free(conn->temp_packet);
-
-    conn->temp_packet = 0;
-    conn->temp_packet_length = 0;
-    conn->temp_packet_sent_time = 0;
-    conn->temp_packet_num_sent = 0;
-    return 0;
+    return conn->max_packet_size - CRYPTO_DATA_PACKET_MIN_SIZE;
 }
 
-
-/* Send the temp packet.
- *
- * return -1 on failure.
- * return 0 on success.
+/*  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
  */
-static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
 {
+    if (length == 0)
+        return -1;
+
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    if (!conn->temp_packet)
+    if (length > crypto_max_lossless_size(conn))
         return -1;
 
-    if (send_packet_to(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length) != 0)
-        return -1;
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    reset_max_speed_reached(c, crypt_connection_id);
 
-    conn->temp_packet_sent_time = current_time_monotonic();
-    ++conn->temp_packet_num_sent;
-    return 0;
-}
+    if (conn->maximum_speed_reached && congestion_control) {
+        return -1;
+    }
 
-/* Create a handshake packet and set it as a temp packet.
- * cookie must be COOKIE_LENGTH.
- *
+    Packet_Data dt;
+    dt.sent_time = 0;
+    dt.length = length;
+    memcpy(dt.data, data, length);
+    pthread_mutex_lock(&conn->mutex);
+    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (packet_num == -1)
+        return -1;
+
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return packet_num;
+    }
+
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
+        Packet_Data *dt1 = NULL;
+        pthread_mutex_lock(&conn->mutex);
+
+        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1)
+            dt1->sent_time = current_time_monotonic();
+
+        pthread_mutex_unlock(&conn->mutex);
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_ERROR("send_data_packet failed\n");
+    }
+
+    return packet_num;
+}
+
+/* Put a lossless packet in the send queue and send it, counting it against the send rate if
+ * congestion_control is set.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ */
+static int64_t queue_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                     uint8_t congestion_control)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+
+    if (ret == -1)
+        return -1;
+
+    ++conn->total_packets_sent;
+
+    if (congestion_control) {
+        /* A coalesced packet may be sent after requested packets used up packets_left. */
+        if (conn->packets_left)
+            --conn->packets_left;
+
+        if (conn->packets_left_requested)
+            --conn->packets_left_requested;
+
+        conn->packets_sent++;
+
+        if (conn->packets_left == 0)
+            conn->last_rate_limited = current_time_monotonic();
+    }
+
+    return ret;
+}
+
+/* Send the coalesced packet of the connection if there is one.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int flush_coalesced_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    pthread_mutex_lock(&conn->mutex);
+    Packet_Data *dt = conn->coalesced_packet;
+
+    if (dt == NULL) {
+        pthread_mutex_unlock(&conn->mutex);
+        return 0;
+    }
+
+    if (queue_lossless_packet(c, crypt_connection_id, dt->data, dt->length, conn->coalesced_congestion_control) == -1) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+
+    conn->send_array.allocator->free(conn->send_array.allocator->object, dt);
+    conn->coalesced_packet = NULL;
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+/* Add a lossless packet to the coalesced packet of the connection.
+ *
+ * The coalesced packet is added to the send array last, nothing else can be added before it is, so its
+ * packet number is the current end of the send array.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number of the coalesced packet if data was put into it.
+ */
+static int64_t coalesce_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                        uint8_t congestion_control)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (conn->coalesced_packet && (uint32_t)conn->coalesced_packet->length + 1 + length > MAX_CRYPTO_DATA_SIZE) {
+        if (flush_coalesced_packet(c, crypt_connection_id) != 0) {
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+    }
+
+    if (conn->coalesced_packet == NULL) {
+        if (congestion_control && conn->packets_left == 0) {
+            conn->last_rate_limited = current_time_monotonic();
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+
+        if (num_packets_array(&conn->send_array) >= CRYPTO_PACKET_BUFFER_SIZE) {
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+
+        Packet_Data *dt = conn->send_array.allocator->alloc(conn->send_array.allocator->object);
+
+        if (dt == NULL) {
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+
+        dt->sent_time = 0;
+        dt->length = 1;
+        dt->data[0] = PACKET_ID_COALESCED;
+        conn->coalesced_packet = dt;
+        conn->coalesced_congestion_control = 0;
+    }
+
+    Packet_Data *dt = conn->coalesced_packet;
+    dt->data[dt->length] = length;
+    memcpy(dt->data + dt->length + 1, data, length);
+    dt->length += 1 + length;
+
+    if (congestion_control)
+        conn->coalesced_congestion_control = 1;
+
+    int64_t packet_num = conn->send_array.buffer_end;
+    pthread_mutex_unlock(&conn->mutex);
+    return packet_num;
+}
+
+/* Get the lowest 2 bytes from the nonce and convert
+ * them to host byte format before returning them.
+ */
+static uint16_t get_nonce_uint16(const uint8_t *nonce)
+{
+    uint16_t num;
+    memcpy(&num, nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+    return ntohs(num);
+}
+
+#define DATA_NUM_THRESHOLD 21845
+
+/* return how far the nonce of the data packet is ahead of recv_nonce.
+ */
+static uint16_t data_packet_nonce_diff(const uint8_t *recv_nonce, const uint8_t *packet)
+{
+    uint16_t num;
+    memcpy(&num, packet + 1, sizeof(uint16_t));
+    num = ntohs(num);
+    return num - get_nonce_uint16(recv_nonce);
+}
+
+/* Decrypt the data packet of length with shared_key and the nonce that follows recv_nonce
+ * and put it into data.
+ * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return -1 on failure.
+ * return length of data on success.
+ */
+static int decrypt_data_packet(const uint8_t *shared_key, const uint8_t *recv_nonce, uint8_t *data,
+                               const uint8_t *packet, uint16_t length)
+{
+    if (length <= (1 + sizeof(uint16_t) + crypto_box_MACBYTES) || length > MAX_CRYPTO_JUMBO_PACKET_SIZE)
+        return -1;
+
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    memcpy(nonce, recv_nonce, crypto_box_NONCEBYTES);
+    increment_nonce_number(nonce, data_packet_nonce_diff(recv_nonce, packet));
+    int len = decrypt_data_symmetric(shared_key, nonce, packet + 1 + sizeof(uint16_t),
+                                     length - (1 + sizeof(uint16_t)), data);
+
+    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
+        return -1;
+
+    return len;
+}
+
+/* Move the nonce of received packets forward once the peer is far enough ahead of it.
+ * Must be called with each data packet that was decrypted, in the order they were received.
+ */
+static void update_recv_nonce(Crypto_Connection *conn, const uint8_t *packet)
+{
+    if (data_packet_nonce_diff(conn->recv_nonce, packet) > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    }
+}
+
+/* Remember the number of a decrypted data packet.
+ * Must be called with each data packet that was decrypted, in the order they were received, on
+ * connections in multipath mode. Peers only send copies on those, elsewhere a late packet is not one.
+ *
+ * return 1 if a packet with that number was received before or it is too old to tell, like the copy
+ *   of a packet sent on both paths that arrived second.
+ * return 0 if it wasn't.
+ */
+static _Bool duplicate_data_packet(Crypto_Connection *conn, const uint8_t *packet)
+{
+    uint16_t num;
+    memcpy(&num, packet + 1, sizeof(uint16_t));
+    num = ntohs(num);
+
+    if (!conn->recv_window_started) {
+        memset(conn->recv_window, 0, sizeof(conn->recv_window));
+        conn->recv_window_highest = num - 1;
+        conn->recv_window_started = 1;
+    }
+
+    uint16_t ahead = num - conn->recv_window_highest;
+
+    if (ahead != 0 && ahead < (1 << 15)) {
+        if (ahead >= CRYPTO_DUPLICATE_WINDOW) {
+            memset(conn->recv_window, 0, sizeof(conn->recv_window));
+        } else {
+            uint16_t i;
+
+            for (i = conn->recv_window_highest + 1; i != num; ++i)
+                conn->recv_window[(i % CRYPTO_DUPLICATE_WINDOW) / 8] &= ~(1 << (i % 8));
+        }
+
+        conn->recv_window_highest = num;
+    } else if ((uint16_t)(conn->recv_window_highest - num) >= CRYPTO_DUPLICATE_WINDOW) {
+        ++conn->duplicates_received;
+        return 1;
+    } else if (conn->recv_window[(num % CRYPTO_DUPLICATE_WINDOW) / 8] & (1 << (num % 8))) {
+        ++conn->duplicates_received;
+        return 1;
+    }
+
+    conn->recv_window[(num % CRYPTO_DUPLICATE_WINDOW) / 8] |= (1 << (num % 8));
+    return 0;
+}
+
+/* Handle a data packet.
+ * Decrypt packet of length and put it into data.
+ * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return -1 on failure.
+ * return length of data on success.
+ */
+static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
+                              uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    int len = decrypt_data_packet(conn->shared_key, conn->recv_nonce, data, packet, length);
+
+    if (len == -1)
+        return -1;
+
+    update_recv_nonce(conn, packet);
+    return len;
+}
+
+/* Number of request packets we also send as selective ack packets to peers that never sent us one. */
+#define CRYPTO_SACK_PROBES 8
+
+/* Minimum time in ms between two request packets sent because packets arrived out of order. */
+#define CRYPTO_FAST_REQUEST_INTERVAL 10
+
+/* Send a request packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    int len;
+
+    if (!conn->peer_sack) {
+        len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+
+        if (len == -1)
+            return -1;
+
+        int ret = send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                          data, len);
+
+        /* Let the peer know that we understand selective ack packets, peers that don't drop them. */
+        if (ret == 0 && conn->status == CRYPTO_CONN_ESTABLISHED && conn->sack_probes_sent < CRYPTO_SACK_PROBES) {
+            ++conn->sack_probes_sent;
+            len = generate_sack_packet(data, sizeof(data), &conn->recv_array);
+
+            if (len != -1)
+                send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                        len);
+        }
+
+        return ret;
+    }
+
+    len = generate_sack_packet(data, sizeof(data), &conn->recv_array);
+
+    if (len == -1)
+        return -1;
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   len);
+}
+
+/* Send a request packet right away because packets arrived after one we are missing,
+ * at most once every quarter of the RTT.
+ */
+static void send_fast_request_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return;
+
+    uint64_t temp_time = current_time_monotonic();
+    uint64_t interval = conn->rtt_time / 4;
+
+    if (interval < CRYPTO_FAST_REQUEST_INTERVAL)
+        interval = CRYPTO_FAST_REQUEST_INTERVAL;
+
+    if (conn->last_fast_request_sent + interval > temp_time)
+        return;
+
+    if (send_request_packet(c, crypt_connection_id) == 0) {
+        conn->last_fast_request_sent = temp_time;
+        conn->last_request_packet_sent = temp_time;
+    }
+}
+
+/* Number of capabilities packets we send to a peer that doesn't answer with its own. */
+#define CRYPTO_CAPABILITIES_PROBES 8
+
+/* Send a capabilities packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_capabilities_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t data[3];
+    data[0] = PACKET_ID_CAPABILITIES;
+    data[1] = CRYPTO_CAPABILITY_COALESCED | CRYPTO_CAPABILITY_JUMBO;
+
+    /* Peers only send copies of packets to us if we drop them. */
+    if (c->multipath != CRYPTO_MULTIPATH_DISABLED)
+        data[1] |= CRYPTO_CAPABILITY_MULTIPATH;
+
+    data[2] = conn->peer_capabilities_known; /* Tells the peer it doesn't need to send its capabilities again. */
+    ++conn->capabilities_sent;
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   sizeof(data));
+}
+
+/* Send up to max num previously requested data packets.
+ *
+ * return -1 on failure.
+ * return number of packets sent on success.
+ */
+static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num)
+{
+    if (max_num == 0)
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint64_t temp_time = current_time_monotonic();
+    pthread_mutex_lock(&conn->mutex);
+    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    pthread_mutex_unlock(&conn->mutex);
+
+    for (i = 0; i < array_size; ++i) {
+        Packet_Data *dt;
+        uint32_t packet_num = (i + conn->send_array.buffer_start);
+        int ret = get_send_packet(conn, &dt, packet_num);
+
+        if (ret == -1) {
+            return -1;
+        } else if (ret == 0) {
+            continue;
+        }
+
+        if (dt->sent_time) {
+            continue;
+        }
+
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                    dt->length) == 0) {
+            dt->sent_time = temp_time;
+            ++num_sent;
+        }
+
+        if (num_sent >= max_num)
+            break;
+    }
+
+    return num_sent;
+}
+
+
+/* Add a new temp packet to send repeatedly.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE)
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t *temp_packet = malloc(length);
+
+    if (temp_packet == 0)
+        return -1;
+
+    if (conn->temp_packet)
+        free(conn->temp_packet);
+
+    memcpy(temp_packet, packet, length);
+    conn->temp_packet = temp_packet;
+    conn->temp_packet_length = length;
+    conn->temp_packet_sent_time = 0;
+    conn->temp_packet_num_sent = 0;
+    return 0;
+}
+
+/* Clear the temp packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int clear_temp_packet(const Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (conn->temp_packet)
+        free(conn->temp_packet);
+
+    conn->temp_packet = 0;
+    conn->temp_packet_length = 0;
+    conn->temp_packet_sent_time = 0;
+    conn->temp_packet_num_sent = 0;
+    return 0;
+}
+
+
+/* Send the temp packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (!conn->temp_packet)
+        return -1;
+
+    if (send_packet_to(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length, SEND_PATH_DEFAULT) != 0)
+        return -1;
+
+    conn->temp_packet_sent_time = current_time_monotonic();
+    ++conn->temp_packet_num_sent;
+    return 0;
+}
+
+/* Set the handshake packet of length HANDSHAKE_PACKET_LENGTH as a temp packet and send it.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_handshake(Net_Crypto *c, int crypt_connection_id, const uint8_t *handshake_packet)
+{
+    if (new_temp_packet(c, crypt_connection_id, handshake_packet, HANDSHAKE_PACKET_LENGTH) != 0)
+        return -1;
+
+    send_temp_packet(c, crypt_connection_id);
+    return 0;
+}
+
+/* Create a handshake packet and set it as a temp packet.
+ * cookie must be COOKIE_LENGTH.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_send_handshake(Net_Crypto *c, int crypt_connection_id, const uint8_t *cookie,
+                                 const uint8_t *dht_public_key)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t handshake_packet[HANDSHAKE_PACKET_LENGTH];
+
+    if (create_crypto_handshake(c, handshake_packet, cookie, conn->sent_nonce, conn->sessionpublic_key,
+                                conn->public_key, dht_public_key) != sizeof(handshake_packet))
+        return -1;
+
+    return send_handshake(c, crypt_connection_id, handshake_packet);
+}
+
+/* Use the valid handshake packet that the connection received.
+ *
+ * shared_key and handshake_packet are the session key and our handshake made by a handshake worker,
+ * NULL to make them here.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int connection_handshake_received(Net_Crypto *c, int crypt_connection_id, const uint8_t *recv_nonce,
+        const uint8_t *peersessionpublic_key, const uint8_t *dht_public_key, const uint8_t *cookie,
+        const uint8_t *shared_key, const uint8_t *handshake_packet)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING && conn->status != CRYPTO_CONN_HANDSHAKE_SENT
+            && conn->status != CRYPTO_CONN_NOT_CONFIRMED)
+        return -1;
+
+    memcpy(conn->recv_nonce, recv_nonce, crypto_box_NONCEBYTES);
+    conn->recv_window_started = 0;
+    memcpy(conn->peersessionpublic_key, peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
+
+    if (public_key_cmp(dht_public_key, conn->dht_public_key) == 0) {
+        if (shared_key) {
+            memcpy(conn->shared_key, shared_key, crypto_box_BEFORENMBYTES);
+        } else {
+            encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+        }
+
+        if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING) {
+            if (handshake_packet) {
+                if (send_handshake(c, crypt_connection_id, handshake_packet) != 0)
+                    return -1;
+            } else if (create_send_handshake(c, crypt_connection_id, cookie, dht_public_key) != 0) {
+                return -1;
+            }
+        }
+
+        conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+    } else {
+        if (conn->dht_pk_callback)
+            conn->dht_pk_callback(conn->dht_pk_callback_object, conn->dht_pk_callback_number, dht_public_key);
+    }
+
+    return 0;
+}
+
+/* Send a kill packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_kill_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t kill_packet = PACKET_ID_KILL;
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                   &kill_packet, sizeof(kill_packet));
+}
+
+static void connection_kill(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return;
+
+    if (conn->connection_status_callback) {
+        conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 0);
+    }
+
+    crypto_kill(c, crypt_connection_id);
+}
+
+/* Interval in ms between two PACKET_ID_MTU_PROBE packets of the same size. */
+#define CRYPTO_PMTU_PROBE_INTERVAL 1000
+
+/* Number of probes of a size sent without an answer before it is considered too big. */
+#define CRYPTO_PMTU_MAX_PROBES 3
+
+/* Interval in ms at which a maximum packet size above MAX_CRYPTO_PACKET_SIZE is confirmed, unless the
+ * peer acknowledged a packet of that size in the meantime. */
+#define CRYPTO_PMTU_CONFIRM_INTERVAL 15000
+
+/* Interval in ms after which a path that didn't carry bigger packets is probed again. */
+#define CRYPTO_PMTU_SEARCH_INTERVAL 600000
+
+/* Packet sizes probed, biggest first: paths with an MTU of 9000, 4470 and 1500 bytes, minus
+ * the IPv6 and UDP headers. All multiples of CRYPTO_MAX_PADDING. */
+static const uint16_t pmtu_probe_sizes[] = {MAX_CRYPTO_JUMBO_PACKET_SIZE, 4416, 1448};
+
+/* return 1 if path MTU discovery may raise the maximum packet size of the connection.
+ * return 0 if not.
+ */
+static _Bool pmtu_discovery_allowed(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 0;
+
+    if (c->pmtu_discovery == CRYPTO_PMTU_DISABLED || !(conn->peer_capabilities & CRYPTO_CAPABILITY_JUMBO))
+        return 0;
+
+    _Bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
+
+    if (!direct_connected)
+        return 0;
+
+    if (c->pmtu_discovery == CRYPTO_PMTU_LAN) {
+        pthread_mutex_lock(&conn->mutex);
+        IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+        pthread_mutex_unlock(&conn->mutex);
+        return LAN_ip(ip_port.ip) == 0;
+    }
+
+    return 1;
+}
+
+/* Send a PACKET_ID_MTU_PROBE packet of size bytes directly to the peer.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_pmtu_probe(Net_Crypto *c, int crypt_connection_id, uint16_t size)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t data[MAX_CRYPTO_JUMBO_DATA_SIZE];
+    uint16_t length = size - CRYPTO_DATA_PACKET_MIN_SIZE;
+    memset(data, 0, length);
+    data[0] = PACKET_ID_MTU_PROBE;
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   length);
+}
+
+/* Tell the peer we received a PACKET_ID_MTU_PROBE packet of size bytes.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_pmtu_ack(Net_Crypto *c, int crypt_connection_id, uint16_t size)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t data[1 + sizeof(uint16_t)];
+    data[0] = PACKET_ID_MTU_ACK;
+    size = htons(size);
+    memcpy(data + 1, &size, sizeof(uint16_t));
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   sizeof(data));
+}
+
+/* Go back to MAX_CRYPTO_PACKET_SIZE and probe again at next_search.
+ *
+ * Lossless packets that are now too big are sent again in PACKET_ID_PART packets.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int pmtu_fallback(Net_Crypto *c, int crypt_connection_id, uint64_t next_search)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    conn->pmtu_probe_size = 0;
+    conn->pmtu_probes_sent = 0;
+    conn->pmtu_next_search = next_search;
+
+    if (conn->max_packet_size == MAX_CRYPTO_PACKET_SIZE)
+        return 0;
+
+    conn->max_packet_size = MAX_CRYPTO_PACKET_SIZE;
+    return 0;
+}
+
+/* Probe for the biggest packet size the path to the peer carries and confirm it regularly.
+ *
+ * return -1 if the connection was killed.
+ * return 0 on success.
+ */
+static int do_pmtu_discovery(Net_Crypto *c, int crypt_connection_id, uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (!pmtu_discovery_allowed(c, crypt_connection_id))
+        return pmtu_fallback(c, crypt_connection_id, temp_time);
+
+    /* The peer acknowledged a packet of that size since the last confirmation was due. */
+    if (conn->max_packet_size > MAX_CRYPTO_PACKET_SIZE
+            && conn->pmtu_confirmed_time + CRYPTO_PMTU_CONFIRM_INTERVAL > temp_time) {
+        conn->pmtu_probe_size = 0;
+        conn->pmtu_probes_sent = 0;
+        return 0;
+    }
+
+    if (conn->pmtu_probe_size == 0) {
+        if (conn->max_packet_size > MAX_CRYPTO_PACKET_SIZE) {
+            conn->pmtu_probe_size = conn->max_packet_size;
+        } else if (conn->pmtu_next_search <= temp_time) {
+            conn->pmtu_probe_size = pmtu_probe_sizes[0];
+        } else {
+            return 0;
+        }
+
+        conn->pmtu_probes_sent = 0;
+    } else if (conn->pmtu_probe_time + CRYPTO_PMTU_PROBE_INTERVAL > temp_time) {
+        return 0;
+    }
+
+    if (conn->pmtu_probes_sent >= CRYPTO_PMTU_MAX_PROBES) {
+        /* The path stopped carrying packets of the size it carried before. */
+        if (conn->pmtu_probe_size == conn->max_packet_size)
+            return pmtu_fallback(c, crypt_connection_id, temp_time + CRYPTO_PMTU_SEARCH_INTERVAL);
+
+        uint16_t probe_size = 0;
+        unsigned int i;
+
+        for (i = 0; i < sizeof(pmtu_probe_sizes) / sizeof(uint16_t); ++i) {
+            if (pmtu_probe_sizes[i] < conn->pmtu_probe_size && pmtu_probe_sizes[i] > conn->max_packet_size) {
+                probe_size = pmtu_probe_sizes[i];
+                break;
+            }
+        }
+
+        conn->pmtu_probe_size = probe_size;
+        conn->pmtu_probes_sent = 0;
+
+        if (probe_size == 0) {
+            conn->pmtu_next_search = temp_time + CRYPTO_PMTU_SEARCH_INTERVAL;
+            return 0;
+        }
+    }
+
+    /* A probe too big to leave this host counts as lost. */
+    send_pmtu_probe(c, crypt_connection_id, conn->pmtu_probe_size);
+    ++conn->pmtu_probes_sent;
+    conn->pmtu_probe_time = temp_time;
+    return 0;
+}
+
+/* Send a PACKET_ID_PATH_PING or PACKET_ID_PATH_PONG packet with the path and the time of the ping on path.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_path_ping(Net_Crypto *c, int crypt_connection_id, uint8_t packet_id, uint8_t path, uint64_t ping_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t data[1 + 1 + sizeof(uint64_t)];
+    data[0] = packet_id;
+    data[1] = path;
+    host_to_net((uint8_t *)&ping_time, sizeof(uint64_t));
+    memcpy(data + 2, &ping_time, sizeof(uint64_t));
+
+    return send_data_packet_path(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                 sizeof(data), path == CRYPTO_PATH_DIRECT ? SEND_PATH_PING_DIRECT : SEND_PATH_PING_TCP);
+}
+
+/* Measure the RTT of the paths that are up with PACKET_ID_PATH_PING packets and forget it for the others.
+ */
+static void do_multipath(Net_Crypto *c, int crypt_connection_id, uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return;
+
+    if (conn->path_ping_time + CRYPTO_PATH_PING_INTERVAL > temp_time)
+        return;
+
+    _Bool up[CRYPTO_PATH_NUM] = {0};
+
+    if (multipath_enabled(c, conn)) {
+        unsigned int online_tcp_relays = 0;
+        crypto_connection_status(c, crypt_connection_id, &up[CRYPTO_PATH_DIRECT], &online_tcp_relays);
+        up[CRYPTO_PATH_TCP] = (online_tcp_relays != 0);
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < CRYPTO_PATH_NUM; ++i) {
+        if (!up[i]) {
+            conn->path_rtt[i] = 0;
+            conn->path_ping_sent[i] = 0;
+            continue;
+        }
+
+        if (send_path_ping(c, crypt_connection_id, PACKET_ID_PATH_PING, i, temp_time) == 0
+                && conn->path_ping_sent[i] == 0)
+            conn->path_ping_sent[i] = temp_time;
+    }
+
+    conn->path_ping_time = temp_time;
+}
+
+/* Handle a PACKET_ID_PATH_PING or PACKET_ID_PATH_PONG packet received on the direct path if udp is 1,
+ * through TCP otherwise.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_path_ping(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length, _Bool udp)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (length != 1 + 1 + sizeof(uint64_t) || data[1] >= CRYPTO_PATH_NUM)
+        return -1;
+
+    uint64_t ping_time;
+    memcpy(&ping_time, data + 2, sizeof(uint64_t));
+    net_to_host((uint8_t *)&ping_time, sizeof(uint64_t));
+
+    if (data[0] == PACKET_ID_PATH_PING) {
+        /* Answered on the path it came on, whatever the peer thinks it is. */
+        uint8_t path = udp ? CRYPTO_PATH_DIRECT : CRYPTO_PATH_TCP;
+        return send_path_ping(c, crypt_connection_id, PACKET_ID_PATH_PONG, path, ping_time);
+    }
+
+    uint64_t temp_time = current_time_monotonic();
+    uint8_t path = data[1];
+
+    if (ping_time > temp_time)
+        return -1;
+
+    /* The path went down since the ping was sent. */
+    if (conn->path_ping_sent[path] == 0)
+        return 0;
+
+    uint64_t rtt = temp_time - ping_time;
+
+    if (conn->path_rtt[path] == 0) {
+        conn->path_rtt[path] = rtt;
+    } else {
+        conn->path_rtt[path] = (conn->path_rtt[path] * 7 + rtt) / 8;
+    }
+
+    conn->path_ping_sent[path] = 0;
+    return 0;
+}
+
+/* Pass a lossless packet to the data callback of the connection, one packet at a time if it is
+ * a coalesced packet.
+ *
+ * return -1 if the connection was killed in the callback.
+ * return 0 on success.
+ */
+static int deliver_lossless_packet(Net_Crypto *c, int crypt_connection_id, Packet_Data *dt)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    if (dt->data[0] != PACKET_ID_COALESCED) {
+        if (conn->connection_data_callback)
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt->data,
+                                           dt->length);
+
+        return 0;
+    }
+
+    uint16_t pos = 1;
+
+    while (pos < dt->length) {
+        uint16_t length = dt->data[pos];
+        ++pos;
+
+        if (length == 0 || length > dt->length - pos)
+            break;
+
+        uint8_t *data = dt->data + pos;
+        pos += length;
+
+        if (data[0] < CRYPTO_RESERVED_PACKETS || data[0] >= PACKET_ID_LOSSY_RANGE_START)
+            continue;
+
+        if (conn->connection_data_callback)
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, data, length);
+
+        /* conn might get killed in callback. */
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Handle lossless packet num of length received on the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_lossless_packet(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *data,
+                                  uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    Packet_Data dt;
+    dt.length = length;
+    memcpy(dt.data, data, length);
+
+    _Bool new_packet = (num - conn->recv_array.buffer_end) < CRYPTO_PACKET_BUFFER_SIZE;
+
+    if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0)
+        return -1;
+
+
+    while (1) {
+        pthread_mutex_lock(&conn->mutex);
+        int ret = read_data_beg_buffer(&conn->recv_array, &dt);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret == -1)
+            break;
+
+        if (deliver_lossless_packet(c, crypt_connection_id, &dt) == -1)
+            return -1;
+
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0)
+            return -1;
+    }
+
+    /* Packet counter. */
+    ++conn->packet_counter;
+    ++conn->total_packets_received;
+
+    /* A packet before this one is still missing. */
+    if (new_packet && conn->peer_sack && num_packets_array(&conn->recv_array) != 0)
+        send_fast_request_packet(c, crypt_connection_id);
+
+    return 0;
+}
+
+/* Handle a PACKET_ID_PART packet of length holding a part of lossless packet num, see
+ * send_data_packet_parts(). The lossless packet is handled once all its parts arrived.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_part_packet(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *data,
+                              uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0 || length <= CRYPTO_PART_HEADER_SIZE)
+        return -1;
+
+    uint16_t offset, packet_length;
+    memcpy(&offset, data + 1, sizeof(uint16_t));
+    memcpy(&packet_length, data + 1 + sizeof(uint16_t), sizeof(uint16_t));
+    offset = ntohs(offset);
+    packet_length = ntohs(packet_length);
+    uint16_t part_length = length - CRYPTO_PART_HEADER_SIZE;
+
+    if (packet_length > MAX_CRYPTO_JUMBO_DATA_SIZE || offset % CRYPTO_PART_DATA_SIZE != 0 || offset >= packet_length)
+        return -1;
+
+    if (part_length != CRYPTO_PART_DATA_SIZE && part_length != packet_length - offset)
+        return -1;
+
+    /* Only one packet is put together at a time, they are sent again in order. */
+    if (conn->part_packet && (conn->part_num != num || conn->part_packet->length != packet_length)) {
+        conn->recv_array.allocator->free(conn->recv_array.allocator->object, conn->part_packet);
+        conn->part_packet = NULL;
+    }
+
+    if (conn->part_packet == NULL) {
+        conn->part_packet = conn->recv_array.allocator->alloc(conn->recv_array.allocator->object);
+
+        if (conn->part_packet == NULL)
+            return -1;
+
+        conn->part_packet->length = packet_length;
+        conn->part_num = num;
+        conn->parts_received = 0;
+    }
+
+    memcpy(conn->part_packet->data + offset, data + CRYPTO_PART_HEADER_SIZE, part_length);
+    conn->parts_received |= 1 << (offset / CRYPTO_PART_DATA_SIZE);
+
+    uint16_t num_parts = (packet_length + CRYPTO_PART_DATA_SIZE - 1) / CRYPTO_PART_DATA_SIZE;
+
+    if (conn->parts_received != (1 << num_parts) - 1)
+        return 0;
+
+    /* The connection might get killed while the packet is handled. */
+    Packet_Data *packet = conn->part_packet;
+    conn->part_packet = NULL;
+    int ret = handle_lossless_packet(c, crypt_connection_id, num, packet->data, packet->length);
+    c->packet_allocator.free(c->packet_allocator.object, packet);
+    return ret;
+}
+
+/* Handle the decrypted contents of length of a data packet received on the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_decrypted_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *data, int len, _Bool udp)
+{
+    if (len <= (int)(sizeof(uint32_t) * 2))
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint32_t buffer_start, num;
+    memcpy(&buffer_start, data, sizeof(uint32_t));
+    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
+    buffer_start = ntohl(buffer_start);
+    num = ntohl(num);
+
+    uint64_t rtt_calc_time = 0;
+    /* Send time of the newest packet the peer received, the RTT measured with it is not
+     * inflated by the time the oldest packets waited for the peer to acknowledge them. */
+    uint64_t acked_sent_time = 0;
+
+    if (buffer_start != conn->send_array.buffer_start) {
+        Packet_Data *packet_time;
+
+        pthread_mutex_lock(&conn->mutex);
+
+        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
+            rtt_calc_time = packet_time->sent_time;
+        }
+
+        if (get_data_pointer(&conn->send_array, &packet_time, buffer_start - 1) == 1) {
+            acked_sent_time = packet_time->sent_time;
+
+            if (packet_time->length > MAX_CRYPTO_DATA_SIZE)
+                conn->pmtu_confirmed_time = current_time_monotonic();
+        }
+
+        int ret = clear_buffer_until(&conn->send_array, buffer_start);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
+    uint16_t real_length = len - (sizeof(uint32_t) * 2);
+
+    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
+        ++real_data;
+        --real_length;
+
+        if (real_length == 0)
+            return -1;
+    }
+
+    if (real_data[0] == PACKET_ID_KILL) {
+        connection_kill(c, crypt_connection_id);
+        return 0;
+    }
+
+    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+        clear_temp_packet(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_ESTABLISHED;
+        send_capabilities_packet(c, crypt_connection_id);
+
+        if (conn->connection_status_callback)
+            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1);
+    }
+
+    if (real_data[0] == PACKET_ID_CAPABILITIES) {
+        if (real_length < 3)
+            return -1;
+
+        conn->peer_capabilities = real_data[1];
+        conn->peer_capabilities_known = 1;
+
+        if (real_data[2]) {
+            conn->capabilities_acked = 1;
+        } else {
+            send_capabilities_packet(c, crypt_connection_id);
+        }
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_MTU_PROBE) {
+        if (!udp)
+            return -1;
+
+        send_pmtu_ack(c, crypt_connection_id, len + 1 + sizeof(uint16_t) + crypto_box_MACBYTES);
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_MTU_ACK) {
+        if (real_length < 1 + sizeof(uint16_t))
+            return -1;
+
+        uint16_t size;
+        memcpy(&size, real_data + 1, sizeof(uint16_t));
+        size = ntohs(size);
+
+        if (conn->pmtu_probe_size != 0 && size == conn->pmtu_probe_size) {
+            conn->max_packet_size = size;
+            conn->pmtu_probe_size = 0;
+            conn->pmtu_probes_sent = 0;
+            conn->pmtu_confirmed_time = current_time_monotonic();
+        }
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_PATH_PING || real_data[0] == PACKET_ID_PATH_PONG) {
+        if (handle_path_ping(c, crypt_connection_id, real_data, real_length, udp) == -1)
+            return -1;
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_SACK) {
+        uint64_t rtt_time;
+
+        if (udp) {
+            rtt_time = conn->rtt_time;
+        } else {
+            rtt_time = DEFAULT_TCP_PING_CONNECTION;
+        }
+
+        int requested;
+        pthread_mutex_lock(&conn->mutex);
+
+        if (real_data[0] == PACKET_ID_SACK) {
+            conn->peer_sack = 1;
+            requested = handle_sack_packet(&conn->send_array, real_data, real_length, &acked_sent_time, rtt_time);
+        } else {
+            requested = handle_request_packet(&conn->send_array, real_data, real_length, &acked_sent_time, rtt_time);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (requested == -1) {
+            return -1;
+        } else {
+            //TODO?
+        }
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] == PACKET_ID_PART) {
+        if (handle_part_packet(c, crypt_connection_id, num, real_data, real_length) == -1)
+            return -1;
+
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0)
+            return -1;
+    } else if ((real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START)
+               || real_data[0] == PACKET_ID_COALESCED) {
+        if (handle_lossless_packet(c, crypt_connection_id, num, real_data, real_length) == -1)
+            return -1;
+
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0)
+            return -1;
+    } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
+               real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
+
+        set_buffer_end(&conn->recv_array, num);
+
+        if (conn->connection_lossy_data_callback)
+            conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
+                                                 conn->connection_lossy_data_callback_id, real_data, real_length);
+
+    } else {
+        return -1;
+    }
+
+    uint64_t temp_time = current_time_monotonic();
+
+    if (rtt_calc_time != 0) {
+        uint64_t rtt_time = temp_time - rtt_calc_time;
+
+        if (rtt_time < conn->rtt_time)
+            conn->rtt_time = rtt_time;
+    }
+
+    if (acked_sent_time != 0 && c->congestion_control->rtt_sample)
+        c->congestion_control->rtt_sample(conn, temp_time - acked_sent_time, temp_time);
+
+    return 0;
+}
+
+/* Handle a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                     _Bool udp)
+{
+    if (length > MAX_CRYPTO_JUMBO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE)
+        return -1;
+
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+
+    if (len == -1)
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    /* Still proof that the path it came on works. */
+    if (multipath_enabled(c, conn) && duplicate_data_packet(conn, packet))
+        return 0;
+
+    return handle_decrypted_data_packet(c, crypt_connection_id, data, len, udp);
+}
+
+/* Handle a packet that was received for the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                    _Bool udp)
+{
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_PACKET_SIZE)
+        return -1;
+
+    if (packet[0] != NET_PACKET_CRYPTO_DATA && length > MAX_CRYPTO_PACKET_SIZE)
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    switch (packet[0]) {
+        case NET_PACKET_COOKIE_RESPONSE: {
+            if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING)
+                return -1;
+
+            uint8_t cookie[COOKIE_LENGTH];
+            uint64_t number;
+
+            if (handle_cookie_response(cookie, &number, packet, length, conn->shared_key) != sizeof(cookie))
+                return -1;
+
+            if (number != conn->cookie_request_number)
+                return -1;
+
+            if (create_send_handshake(c, crypt_connection_id, cookie, conn->dht_public_key) != 0)
+                return -1;
+
+            conn->status = CRYPTO_CONN_HANDSHAKE_SENT;
+            return 0;
+        }
+
+        case NET_PACKET_CRYPTO_HS: {
+            if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
+                    || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+                if (c->handshake_workers) {
+                    IP_Port source;
+                    memset(&source, 0, sizeof(source));
+                    return queue_connection_handshake(c, crypt_connection_id, source, packet, length);
+                }
+
+                uint8_t recv_nonce[crypto_box_NONCEBYTES];
+                uint8_t peersessionpublic_key[crypto_box_PUBLICKEYBYTES];
+                uint8_t peer_real_pk[crypto_box_PUBLICKEYBYTES];
+                uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
+                uint8_t cookie[COOKIE_LENGTH];
+
+                if (handle_crypto_handshake(c, recv_nonce, peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
+                                            packet, length, conn->public_key) != 0)
+                    return -1;
+
+                return connection_handshake_received(c, crypt_connection_id, recv_nonce, peersessionpublic_key,
+                                                     dht_public_key, cookie, NULL, NULL);
+            } else {
+                return -1;
+            }
+
+            return 0;
+        }
+
+        case NET_PACKET_CRYPTO_DATA: {
+            if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
+                return handle_data_packet_helper(c, crypt_connection_id, packet, length, udp);
+            } else {
+                return -1;
+            }
+
+            return 0;
+        }
+
+        default: {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Set the size of the friend list to numfriends.
+ *
+ *  return -1 if realloc fails.
+ *  return 0 if it succeeds.
+ */
+static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
+{
+    if (num == 0) {
+        free(c->crypto_connections);
+        c->crypto_connections = NULL;
+        return 0;
+    }
+
+    Crypto_Connection *newcrypto_connections = realloc(c->crypto_connections, num * sizeof(Crypto_Connection));
+
+    if (newcrypto_connections == NULL)
+        return -1;
+
+    c->crypto_connections = newcrypto_connections;
+    return 0;
+}
+
+
+/* Create a new empty crypto connection.
+ *
+ * return -1 on failure.
+ * return connection id on success.
+ */
+static int create_crypto_connection(Net_Crypto *c)
+{
+    Submit_Queue *submit_queue = new_submit_queue();
+
+    if (submit_queue == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
+            c->crypto_connections[i].send_array.allocator = &c->packet_allocator;
+            c->crypto_connections[i].recv_array.allocator = &c->packet_allocator;
+            c->crypto_connections[i].max_packet_size = MAX_CRYPTO_PACKET_SIZE;
+            atomic_store_ptr(&c->crypto_connections[i].submit_queue, submit_queue, ATOMIC_RELEASE);
+            return i;
+        }
+    }
+
+    lock_connections(c);
+
+    int id = -1;
+
+    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
+        id = c->crypto_connections_length;
+        ++c->crypto_connections_length;
+        memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
+        c->crypto_connections[id].send_array.allocator = &c->packet_allocator;
+        c->crypto_connections[id].recv_array.allocator = &c->packet_allocator;
+        c->crypto_connections[id].max_packet_size = MAX_CRYPTO_PACKET_SIZE;
+        c->crypto_connections[id].submit_queue = submit_queue;
+
+        /* Recursive, the coalesced packet is sent with it held. */
+        if (create_recursive_mutex(&c->crypto_connections[id].mutex) != 0) {
+            c->crypto_connections[id].submit_queue = NULL;
+            kill_submit_queue(submit_queue);
+            unlock_connections(c);
+            return -1;
+        }
+    } else {
+        kill_submit_queue(submit_queue);
+    }
+
+    unlock_connections(c);
+    return id;
+}
+
+/* Wipe a crypto connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    if (crypt_connection_id_not_valid(c, crypt_connection_id))
+        return -1;
+
+    uint32_t i;
+
+    if (c->crypto_connections[crypt_connection_id].status != CRYPTO_CONN_NO_CONNECTION) {
+        hash_map_remove(&c->real_pk_list, c->crypto_connections[crypt_connection_id].public_key, crypt_connection_id);
+    }
+
+    /* Keep mutex, only destroy it when connection is realloced out. */
+    pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
+    sodium_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
+    c->crypto_connections[crypt_connection_id].mutex = mutex;
+
+    for (i = c->crypto_connections_length; i != 0; --i) {
+        if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
+            pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
+        } else {
+            break;
+        }
+    }
+
+    if (c->crypto_connections_length != i) {
+        c->crypto_connections_length = i;
+        realloc_cryptoconnection(c, c->crypto_connections_length);
+    }
+
+    return 0;
+}
+
+/* Get crypto connection id from public key of peer.
+ *
+ *  return -1 if there are no connections like we are looking for.
+ *  return id if it found it.
+ */
+static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
+{
+    return hash_map_find(&c->real_pk_list, public_key);
+}
+
+/* Add a connection that was just set up to the public key lookup list.
+ *
  * return -1 on failure.
  * return 0 on success.
  */
-static int create_send_handshake(Net_Crypto *c, int crypt_connection_id, const uint8_t *cookie,
-                                 const uint8_t *dht_public_key)
+static int add_pk_lists_connection(Net_Crypto *c, int crypt_connection_id)
 {
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    uint8_t handshake_packet[HANDSHAKE_PACKET_LENGTH];
-
-    if (create_crypto_handshake(c, handshake_packet, cookie, conn->sent_nonce, conn->sessionpublic_key,
-                                conn->public_key, dht_public_key) != sizeof(handshake_packet))
-        return -1;
-
-    if (new_temp_packet(c, crypt_connection_id, handshake_packet, sizeof(handshake_packet)) != 0)
+    if (!hash_map_add(&c->real_pk_list, conn->public_key, crypt_connection_id))
         return -1;
 
-    send_temp_packet(c, crypt_connection_id);
     return 0;
 }
 
-/* Send a kill packet.
+/* Add a source to the crypto connection.
+ * This is to be used only when we have received a packet from that source.
  *
- * return -1 on failure.
- * return 0 on success.
+ *  return -1 on failure.
+ *  return positive number on success.
+ *  0 if source was a direct UDP connection.
  */
-static int send_kill_packet(Net_Crypto *c, int crypt_connection_id)
+static int crypto_connection_add_source(Net_Crypto *c, int crypt_connection_id, IP_Port source)
 {
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    uint8_t kill_packet = PACKET_ID_KILL;
-    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
-                                   &kill_packet, sizeof(kill_packet));
+    if (source.ip.family == AF_INET || source.ip.family == AF_INET6) {
+        if (add_ip_port_connection(c, crypt_connection_id, source) != 0)
+            return -1;
+
+        if (source.ip.family == AF_INET) {
+            conn->direct_lastrecv_timev4 = unix_time();
+        } else {
+            conn->direct_lastrecv_timev6 = unix_time();
+        }
+
+        return 0;
+    } else if (source.ip.family == TCP_FAMILY) {
+        if (add_tcp_number_relay_connection(c->tcp_c, conn->connection_number_tcp, source.ip.ip6.uint32[0]) == 0)
+            return 1;
+    }
+
+    return -1;
 }
 
-static void connection_kill(Net_Crypto *c, int crypt_connection_id)
+
+/* Set function to be called when someone requests a new connection to us.
+ *
+ * The set function should return -1 on failure and 0 on success.
+ *
+ * n_c is only valid for the duration of the function call.
+ */
+void new_connection_handler(Net_Crypto *c, int (*new_connection_callback)(void *object, New_Connection *n_c),
+                            void *object)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    c->new_connection_callback = new_connection_callback;
+    c->new_connection_callback_object = object;
+}
 
-    if (conn == 0)
-        return;
+/* Use the valid handshake packet of someone who wants to initiate a new connection with us.
+ * This calls the callback set by new_connection_handler().
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int new_connection_handshake_received(Net_Crypto *c, New_Connection *n_c)
+{
+    int crypt_connection_id = getcryptconnection_id(c, n_c->public_key);
 
-    if (conn->connection_status_callback) {
-        conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 0);
+    if (crypt_connection_id != -1) {
+        Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (public_key_cmp(n_c->dht_public_key, conn->dht_public_key) != 0) {
+            connection_kill(c, crypt_connection_id);
+        } else {
+            int ret = -1;
+
+            /* We were connecting to them at the same time, the session keys of a worker are of no use here. */
+            if (conn && (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT)) {
+                memcpy(conn->recv_nonce, n_c->recv_nonce, crypto_box_NONCEBYTES);
+                conn->recv_window_started = 0;
+                memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
+                encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+
+                crypto_connection_add_source(c, crypt_connection_id, n_c->source);
+
+                if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) == 0) {
+                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+                    ret = 0;
+                }
+            }
+
+            return ret;
+        }
     }
 
-    crypto_kill(c, crypt_connection_id);
+    return c->new_connection_callback(c->new_connection_callback_object, n_c);
 }
 
-/* Handle a received data packet.
+/* Handle a handshake packet by someone who wants to initiate a new connection with us.
+ * This calls the callback set by new_connection_handler() if the handshake is ok.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                     _Bool udp)
+static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length)
 {
-    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE)
+    if (c->handshake_workers) {
+        if (length != HANDSHAKE_PACKET_LENGTH)
+            return -1;
+
+        return queue_handshake_job(c, HANDSHAKE_JOB_NEW_CONNECTION, source, data, length, NULL);
+    }
+
+    New_Connection n_c;
+    n_c.cookie = malloc(COOKIE_LENGTH);
+
+    if (n_c.cookie == NULL)
         return -1;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    n_c.source = source;
+    n_c.cookie_length = COOKIE_LENGTH;
 
-    if (conn == 0)
+    if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
+                                n_c.cookie, data, length, 0) != 0) {
+        free(n_c.cookie);
         return -1;
+    }
 
-    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
-    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+    int ret = new_connection_handshake_received(c, &n_c);
+    free(n_c.cookie);
+    return ret;
+}
 
-    if (len <= (int)(sizeof(uint32_t) * 2))
+/* Accept a crypto connection.
+ *
+ * return -1 on failure.
+ * return connection id on success.
+ */
+int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
+{
+    if (getcryptconnection_id(c, n_c->public_key) != -1)
         return -1;
 
-    uint32_t buffer_start, num;
-    memcpy(&buffer_start, data, sizeof(uint32_t));
-    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
-    buffer_start = ntohl(buffer_start);
-    num = ntohl(num);
+    int crypt_connection_id = create_crypto_connection(c);
 
-    uint64_t rtt_calc_time = 0;
+    if (crypt_connection_id == -1)
+        return -1;
 
-    if (buffer_start != conn->send_array.buffer_start) {
-        Packet_Data *packet_time;
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
 
-        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
-            rtt_calc_time = packet_time->sent_time;
-        }
+    if (n_c->cookie_length != COOKIE_LENGTH)
+        return -1;
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
-            return -1;
-        }
+    /* Session keys and handshake a handshake worker prepared for this connection. */
+    const Handshake_Job *precomputed = c->new_connection_job;
+
+    if (precomputed && (public_key_cmp(precomputed->public_key, n_c->public_key) != 0
+                        || public_key_cmp(precomputed->peersessionpublic_key, n_c->peersessionpublic_key) != 0))
+        precomputed = NULL;
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, n_c->dht_public_key, crypt_connection_id);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    if (connection_number_tcp == -1)
+        return -1;
+
+    conn->connection_number_tcp = connection_number_tcp;
+    memcpy(conn->public_key, n_c->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(conn->recv_nonce, n_c->recv_nonce, crypto_box_NONCEBYTES);
+    memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
+
+    if (precomputed) {
+        memcpy(conn->sent_nonce, precomputed->sent_nonce, crypto_box_NONCEBYTES);
+        memcpy(conn->sessionpublic_key, precomputed->sessionpublic_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(conn->sessionsecret_key, precomputed->sessionsecret_key, crypto_box_SECRETKEYBYTES);
+        memcpy(conn->shared_key, precomputed->shared_key, crypto_box_BEFORENMBYTES);
+    } else {
+        random_nonce(conn->sent_nonce);
+        crypto_box_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
+        encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
     }
 
-    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
-    uint16_t real_length = len - (sizeof(uint32_t) * 2);
+    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
 
-    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
-        ++real_data;
-        --real_length;
+    int ret;
 
-        if (real_length == 0)
-            return -1;
+    if (precomputed) {
+        ret = send_handshake(c, crypt_connection_id, precomputed->handshake);
+    } else {
+        ret = create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key);
     }
 
-    if (real_data[0] == PACKET_ID_KILL) {
-        connection_kill(c, crypt_connection_id);
-        return 0;
+    if (ret != 0) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        return -1;
     }
 
-    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-        clear_temp_packet(c, crypt_connection_id);
-        conn->status = CRYPTO_CONN_ESTABLISHED;
+    memcpy(conn->dht_public_key, n_c->dht_public_key, crypto_box_PUBLICKEYBYTES);
+    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
+    conn->rtt_time = DEFAULT_PING_CONNECTION;
 
-        if (conn->connection_status_callback)
-            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1);
+    if (add_pk_lists_connection(c, crypt_connection_id) != 0) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        return -1;
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
-        uint64_t rtt_time;
+    crypto_connection_add_source(c, crypt_connection_id, n_c->source);
+    return crypt_connection_id;
+}
 
-        if (udp) {
-            rtt_time = conn->rtt_time;
-        } else {
-            rtt_time = DEFAULT_TCP_PING_CONNECTION;
-        }
+/* Number of jobs allocated at a time by the job pool of the handshake workers. */
+#define HANDSHAKE_JOB_POOL_SLAB_SIZE 32
 
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
+/* Interval in ms to run do_net_crypto() at while the handshake or decrypt workers have jobs. */
+#define CRYPTO_WORKERS_RUN_INTERVAL 1
 
-        if (requested == -1) {
-            return -1;
-        } else {
-            //TODO?
+struct Handshake_Workers {
+    Net_Crypto *c;
+    pthread_t threads[CRYPTO_MAX_HANDSHAKE_WORKERS];
+    unsigned int num_threads;
+
+    /* Jobs waiting for a worker, protected by mutex. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Handshake_Job *first, *last;
+    _Bool stop;
+
+    Mpsc_Queue done; /* Jobs processed by the workers, popped by do_net_crypto(). */
+    Mem_Pool *pool;
+
+    /* Only touched by the thread running net_crypto. */
+    uint32_t queued;
+    uint64_t processed, dropped;
+};
+
+/* Do the crypto of job, only reads the keys of c.
+ */
+static void process_handshake_job(const Net_Crypto *c, Handshake_Job *job)
+{
+    switch (job->type) {
+        case HANDSHAKE_JOB_COOKIE_REQUEST: {
+            uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
+            memcpy(job->dht_public_key, job->packet + 1, crypto_box_PUBLICKEYBYTES);
+            /* The shared key cache of the DHT can only be used by its own thread. */
+            encrypt_precompute(job->dht_public_key, c->dht->self_secret_key, job->shared_key);
+
+            if (open_cookie_request(request_plain, job->shared_key, job->packet) != 0)
+                return;
+
+            if (create_cookie_response(c, job->response, request_plain, job->shared_key,
+                                       job->dht_public_key) != sizeof(job->response))
+                return;
+
+            break;
         }
 
-        set_buffer_end(&conn->recv_array, num);
-    } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
-        Packet_Data dt;
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
+        case HANDSHAKE_JOB_NEW_CONNECTION: {
+            if (handle_crypto_handshake(c, job->recv_nonce, job->peersessionpublic_key, job->public_key, job->dht_public_key,
+                                        job->cookie, job->packet, job->length, 0) != 0)
+                return;
 
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0)
-            return -1;
+            random_nonce(job->sent_nonce);
+            crypto_box_keypair(job->sessionpublic_key, job->sessionsecret_key);
+            encrypt_precompute(job->peersessionpublic_key, job->sessionsecret_key, job->shared_key);
+            break;
+        }
 
+        case HANDSHAKE_JOB_CONNECTION: {
+            uint8_t peer_real_pk[crypto_box_PUBLICKEYBYTES];
 
-        while (1) {
-            pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(&conn->recv_array, &dt);
-            pthread_mutex_unlock(&conn->mutex);
+            if (handle_crypto_handshake(c, job->recv_nonce, job->peersessionpublic_key, peer_real_pk, job->dht_public_key,
+                                        job->cookie, job->packet, job->length, job->public_key) != 0)
+                return;
 
-            if (ret == -1)
+            if (public_key_cmp(job->dht_public_key, job->connection_dht_public_key) != 0) {
+                job->create_handshake = 0;
                 break;
+            }
 
-            if (conn->connection_data_callback)
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length);
+            encrypt_precompute(job->peersessionpublic_key, job->sessionsecret_key, job->shared_key);
+            break;
+        }
 
-            /* conn might get killed in callback. */
-            conn = get_crypto_connection(c, crypt_connection_id);
+        default:
+            return;
+    }
+
+    if (job->create_handshake) {
+        job->handshake_created = (create_crypto_handshake(c, job->handshake, job->cookie, job->sent_nonce,
+                                  job->sessionpublic_key, job->public_key, job->dht_public_key) == sizeof(job->handshake));
+    }
+
+    job->result = 0;
+}
+
+static void *run_handshake_worker(void *arg)
+{
+    Handshake_Workers *workers = arg;
+
+    pthread_mutex_lock(&workers->mutex);
+
+    while (!workers->stop) {
+        Handshake_Job *job = workers->first;
+
+        if (job == NULL) {
+            pthread_cond_wait(&workers->cond, &workers->mutex);
+            continue;
+        }
+
+        workers->first = job->next;
+
+        if (workers->first == NULL)
+            workers->last = NULL;
+
+        pthread_mutex_unlock(&workers->mutex);
+        process_handshake_job(workers->c, job);
+        mpsc_queue_push(&workers->done, &job->node);
+        pthread_mutex_lock(&workers->mutex);
+    }
+
+    pthread_mutex_unlock(&workers->mutex);
+    return NULL;
+}
+
+static void free_handshake_job(Handshake_Workers *workers, Handshake_Job *job)
+{
+    sodium_memzero(job, sizeof(Handshake_Job));
+    mem_pool_free(workers->pool, job);
+}
 
-            if (conn == 0)
-                return -1;
-        }
+/* Queue the packet of length received from source to the handshake workers.
+ * conn is the connection the packet was received on for HANDSHAKE_JOB_CONNECTION.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int queue_handshake_job(Net_Crypto *c, uint8_t type, IP_Port source, const uint8_t *packet, uint16_t length,
+                               const Crypto_Connection *conn)
+{
+    Handshake_Workers *workers = c->handshake_workers;
 
-        /* Packet counter. */
-        ++conn->packet_counter;
-    } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
-               real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
+    if (length > HANDSHAKE_PACKET_LENGTH)
+        return -1;
 
-        set_buffer_end(&conn->recv_array, num);
+    if (workers->queued >= CRYPTO_MAX_HANDSHAKE_JOBS) {
+        ++workers->dropped;
+        return -1;
+    }
 
-        if (conn->connection_lossy_data_callback)
-            conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
-                                                 conn->connection_lossy_data_callback_id, real_data, real_length);
+    Handshake_Job *job = mem_pool_alloc(workers->pool);
 
-    } else {
+    if (job == NULL)
         return -1;
+
+    memset(job, 0, sizeof(Handshake_Job));
+    job->type = type;
+    job->result = -1;
+    job->source = source;
+    memcpy(job->packet, packet, length);
+    job->length = length;
+
+    if (type == HANDSHAKE_JOB_NEW_CONNECTION) {
+        job->create_handshake = 1;
+    } else if (type == HANDSHAKE_JOB_CONNECTION) {
+        memcpy(job->public_key, conn->public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(job->connection_dht_public_key, conn->dht_public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(job->sent_nonce, conn->sent_nonce, crypto_box_NONCEBYTES);
+        memcpy(job->sessionpublic_key, conn->sessionpublic_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(job->sessionsecret_key, conn->sessionsecret_key, crypto_box_SECRETKEYBYTES);
+        job->create_handshake = (conn->status == CRYPTO_CONN_COOKIE_REQUESTING);
     }
 
-    if (rtt_calc_time != 0) {
-        uint64_t rtt_time = current_time_monotonic() - rtt_calc_time;
+    pthread_mutex_lock(&workers->mutex);
 
-        if (rtt_time < conn->rtt_time)
-            conn->rtt_time = rtt_time;
+    if (workers->last) {
+        workers->last->next = job;
+    } else {
+        workers->first = job;
     }
 
+    workers->last = job;
+    pthread_cond_signal(&workers->cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    ++workers->queued;
     return 0;
 }
 
-/* Handle a packet that was received for the connection.
+/* Queue the handshake packet of length received for the connection to the handshake workers.
+ * source is where the packet came from, with family 0 if it was relayed over TCP.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                    _Bool udp)
+static int queue_connection_handshake(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                                      uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE)
-        return -1;
-
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
 
-    switch (packet[0]) {
-        case NET_PACKET_COOKIE_RESPONSE: {
-            if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING)
-                return -1;
-
-            uint8_t cookie[COOKIE_LENGTH];
-            uint64_t number;
+    if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING && conn->status != CRYPTO_CONN_HANDSHAKE_SENT
+            && conn->status != CRYPTO_CONN_NOT_CONFIRMED)
+        return -1;
 
-            if (handle_cookie_response(cookie, &number, packet, length, conn->shared_key) != sizeof(cookie))
-                return -1;
+    return queue_handshake_job(c, HANDSHAKE_JOB_CONNECTION, source, packet, length, conn);
+}
 
-            if (number != conn->cookie_request_number)
-                return -1;
+/* Use the result of a job processed by a handshake worker.
+ */
+static void handshake_job_done(Net_Crypto *c, Handshake_Job *job)
+{
+    if (job->result != 0)
+        return;
 
-            if (create_send_handshake(c, crypt_connection_id, cookie, conn->dht_public_key) != 0)
-                return -1;
+    switch (job->type) {
+        case HANDSHAKE_JOB_COOKIE_REQUEST: {
+            sendpacket(c->dht->net, job->source, job->response, sizeof(job->response));
+            break;
+        }
 
-            conn->status = CRYPTO_CONN_HANDSHAKE_SENT;
-            return 0;
+        case HANDSHAKE_JOB_NEW_CONNECTION: {
+            New_Connection n_c;
+            n_c.source = job->source;
+            memcpy(n_c.public_key, job->public_key, crypto_box_PUBLICKEYBYTES);
+            memcpy(n_c.dht_public_key, job->dht_public_key, crypto_box_PUBLICKEYBYTES);
+            memcpy(n_c.recv_nonce, job->recv_nonce, crypto_box_NONCEBYTES);
+            memcpy(n_c.peersessionpublic_key, job->peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
+            n_c.cookie = job->cookie;
+            n_c.cookie_length = COOKIE_LENGTH;
+            c->new_connection_job = job->handshake_created ? job : NULL;
+            new_connection_handshake_received(c, &n_c);
+            c->new_connection_job = NULL;
+            break;
         }
 
-        case NET_PACKET_CRYPTO_HS: {
-            if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
-                    || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-                uint8_t peer_real_pk[crypto_box_PUBLICKEYBYTES];
-                uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
-                uint8_t cookie[COOKIE_LENGTH];
+        case HANDSHAKE_JOB_CONNECTION: {
+            int crypt_connection_id = getcryptconnection_id(c, job->public_key);
+            Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-                if (handle_crypto_handshake(c, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
-                                            packet, length, conn->public_key) != 0)
-                    return -1;
+            /* The connection was killed or a new session started while the job was processed. */
+            if (conn == 0 || public_key_cmp(conn->sessionpublic_key, job->sessionpublic_key) != 0)
+                break;
 
-                if (public_key_cmp(dht_public_key, conn->dht_public_key) == 0) {
-                    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+            const uint8_t *shared_key = NULL, *handshake_packet = NULL;
 
-                    if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING) {
-                        if (create_send_handshake(c, crypt_connection_id, cookie, dht_public_key) != 0)
-                            return -1;
-                    }
+            if (public_key_cmp(job->dht_public_key, conn->dht_public_key) == 0)
+                shared_key = job->shared_key;
 
-                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
-                } else {
-                    if (conn->dht_pk_callback)
-                        conn->dht_pk_callback(conn->dht_pk_callback_object, conn->dht_pk_callback_number, dht_public_key);
-                }
+            if (job->handshake_created && memcmp(conn->sent_nonce, job->sent_nonce, crypto_box_NONCEBYTES) == 0)
+                handshake_packet = job->handshake;
 
-            } else {
-                return -1;
-            }
+            if (connection_handshake_received(c, crypt_connection_id, job->recv_nonce, job->peersessionpublic_key,
+                                              job->dht_public_key, job->cookie, shared_key, handshake_packet) != 0)
+                break;
 
-            return 0;
-        }
+            /* A direct handshake only counts as a direct packet once it was found valid. */
+            conn = get_crypto_connection(c, crypt_connection_id);
 
-        case NET_PACKET_CRYPTO_DATA: {
-            if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
-                return handle_data_packet_helper(c, crypt_connection_id, packet, length, udp);
+            if (conn == 0 || (job->source.ip.family != AF_INET && job->source.ip.family != AF_INET6))
+                break;
+
+            pthread_mutex_lock(&conn->mutex);
+
+            if (job->source.ip.family == AF_INET) {
+                conn->direct_lastrecv_timev4 = unix_time();
             } else {
-                return -1;
+                conn->direct_lastrecv_timev6 = unix_time();
             }
 
-            return 0;
-        }
-
-        default: {
-            return -1;
+            pthread_mutex_unlock(&conn->mutex);
+            break;
         }
     }
+}
 
-    return 0;
+/* Use the results of all the jobs the handshake workers processed.
+ */
+static void do_handshake_workers(Net_Crypto *c)
+{
+    Handshake_Workers *workers = c->handshake_workers;
+
+    if (workers == NULL)
+        return;
+
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&workers->done))) {
+        Handshake_Job *job = (Handshake_Job *)node;
+        --workers->queued;
+        ++workers->processed;
+        handshake_job_done(c, job);
+        free_handshake_job(workers, job);
+    }
 }
 
-/* Set the size of the friend list to numfriends.
- *
- *  return -1 if realloc fails.
- *  return 0 if it succeeds.
+/* Stop the threads of the handshake workers and free them with the jobs they didn't finish.
  */
-static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
+static void kill_handshake_workers(Handshake_Workers *workers)
 {
-    if (num == 0) {
-        free(c->crypto_connections);
-        c->crypto_connections = NULL;
-        return 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->stop = 1;
+    pthread_cond_broadcast(&workers->cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    for (i = 0; i < workers->num_threads; ++i) {
+        pthread_join(workers->threads[i], NULL);
     }
 
-    Crypto_Connection *newcrypto_connections = realloc(c->crypto_connections, num * sizeof(Crypto_Connection));
+    while (workers->first) {
+        Handshake_Job *job = workers->first;
+        workers->first = job->next;
+        free_handshake_job(workers, job);
+    }
 
-    if (newcrypto_connections == NULL)
-        return -1;
+    Mpsc_Node *node;
 
-    c->crypto_connections = newcrypto_connections;
-    return 0;
-}
+    while ((node = mpsc_queue_pop(&workers->done))) {
+        free_handshake_job(workers, (Handshake_Job *)node);
+    }
 
+    kill_mem_pool(workers->pool);
+    pthread_cond_destroy(&workers->cond);
+    pthread_mutex_destroy(&workers->mutex);
+    free(workers);
+}
 
-/* Create a new empty crypto connection.
- *
- * return -1 on failure.
- * return connection id on success.
+/* return new handshake workers running num_threads threads on success.
+ * return NULL on failure.
  */
-static int create_crypto_connection(Net_Crypto *c)
+static Handshake_Workers *new_handshake_workers(Net_Crypto *c, unsigned int num_threads)
 {
-    uint32_t i;
+    Handshake_Workers *workers = calloc(1, sizeof(Handshake_Workers));
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION)
-            return i;
+    if (workers == NULL)
+        return NULL;
+
+    workers->pool = new_mem_pool(sizeof(Handshake_Job), HANDSHAKE_JOB_POOL_SLAB_SIZE);
+
+    if (workers->pool == NULL) {
+        free(workers);
+        return NULL;
     }
 
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
+    if (pthread_mutex_init(&workers->mutex, NULL) != 0) {
+        kill_mem_pool(workers->pool);
+        free(workers);
+        return NULL;
+    }
 
-        if (!c->connection_use_counter) {
-            break;
+    if (pthread_cond_init(&workers->cond, NULL) != 0) {
+        pthread_mutex_destroy(&workers->mutex);
+        kill_mem_pool(workers->pool);
+        free(workers);
+        return NULL;
+    }
+
+    workers->c = c;
+    mpsc_queue_init(&workers->done);
+
+    for (workers->num_threads = 0; workers->num_threads < num_threads; ++workers->num_threads) {
+        if (pthread_create(&workers->threads[workers->num_threads], NULL, run_handshake_worker, workers) != 0) {
+            kill_handshake_workers(workers);
+            return NULL;
         }
+    }
 
-        pthread_mutex_unlock(&c->connections_mutex);
+    return workers;
+}
+
+int net_crypto_set_handshake_workers(Net_Crypto *c, unsigned int num_workers)
+{
+    if (num_workers > CRYPTO_MAX_HANDSHAKE_WORKERS)
+        return -1;
+
+    if (c->handshake_workers) {
+        kill_handshake_workers(c->handshake_workers);
+        c->handshake_workers = NULL;
     }
 
-    int id = -1;
+    if (num_workers == 0)
+        return 0;
 
-    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
-        id = c->crypto_connections_length;
-        ++c->crypto_connections_length;
-        memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
+    c->handshake_workers = new_handshake_workers(c, num_workers);
 
-        if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
-            return -1;
+    if (c->handshake_workers == NULL)
+        return -1;
+
+    return 0;
+}
+
+void net_crypto_handshake_stats(const Net_Crypto *c, Crypto_Workers_Stats *stats)
+{
+    memset(stats, 0, sizeof(Crypto_Workers_Stats));
+    const Handshake_Workers *workers = c->handshake_workers;
+
+    if (workers == NULL)
+        return;
+
+    stats->workers = workers->num_threads;
+    stats->queued = workers->queued;
+    stats->processed = workers->processed;
+    stats->dropped = workers->dropped;
+}
+
+/* A data packet decrypted by a decrypt worker. */
+typedef struct Decrypt_Job {
+    Mpsc_Node node; /* In the done queue once decrypted. */
+    struct Decrypt_Job *next; /* Next job waiting for the worker. */
+    int crypt_connection_id;
+    IP_Port source;
+    _Bool udp;
+    /* Keys of the connection when the packet was received. */
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t recv_nonce[crypto_box_NONCEBYTES];
+    uint8_t packet[MAX_CRYPTO_JUMBO_PACKET_SIZE];
+    uint16_t length;
+    int data_length; /* -1 if the packet could not be decrypted. */
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+} Decrypt_Job;
+
+typedef struct {
+    Decrypt_Workers *workers;
+    pthread_t thread;
+    _Bool running;
+
+    /* Jobs waiting for this worker, protected by mutex. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Decrypt_Job *first, *last;
+    _Bool stop;
+} Decrypt_Worker;
+
+struct Decrypt_Workers {
+    Decrypt_Worker workers[CRYPTO_MAX_DECRYPT_WORKERS];
+    unsigned int num_workers;
+
+    Mpsc_Queue done; /* Jobs decrypted by the workers, popped by do_net_crypto(). */
+    Mem_Pool *pool;
+
+    /* Only touched by the thread running net_crypto. */
+    uint32_t queued;
+    uint64_t processed, dropped;
+};
+
+/* Number of jobs allocated at a time by the job pool of the decrypt workers. */
+#define DECRYPT_JOB_POOL_SLAB_SIZE 64
+
+static void *run_decrypt_worker(void *arg)
+{
+    Decrypt_Worker *worker = arg;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    while (!worker->stop) {
+        Decrypt_Job *job = worker->first;
+
+        if (job == NULL) {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+            continue;
         }
+
+        worker->first = job->next;
+
+        if (worker->first == NULL)
+            worker->last = NULL;
+
+        pthread_mutex_unlock(&worker->mutex);
+        job->data_length = decrypt_data_packet(job->shared_key, job->recv_nonce, job->data, job->packet, job->length);
+        mpsc_queue_push(&worker->workers->done, &job->node);
+        pthread_mutex_lock(&worker->mutex);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
-    return id;
+    pthread_mutex_unlock(&worker->mutex);
+    return NULL;
 }
 
-/* Wipe a crypto connection.
+/* Queue the data packet of length received on the connection to the decrypt worker of the connection.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+static int queue_decrypt_job(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                             uint16_t length, _Bool udp)
 {
-    if (crypt_connection_id_not_valid(c, crypt_connection_id))
+    Decrypt_Workers *workers = c->decrypt_workers;
+
+    if (length > MAX_CRYPTO_JUMBO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE)
         return -1;
 
-    uint32_t i;
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    /* Keep mutex, only destroy it when connection is realloced out. */
-    pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
-    sodium_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
-    c->crypto_connections[crypt_connection_id].mutex = mutex;
+    if (conn == 0)
+        return -1;
 
-    for (i = c->crypto_connections_length; i != 0; --i) {
-        if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
-            pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
-        } else {
-            break;
-        }
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED)
+        return -1;
+
+    if (workers->queued >= CRYPTO_MAX_DECRYPT_JOBS) {
+        ++workers->dropped;
+        return -1;
     }
 
-    if (c->crypto_connections_length != i) {
-        c->crypto_connections_length = i;
-        realloc_cryptoconnection(c, c->crypto_connections_length);
+    Decrypt_Job *job = mem_pool_alloc(workers->pool);
+
+    if (job == NULL)
+        return -1;
+
+    job->next = NULL;
+    job->crypt_connection_id = crypt_connection_id;
+    job->source = source;
+    job->udp = udp;
+    memcpy(job->shared_key, conn->shared_key, crypto_box_BEFORENMBYTES);
+    memcpy(job->recv_nonce, conn->recv_nonce, crypto_box_NONCEBYTES);
+    memcpy(job->packet, packet, length);
+    job->length = length;
+
+    Decrypt_Worker *worker = &workers->workers[crypt_connection_id % workers->num_workers];
+    pthread_mutex_lock(&worker->mutex);
+
+    if (worker->last) {
+        worker->last->next = job;
+    } else {
+        worker->first = job;
     }
 
+    worker->last = job;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+
+    ++workers->queued;
     return 0;
 }
 
-/* Get crypto connection id from public key of peer.
- *
- *  return -1 if there are no connections like we are looking for.
- *  return id if it found it.
+/* Handle a data packet decrypted by a decrypt worker, like handle_data_packet_helper() would have.
  */
-static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
+static void decrypt_job_done(Net_Crypto *c, Decrypt_Job *job)
 {
-    uint32_t i;
+    if (job->data_length == -1)
+        return;
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION)
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0)
-                return i;
+    Crypto_Connection *conn = get_crypto_connection(c, job->crypt_connection_id);
+
+    /* The connection was killed or started a new session since the packet was received. */
+    if (conn == 0 || sodium_memcmp(conn->shared_key, job->shared_key, crypto_box_BEFORENMBYTES) != 0)
+        return;
+
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED)
+        return;
+
+    update_recv_nonce(conn, job->packet);
+
+    if (!(multipath_enabled(c, conn) && duplicate_data_packet(conn, job->packet))
+            && handle_decrypted_data_packet(c, job->crypt_connection_id, job->data, job->data_length, job->udp) != 0)
+        return;
+
+    if (!job->udp)
+        return;
+
+    conn = get_crypto_connection(c, job->crypt_connection_id);
+
+    if (conn == 0)
+        return;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (job->source.ip.family == AF_INET) {
+        conn->direct_lastrecv_timev4 = unix_time();
+    } else {
+        conn->direct_lastrecv_timev6 = unix_time();
     }
 
-    return -1;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+static void free_decrypt_job(Decrypt_Workers *workers, Decrypt_Job *job)
+{
+    sodium_memzero(job, sizeof(Decrypt_Job));
+    mem_pool_free(workers->pool, job);
+}
+
+/* Handle all the data packets the decrypt workers decrypted, in the order they were received.
+ */
+static void do_decrypt_workers(Net_Crypto *c)
+{
+    Decrypt_Workers *workers = c->decrypt_workers;
+
+    if (workers == NULL)
+        return;
+
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&workers->done))) {
+        Decrypt_Job *job = (Decrypt_Job *)node;
+        --workers->queued;
+        ++workers->processed;
+        decrypt_job_done(c, job);
+        free_decrypt_job(workers, job);
+    }
 }
 
-/* Add a source to the crypto connection.
- * This is to be used only when we have received a packet from that source.
- *
- *  return -1 on failure.
- *  return positive number on success.
- *  0 if source was a direct UDP connection.
+/* Stop the threads of the decrypt workers and free them with the packets they didn't decrypt.
  */
-static int crypto_connection_add_source(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+static void kill_decrypt_workers(Decrypt_Workers *workers)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    unsigned int i;
 
-    if (conn == 0)
-        return -1;
+    for (i = 0; i < workers->num_workers; ++i) {
+        Decrypt_Worker *worker = &workers->workers[i];
 
-    if (source.ip.family == AF_INET || source.ip.family == AF_INET6) {
-        if (add_ip_port_connection(c, crypt_connection_id, source) != 0)
-            return -1;
+        if (worker->running) {
+            pthread_mutex_lock(&worker->mutex);
+            worker->stop = 1;
+            pthread_cond_signal(&worker->cond);
+            pthread_mutex_unlock(&worker->mutex);
+            pthread_join(worker->thread, NULL);
+        }
 
-        if (source.ip.family == AF_INET) {
-            conn->direct_lastrecv_timev4 = unix_time();
-        } else {
-            conn->direct_lastrecv_timev6 = unix_time();
+        while (worker->first) {
+            Decrypt_Job *job = worker->first;
+            worker->first = job->next;
+            free_decrypt_job(workers, job);
         }
 
-        return 0;
-    } else if (source.ip.family == TCP_FAMILY) {
-        if (add_tcp_number_relay_connection(c->tcp_c, conn->connection_number_tcp, source.ip.ip6.uint32[0]) == 0)
-            return 1;
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
     }
 
-    return -1;
-}
+    Mpsc_Node *node;
 
+    while ((node = mpsc_queue_pop(&workers->done))) {
+        free_decrypt_job(workers, (Decrypt_Job *)node);
+    }
 
-/* Set function to be called when someone requests a new connection to us.
- *
- * The set function should return -1 on failure and 0 on success.
- *
- * n_c is only valid for the duration of the function call.
- */
-void new_connection_handler(Net_Crypto *c, int (*new_connection_callback)(void *object, New_Connection *n_c),
-                            void *object)
-{
-    c->new_connection_callback = new_connection_callback;
-    c->new_connection_callback_object = object;
+    kill_mem_pool(workers->pool);
+    free(workers);
 }
 
-/* Handle a handshake packet by someone who wants to initiate a new connection with us.
- * This calls the callback set by new_connection_handler() if the handshake is ok.
- *
- * return -1 on failure.
- * return 0 on success.
+/* return new decrypt workers running num_workers threads on success.
+ * return NULL on failure.
  */
-static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length)
+static Decrypt_Workers *new_decrypt_workers(unsigned int num_workers)
 {
-    New_Connection n_c;
-    n_c.cookie = malloc(COOKIE_LENGTH);
+    Decrypt_Workers *workers = calloc(1, sizeof(Decrypt_Workers));
 
-    if (n_c.cookie == NULL)
-        return -1;
+    if (workers == NULL)
+        return NULL;
 
-    n_c.source = source;
-    n_c.cookie_length = COOKIE_LENGTH;
+    workers->pool = new_mem_pool(sizeof(Decrypt_Job), DECRYPT_JOB_POOL_SLAB_SIZE);
 
-    if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
-                                n_c.cookie, data, length, 0) != 0) {
-        free(n_c.cookie);
-        return -1;
+    if (workers->pool == NULL) {
+        free(workers);
+        return NULL;
     }
 
-    int crypt_connection_id = getcryptconnection_id(c, n_c.public_key);
-
-    if (crypt_connection_id != -1) {
-        Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-        if (public_key_cmp(n_c.dht_public_key, conn->dht_public_key) != 0) {
-            connection_kill(c, crypt_connection_id);
-        } else {
-            int ret = -1;
+    mpsc_queue_init(&workers->done);
 
-            if (conn && (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT)) {
-                memcpy(conn->recv_nonce, n_c.recv_nonce, crypto_box_NONCEBYTES);
-                memcpy(conn->peersessionpublic_key, n_c.peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
-                encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+    for (workers->num_workers = 0; workers->num_workers < num_workers; ++workers->num_workers) {
+        Decrypt_Worker *worker = &workers->workers[workers->num_workers];
+        worker->workers = workers;
 
-                crypto_connection_add_source(c, crypt_connection_id, source);
+        if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+            kill_decrypt_workers(workers);
+            return NULL;
+        }
 
-                if (create_send_handshake(c, crypt_connection_id, n_c.cookie, n_c.dht_public_key) == 0) {
-                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
-                    ret = 0;
-                }
-            }
+        if (pthread_cond_init(&worker->cond, NULL) != 0) {
+            pthread_mutex_destroy(&worker->mutex);
+            kill_decrypt_workers(workers);
+            return NULL;
+        }
 
-            free(n_c.cookie);
-            return ret;
+        if (pthread_create(&worker->thread, NULL, run_decrypt_worker, worker) != 0) {
+            ++workers->num_workers;
+            kill_decrypt_workers(workers);
+            return NULL;
         }
+
+        worker->running = 1;
     }
 
-    int ret = c->new_connection_callback(c->new_connection_callback_object, &n_c);
-    free(n_c.cookie);
-    return ret;
+    return workers;
 }
 
-/* Accept a crypto connection.
- *
- * return -1 on failure.
- * return connection id on success.
- */
-int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
+int net_crypto_set_decrypt_workers(Net_Crypto *c, unsigned int num_workers)
 {
-    if (getcryptconnection_id(c, n_c->public_key) != -1)
+    if (num_workers > CRYPTO_MAX_DECRYPT_WORKERS)
         return -1;
 
-    int crypt_connection_id = create_crypto_connection(c);
+    if (c->decrypt_workers) {
+        kill_decrypt_workers(c->decrypt_workers);
+        c->decrypt_workers = NULL;
+    }
 
-    if (crypt_connection_id == -1)
-        return -1;
+    if (num_workers == 0)
+        return 0;
 
-    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    c->decrypt_workers = new_decrypt_workers(num_workers);
 
-    if (n_c->cookie_length != COOKIE_LENGTH)
+    if (c->decrypt_workers == NULL)
         return -1;
 
-    pthread_mutex_lock(&c->tcp_mutex);
-    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, n_c->dht_public_key, crypt_connection_id);
-    pthread_mutex_unlock(&c->tcp_mutex);
-
-    if (connection_number_tcp == -1)
-        return -1;
+    return 0;
+}
 
-    conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, n_c->public_key, crypto_box_PUBLICKEYBYTES);
-    memcpy(conn->recv_nonce, n_c->recv_nonce, crypto_box_NONCEBYTES);
-    memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, crypto_box_PUBLICKEYBYTES);
-    random_nonce(conn->sent_nonce);
-    crypto_box_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
-    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
-    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+void net_crypto_decrypt_stats(const Net_Crypto *c, Crypto_Workers_Stats *stats)
+{
+    memset(stats, 0, sizeof(Crypto_Workers_Stats));
+    const Decrypt_Workers *workers = c->decrypt_workers;
 
-    if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
-        pthread_mutex_lock(&c->tcp_mutex);
-        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
-        pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
-        return -1;
-    }
+    if (workers == NULL)
+        return;
 
-    memcpy(conn->dht_public_key, n_c->dht_public_key, crypto_box_PUBLICKEYBYTES);
-    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
-    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-    conn->rtt_time = DEFAULT_PING_CONNECTION;
-    crypto_connection_add_source(c, crypt_connection_id, n_c->source);
-    return crypt_connection_id;
+    stats->workers = workers->num_workers;
+    stats->queued = workers->queued;
+    stats->processed = workers->processed;
+    stats->dropped = workers->dropped;
 }
 
 /* Create a crypto connection.
@@ -1758,10 +4070,12 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
 
     if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
                               conn->shared_key) != sizeof(cookie_request)
-            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
+            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0
+            || add_pk_lists_connection(c, crypt_connection_id) != 0) {
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        clear_temp_packet(c, crypt_connection_id);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
@@ -1821,6 +4135,12 @@ static int tcp_data_callback(void *object, int id, const uint8_t *data, uint16_t
         return tcp_handle_cookie_request(c, conn->connection_number_tcp, data, length);
     }
 
+    if (data[0] == NET_PACKET_CRYPTO_DATA && c->decrypt_workers) {
+        IP_Port source;
+        memset(&source, 0, sizeof(source));
+        return queue_decrypt_job(c, id, source, data, length, 0);
+    }
+
     pthread_mutex_unlock(&c->tcp_mutex);
     int ret = handle_packet_connection(c, id, data, length, 0);
     pthread_mutex_lock(&c->tcp_mutex);
@@ -1955,7 +4275,8 @@ static void do_tcp(Net_Crypto *c)
             _Bool direct_connected = 0;
             crypto_connection_status(c, i, &direct_connected, NULL);
 
-            if (direct_connected) {
+            /* In multipath mode TCP stays up as the other path. */
+            if (direct_connected && !multipath_enabled(c, conn)) {
                 pthread_mutex_lock(&c->tcp_mutex);
                 set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 0);
                 pthread_mutex_unlock(&c->tcp_mutex);
@@ -2068,7 +4389,9 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &ip_port);
+    return hash_map_find(&c->ip_port_list, key);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + crypto_box_MACBYTES)
@@ -2083,59 +4406,316 @@ static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
  */
 static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
-    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE)
+    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_JUMBO_PACKET_SIZE)
+        return 1;
+
+    if (packet[0] != NET_PACKET_CRYPTO_DATA && length > MAX_CRYPTO_PACKET_SIZE)
+        return 1;
+
+    Net_Crypto *c = object;
+    int crypt_connection_id = crypto_id_ip_port(c, source);
+
+    if (crypt_connection_id == -1) {
+        if (packet[0] != NET_PACKET_CRYPTO_HS)
+            return 1;
+
+        if (handle_new_connection_handshake(c, source, packet, length) != 0)
+            return 1;
+
+        return 0;
+    }
+
+    /* The time of the last direct packet is updated once the handshake was verified. */
+    if (packet[0] == NET_PACKET_CRYPTO_HS && c->handshake_workers) {
+        if (queue_connection_handshake(c, crypt_connection_id, source, packet, length) != 0)
+            return 1;
+
+        return 0;
+    }
+
+    /* The time of the last direct packet is updated once the packet was decrypted. */
+    if (packet[0] == NET_PACKET_CRYPTO_DATA && c->decrypt_workers) {
+        if (queue_decrypt_job(c, crypt_connection_id, source, packet, length, 1) != 0)
+            return 1;
+
+        return 0;
+    }
+
+    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1) != 0)
+        return 1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (source.ip.family == AF_INET) {
+        conn->direct_lastrecv_timev4 = unix_time();
+    } else {
+        conn->direct_lastrecv_timev6 = unix_time();
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+/* Called by the network send queue when a data packet sent directly to a peer couldn't be sent.
+ *
+ * send_packet_to() already returned success for it, so the packet is sent again through TCP like
+ * packets without a direct path are. The full socket buffer is then handled like a failed send in
+ * send_lossless_packet().
+ */
+static int udp_handle_send_failed(void *object, IP_Port dest, const uint8_t *packet, uint16_t length)
+{
+    Net_Crypto *c = object;
+    int crypt_connection_id = crypto_id_ip_port(c, dest);
+
+    if (crypt_connection_id == -1)
+        return 1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
         return 1;
 
-    Net_Crypto *c = object;
-    int crypt_connection_id = crypto_id_ip_port(c, source);
+    /* A PACKET_ID_MTU_PROBE too big for the path, not a full socket buffer. */
+    if (length > conn->max_packet_size)
+        return 0;
+
+    send_packet_tcp(c, conn, packet, length, 0);
+
+    pthread_mutex_lock(&conn->mutex);
+    conn->maximum_speed_reached = 1;
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+/* The dT for the average packet receiving rate calculations.
+   Also used as the */
+#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+
+/* Ratio of recv queue size / recv packet rate (in seconds) times
+ * the number of ms between request packets to send at that ratio
+ */
+#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+/* Queue based congestion control: the send rate follows the rate at which packets leave the send queue
+ * and is reduced when the queue grows.
+ */
+static void queue_congestion_update(Crypto_Connection *conn, const Congestion_Sample *sample)
+{
+    unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    conn->last_sendqueue_size[pos] = sample->send_queue;
+    ++conn->last_sendqueue_counter;
+
+    unsigned int j;
+    long signed int sum = 0;
+    sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    conn->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    conn->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    if (sample->direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > sample->time) {
+        /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+        return;
+    }
+
+    long signed int total_sent = 0, total_resent = 0;
+
+    //TODO use real delay
+    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += conn->last_num_packets_sent[ind];
+        total_resent += conn->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum)
+            total_resent = -sum;
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = sample->send_queue;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    if (min_speed < CRYPTO_PACKET_MIN_RATE)
+        min_speed = CRYPTO_PACKET_MIN_RATE;
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    //TODO: Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        conn->packet_send_rate = min_speed * 1.2;
+    } else {
+        conn->packet_send_rate = min_speed * 0.9;
+    }
+
+    conn->packet_send_rate_requested = min_speed_request * 1.2;
+
+    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
+        conn->packet_send_rate_requested = conn->packet_send_rate;
+    }
+}
+
+static uint32_t queue_max_packets_left(const Crypto_Connection *conn, uint32_t num_packets)
+{
+    return num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
+}
+
+/* Queuing delay (RTT above the base RTT) the delay based congestion control aims for in ms. */
+#define CONGESTION_DELAY_TARGET 100
+
+/* Minimum time between two changes of the send rate based on the delay in ms, the RTT is used if it is longer. */
+#define CONGESTION_DELAY_UPDATE_INTERVAL 200
+
+/* The base RTT is the lowest RTT of the current and the previous window of this many ms. */
+#define CONGESTION_BASE_RTT_WINDOW 60000
+
+/* The send rate is multiplied by this when the peer requested packets again, at most once per RTT. */
+#define CONGESTION_LOSS_FACTOR 0.75
+
+/* Number of packets paced connections can send at once on top of what their send rate allows. */
+#define CONGESTION_PACING_BURST 4
+
+/* Delay based congestion control: the send rate grows while the RTT stays close to the base RTT and
+ * drops as soon as packets start waiting in queues on the path, so that a transfer doesn't add
+ * latency to everything else that goes over the same link.
+ */
+static uint64_t delay_base_rtt(const Crypto_Connection *conn)
+{
+    if (conn->rtt_base[1] != 0 && (conn->rtt_base[0] == 0 || conn->rtt_base[1] < conn->rtt_base[0]))
+        return conn->rtt_base[1];
+
+    return conn->rtt_base[0];
+}
+
+static void delay_rtt_sample(Crypto_Connection *conn, uint64_t rtt, uint64_t time)
+{
+    /* 0 means no RTT. */
+    if (rtt == 0)
+        rtt = 1;
+
+    if (conn->rtt_base_set + CONGESTION_BASE_RTT_WINDOW < time) {
+        conn->rtt_base[1] = conn->rtt_base[0];
+        conn->rtt_base[0] = 0;
+        conn->rtt_base_set = time;
+    }
+
+    if (conn->rtt_base[0] == 0 || rtt < conn->rtt_base[0])
+        conn->rtt_base[0] = rtt;
+
+    if (conn->rtt_current == 0 || rtt < conn->rtt_current)
+        conn->rtt_current = rtt;
+}
+
+static void delay_congestion_update(Crypto_Connection *conn, const Congestion_Sample *sample)
+{
+    if (sample->direct_connected != conn->rtt_base_direct) {
+        /* The RTT of the old path says nothing about the new one. */
+        conn->rtt_base_direct = sample->direct_connected;
+        conn->rtt_base[0] = conn->rtt_base[1] = 0;
+        conn->rtt_base_set = sample->time;
+        conn->rtt_current = 0;
+        return;
+    }
+
+    uint64_t base_rtt = delay_base_rtt(conn);
+    uint64_t update_interval = base_rtt > CONGESTION_DELAY_UPDATE_INTERVAL ? base_rtt : CONGESTION_DELAY_UPDATE_INTERVAL;
+    double rate = conn->packet_send_rate;
 
-    if (crypt_connection_id == -1) {
-        if (packet[0] != NET_PACKET_CRYPTO_HS)
-            return 1;
+    conn->delay_packets_sent += sample->packets_sent;
 
-        if (handle_new_connection_handshake(c, source, packet, length) != 0)
-            return 1;
+    if (sample->packets_resent != 0 && conn->last_loss_event + update_interval <= sample->time) {
+        conn->last_loss_event = sample->time;
+        rate *= CONGESTION_LOSS_FACTOR;
+    } else if (conn->rtt_current != 0 && conn->last_delay_update + update_interval <= sample->time) {
+        double off_target = ((double)CONGESTION_DELAY_TARGET - (double)(conn->rtt_current - base_rtt)) /
+                            CONGESTION_DELAY_TARGET;
 
-        return 0;
-    }
+        /* At most double or halve the rate per update. */
+        if (off_target > 1.0)
+            off_target = 1.0;
 
-    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1) != 0)
-        return 1;
+        if (off_target < -0.5)
+            off_target = -0.5;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+        if (off_target < 0.0) {
+            rate *= 1.0 + off_target;
+        } else if (conn->last_rate_limited >= conn->last_delay_update) {
+            /* Only speed up if the rate is what kept the connection from sending more and never
+             * to more than twice the rate at which the peer received the packets. */
+            double delivered = (double)conn->delay_packets_sent + (double)conn->delay_send_queue - (double)sample->send_queue;
+            double max_rate = 2.0 * 1000.0 * delivered / (double)(sample->time - conn->last_delay_update);
 
-    if (conn == 0)
-        return -1;
+            rate *= 1.0 + off_target;
 
-    pthread_mutex_lock(&conn->mutex);
+            if (rate > max_rate)
+                rate = max_rate > conn->packet_send_rate ? max_rate : conn->packet_send_rate;
+        }
 
-    if (source.ip.family == AF_INET) {
-        conn->direct_lastrecv_timev4 = unix_time();
-    } else {
-        conn->direct_lastrecv_timev6 = unix_time();
+        conn->last_delay_update = sample->time;
+        conn->delay_packets_sent = 0;
+        conn->delay_send_queue = sample->send_queue;
+        conn->rtt_current = 0;
     }
 
-    pthread_mutex_unlock(&conn->mutex);
-    return 0;
+    if (rate < CRYPTO_PACKET_MIN_RATE)
+        rate = CRYPTO_PACKET_MIN_RATE;
+
+    conn->packet_send_rate = rate;
+    conn->packet_send_rate_requested = rate * 1.2;
 }
 
-/* The dT for the average packet receiving rate calculations.
-   Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+static uint32_t delay_max_packets_left(const Crypto_Connection *conn, uint32_t num_packets)
+{
+    return num_packets + CONGESTION_PACING_BURST;
+}
 
-/* Ratio of recv queue size / recv packet rate (in seconds) times
- * the number of ms between request packets to send at that ratio
- */
-#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
+static const Congestion_Control congestion_controls[CRYPTO_CONGESTION_NUM] = {
+    {&queue_congestion_update, NULL, &queue_max_packets_left},
+    {&delay_congestion_update, &delay_rtt_sample, &delay_max_packets_left},
+};
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
+int net_crypto_set_congestion_control(Net_Crypto *c, uint8_t algorithm)
+{
+    if (algorithm >= CRYPTO_CONGESTION_NUM)
+        return -1;
 
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
+    c->congestion_control = &congestion_controls[algorithm];
+    return 0;
+}
 
 static void send_crypto_packets(Net_Crypto *c)
 {
@@ -2160,9 +4740,22 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->last_request_packet_sent = temp_time;
             }
 
+            if (conn->status == CRYPTO_CONN_ESTABLISHED && !(conn->peer_capabilities_known && conn->capabilities_acked)
+                    && conn->capabilities_sent < CRYPTO_CAPABILITIES_PROBES) {
+                send_capabilities_packet(c, i);
+            }
+        }
+
+        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            flush_coalesced_packet(c, i);
         }
 
         if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            if (do_pmtu_discovery(c, i, temp_time) == -1)
+                continue;
+
+            do_multipath(c, i, temp_time);
+
             if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
                 double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / (((double)num_packets_array(
                                                       &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
@@ -2198,91 +4791,17 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->packet_counter = 0;
                 conn->packet_counter_set = temp_time;
 
-                uint32_t packets_sent = conn->packets_sent;
+                Congestion_Sample sample;
+                sample.time = temp_time;
+                sample.packets_sent = conn->packets_sent;
                 conn->packets_sent = 0;
-
-                uint32_t packets_resent = conn->packets_resent;
+                sample.packets_resent = conn->packets_resent;
                 conn->packets_resent = 0;
+                sample.send_queue = num_packets_array(&conn->send_array);
+                sample.direct_connected = 0;
+                crypto_connection_status(c, i, &sample.direct_connected, NULL);
 
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
-
-                unsigned int j;
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
-                _Bool direct_connected = 0;
-                crypto_connection_status(c, i, &direct_connected, NULL);
-
-                if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
-                    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                } else {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    //TODO use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum)
-                            total_resent = -sum;
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE)
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    //TODO: Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
-
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
-
+                c->congestion_control->update(conn, &sample);
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
@@ -2296,8 +4815,10 @@ static void send_crypto_packets(Net_Crypto *c)
                     uint32_t num_packets = n_packets;
                     double rem = n_packets - (double)num_packets;
 
-                    if (conn->packets_left > num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH) {
-                        conn->packets_left = num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
+                    uint32_t max_packets_left = c->congestion_control->max_packets_left(conn, num_packets);
+
+                    if (conn->packets_left > max_packets_left) {
+                        conn->packets_left = max_packets_left;
                     } else {
                         conn->packets_left += num_packets;
                     }
@@ -2329,11 +4850,13 @@ static void send_crypto_packets(Net_Crypto *c)
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                conn->total_packets_resent += ret;
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
                 } else {
                     conn->last_congestion_event = temp_time;
+                    conn->last_rate_limited = temp_time;
                     conn->packets_left = 0;
                 }
             }
@@ -2374,6 +4897,19 @@ _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     return reset_max_speed_reached(c, crypt_connection_id) != 0;
 }
 
+/* return the largest length of data that can be sent on the connection right now.
+ * return 0 on failure.
+ */
+uint16_t crypto_max_data_size(const Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 0;
+
+    return conn->max_packet_size - CRYPTO_DATA_PACKET_MIN_SIZE;
+}
+
 /* returns the number of packet slots left in the sendbuffer.
  * return 0 if failure.
  */
@@ -2420,23 +4956,189 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (conn->status != CRYPTO_CONN_ESTABLISHED)
         return -1;
 
-    if (congestion_control && conn->packets_left == 0)
+    /* Redundant packets must stay on their own to be sent on both paths. */
+    if (c->coalesce_packets && (conn->peer_capabilities & CRYPTO_CAPABILITY_COALESCED)
+            && length <= CRYPTO_MAX_COALESCED_LENGTH
+            && !(c->multipath == CRYPTO_MULTIPATH_REDUNDANT && redundant_packet_id(c, data[0]))) {
+        return coalesce_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    }
+
+    /* Packets must stay in order, nothing may be coalesced between the flush and this packet. */
+    pthread_mutex_lock(&conn->mutex);
+
+    if (flush_coalesced_packet(c, crypt_connection_id) != 0) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+
+    if (congestion_control && conn->packets_left == 0) {
+        conn->last_rate_limited = current_time_monotonic();
+        pthread_mutex_unlock(&conn->mutex);
         return -1;
+    }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    int64_t ret = queue_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    pthread_mutex_unlock(&conn->mutex);
+    return ret;
+}
 
-    if (ret == -1)
+int submit_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                       uint8_t congestion_control)
+{
+    if (length == 0 || data[0] < CRYPTO_RESERVED_PACKETS)
         return -1;
 
-    if (congestion_control) {
-        --conn->packets_left;
-        --conn->packets_left_requested;
-        conn->packets_sent++;
+    if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE))
+        return -1;
+
+    /* Lossless packets can't be dropped if path MTU discovery falls back before they are sent. */
+    if (length > (data[0] < PACKET_ID_LOSSY_RANGE_START ? MAX_CRYPTO_DATA_SIZE : MAX_CRYPTO_JUMBO_DATA_SIZE))
+        return -1;
+
+    Submitted_Packet *packet = malloc(sizeof(Submitted_Packet) + length);
+
+    if (packet == NULL)
+        return -1;
+
+    packet->length = length;
+    packet->congestion_control = congestion_control;
+    memcpy(packet->data, data, length);
+
+    int ret = -1;
+    use_connections(c);
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    Submit_Queue *queue = conn ? atomic_load_ptr(&conn->submit_queue, ATOMIC_ACQUIRE) : NULL;
+
+    if (queue && conn->status == CRYPTO_CONN_ESTABLISHED) {
+        if (atomic_add_fetch_u32(&queue->size, 1, ATOMIC_RELAXED) <= CRYPTO_MAX_SUBMITTED_PACKETS) {
+            mpsc_queue_push(&queue->queue, &packet->node);
+            ret = 0;
+        } else {
+            atomic_sub_fetch_u32(&queue->size, 1, ATOMIC_RELAXED);
+        }
     }
 
+    release_connections(c);
+
+    if (ret == -1)
+        free(packet);
+
     return ret;
 }
 
+static void free_submitted_packet(Submit_Queue *queue, Submitted_Packet *packet)
+{
+    free(packet);
+    atomic_sub_fetch_u32(&queue->size, 1, ATOMIC_RELAXED);
+}
+
+/* Send the packets submitted to the connection with submit_cryptpacket().
+ */
+static void send_submitted_packets(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0 || conn->status != CRYPTO_CONN_ESTABLISHED)
+        return;
+
+    Submit_Queue *queue = conn->submit_queue;
+
+    while (queue->blocked) {
+        Submitted_Packet *packet = queue->blocked;
+
+        if (write_cryptpacket(c, crypt_connection_id, packet->data, packet->length, packet->congestion_control) == -1)
+            break;
+
+        queue->blocked = packet->next;
+        free_submitted_packet(queue, packet);
+    }
+
+    Mpsc_Node *node;
+
+    while ((node = mpsc_queue_pop(&queue->queue))) {
+        Submitted_Packet *packet = (Submitted_Packet *)node;
+
+        if (packet->data[0] >= PACKET_ID_LOSSY_RANGE_START) {
+            send_lossy_cryptpacket(c, crypt_connection_id, packet->data, packet->length);
+        } else if (queue->blocked
+                   || write_cryptpacket(c, crypt_connection_id, packet->data, packet->length, packet->congestion_control) == -1) {
+            /* Lossless packets behind it must wait too. */
+            packet->next = NULL;
+
+            if (queue->blocked) {
+                queue->blocked_last->next = packet;
+            } else {
+                queue->blocked = packet;
+            }
+
+            queue->blocked_last = packet;
+            continue;
+        }
+
+        free_submitted_packet(queue, packet);
+    }
+}
+
+void flush_coalesced_packets(Net_Crypto *c)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        Crypto_Connection *conn = get_crypto_connection(c, i);
+
+        if (conn && conn->status == CRYPTO_CONN_ESTABLISHED)
+            flush_coalesced_packet(c, i);
+    }
+}
+
+void net_crypto_set_coalescing(Net_Crypto *c, _Bool enabled)
+{
+    c->coalesce_packets = enabled;
+
+    if (!enabled)
+        flush_coalesced_packets(c);
+}
+
+int net_crypto_set_pmtu_discovery(Net_Crypto *c, uint8_t mode)
+{
+    if (mode > CRYPTO_PMTU_ALL)
+        return -1;
+
+    /* Probes too big for the path must be dropped on the way, not split up by the IP layer. */
+    if (!set_socket_dontfragment(c->dht->net->sock, c->dht->net->family, mode != CRYPTO_PMTU_DISABLED)
+            && mode != CRYPTO_PMTU_DISABLED)
+        return -1;
+
+    /* Connections fall back on their next run if they are no longer allowed to send bigger packets. */
+    c->pmtu_discovery = mode;
+    return 0;
+}
+
+int net_crypto_set_multipath(Net_Crypto *c, uint8_t mode)
+{
+    if (mode > CRYPTO_MULTIPATH_REDUNDANT)
+        return -1;
+
+    /* Connections forget the RTT of the paths on their next run if the mode is disabled. */
+    c->multipath = mode;
+    return 0;
+}
+
+int net_crypto_set_redundant_packet_id(Net_Crypto *c, uint8_t packet_id, _Bool redundant)
+{
+    if (packet_id < CRYPTO_RESERVED_PACKETS || packet_id >= PACKET_ID_LOSSY_RANGE_START)
+        return -1;
+
+    if (redundant) {
+        c->redundant_packet_ids[packet_id / 8] |= (1 << (packet_id % 8));
+    } else {
+        c->redundant_packet_ids[packet_id / 8] &= ~(1 << (packet_id % 8));
+    }
+
+    return 0;
+}
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -2451,8 +5153,10 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
     if (conn == 0)
         return -1;
 
+    pthread_mutex_lock(&conn->mutex);
     uint32_t num = conn->send_array.buffer_end - conn->send_array.buffer_start;
     uint32_t num1 = packet_number - conn->send_array.buffer_start;
+    pthread_mutex_unlock(&conn->mutex);
 
     if (num < num1) {
         return 0;
@@ -2468,7 +5172,7 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_DATA_SIZE)
         return -1;
 
     if (data[0] < PACKET_ID_LOSSY_RANGE_START)
@@ -2477,15 +5181,13 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE))
         return -1;
 
-    pthread_mutex_lock(&c->connections_mutex);
-    ++c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    use_connections(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     int ret = -1;
 
-    if (conn) {
+    if (conn && length <= conn->max_packet_size - CRYPTO_DATA_PACKET_MIN_SIZE) {
         pthread_mutex_lock(&conn->mutex);
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
@@ -2493,9 +5195,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    --c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    release_connections(c);
 
     return ret;
 }
@@ -2507,37 +5207,41 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 {
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    lock_connections(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     int ret = -1;
 
     if (conn) {
-        if (conn->status == CRYPTO_CONN_ESTABLISHED)
+        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            flush_coalesced_packet(c, crypt_connection_id);
             send_kill_packet(c, crypt_connection_id);
+        }
+
+        if (conn->coalesced_packet)
+            conn->send_array.allocator->free(conn->send_array.allocator->object, conn->coalesced_packet);
+
+        if (conn->part_packet)
+            conn->recv_array.allocator->free(conn->recv_array.allocator->object, conn->part_packet);
 
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        uint8_t key[IP_PORT_KEY_SIZE];
+        ip_port_key(key, &conn->ip_portv4);
+        hash_map_remove(&c->ip_port_list, key, crypt_connection_id);
+        ip_port_key(key, &conn->ip_portv6);
+        hash_map_remove(&c->ip_port_list, key, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
         clear_buffer(&conn->send_array);
         clear_buffer(&conn->recv_array);
+        kill_submit_queue(conn->submit_queue);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    unlock_connections(c);
 
     return ret;
 }
@@ -2574,6 +5278,35 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     return conn->status;
 }
 
+/* Fill stats with the transport statistics of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    stats->status = crypto_connection_status(c, crypt_connection_id, &stats->direct_connected, &stats->online_tcp_relays);
+    stats->rtt_time = conn->rtt_time;
+    stats->packet_send_rate = conn->packet_send_rate;
+    stats->packet_recv_rate = conn->packet_recv_rate;
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->packets_received = conn->total_packets_received;
+    stats->send_queue = num_packets_array(&conn->send_array);
+    stats->recv_queue = num_packets_array(&conn->recv_array);
+    stats->max_packet_size = conn->max_packet_size;
+    memcpy(stats->path_rtt, conn->path_rtt, sizeof(stats->path_rtt));
+    stats->packets_duplicated = conn->packets_duplicated;
+    stats->duplicates_received = conn->duplicates_received;
+    stats->submit_queue = atomic_load_u32(&conn->submit_queue->size, ATOMIC_RELAXED);
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_box_keypair(c->self_public_key, c->self_secret_key);
@@ -2599,6 +5332,40 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk)
     crypto_scalarmult_curve25519_base(c->self_public_key, c->self_secret_key);
 }
 
+static Packet_Data *pool_alloc_packet(void *object)
+{
+    return mem_pool_alloc(object);
+}
+
+static void pool_free_packet(void *object, Packet_Data *data)
+{
+    mem_pool_free(object, data);
+}
+
+/* Replace the allocator of the Packet_Data in the packet buffers of the connections,
+ * NULL to go back to the default pool.
+ *
+ * Can only be done while there are no connections.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_packet_allocator(Net_Crypto *c, const Packet_Allocator *allocator)
+{
+    if (c->crypto_connections_length != 0)
+        return -1;
+
+    if (allocator) {
+        c->packet_allocator = *allocator;
+    } else {
+        c->packet_allocator.alloc = &pool_alloc_packet;
+        c->packet_allocator.free = &pool_free_packet;
+        c->packet_allocator.object = c->packet_pool;
+    }
+
+    return 0;
+}
+
 /* Run this to (re)initialize net_crypto.
  * Sets all the global connection variables to their default values.
  */
@@ -2614,9 +5381,18 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
     if (temp == NULL)
         return NULL;
 
+    temp->packet_pool = new_mem_pool(CRYPTO_PACKET_DATA_SIZE, CRYPTO_PACKET_POOL_SLAB_SIZE);
+
+    if (temp->packet_pool == NULL) {
+        free(temp);
+        return NULL;
+    }
+
+    net_crypto_set_packet_allocator(temp, NULL);
     temp->tcp_c = new_tcp_connections(dht->self_secret_key, proxy_info);
 
     if (temp->tcp_c == NULL) {
+        kill_mem_pool(temp->packet_pool);
         free(temp);
         return NULL;
     }
@@ -2625,8 +5401,10 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
     set_oob_packet_tcp_connection_callback(temp->tcp_c, &tcp_oob_callback, temp);
 
     if (create_recursive_mutex(&temp->tcp_mutex) != 0 ||
-            pthread_mutex_init(&temp->connections_mutex, NULL) != 0) {
+            pthread_mutex_init(&temp->connections_mutex, NULL) != 0 ||
+            pthread_cond_init(&temp->connections_cond, NULL) != 0) {
         kill_tcp_connections(temp->tcp_c);
+        kill_mem_pool(temp->packet_pool);
         free(temp);
         return NULL;
     }
@@ -2637,13 +5415,17 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
     new_symmetric_key(temp->secret_symmetric_key);
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    temp->congestion_control = &congestion_controls[CRYPTO_CONGESTION_QUEUE];
+    temp->pmtu_discovery = CRYPTO_PMTU_DISABLED;
 
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
+    networking_register_send_fail_handler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_send_failed, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    hash_map_init(&temp->ip_port_list, IP_PORT_KEY_SIZE, 8);
+    hash_map_init(&temp->real_pk_list, crypto_box_PUBLICKEYBYTES, 8);
 
     return temp;
 }
@@ -2681,6 +5463,12 @@ static void kill_timedout(Net_Crypto *c)
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
 {
+    _Bool queued = (c->handshake_workers && c->handshake_workers->queued != 0)
+                   || (c->decrypt_workers && c->decrypt_workers->queued != 0);
+
+    if (queued && c->current_sleep_time > CRYPTO_WORKERS_RUN_INTERVAL)
+        return CRYPTO_WORKERS_RUN_INTERVAL;
+
     return c->current_sleep_time;
 }
 
@@ -2688,8 +5476,16 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
 void do_net_crypto(Net_Crypto *c)
 {
     unix_time_update();
+    do_handshake_workers(c);
+    do_decrypt_workers(c);
     kill_timedout(c);
     do_tcp(c);
+
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i)
+        send_submitted_packets(c, i);
+
     send_crypto_packets(c);
 }
 
@@ -2697,19 +5493,29 @@ void kill_net_crypto(Net_Crypto *c)
 {
     uint32_t i;
 
+    if (c->handshake_workers)
+        kill_handshake_workers(c->handshake_workers);
+
+    if (c->decrypt_workers)
+        kill_decrypt_workers(c->decrypt_workers);
+
     for (i = 0; i < c->crypto_connections_length; ++i) {
         crypto_kill(c, i);
     }
 
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    pthread_cond_destroy(&c->connections_cond);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    hash_map_free(&c->ip_port_list);
+    hash_map_free(&c->real_pk_list);
+    kill_mem_pool(c->packet_pool);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_DATA, NULL, NULL);
+    networking_register_send_fail_handler(c->dht->net, NET_PACKET_CRYPTO_DATA, NULL, NULL);
     sodium_memzero(c, sizeof(Net_Crypto));
     free(c);
 }
@@ -27,7 +27,9 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "mem_pool.h"
 #include <pthread.h>
+#include <stddef.h>
 
 #define CRYPTO_CONN_NO_CONNECTION 0
 #define CRYPTO_CONN_COOKIE_REQUESTING 1 //send cookie request packets
@@ -38,19 +40,31 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
+/* Size the packet buffers start at, they grow up to CRYPTO_PACKET_BUFFER_SIZE as needed. */
+#define CRYPTO_MIN_PACKET_BUFFER_SIZE 64 /* Must be a power of 2 */
+
+/* Number of packets allocated at a time by the packet pool. */
+#define CRYPTO_PACKET_POOL_SLAB_SIZE 32
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
 /* Minimum packet queue max length. */
 #define CRYPTO_MIN_QUEUE_LENGTH 64
 
-/* Maximum total size of packets that net_crypto sends. */
+/* Maximum total size of packets that net_crypto sends, unless path MTU discovery found
+ * that bigger ones reach the peer. */
 #define MAX_CRYPTO_PACKET_SIZE 1400
 
+/* Maximum total size of data packets sent over a path with a 9000 byte MTU, see
+ * net_crypto_set_pmtu_discovery(). Must be a multiple of CRYPTO_MAX_PADDING. */
+#define MAX_CRYPTO_JUMBO_PACKET_SIZE 8952
+
 #define CRYPTO_DATA_PACKET_MIN_SIZE (1 + sizeof(uint16_t) + (sizeof(uint32_t) + sizeof(uint32_t)) + crypto_box_MACBYTES)
 
 /* Max size of data in packets */
 #define MAX_CRYPTO_DATA_SIZE (MAX_CRYPTO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
+#define MAX_CRYPTO_JUMBO_DATA_SIZE (MAX_CRYPTO_JUMBO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
 
 /* Interval in ms between sending cookie request/handshake packets. */
 #define CRYPTO_SEND_PACKET_INTERVAL 1000
@@ -65,6 +79,25 @@
 #define PACKET_ID_PADDING 3 /* Denotes padding */
 #define PACKET_ID_REQUEST 4 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    5 /* Used to kill connection */
+#define PACKET_ID_SACK    6 /* Used to request unreceived packets as ranges, only sent to peers that sent one */
+#define PACKET_ID_COALESCED    7 /* Holds several small lossless packets, see write_cryptpacket() */
+#define PACKET_ID_CAPABILITIES 8 /* Used to tell the peer which optional packets we understand */
+#define PACKET_ID_MTU_PROBE    9 /* Padded to the packet size being probed, only sent directly */
+#define PACKET_ID_MTU_ACK      10 /* Tells the peer the size of the PACKET_ID_MTU_PROBE packet we received */
+#define PACKET_ID_PATH_PING    11 /* Sent on one path to measure its RTT, the peer answers on the same path */
+#define PACKET_ID_PATH_PONG    12 /* Echoes the content of a PACKET_ID_PATH_PING packet */
+#define PACKET_ID_PART         13 /* Part of a lossless packet too big for the maximum packet size */
+
+/* Flags of PACKET_ID_CAPABILITIES packets. */
+#define CRYPTO_CAPABILITY_COALESCED 1 /* We understand PACKET_ID_COALESCED packets. */
+#define CRYPTO_CAPABILITY_JUMBO     2 /* We accept data packets up to MAX_CRYPTO_JUMBO_PACKET_SIZE and PACKET_ID_PART packets. */
+#define CRYPTO_CAPABILITY_MULTIPATH 4 /* We drop copies of data packets and answer PACKET_ID_PATH_PING packets. */
+
+/* Number of packet numbers below the highest one received for which copies of data packets are detected. */
+#define CRYPTO_DUPLICATE_WINDOW 1024
+
+/* Lossless packets up to this length are coalesced when coalescing is enabled. */
+#define CRYPTO_MAX_COALESCED_LENGTH 255
 
 /* Packet ids 0 to CRYPTO_RESERVED_PACKETS - 1 are reserved for use by net_crypto. */
 #define CRYPTO_RESERVED_PACKETS 16
@@ -83,6 +116,22 @@
 #define CONGESTION_QUEUE_ARRAY_SIZE 12
 #define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
 
+/* Maximum number of threads that can process handshakes, see net_crypto_set_handshake_workers(). */
+#define CRYPTO_MAX_HANDSHAKE_WORKERS 16
+
+/* Maximum number of packets queued to or being processed by the handshake workers,
+ * packets received while the queue is full are dropped. */
+#define CRYPTO_MAX_HANDSHAKE_JOBS 1024
+
+/* Maximum number of threads that can decrypt data packets, see net_crypto_set_decrypt_workers(). */
+#define CRYPTO_MAX_DECRYPT_WORKERS 16
+
+/* Maximum number of data packets queued to or being decrypted by the decrypt workers. */
+#define CRYPTO_MAX_DECRYPT_JOBS 4096
+
+/* Maximum number of packets submitted to a connection with submit_cryptpacket() that were not sent yet. */
+#define CRYPTO_MAX_SUBMITTED_PACKETS 1024
+
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
@@ -90,15 +139,42 @@
 typedef struct {
     uint64_t sent_time;
     uint16_t length;
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    uint8_t data[MAX_CRYPTO_JUMBO_DATA_SIZE];
 } Packet_Data;
 
+/* Number of bytes of a Packet_Data that holds length bytes of data. Packets in the packet buffers
+ * are only allocated that big. */
+#define PACKET_DATA_SIZE(length) (offsetof(Packet_Data, data) + (length))
+
+/* Size of the Packet_Data allocated by a Packet_Allocator, packets with more data than
+ * MAX_CRYPTO_DATA_SIZE are allocated with malloc(). */
+#define CRYPTO_PACKET_DATA_SIZE PACKET_DATA_SIZE(MAX_CRYPTO_DATA_SIZE)
+
+/* Allocator for the Packet_Data in the packet buffers of all the connections of a Net_Crypto.
+ * alloc must return CRYPTO_PACKET_DATA_SIZE bytes.
+ * May be called from any thread that sends packets.
+ */
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packet_Data *(*alloc)(void *object);
+    void (*free)(void *object, Packet_Data *data);
+    void *object;
+} Packet_Allocator;
+
+typedef struct {
+    Packet_Data **buffer; /* Ring of capacity pointers, packet number n is at n % capacity. */
+    uint32_t  capacity;
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
+    const Packet_Allocator *allocator;
 } Packets_Array;
 
+/* Paths to a peer. */
+enum {
+    CRYPTO_PATH_DIRECT, /* The direct UDP connection. */
+    CRYPTO_PATH_TCP, /* The first online TCP relay of the connection. */
+    CRYPTO_PATH_NUM
+};
+
 typedef struct {
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
@@ -143,6 +219,42 @@ typedef struct {
     int connection_lossy_data_callback_id;
 
     uint64_t last_request_packet_sent;
+    uint64_t last_fast_request_sent; /* Last request packet sent because packets arrived out of order. */
+    _Bool peer_sack; /* If the peer sent us a PACKET_ID_SACK packet. */
+    uint8_t sack_probes_sent; /* PACKET_ID_SACK packets sent next to PACKET_ID_REQUEST ones while peer_sack is 0. */
+
+    uint8_t peer_capabilities; /* CRYPTO_CAPABILITY_* flags the peer sent us. */
+    _Bool peer_capabilities_known;
+    _Bool capabilities_acked; /* If the peer told us it received our capabilities. */
+    uint8_t capabilities_sent; /* PACKET_ID_CAPABILITIES packets sent. */
+
+    /* Path MTU discovery, see net_crypto_set_pmtu_discovery(). */
+    uint16_t max_packet_size; /* Largest data packet we send to the peer. */
+    uint16_t pmtu_probe_size; /* Size of the PACKET_ID_MTU_PROBE packets being sent, 0 if none. */
+    uint8_t pmtu_probes_sent; /* Probes of pmtu_probe_size sent without an answer. */
+    uint64_t pmtu_probe_time; /* Time the last probe was sent. */
+    uint64_t pmtu_confirmed_time; /* Last time the peer confirmed it received a packet of max_packet_size. */
+    uint64_t pmtu_next_search; /* Time to probe for a size above max_packet_size again. */
+    Packet_Data *part_packet; /* Lossless packet being put together from PACKET_ID_PART packets, NULL if none. */
+    uint32_t part_num; /* Number of part_packet. */
+    uint16_t parts_received; /* Bit set of the parts of part_packet received. */
+
+    /* Multipath, see net_crypto_set_multipath(). */
+    uint64_t path_rtt[CRYPTO_PATH_NUM]; /* Smoothed RTT of each path in ms, 0 if not measured. */
+    uint64_t path_ping_sent[CRYPTO_PATH_NUM]; /* Time of the oldest PACKET_ID_PATH_PING not answered, 0 if none. */
+    uint64_t path_ping_time; /* Time the last PACKET_ID_PATH_PING packets were sent. */
+    uint64_t packets_duplicated; /* Data packets sent on both paths. */
+
+    /* Numbers of the data packets received, to drop copies of packets sent on more than one path. */
+    uint8_t recv_window[CRYPTO_DUPLICATE_WINDOW / 8];
+    uint16_t recv_window_highest;
+    _Bool recv_window_started;
+    uint64_t duplicates_received; /* Data packets dropped because they were copies or too old to tell. */
+
+    struct Submit_Queue *submit_queue; /* Packets submitted from any thread, see submit_cryptpacket(). */
+
+    Packet_Data *coalesced_packet; /* PACKET_ID_COALESCED packet being filled, NULL if none. */
+    _Bool coalesced_congestion_control; /* If congestion control applies to coalesced_packet. */
     uint64_t direct_send_attempt_time;
 
     uint32_t packet_counter;
@@ -165,6 +277,19 @@ typedef struct {
     uint32_t packets_sent, packets_resent;
     uint64_t last_congestion_event;
     uint64_t rtt_time;
+    /* Lossless packets since the connection was created. */
+    uint64_t total_packets_sent, total_packets_resent, total_packets_received;
+    uint64_t last_rate_limited; /* Last time packets_left ran out. */
+
+    /* State of the delay based congestion control. */
+    uint64_t rtt_base[2]; /* Lowest RTT in the current and the previous base window, 0 if none. */
+    uint64_t rtt_base_set; /* Time the current base window started. */
+    _Bool rtt_base_direct; /* If the RTT in rtt_base was measured on the direct UDP connection. */
+    uint64_t rtt_current; /* Lowest RTT since the last update of the send rate, 0 if none. */
+    uint64_t last_delay_update;
+    uint32_t delay_packets_sent; /* New packets sent since the last update of the send rate. */
+    uint32_t delay_send_queue; /* Number of packets in the send array at the last update. */
+    uint64_t last_loss_event;
 
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
@@ -178,6 +303,68 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 } Crypto_Connection;
 
+/* Transport statistics of a connection, see crypto_connection_stats(). */
+typedef struct {
+    unsigned int status; /* One of CRYPTO_CONN_* */
+    _Bool direct_connected;
+    unsigned int online_tcp_relays;
+    uint64_t rtt_time; /* Lowest measured RTT in ms, DEFAULT_PING_CONNECTION until one was measured. */
+    double packet_send_rate; /* Lossless packets per second the congestion control allows. */
+    double packet_recv_rate; /* Lossless packets per second received. */
+    uint64_t packets_sent; /* Lossless packets queued for sending. */
+    uint64_t packets_resent; /* Lossless packets sent again because the peer requested them. */
+    uint64_t packets_received; /* Lossless packets received. */
+    uint32_t send_queue; /* Packets in the send array, not acknowledged by the peer yet. */
+    uint32_t recv_queue; /* Packets in the receive array, waiting for missing ones before them. */
+    uint16_t max_packet_size; /* Largest data packet sent to the peer, raised by path MTU discovery. */
+    uint64_t path_rtt[CRYPTO_PATH_NUM]; /* Smoothed RTT of each path in multipath mode, 0 if not measured. */
+    uint64_t packets_duplicated; /* Data packets sent on both paths. */
+    uint64_t duplicates_received; /* Data packets dropped because they were copies or too old to tell. */
+    uint32_t submit_queue; /* Packets submitted with submit_cryptpacket() that were not sent yet. */
+} Crypto_Connection_Stats;
+
+/* Paths on which path MTU discovery looks for sizes above MAX_CRYPTO_PACKET_SIZE. */
+enum {
+    CRYPTO_PMTU_DISABLED, /* (default) */
+    CRYPTO_PMTU_LAN, /* Direct UDP connections to peers on the LAN. */
+    CRYPTO_PMTU_ALL /* All direct UDP connections, for networks with jumbo frames end to end. */
+};
+
+/* How connections use the direct UDP connection and TCP when both are up. */
+enum {
+    CRYPTO_MULTIPATH_DISABLED, /* Only the direct UDP connection (default). */
+    CRYPTO_MULTIPATH_FASTEST, /* The path with the lowest RTT. */
+    CRYPTO_MULTIPATH_REDUNDANT /* Like CRYPTO_MULTIPATH_FASTEST, and lossy and redundant packets go on both. */
+};
+
+/* Congestion control algorithms. */
+enum {
+    CRYPTO_CONGESTION_QUEUE, /* Based on the growth of the send queue (default). */
+    CRYPTO_CONGESTION_DELAY, /* Based on the queuing delay, keeps the RTT close to its minimum and paces packets. */
+    CRYPTO_CONGESTION_NUM
+};
+
+/* What happened on a connection during the last PACKET_COUNTER_AVERAGE_INTERVAL. */
+typedef struct {
+    uint64_t time;
+    uint32_t packets_sent; /* New packets sent. */
+    uint32_t packets_resent; /* Packets sent again because the peer requested them. */
+    uint32_t send_queue; /* Number of packets in the send array. */
+    _Bool direct_connected;
+} Congestion_Sample;
+
+/* A congestion control algorithm sets packet_send_rate (new packets) and packet_send_rate_requested
+ * (new and requested packets) of the connections.
+ */
+typedef struct {
+    /* Called every PACKET_COUNTER_AVERAGE_INTERVAL for each established connection. */
+    void (*update)(Crypto_Connection *conn, const Congestion_Sample *sample);
+    /* Called with each RTT measured on the connection, may be NULL. */
+    void (*rtt_sample)(Crypto_Connection *conn, uint64_t rtt, uint64_t time);
+    /* return the most packets_left may grow to when num_packets more packets can be sent. */
+    uint32_t (*max_packets_left)(const Crypto_Connection *conn, uint32_t num_packets);
+} Congestion_Control;
+
 typedef struct {
     IP_Port source;
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
@@ -188,6 +375,14 @@ typedef struct {
     uint8_t cookie_length;
 } New_Connection;
 
+/* Statistics of the handshake or decrypt workers, see net_crypto_handshake_stats() and net_crypto_decrypt_stats(). */
+typedef struct {
+    unsigned int workers;
+    uint32_t queued; /* Packets queued to or being processed by the workers. */
+    uint64_t processed; /* Packets processed by the workers. */
+    uint64_t dropped; /* Packets dropped because the queue was full. */
+} Crypto_Workers_Stats;
+
 typedef struct {
     DHT *dht;
     TCP_Connections *tcp_c;
@@ -195,8 +390,13 @@ typedef struct {
     Crypto_Connection *crypto_connections;
     pthread_mutex_t tcp_mutex;
 
+    /* Threads other than the one running do_net_crypto() count themselves in connection_use_counter
+     * while they use the connections array, connections_changing is set while it is being changed.
+     * connections_cond is signaled when either of them drops to 0. */
     pthread_mutex_t connections_mutex;
-    unsigned int connection_use_counter;
+    pthread_cond_t connections_cond;
+    uint32_t connection_use_counter;
+    uint8_t connections_changing;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
 
@@ -213,7 +413,25 @@ typedef struct {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_LIST ip_port_list;
+    Hash_Map ip_port_list;
+
+    /* Ids of the active connections by real public key of the peer. */
+    Hash_Map real_pk_list;
+
+    Packet_Allocator packet_allocator;
+    Mem_Pool *packet_pool;
+
+    const Congestion_Control *congestion_control;
+
+    _Bool coalesce_packets; /* If small lossless packets are coalesced for peers that understand it. */
+    uint8_t pmtu_discovery; /* One of CRYPTO_PMTU_* */
+    uint8_t multipath; /* One of CRYPTO_MULTIPATH_* */
+    uint8_t redundant_packet_ids[256 / 8]; /* Bit set of the lossless packet ids sent on both paths. */
+
+    struct Handshake_Workers *handshake_workers; /* NULL if handshakes are processed inline. */
+    /* Job of the new connection being passed to new_connection_callback, its session is used if it is accepted. */
+    const struct Handshake_Job *new_connection_job;
+    struct Decrypt_Workers *decrypt_workers; /* NULL if data packets are decrypted inline. */
 } Net_Crypto;
 
 
@@ -310,6 +528,16 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
  */
 _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 
+/* return the largest length of data that can be sent on the connection right now.
+ * return 0 on failure.
+ *
+ * This is MAX_CRYPTO_DATA_SIZE unless path MTU discovery raised it, and it drops back to
+ * MAX_CRYPTO_DATA_SIZE if the path stops carrying bigger packets. Lossless packets up to the
+ * size returned before can still be written to peers that accept jumbo packets, they are sent
+ * in parts.
+ */
+uint16_t crypto_max_data_size(const Net_Crypto *c, int crypt_connection_id);
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -331,6 +559,23 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet_number);
 
+/* Queue a packet to be sent to the peer by the next do_net_crypto(), can be called from any thread.
+ *
+ * Lossless packets (see write_cryptpacket()) of at most MAX_CRYPTO_DATA_SIZE bytes are sent in the
+ * order they were submitted, once the send queue and the congestion control (if congestion_control
+ * is set) have room for them. Lossy packets (see send_lossy_cryptpacket()) are sent as soon as
+ * do_net_crypto() finds them, ahead of lossless packets still waiting for room.
+ *
+ * Submitting doesn't take any lock unless the connection array is being changed at that moment
+ * because a connection is created or killed. Up to CRYPTO_MAX_SUBMITTED_PACKETS packets can wait
+ * per connection.
+ *
+ * return -1 on failure.
+ * return 0 if the packet was queued.
+ */
+int submit_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                       uint8_t congestion_control);
+
 /* return -1 on failure.
  * return 0 on success.
  *
@@ -389,6 +634,13 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, _Bool *direct_connected,
                                       unsigned int *online_tcp_relays);
 
+/* Fill stats with the transport statistics of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -404,6 +656,115 @@ void save_keys(const Net_Crypto *c, uint8_t *keys);
  */
 void load_secret_key(Net_Crypto *c, const uint8_t *sk);
 
+/* Replace the allocator of the Packet_Data in the packet buffers of the connections,
+ * NULL to go back to the default pool.
+ *
+ * Can only be done while there are no connections.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_packet_allocator(Net_Crypto *c, const Packet_Allocator *allocator);
+
+/* Use the congestion control algorithm (CRYPTO_CONGESTION_*) for all the connections.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_congestion_control(Net_Crypto *c, uint8_t algorithm);
+
+/* Enable or disable coalescing of lossless packets.
+ *
+ * When enabled, lossless packets of at most CRYPTO_MAX_COALESCED_LENGTH bytes written to a peer that
+ * understands it are packed into one PACKET_ID_COALESCED packet until the packet is full, a bigger
+ * packet is written or flush_coalesced_packets() is called. All of them get the packet number
+ * of that packet.
+ */
+void net_crypto_set_coalescing(Net_Crypto *c, _Bool enabled);
+
+/* Send the coalesced packets of all the connections. */
+void flush_coalesced_packets(Net_Crypto *c);
+
+/* Set on which paths (CRYPTO_PMTU_*) path MTU discovery runs.
+ *
+ * On those paths, connections to peers that accept jumbo packets send PACKET_ID_MTU_PROBE packets
+ * of decreasing size, from MAX_CRYPTO_JUMBO_PACKET_SIZE down, directly to the peer. The biggest one
+ * the peer confirms becomes the maximum packet size of the connection (see crypto_max_data_size()).
+ * The size is confirmed regularly and falls back to MAX_CRYPTO_PACKET_SIZE when that fails or the
+ * direct connection is lost. Lossless packets that are then too big for the path are sent in
+ * PACKET_ID_PART packets, and can still be written (see crypto_max_data_size()).
+ *
+ * While path MTU discovery runs, the packets of the socket are sent with the don't fragment bit, so
+ * that probes too big for the path are lost instead of being split up by the IP layer.
+ *
+ * return -1 on failure (or if the platform can't set the don't fragment bit).
+ * return 0 on success.
+ */
+int net_crypto_set_pmtu_discovery(Net_Crypto *c, uint8_t mode);
+
+/* Set how connections use the direct UDP connection and TCP when both are up (CRYPTO_MULTIPATH_*).
+ *
+ * By default TCP relays are put to sleep while the direct connection is up and all packets are sent
+ * directly until no packet was received directly for UDP_DIRECT_TIMEOUT seconds, so a path that
+ * silently died loses everything sent in that time.
+ *
+ * In the multipath modes, connections to peers that understand it keep one TCP relay online and send
+ * PACKET_ID_PATH_PING packets on both paths to measure their RTT. A path that stops answering counts
+ * as at least as slow as the age of its oldest unanswered ping. CRYPTO_MULTIPATH_FASTEST sends the
+ * packets on the path with the lowest RTT. CRYPTO_MULTIPATH_REDUNDANT also sends lossy packets and
+ * the lossless packets set with net_crypto_set_redundant_packet_id() on both paths, the peer drops
+ * the copy that arrives second.
+ *
+ * Both peers must have multipath enabled when they connect: peers that disabled it don't tell the
+ * other one they drop copies, so neither sends any and all their packets are handled as before.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_multipath(Net_Crypto *c, uint8_t mode);
+
+/* Set if lossless packets starting with packet_id are sent on both paths in CRYPTO_MULTIPATH_REDUNDANT mode.
+ *
+ * Meant for small packets that should arrive quickly, like typing notifications or call control.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_redundant_packet_id(Net_Crypto *c, uint8_t packet_id, _Bool redundant);
+
+/* Process cookie requests and handshakes in num_workers threads instead of in the thread that
+ * receives them, 0 to process them inline again.
+ *
+ * The workers open the cookies, decrypt the handshakes and precompute the session keys and our
+ * handshake. The results are applied by do_net_crypto(). Packets received while
+ * CRYPTO_MAX_HANDSHAKE_JOBS are queued are dropped, like packets lost on the way.
+ *
+ * Cookie requests received over TCP are still processed inline.
+ * Our keys must not be changed while workers are running.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_handshake_workers(Net_Crypto *c, unsigned int num_workers);
+
+/* Fill stats with the statistics of the handshake workers. */
+void net_crypto_handshake_stats(const Net_Crypto *c, Crypto_Workers_Stats *stats);
+
+/* Decrypt the data packets of the connections in num_workers threads instead of in the thread that
+ * receives them, 0 to decrypt them inline again.
+ *
+ * All the packets of a connection are decrypted by the same worker, in the order they were received.
+ * do_net_crypto() then handles them in that order and calls the data callbacks. Packets received while
+ * CRYPTO_MAX_DECRYPT_JOBS are queued are dropped, like packets lost on the way.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_set_decrypt_workers(Net_Crypto *c, unsigned int num_workers);
+
+/* Fill stats with the statistics of the decrypt workers. */
+void net_crypto_decrypt_stats(const Net_Crypto *c, Crypto_Workers_Stats *stats);
+
 /* Create new instance of Net_Crypto.
  *  Sets all the global connection variables to their default values.
  */
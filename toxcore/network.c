@@ -25,6 +25,11 @@
 #define _WIN32_WINNT  0x501
 #endif
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Needed for recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -41,8 +46,46 @@
 #endif
 
 #include "network.h"
+#include "rate_limit.h"
 #include "util.h"
 
+#include <pthread.h>
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define NET_USE_RECVMMSG
+#define NET_USE_SENDMMSG
+#endif
+
+#ifdef NET_USE_RECVMMSG
+struct Net_Recv_Ring {
+    struct mmsghdr msgs[NET_RECV_BATCH_SIZE];
+    struct iovec iovecs[NET_RECV_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_RECV_BATCH_SIZE];
+    /* Only the pages actually written by the kernel become resident. */
+    uint8_t data[NET_RECV_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+};
+#endif
+
+struct Net_Send_Queue {
+    pthread_mutex_t mutex;
+    uint8_t deferring;
+
+    unsigned int num;
+    IP_Port ip_ports[NET_SEND_QUEUE_SIZE];
+    struct sockaddr_storage addrs[NET_SEND_QUEUE_SIZE];
+    size_t addrsizes[NET_SEND_QUEUE_SIZE];
+    uint32_t offsets[NET_SEND_QUEUE_SIZE];
+    uint16_t lengths[NET_SEND_QUEUE_SIZE];
+    uint8_t failed[NET_SEND_QUEUE_SIZE];
+#ifdef NET_USE_SENDMMSG
+    struct mmsghdr msgs[NET_SEND_QUEUE_SIZE];
+    struct iovec iovecs[NET_SEND_QUEUE_SIZE];
+#endif
+
+    uint32_t data_length;
+    uint8_t data[NET_SEND_QUEUE_BYTES];
+};
+
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 
 static const char *inet_ntop(sa_family_t family, void *addr, char *buf, size_t bufsize)
@@ -183,6 +226,21 @@ int set_socket_reuseaddr(sock_t sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure (or if the platform doesn't have SO_REUSEPORT)
+ */
+int set_socket_reuseport(sock_t sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -201,6 +259,46 @@ int set_socket_dualstack(sock_t sock)
     return (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&ipv6only, sizeof(ipv6only)) == 0);
 }
 
+/* Set or clear the don't fragment bit on the packets of socket of family
+ *
+ * return 1 on success
+ * return 0 on failure (or if the platform can't set it)
+ */
+int set_socket_dontfragment(sock_t sock, sa_family_t family, uint8_t enabled)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    /* IPv4 packets of dual stack sockets use the IPv4 setting. */
+    int mode = enabled ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, (void *)&mode, sizeof(mode)) != 0 && family == AF_INET)
+        return 0;
+
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+
+    if (family == AF_INET6) {
+        mode = enabled ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+        return (setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (void *)&mode, sizeof(mode)) == 0);
+    }
+
+#endif
+    return 1;
+#elif defined(IP_DONTFRAG)
+    int set = enabled;
+
+    if (family == AF_INET6) {
+#ifdef IPV6_DONTFRAG
+        return (setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG, (void *)&set, sizeof(set)) == 0);
+#else
+        return !enabled;
+#endif
+    }
+
+    return (setsockopt(sock, IPPROTO_IP, IP_DONTFRAG, (void *)&set, sizeof(set)) == 0);
+#else
+    return !enabled;
+#endif
+}
+
 
 /*  return current UNIX time in microseconds (us). */
 static uint64_t current_time_actual(void)
@@ -289,27 +387,24 @@ uint64_t current_time_monotonic(void)
 
 #endif /* TOX_LOGGER */
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Convert ip_port into a destination address for our socket.
+ *
+ * return 0 on success.
+ * return -1 if we can't send to that address.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static int ipport_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr,
+                              size_t *addrsize)
 {
-    if (net->family == 0) /* Socket not initialized */
-        return -1;
-
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET))
         return -1;
 
-    struct sockaddr_storage addr;
-    size_t addrsize = 0;
-
     if (ip_port.ip.family == AF_INET) {
         if (net->family == AF_INET6) {
             /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
-            addrsize = sizeof(struct sockaddr_in6);
+            *addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
             addr6->sin6_port = ip_port.port;
 
@@ -326,17 +421,17 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
         } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
 
-            addrsize = sizeof(struct sockaddr_in);
+            *addrsize = sizeof(struct sockaddr_in);
             addr4->sin_family = AF_INET;
             addr4->sin_addr = ip_port.ip.ip4.in_addr;
             addr4->sin_port = ip_port.port;
         }
     } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        *addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ip_port.port;
         addr6->sin6_addr = ip_port.ip.ip6.in6_addr;
@@ -348,6 +443,129 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         return -1;
     }
 
+    return 0;
+}
+
+/* Send the packets in the send queue, the queue mutex must be held.
+ * Packets that could not be sent are marked in queue->failed.
+ *
+ * return number of packets that could not be sent.
+ */
+static unsigned int send_queue_send(Networking_Core *net)
+{
+    Net_Send_Queue *queue = net->send_queue;
+    unsigned int i, num_failed = 0;
+
+#ifdef NET_USE_SENDMMSG
+
+    for (i = 0; i < queue->num; ++i) {
+        queue->iovecs[i].iov_base = queue->data + queue->offsets[i];
+        queue->iovecs[i].iov_len = queue->lengths[i];
+        memset(&queue->msgs[i], 0, sizeof(struct mmsghdr));
+        queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+        queue->msgs[i].msg_hdr.msg_namelen = queue->addrsizes[i];
+        queue->msgs[i].msg_hdr.msg_iov = &queue->iovecs[i];
+        queue->msgs[i].msg_hdr.msg_iovlen = 1;
+        queue->failed[i] = 0;
+    }
+
+    i = 0;
+
+    while (i < queue->num) {
+        int sent = sendmmsg(net->sock, queue->msgs + i, queue->num - i, 0);
+
+        if (sent <= 0) {
+            /* sendmmsg stops at the first datagram that fails, skip it and carry on with the rest. */
+            loglogdata("O=>", (queue->data + queue->offsets[i]), queue->lengths[i], queue->ip_ports[i], -1);
+            queue->failed[i] = 1;
+            ++num_failed;
+            ++i;
+            continue;
+        }
+
+        unsigned int j;
+
+        for (j = i; j < i + (unsigned int)sent; ++j) {
+            loglogdata("O=>", (queue->data + queue->offsets[j]), queue->lengths[j], queue->ip_ports[j],
+                       (int)queue->msgs[j].msg_len);
+        }
+
+        i += sent;
+    }
+
+#else
+
+    for (i = 0; i < queue->num; ++i) {
+        const uint8_t *data = queue->data + queue->offsets[i];
+        int res = sendto(net->sock, (const char *) data, queue->lengths[i], 0, (struct sockaddr *)&queue->addrs[i],
+                         queue->addrsizes[i]);
+
+        loglogdata("O=>", data, queue->lengths[i], queue->ip_ports[i], res);
+
+        queue->failed[i] = (res != queue->lengths[i]);
+
+        if (queue->failed[i])
+            ++num_failed;
+    }
+
+#endif
+
+    return num_failed;
+}
+
+/* Add a packet to the send queue if it is deferring packets and has room for it.
+ *
+ * return 1 if the packet was queued.
+ * return 0 if it should be sent right away.
+ */
+static int send_queue_add(Networking_Core *net, IP_Port ip_port, const struct sockaddr_storage *addr, size_t addrsize,
+                          const uint8_t *data, uint16_t length)
+{
+    Net_Send_Queue *queue = net->send_queue;
+    pthread_mutex_lock(&queue->mutex);
+
+    if (!queue->deferring) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+
+    if (queue->num == NET_SEND_QUEUE_SIZE || queue->data_length + length > NET_SEND_QUEUE_BYTES) {
+        /* Queue is full, send this one right away so the caller still gets the result. */
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+
+    unsigned int i = queue->num;
+    queue->ip_ports[i] = ip_port;
+    memcpy(&queue->addrs[i], addr, addrsize);
+    queue->addrsizes[i] = addrsize;
+    queue->offsets[i] = queue->data_length;
+    queue->lengths[i] = length;
+    memcpy(queue->data + queue->data_length, data, length);
+    queue->data_length += length;
+    ++queue->num;
+
+    pthread_mutex_unlock(&queue->mutex);
+    return 1;
+}
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (net->family == 0) /* Socket not initialized */
+        return -1;
+
+    struct sockaddr_storage addr;
+    size_t addrsize = 0;
+
+    if (ipport_to_sockaddr(net, ip_port, &addr, &addrsize) == -1)
+        return -1;
+
+    if (net->send_queue && send_queue_add(net, ip_port, &addr, addrsize, data, length))
+        return length;
+
     int res = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata("O=>", data, length, ip_port, res);
@@ -355,6 +573,123 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     return res;
 }
 
+void networking_register_send_fail_handler(Networking_Core *net, uint8_t byte, packet_handler_callback cb,
+        void *object)
+{
+    net->send_fail_handlers[byte].function = cb;
+    net->send_fail_handlers[byte].object = object;
+}
+
+int networking_enable_send_queue(Networking_Core *net, uint8_t enable)
+{
+    if (net->family == 0) /* Socket not initialized */
+        return -1;
+
+    if (!enable) {
+        if (net->send_queue) {
+            networking_send_queue_flush(net);
+            pthread_mutex_destroy(&net->send_queue->mutex);
+            free(net->send_queue);
+            net->send_queue = NULL;
+        }
+
+        return 0;
+    }
+
+    if (net->send_queue)
+        return 0;
+
+    Net_Send_Queue *queue = calloc(1, sizeof(Net_Send_Queue));
+
+    if (queue == NULL)
+        return -1;
+
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        free(queue);
+        return -1;
+    }
+
+    net->send_queue = queue;
+    return 0;
+}
+
+void networking_send_queue_begin(Networking_Core *net)
+{
+    if (!net->send_queue)
+        return;
+
+    pthread_mutex_lock(&net->send_queue->mutex);
+    net->send_queue->deferring = 1;
+    pthread_mutex_unlock(&net->send_queue->mutex);
+}
+
+unsigned int networking_send_queue_flush(Networking_Core *net)
+{
+    Net_Send_Queue *queue = net->send_queue;
+
+    if (!queue)
+        return 0;
+
+    pthread_mutex_lock(&queue->mutex);
+    unsigned int num_failed = send_queue_send(net);
+    unsigned int num = queue->num;
+    queue->num = 0;
+    queue->data_length = 0;
+    queue->deferring = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (num_failed == 0)
+        return 0;
+
+    /* Nothing is queued while we aren't deferring so the packet data stays valid,
+     * and the handlers are free to call sendpacket(). */
+    unsigned int i;
+
+    for (i = 0; i < num; ++i) {
+        if (!queue->failed[i])
+            continue;
+
+        const uint8_t *data = queue->data + queue->offsets[i];
+        Packet_Handles *handle = &net->send_fail_handlers[data[0]];
+
+        if (handle->function)
+            handle->function(handle->object, queue->ip_ports[i], data, queue->lengths[i]);
+    }
+
+    return num_failed;
+}
+
+/* Convert the sender address of a received datagram into ip_port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is unknown.
+ */
+static int sockaddr_to_ipport(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+
+        ip_port->ip.family = addr_in->sin_family;
+        ip_port->ip.ip4.in_addr = addr_in->sin_addr;
+        ip_port->port = addr_in->sin_port;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        ip_port->ip.family = addr_in6->sin6_family;
+        ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
+        ip_port->port = addr_in6->sin6_port;
+
+        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+            ip_port->ip.family = AF_INET;
+            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+        }
+    } else
+        return -1;
+
+    return 0;
+}
+
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
  *  Packet data is put into data.
@@ -382,23 +717,7 @@ static int receivepacket(sock_t sock, IP_Port *ip_port, uint8_t *data, uint32_t
 
     *length = (uint32_t)fail_or_len;
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
-
-        ip_port->ip.family = addr_in->sin_family;
-        ip_port->ip.ip4.in_addr = addr_in->sin_addr;
-        ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-        ip_port->ip.family = addr_in6->sin6_family;
-        ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
-        ip_port->port = addr_in6->sin6_port;
-
-        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-            ip_port->ip.family = AF_INET;
-            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
-        }
-    } else
+    if (sockaddr_to_ipport(&addr, ip_port) == -1)
         return -1;
 
     loglogdata("=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
@@ -412,6 +731,85 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
     net->packethandlers[byte].object = object;
 }
 
+/* Pass a received packet to the handler registered for its first byte. */
+static void networking_dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length)
+{
+    if (length < 1)
+        return;
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING("[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    if (net->rate_limiter && !rate_limiter_allow(net->rate_limiter, &ip_port.ip, data[0]))
+        return;
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
+}
+
+#ifdef NET_USE_RECVMMSG
+static Net_Recv_Ring *new_recv_ring(void)
+{
+    Net_Recv_Ring *ring = malloc(sizeof(Net_Recv_Ring));
+
+    if (ring == NULL)
+        return NULL;
+
+    memset(ring->msgs, 0, sizeof(ring->msgs));
+    unsigned int i;
+
+    for (i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        ring->iovecs[i].iov_base = ring->data[i];
+        ring->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iovecs[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return ring;
+}
+
+/* Read datagrams NET_RECV_BATCH_SIZE at a time until the socket is drained. */
+static void networking_poll_batched(Networking_Core *net)
+{
+    Net_Recv_Ring *ring = net->recv_ring;
+
+    while (1) {
+        unsigned int i;
+
+        for (i = 0; i < NET_RECV_BATCH_SIZE; ++i)
+            ring->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+        int count = recvmmsg(net->sock, ring->msgs, NET_RECV_BATCH_SIZE, 0, NULL);
+        ++net->poll_syscalls;
+
+        if (count <= 0) {
+            LOGGER_SCOPE( if ((count < 0) && (errno != EWOULDBLOCK))
+                          LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", errno, strerror(errno)); );
+            return;
+        }
+
+        for (i = 0; i < (unsigned int)count; ++i) {
+            IP_Port ip_port;
+
+            if (sockaddr_to_ipport(&ring->addrs[i], &ip_port) == -1)
+                continue;
+
+            uint32_t length = ring->msgs[i].msg_len;
+            loglogdata("=>O", ring->data[i], MAX_UDP_PACKET_SIZE, ip_port, length);
+
+            ++net->poll_packets;
+            networking_dispatch(net, ip_port, ring->data[i], length);
+        }
+
+        /* A short batch means the socket had nothing more queued, skip the syscall that would return EWOULDBLOCK. */
+        if (count < NET_RECV_BATCH_SIZE)
+            return;
+    }
+}
+#endif
+
 void networking_poll(Networking_Core *net)
 {
     if (net->family == 0) /* Socket not initialized */
@@ -419,22 +817,68 @@ void networking_poll(Networking_Core *net)
 
     unix_time_update();
 
+    net->poll_packets = 0;
+    net->poll_syscalls = 0;
+
+    if (net->rate_limiter)
+        rate_limiter_update_time(net->rate_limiter);
+
+#ifdef NET_USE_RECVMMSG
+
+    if (net->recv_ring) {
+        networking_poll_batched(net);
+        return;
+    }
+
+#endif
+
     IP_Port ip_port;
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
-    while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) continue;
+    while (1) {
+        ++net->poll_syscalls;
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING("[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
+        if (receivepacket(net->sock, &ip_port, data, &length) == -1)
+            break;
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
+        ++net->poll_packets;
+        networking_dispatch(net, ip_port, data, length);
     }
 }
 
+int networking_enable_rate_limit(Networking_Core *net, uint8_t enable, uint8_t ipv4_prefix, uint8_t ipv6_prefix)
+{
+    kill_rate_limiter(net->rate_limiter);
+    net->rate_limiter = NULL;
+
+    if (!enable)
+        return 0;
+
+    net->rate_limiter = new_rate_limiter(ipv4_prefix, ipv6_prefix);
+
+    if (net->rate_limiter == NULL)
+        return -1;
+
+    return 0;
+}
+
+int networking_set_packet_budget(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst)
+{
+    if (net->rate_limiter == NULL)
+        return -1;
+
+    return rate_limiter_set_budget(net->rate_limiter, packet_id, rate, burst);
+}
+
+uint64_t networking_packets_dropped(const Networking_Core *net, uint8_t packet_id)
+{
+    if (net->rate_limiter == NULL)
+        return 0;
+
+    return net->rate_limiter->dropped[packet_id];
+}
+
 #ifndef VANILLA_NACL
 /* Used for sodium_init() */
 #include <sodium.h>
@@ -553,6 +997,11 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
         return NULL;
     }
 
+#ifdef NET_USE_RECVMMSG
+    /* If this fails we just fall back to reading one datagram per syscall. */
+    temp->recv_ring = new_recv_ring();
+#endif
+
     /* Functions to increase the size of the send and receive UDP buffers.
      */
     int n = 1024 * 1024 * 2;
@@ -610,7 +1059,7 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
 
         portptr = &addr6->sin6_port;
     } else {
-        free(temp);
+        kill_networking(temp);
         return NULL;
     }
 
@@ -702,9 +1151,13 @@ void kill_networking(Networking_Core *net)
     if (!net)
         return;
 
+    networking_enable_send_queue(net, 0);
+    kill_rate_limiter(net->rate_limiter);
+
     if (net->family != 0) /* Socket not initialized */
         kill_sock(net->sock);
 
+    free(net->recv_ring);
     free(net);
     return;
 }
@@ -827,6 +1280,20 @@ void ipport_copy(IP_Port *target, const IP_Port *source)
     memcpy(target, source, sizeof(IP_Port));
 }
 
+void ip_port_key(uint8_t *key, const IP_Port *ip_port)
+{
+    memset(key, 0, IP_PORT_KEY_SIZE);
+    key[0] = ip_port->ip.family;
+
+    if (ip_port->ip.family == AF_INET) {
+        memcpy(key + 1, ip_port->ip.ip4.uint8, sizeof(IP4));
+    } else if (ip_port->ip.family == AF_INET6) {
+        memcpy(key + 1, ip_port->ip.ip6.uint8, sizeof(IP6));
+    }
+
+    memcpy(key + 1 + sizeof(IP6), &ip_port->port, sizeof(uint16_t));
+}
+
 /* ip_ntoa
  *   converts ip into a string
  *   uses a static buffer, so mustn't used multiple times in the same output
@@ -262,6 +262,16 @@ void ip_copy(IP *target, const IP *source);
 /* copies an ip_port structure */
 void ipport_copy(IP_Port *target, const IP_Port *source);
 
+/* Size of the keys made by ip_port_key(): family, address and port. */
+#define IP_PORT_KEY_SIZE (1 + sizeof(IP6) + sizeof(uint16_t))
+
+/* Pack ip_port into a key of IP_PORT_KEY_SIZE bytes for hash maps.
+ *
+ * Only the bytes of the address that belong to the family are used so that stale
+ * bytes in the IP union or struct padding never make two equal ip_ports differ.
+ */
+void ip_port_key(uint8_t *key, const IP_Port *ip_port);
+
 /*
  * addr_resolve():
  *  uses getaddrinfo to resolve an address into an IP address
@@ -309,6 +319,17 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+/* Maximum number of datagrams pulled from the socket by one batched receive call. */
+#define NET_RECV_BATCH_SIZE 16
+
+/* Maximum number of datagrams and bytes held by the send queue, packets that don't fit are sent right away. */
+#define NET_SEND_QUEUE_SIZE 256
+#define NET_SEND_QUEUE_BYTES (1024 * 256)
+
+typedef struct Net_Recv_Ring Net_Recv_Ring;
+typedef struct Net_Send_Queue Net_Send_Queue;
+typedef struct Rate_Limiter Rate_Limiter;
+
 typedef struct {
     Packet_Handles packethandlers[256];
 
@@ -316,6 +337,24 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     sock_t sock;
+
+    /* Reusable packet buffers for batched receiving (recvmmsg).
+     * NULL if the platform doesn't support it, in which case every datagram is read with recvfrom. */
+    Net_Recv_Ring *recv_ring;
+
+    /* Handlers called for queued datagrams that failed to send, see networking_send_queue_flush(). */
+    Packet_Handles send_fail_handlers[256];
+
+    /* Outgoing datagram queue, NULL unless enabled with networking_enable_send_queue(). */
+    Net_Send_Queue *send_queue;
+
+    /* Per source budgets checked before received datagrams are passed to their handler,
+     * NULL unless enabled with networking_enable_rate_limit(). */
+    Rate_Limiter *rate_limiter;
+
+    /* Number of datagrams received and receive syscalls made during the last networking_poll(). */
+    uint32_t poll_packets;
+    uint32_t poll_syscalls;
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -357,6 +396,13 @@ int set_socket_nosigpipe(sock_t sock);
  */
 int set_socket_reuseaddr(sock_t sock);
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure (or if the platform doesn't have SO_REUSEPORT)
+ */
+int set_socket_reuseport(sock_t sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -364,18 +410,87 @@ int set_socket_reuseaddr(sock_t sock);
  */
 int set_socket_dualstack(sock_t sock);
 
+/* Set or clear the don't fragment bit on the packets of socket of family, with the kernel not
+ * limiting their size to the path MTU it knows when it is set.
+ *
+ * return 1 on success
+ * return 0 on failure (or if the platform can't set it)
+ */
+int set_socket_dontfragment(sock_t sock, sa_family_t family, uint8_t enabled);
+
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * If the send queue is deferring packets, the packet is copied into it and length is returned,
+ * failures are reported later to the send fail handler registered for data[0].
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
-/* Call this several times a second. */
+/* Function to call when a queued packet beginning with byte could not be sent.
+ *
+ * Only used when the send queue is enabled: sendpacket() then returns before the
+ * datagram hits the socket so this is the only way to learn it was dropped.
+ */
+void networking_register_send_fail_handler(Networking_Core *net, uint8_t byte, packet_handler_callback cb,
+        void *object);
+
+/* Enable or disable the send queue.
+ * Disabling it sends whatever is still queued.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_enable_send_queue(Networking_Core *net, uint8_t enable);
+
+/* Start deferring packets passed to sendpacket() until networking_send_queue_flush() is called.
+ * Does nothing if the send queue isn't enabled.
+ */
+void networking_send_queue_begin(Networking_Core *net);
+
+/* Send all queued packets (with sendmmsg where available) and stop deferring.
+ * The send fail handler of every packet that could not be sent is called.
+ *
+ * networking_send_queue_begin() and this must be called from the same thread,
+ * sendpacket() may be called from any thread.
+ *
+ * return number of packets that could not be sent.
+ */
+unsigned int networking_send_queue_flush(Networking_Core *net);
+
+/* Enable or disable the rate limiter for received datagrams.
+ * Sources are grouped by their first ipv4_prefix (1 - 32) or ipv6_prefix (1 - 128) bits.
+ * Disabling it forgets the budgets and the drop counts.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_enable_rate_limit(Networking_Core *net, uint8_t enable, uint8_t ipv4_prefix, uint8_t ipv6_prefix);
+
+/* Let every source send rate datagrams per second beginning with packet_id, and up to burst of them
+ * at once. Datagrams over the budget are dropped before their handler sees them.
+ * A rate of 0 removes the limit.
+ *
+ * return 0 on success.
+ * return -1 on failure (or if the rate limiter isn't enabled).
+ */
+int networking_set_packet_budget(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst);
+
+/* return the number of datagrams beginning with packet_id the rate limiter dropped. */
+uint64_t networking_packets_dropped(const Networking_Core *net, uint8_t packet_id);
+
+/* Call this several times a second.
+ *
+ * Reads every pending datagram from the socket and passes it to its packet handler.
+ * net->poll_packets and net->poll_syscalls are set to the number of datagrams read
+ * and the number of receive syscalls it took.
+ */
 void networking_poll(Networking_Core *net);
 
 /* Initialize networking.
@@ -0,0 +1,295 @@
+/* node_cache.c
+ *
+ * Known good DHT nodes and TCP relays, kept across restarts
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "node_cache.h"
+#include "util.h"
+
+#define NODE_CACHE_COOKIE 0x15ed0c4e
+
+/* Size of a saved entry without its packed node: type, last seen, rtt, attempts and successes. */
+#define NODE_CACHE_ENTRY_HEADER (1 + sizeof(uint64_t) + sizeof(uint16_t) * 3)
+
+Node_Cache *new_node_cache(void)
+{
+    return calloc(1, sizeof(Node_Cache));
+}
+
+void kill_node_cache(Node_Cache *cache)
+{
+    free(cache);
+}
+
+static Node_Cache_Entry *cache_entries(const Node_Cache *cache, uint8_t type, uint16_t *max_num)
+{
+    if (type == NODE_CACHE_TYPE_DHT) {
+        *max_num = NODE_CACHE_DHT_NODES;
+        return (Node_Cache_Entry *)cache->dht_nodes;
+    }
+
+    *max_num = NODE_CACHE_TCP_RELAYS;
+    return (Node_Cache_Entry *)cache->tcp_relays;
+}
+
+static Node_Cache_Entry *find_entry(Node_Cache *cache, uint8_t type, const uint8_t *public_key)
+{
+    uint16_t max_num, i;
+    Node_Cache_Entry *entries = cache_entries(cache, type, &max_num);
+
+    for (i = 0; i < cache->num_entries[type]; ++i) {
+        if (public_key_cmp(entries[i].node.public_key, public_key) == 0)
+            return &entries[i];
+    }
+
+    return NULL;
+}
+
+/* Rank of an entry, higher is better: its success rate counting one success and one failure more
+ * than it had, so that a node with a single answer doesn't beat a reliable one, slowed down by its
+ * round trip time and halved for every NODE_CACHE_AGE_HALF_LIFE since it was last seen.
+ */
+static uint64_t entry_score(const Node_Cache_Entry *entry, uint64_t now)
+{
+    uint64_t score = ((uint64_t)entry->successes + 1) * 65536 / ((uint64_t)entry->attempts + 2);
+    score = score * NODE_CACHE_RTT_REFERENCE / (NODE_CACHE_RTT_REFERENCE + entry->rtt);
+
+    uint64_t age = now > entry->last_seen ? now - entry->last_seen : 0;
+
+    if (age / NODE_CACHE_AGE_HALF_LIFE >= 32)
+        return 0;
+
+    return score >> (age / NODE_CACHE_AGE_HALF_LIFE);
+}
+
+void node_cache_attempt(Node_Cache *cache, uint8_t type, const uint8_t *public_key)
+{
+    if (type >= NODE_CACHE_NUM_TYPES)
+        return;
+
+    Node_Cache_Entry *entry = find_entry(cache, type, public_key);
+
+    if (entry == NULL)
+        return;
+
+    if (entry->attempts >= NODE_CACHE_MAX_ATTEMPTS) {
+        entry->attempts /= 2;
+        entry->successes /= 2;
+    }
+
+    ++entry->attempts;
+}
+
+void node_cache_success(Node_Cache *cache, uint8_t type, const Node_format *node, uint64_t rtt)
+{
+    if (type >= NODE_CACHE_NUM_TYPES)
+        return;
+
+    if (rtt > UINT16_MAX)
+        rtt = UINT16_MAX;
+
+    uint64_t now = unix_time();
+    Node_Cache_Entry *entry = find_entry(cache, type, node->public_key);
+
+    if (entry) {
+        entry->node.ip_port = node->ip_port;
+        entry->last_seen = now;
+        entry->rtt = (entry->rtt * 7 + rtt) / 8;
+
+        /* Answers to requests sent before the node was added have no attempt. */
+        if (entry->successes < entry->attempts)
+            ++entry->successes;
+
+        return;
+    }
+
+    Node_Cache_Entry new_entry;
+    new_entry.node = *node;
+    new_entry.last_seen = now;
+    new_entry.rtt = rtt;
+    new_entry.attempts = 1;
+    new_entry.successes = 1;
+
+    uint16_t max_num;
+    Node_Cache_Entry *entries = cache_entries(cache, type, &max_num);
+
+    if (cache->num_entries[type] < max_num) {
+        entries[cache->num_entries[type]] = new_entry;
+        ++cache->num_entries[type];
+        return;
+    }
+
+    uint16_t i, worst = 0;
+    uint64_t worst_score = UINT64_MAX;
+
+    for (i = 0; i < max_num; ++i) {
+        uint64_t score = entry_score(&entries[i], now);
+
+        if (score < worst_score) {
+            worst_score = score;
+            worst = i;
+        }
+    }
+
+    if (worst_score < entry_score(&new_entry, now))
+        entries[worst] = new_entry;
+}
+
+uint16_t node_cache_best(const Node_Cache *cache, uint8_t type, Node_format *nodes, uint16_t max_num)
+{
+    if (type >= NODE_CACHE_NUM_TYPES)
+        return 0;
+
+    uint16_t num_entries, i, j;
+    const Node_Cache_Entry *entries = cache_entries(cache, type, &num_entries);
+    num_entries = cache->num_entries[type];
+
+    if (num_entries == 0 || max_num == 0)
+        return 0;
+
+    uint64_t now = unix_time();
+    uint64_t scores[num_entries];
+    uint16_t order[num_entries];
+
+    /* Insertion sort, the cache is small. */
+    for (i = 0; i < num_entries; ++i) {
+        uint64_t score = entry_score(&entries[i], now);
+
+        for (j = i; j > 0 && scores[j - 1] < score; --j) {
+            scores[j] = scores[j - 1];
+            order[j] = order[j - 1];
+        }
+
+        scores[j] = score;
+        order[j] = i;
+    }
+
+    for (i = 0; i < num_entries && i < max_num; ++i)
+        nodes[i] = entries[order[i]].node;
+
+    return i;
+}
+
+uint32_t node_cache_size(const Node_Cache *cache)
+{
+    uint32_t size = sizeof(uint32_t);
+    uint8_t type;
+    uint16_t i, max_num;
+
+    for (type = 0; type < NODE_CACHE_NUM_TYPES; ++type) {
+        const Node_Cache_Entry *entries = cache_entries(cache, type, &max_num);
+
+        for (i = 0; i < cache->num_entries[type]; ++i)
+            size += NODE_CACHE_ENTRY_HEADER + packed_node_size(entries[i].node.ip_port.ip.family);
+    }
+
+    return size;
+}
+
+void node_cache_save(const Node_Cache *cache, uint8_t *data)
+{
+    host_to_lendian32(data, NODE_CACHE_COOKIE);
+    data += sizeof(uint32_t);
+
+    uint8_t type;
+    uint16_t i, max_num;
+
+    for (type = 0; type < NODE_CACHE_NUM_TYPES; ++type) {
+        const Node_Cache_Entry *entries = cache_entries(cache, type, &max_num);
+
+        for (i = 0; i < cache->num_entries[type]; ++i) {
+            const Node_Cache_Entry *entry = &entries[i];
+            int node_size = packed_node_size(entry->node.ip_port.ip.family);
+
+            data[0] = type;
+            U64_to_bytes(data + 1, entry->last_seen);
+            U16_to_bytes(data + 1 + sizeof(uint64_t), entry->rtt);
+            U16_to_bytes(data + 1 + sizeof(uint64_t) + sizeof(uint16_t), entry->attempts);
+            U16_to_bytes(data + 1 + sizeof(uint64_t) + sizeof(uint16_t) * 2, entry->successes);
+            pack_nodes(data + NODE_CACHE_ENTRY_HEADER, node_size, &entry->node, 1);
+            data += NODE_CACHE_ENTRY_HEADER + node_size;
+        }
+    }
+}
+
+int node_cache_load(Node_Cache *cache, const uint8_t *data, uint32_t length)
+{
+    memset(cache, 0, sizeof(Node_Cache));
+
+    uint32_t cookie;
+
+    if (length < sizeof(uint32_t))
+        return -1;
+
+    lendian_to_host32(&cookie, data);
+
+    if (cookie != NODE_CACHE_COOKIE)
+        return -1;
+
+    uint32_t processed = sizeof(uint32_t);
+
+    while (processed < length) {
+        if (length - processed < NODE_CACHE_ENTRY_HEADER)
+            goto fail;
+
+        const uint8_t *entry_data = data + processed;
+        uint8_t type = entry_data[0];
+
+        if (type >= NODE_CACHE_NUM_TYPES)
+            goto fail;
+
+        Node_Cache_Entry entry;
+        uint16_t node_length;
+        uint32_t node_data_length = length - processed - NODE_CACHE_ENTRY_HEADER;
+
+        if (node_data_length > (uint32_t)packed_node_size(AF_INET6))
+            node_data_length = packed_node_size(AF_INET6);
+
+        if (unpack_nodes(&entry.node, 1, &node_length, entry_data + NODE_CACHE_ENTRY_HEADER, node_data_length,
+                         type == NODE_CACHE_TYPE_TCP) != 1)
+            goto fail;
+
+        bytes_to_U64(&entry.last_seen, entry_data + 1);
+        bytes_to_U16(&entry.rtt, entry_data + 1 + sizeof(uint64_t));
+        bytes_to_U16(&entry.attempts, entry_data + 1 + sizeof(uint64_t) + sizeof(uint16_t));
+        bytes_to_U16(&entry.successes, entry_data + 1 + sizeof(uint64_t) + sizeof(uint16_t) * 2);
+        processed += NODE_CACHE_ENTRY_HEADER + node_length;
+
+        uint16_t max_num;
+        Node_Cache_Entry *entries = cache_entries(cache, type, &max_num);
+
+        if (cache->num_entries[type] == max_num || entry.successes > entry.attempts)
+            goto fail;
+
+        entries[cache->num_entries[type]] = entry;
+        ++cache->num_entries[type];
+    }
+
+    return 0;
+
+fail:
+    memset(cache, 0, sizeof(Node_Cache));
+    return -1;
+}
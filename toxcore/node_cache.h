@@ -0,0 +1,101 @@
+/* node_cache.h
+ *
+ * Known good DHT nodes and TCP relays, kept across restarts
+ * -Every node we sent a get nodes request to and every relay we connected to counts as an attempt,
+ *  every answer or relay that came online as a success
+ * -Nodes are ranked by success rate, round trip time and when they were last seen
+ * -The cache is saved separately from the profile so that clients can keep it in its own file
+ *  and share it between profiles
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NODE_CACHE_H
+#define NODE_CACHE_H
+
+#include "DHT.h"
+
+#define NODE_CACHE_TYPE_DHT 0
+#define NODE_CACHE_TYPE_TCP 1
+#define NODE_CACHE_NUM_TYPES 2
+
+/* Number of DHT nodes and TCP relays kept. */
+#define NODE_CACHE_DHT_NODES 64
+#define NODE_CACHE_TCP_RELAYS 16
+
+/* Number of the best DHT nodes and TCP relays contacted at once on start. */
+#define NODE_CACHE_BOOTSTRAP_NODES 16
+#define NODE_CACHE_BOOTSTRAP_RELAYS 8
+
+/* Attempts and successes are halved once the attempts reach this, so that the success rate
+ * follows what a node did recently. */
+#define NODE_CACHE_MAX_ATTEMPTS 64
+
+/* The score of a node halves for every this many seconds since it was last seen. */
+#define NODE_CACHE_AGE_HALF_LIFE (60 * 60 * 24)
+
+/* A node with a round trip time of this many ms gets half the score of one that answers right away. */
+#define NODE_CACHE_RTT_REFERENCE 100
+
+typedef struct {
+    Node_format node;
+    uint64_t last_seen; /* unix_time() of the last success. */
+    uint16_t rtt; /* Smoothed round trip time in ms. */
+    uint16_t attempts;
+    uint16_t successes;
+} Node_Cache_Entry;
+
+struct Node_Cache {
+    Node_Cache_Entry dht_nodes[NODE_CACHE_DHT_NODES];
+    Node_Cache_Entry tcp_relays[NODE_CACHE_TCP_RELAYS];
+    uint16_t num_entries[NODE_CACHE_NUM_TYPES];
+};
+
+Node_Cache *new_node_cache(void);
+
+void kill_node_cache(Node_Cache *cache);
+
+/* Count a request sent to the node of type with public_key, if it is in the cache. */
+void node_cache_attempt(Node_Cache *cache, uint8_t type, const uint8_t *public_key);
+
+/* Count an answer from node that took rtt ms. Nodes not in the cache are added if they rank higher
+ * than the worst node of the full cache, which is then removed.
+ */
+void node_cache_success(Node_Cache *cache, uint8_t type, const Node_format *node, uint64_t rtt);
+
+/* Copy up to max_num of the best ranked nodes of type into nodes, best first.
+ *
+ * return the number of nodes copied.
+ */
+uint16_t node_cache_best(const Node_Cache *cache, uint8_t type, Node_format *nodes, uint16_t max_num);
+
+/* return the size of the cache (for saving). */
+uint32_t node_cache_size(const Node_Cache *cache);
+
+/* Save the cache in data where data is an array of size node_cache_size(). */
+void node_cache_save(const Node_Cache *cache, uint8_t *data);
+
+/* Replace the cache with the one saved in data of size length.
+ *
+ * return -1 on failure, the cache is then left empty.
+ * return 0 on success.
+ */
+int node_cache_load(Node_Cache *cache, const uint8_t *data, uint32_t length);
+
+#endif
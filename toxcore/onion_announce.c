@@ -244,92 +244,6 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_hash_sha256(ping_id, data, sizeof(data));
 }
 
-/* check if public key is in entries list
- *
- * return -1 if no
- * return position in list if yes
- */
-static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
-{
-    unsigned int i;
-
-    for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0)
-            return i;
-    }
-
-    return -1;
-}
-
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
-{
-    Onion_Announce_Entry entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Announce_Entry));
-    memcpy(&entry2, b, sizeof(Onion_Announce_Entry));
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
-
-    if (t1 && t2)
-        return 0;
-
-    if (t1)
-        return -1;
-
-    if (t2)
-        return 1;
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1)
-        return 1;
-
-    if (close == 2)
-        return -1;
-
-    return 0;
-}
-
-/* add entry to entries list
- *
- * return -1 if failure
- * return position if added
- */
-static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
-                          const uint8_t *data_public_key, const uint8_t *ret)
-{
-
-    int pos = in_entries(onion_a, public_key);
-
-    unsigned int i;
-
-    if (pos == -1) {
-        for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT))
-                pos = i;
-        }
-    }
-
-    if (pos == -1) {
-        if (id_closest(onion_a->dht->self_public_key, public_key, onion_a->entries[0].public_key) == 1)
-            pos = 0;
-    }
-
-    if (pos == -1)
-        return -1;
-
-    memcpy(onion_a->entries[pos].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-    onion_a->entries[pos].ret_ip_port = ret_ip_port;
-    memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
-    memcpy(onion_a->entries[pos].data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
-    onion_a->entries[pos].time = unix_time();
-
-    memcpy(cmp_public_key, onion_a->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, sizeof(Onion_Announce_Entry), cmp_entry);
-    return in_entries(onion_a, public_key);
-}
-
 static int handle_gc_announce_request(Onion_Announce *onion_a, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     if (length > ANNOUNCE_REQUEST_MAX_SIZE_RECV || length < ANNOUNCE_REQUEST_MIN_SIZE_RECV) {
@@ -355,16 +269,16 @@ static int handle_gc_announce_request(Onion_Announce *onion_a, IP_Port source, c
     uint8_t ping_id2[ONION_PING_ID_SIZE];
     generate_ping_id(onion_a, unix_time() + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
 
-    int index;
+    const Onion_Announce_Entry *entry;
 
     uint8_t *data_public_key = plain + ONION_PING_ID_SIZE + crypto_box_PUBLICKEYBYTES;
 
     if (sodium_memcmp(ping_id1, plain, ONION_PING_ID_SIZE) == 0
         || sodium_memcmp(ping_id2, plain, ONION_PING_ID_SIZE) == 0) {
-        index = add_to_entries(onion_a, source, packet_public_key, data_public_key,
-                               packet + (length - ONION_RETURN_3));
+        entry = announce_store_add(&onion_a->entries, packet_public_key, source, packet + (length - ONION_RETURN_3),
+                                   data_public_key);
     } else {
-        index = in_entries(onion_a, plain + ONION_PING_ID_SIZE);
+        entry = announce_store_find(&onion_a->entries, plain + ONION_PING_ID_SIZE);
     }
 
     /*Respond with a announce response packet*/
@@ -377,12 +291,12 @@ static int handle_gc_announce_request(Onion_Announce *onion_a, IP_Port source, c
 
     uint8_t pl[3 + ONION_PING_ID_SIZE + sizeof(nodes_list) + sizeof(gc_announces)];
 
-    if (index == -1) {
+    if (entry == NULL) {
         pl[0] = 0;
         memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
     } else {
-        if (public_key_cmp(onion_a->entries[index].public_key, packet_public_key) == 0) {
-            if (public_key_cmp(onion_a->entries[index].data_public_key, data_public_key) != 0) {
+        if (public_key_cmp(entry->public_key, packet_public_key) == 0) {
+            if (public_key_cmp(entry->data_public_key, data_public_key) != 0) {
                 pl[0] = 0;
                 memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
             } else {
@@ -391,7 +305,7 @@ static int handle_gc_announce_request(Onion_Announce *onion_a, IP_Port source, c
             }
         } else {
             pl[0] = 1;
-            memcpy(pl + 1, onion_a->entries[index].data_public_key, crypto_box_PUBLICKEYBYTES);
+            memcpy(pl + 1, entry->data_public_key, crypto_box_PUBLICKEYBYTES);
         }
     }
 
@@ -470,16 +384,16 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
     uint8_t ping_id2[ONION_PING_ID_SIZE];
     generate_ping_id(onion_a, unix_time() + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
 
-    int index;
+    const Onion_Announce_Entry *entry;
 
     uint8_t *data_public_key = plain + ONION_PING_ID_SIZE + crypto_box_PUBLICKEYBYTES;
 
     if (sodium_memcmp(ping_id1, plain, ONION_PING_ID_SIZE) == 0
             || sodium_memcmp(ping_id2, plain, ONION_PING_ID_SIZE) == 0) {
-        index = add_to_entries(onion_a, source, packet_public_key, data_public_key,
-                               packet + (length - ONION_RETURN_3));
+        entry = announce_store_add(&onion_a->entries, packet_public_key, source, packet + (length - ONION_RETURN_3),
+                                   data_public_key);
     } else {
-        index = in_entries(onion_a, plain + ONION_PING_ID_SIZE);
+        entry = announce_store_find(&onion_a->entries, plain + ONION_PING_ID_SIZE);
     }
 
     /*Respond with a announce response packet*/
@@ -491,12 +405,12 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     uint8_t pl[2 + ONION_PING_ID_SIZE + sizeof(nodes_list)];
 
-    if (index == -1) {
+    if (entry == NULL) {
         pl[0] = 0;
         memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
     } else {
-        if (public_key_cmp(onion_a->entries[index].public_key, packet_public_key) == 0) {
-            if (public_key_cmp(onion_a->entries[index].data_public_key, data_public_key) != 0) {
+        if (public_key_cmp(entry->public_key, packet_public_key) == 0) {
+            if (public_key_cmp(entry->data_public_key, data_public_key) != 0) {
                 pl[0] = 0;
                 memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
             } else {
@@ -505,7 +419,7 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
             }
         } else {
             pl[0] = 1;
-            memcpy(pl + 1, onion_a->entries[index].data_public_key, crypto_box_PUBLICKEYBYTES);
+            memcpy(pl + 1, entry->data_public_key, crypto_box_PUBLICKEYBYTES);
         }
     }
 
@@ -551,17 +465,16 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
     if (length > ONION_MAX_PACKET_SIZE)
         return 1;
 
-    int index = in_entries(onion_a, packet + 1);
+    const Onion_Announce_Entry *entry = announce_store_find(&onion_a->entries, packet + 1);
 
-    if (index == -1)
+    if (entry == NULL)
         return 1;
 
     uint8_t data[length - (crypto_box_PUBLICKEYBYTES + ONION_RETURN_3)];
     data[0] = NET_PACKET_ONION_DATA_RESPONSE;
     memcpy(data + 1, packet + 1 + crypto_box_PUBLICKEYBYTES, length - (1 + crypto_box_PUBLICKEYBYTES + ONION_RETURN_3));
 
-    if (send_onion_response(onion_a->net, onion_a->entries[index].ret_ip_port, data, sizeof(data),
-                            onion_a->entries[index].ret) == -1)
+    if (send_onion_response(onion_a->net, entry->ret_ip_port, data, sizeof(data), entry->ret) == -1)
         return 1;
 
     return 0;
@@ -577,6 +490,18 @@ Onion_Announce *new_onion_announce(DHT *dht, GC_Announces_List *gc_announces_lis
     if (onion_a == NULL)
         return NULL;
 
+    if (shared_keys_init(&onion_a->shared_keys_recv, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        free(onion_a);
+        return NULL;
+    }
+
+    if (announce_store_init(&onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, ONION_ANNOUNCE_TIMEOUT,
+                            dht->self_public_key) == -1) {
+        shared_keys_free(&onion_a->shared_keys_recv);
+        free(onion_a);
+        return NULL;
+    }
+
     onion_a->dht = dht;
     onion_a->net = dht->net;
     onion_a->gc_announces_list = gc_announces_list;
@@ -588,6 +513,18 @@ Onion_Announce *new_onion_announce(DHT *dht, GC_Announces_List *gc_announces_lis
     return onion_a;
 }
 
+int onion_announce_set_capacity(Onion_Announce *onion_a, uint32_t capacity)
+{
+    Announce_Store entries;
+
+    if (announce_store_init(&entries, capacity, ONION_ANNOUNCE_TIMEOUT, onion_a->dht->self_public_key) == -1)
+        return -1;
+
+    announce_store_free(&onion_a->entries);
+    onion_a->entries = entries;
+    return 0;
+}
+
 void kill_onion_announce(Onion_Announce *onion_a)
 {
     if (onion_a == NULL)
@@ -595,5 +532,7 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    shared_keys_free(&onion_a->shared_keys_recv);
+    announce_store_free(&onion_a->entries);
     free(onion_a);
 }
@@ -25,7 +25,9 @@
 
 #include "onion.h"
 #include "group_announce.h"
+#include "announce_store.h"
 
+/* Default number of announcements stored, onion_announce_set_capacity() changes it. */
 #define ONION_ANNOUNCE_MAX_ENTRIES 160
 #define ONION_ANNOUNCE_TIMEOUT 300
 #define ONION_PING_ID_SIZE crypto_hash_sha256_BYTES
@@ -48,19 +50,11 @@
 #define ONION_DATA_REQUEST_MIN_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES)
 #define MAX_DATA_REQUEST_SIZE (ONION_MAX_DATA_SIZE - ONION_DATA_REQUEST_MIN_SIZE)
 
-typedef struct {
-    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-    IP_Port ret_ip_port;
-    uint8_t ret[ONION_RETURN_3];
-    uint8_t data_public_key[crypto_box_PUBLICKEYBYTES];
-    uint64_t time;
-} Onion_Announce_Entry;
-
 typedef struct {
     DHT     *dht;
     Networking_Core *net;
     GC_Announces_List *gc_announces_list;
-    Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
+    Announce_Store entries;
     /* This is crypto_box_KEYBYTES long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[crypto_box_KEYBYTES];
 
@@ -143,6 +137,13 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
 
 Onion_Announce *new_onion_announce(DHT *dht, GC_Announces_List *gc_announces_list);
 
+/* Make onion_a store up to capacity announcements. Announcements stored so far are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int onion_announce_set_capacity(Onion_Announce *onion_a, uint32_t capacity);
+
 void kill_onion_announce(Onion_Announce *onion_a);
 
 
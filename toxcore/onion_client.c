@@ -450,33 +450,44 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+/* return 1 if entry1 goes after entry2 in a list sorted by sort_onion_node_list().
+ * return 0 if it doesn't.
+ */
+static _Bool onion_node_after(const Onion_Node *entry1, const Onion_Node *entry2, const uint8_t *cmp_public_key)
 {
-    Onion_Node entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Node));
-    memcpy(&entry2, b, sizeof(Onion_Node));
-    int t1 = is_timeout(entry1.timestamp, ONION_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.timestamp, ONION_NODE_TIMEOUT);
+    int t1 = is_timeout(entry1->timestamp, ONION_NODE_TIMEOUT);
+    int t2 = is_timeout(entry2->timestamp, ONION_NODE_TIMEOUT);
 
-    if (t1 && t2)
-        return 0;
+    if (t1 || t2)
+        return t2 && !t1;
 
-    if (t1)
-        return -1;
+    return id_closest(cmp_public_key, entry1->public_key, entry2->public_key) == 1;
+}
 
-    if (t2)
-        return 1;
+/* Sort the timed out nodes of list first, then the others from the furthest from cmp_public_key
+ * to the closest.
+ *
+ * The lists are short and mostly sorted already, an insertion sort only compares each node
+ * with the one before it then.
+ */
+static void sort_onion_node_list(Onion_Node *list, unsigned int length, const uint8_t *cmp_public_key)
+{
+    unsigned int i;
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    for (i = 1; i < length; ++i) {
+        if (!onion_node_after(&list[i - 1], &list[i], cmp_public_key))
+            continue;
 
-    if (close == 1)
-        return 1;
+        Onion_Node node = list[i];
+        unsigned int j = i;
 
-    if (close == 2)
-        return -1;
+        do {
+            list[j] = list[j - 1];
+            --j;
+        } while (j > 0 && onion_node_after(&list[j - 1], &node, cmp_public_key));
 
-    return 0;
+        list[j] = node;
+    }
 }
 
 static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
@@ -507,8 +518,7 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
         list_length = MAX_ONION_CLIENTS;
     }
 
-    memcpy(cmp_public_key, reference_id, crypto_box_PUBLICKEYBYTES);
-    qsort(list_nodes, list_length, sizeof(Onion_Node), cmp_entry);
+    sort_onion_node_list(list_nodes, list_length, reference_id);
 
     int index = -1, stored = 0;
     unsigned int i;
@@ -1518,6 +1528,12 @@ void do_onion_client(Onion_Client *onion_c)
     onion_c->last_run = unix_time();
 }
 
+uint64_t onion_client_deadline(const Onion_Client *onion_c)
+{
+    /* The connection status is counted in seconds, do_onion_client() has to run once a second. */
+    return onion_c->last_run + 1;
+}
+
 Onion_Client *new_onion_client(Net_Crypto *c, GC_Session *gc_session)
 {
     if (!c || !gc_session) {
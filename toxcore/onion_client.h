@@ -283,6 +283,9 @@ void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_ha
 
 void do_onion_client(Onion_Client *onion_c);
 
+/* return the unix_time() at which do_onion_client() next has something to do. */
+uint64_t onion_client_deadline(const Onion_Client *onion_c);
+
 Onion_Client *new_onion_client(Net_Crypto *c, GC_Session *gc_session);
 
 void kill_onion_client(Onion_Client *onion_c);
@@ -265,7 +265,9 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
     if (!node_addable_to_close_list(ping->dht, public_key, ip_port))
         return -1;
 
-    if (in_list(ping->dht->close_clientlist, LCLIENT_LIST, public_key, ip_port))
+    const Client_data *client = get_close_client(ping->dht, public_key);
+
+    if (client && in_list(client, 1, public_key, ip_port))
         return -1;
 
     IP_Port temp;
@@ -324,6 +326,14 @@ void do_to_ping(PING *ping)
         ping->last_to_ping = unix_time();
 }
 
+uint64_t to_ping_deadline(const PING *ping)
+{
+    if (!ip_isset(&ping->to_ping[0].ip_port.ip))
+        return UINT64_MAX;
+
+    return ping->last_to_ping + TIME_TO_PING;
+}
+
 
 PING *new_ping(DHT *dht)
 {
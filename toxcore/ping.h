@@ -39,6 +39,9 @@ typedef struct PING PING;
 int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port);
 void do_to_ping(PING *ping);
 
+/* return the unix_time() at which do_to_ping() next pings nodes, UINT64_MAX if there are none to ping. */
+uint64_t to_ping_deadline(const PING *ping);
+
 PING *new_ping(DHT *dht);
 void kill_ping(PING *ping);
 
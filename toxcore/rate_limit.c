@@ -0,0 +1,148 @@
+/* rate_limit.c
+ *
+ * Per source address token buckets for received packets
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "rate_limit.h"
+#include "crypto_core.h"
+#include "util.h"
+
+/* The buckets are kept as theoretical arrival times (GCRA): a bucket is full once the time passed
+ * its cell, every packet pushes the cell interval further into the future and a packet that finds
+ * the cell more than tolerance ahead of now is dropped.
+ *
+ * Sources that collide in a cell share it, so a cell can only be later than the bucket of any one
+ * of them. Taking the earliest of the RATE_LIMIT_ROWS cells of a source and only moving cells that
+ * are behind the new time (conservative update) keeps that error small: an honest source is only
+ * limited by others if it shares a cell with a heavy sender in every row.
+ */
+
+Rate_Limiter *new_rate_limiter(uint8_t ipv4_prefix, uint8_t ipv6_prefix)
+{
+    if (ipv4_prefix == 0 || ipv4_prefix > 32 || ipv6_prefix == 0 || ipv6_prefix > 128)
+        return NULL;
+
+    Rate_Limiter *limiter = calloc(1, sizeof(Rate_Limiter));
+
+    if (limiter == NULL)
+        return NULL;
+
+    limiter->ipv4_prefix = ipv4_prefix;
+    limiter->ipv6_prefix = ipv6_prefix;
+    limiter->hash_key = random_64b();
+    rate_limiter_update_time(limiter);
+    return limiter;
+}
+
+void kill_rate_limiter(Rate_Limiter *limiter)
+{
+    free(limiter);
+}
+
+int rate_limiter_set_budget(Rate_Limiter *limiter, uint8_t packet_id, uint32_t rate, uint32_t burst)
+{
+    if (rate == 0) {
+        limiter->budgets[packet_id].interval = 0;
+        limiter->budgets[packet_id].tolerance = 0;
+        return 0;
+    }
+
+    if (burst == 0 || rate > 1000000)
+        return -1;
+
+    limiter->budgets[packet_id].interval = 1000000 / rate;
+    limiter->budgets[packet_id].tolerance = (uint64_t)(burst - 1) * limiter->budgets[packet_id].interval;
+    return 0;
+}
+
+void rate_limiter_update_time(Rate_Limiter *limiter)
+{
+    limiter->time = current_time_monotonic() * 1000;
+}
+
+/* Hash the prefix of source together with packet_id. */
+static uint64_t hash_source(const Rate_Limiter *limiter, const IP *source, uint8_t packet_id)
+{
+    uint8_t address[SIZE_IP6] = {0};
+    uint8_t prefix;
+
+    if (source->family == AF_INET) {
+        memcpy(address, source->ip4.uint8, SIZE_IP4);
+        prefix = limiter->ipv4_prefix;
+    } else {
+        memcpy(address, source->ip6.uint8, SIZE_IP6);
+        prefix = limiter->ipv6_prefix;
+    }
+
+    if (prefix % 8)
+        address[prefix / 8] &= 0xFF << (8 - prefix % 8);
+
+    if ((prefix + 7) / 8 < SIZE_IP6)
+        memset(address + (prefix + 7) / 8, 0, SIZE_IP6 - (prefix + 7) / 8);
+
+    uint8_t data[2 + SIZE_IP6];
+    data[0] = source->family;
+    data[1] = packet_id;
+    memcpy(data + 2, address, SIZE_IP6);
+    return keyed_hash(limiter->hash_key, data, sizeof(data));
+}
+
+int rate_limiter_allow(Rate_Limiter *limiter, const IP *source, uint8_t packet_id)
+{
+    const Rate_Limit_Budget *budget = &limiter->budgets[packet_id];
+
+    if (budget->interval == 0)
+        return 1;
+
+    uint64_t hash = hash_source(limiter, source, packet_id);
+    uint32_t index = (uint32_t)hash, step = (uint32_t)(hash >> 32) | 1;
+    uint64_t *cells[RATE_LIMIT_ROWS];
+    uint64_t arrival = UINT64_MAX;
+    unsigned int i;
+
+    for (i = 0; i < RATE_LIMIT_ROWS; ++i, index += step) {
+        cells[i] = &limiter->cells[i * RATE_LIMIT_COLUMNS + (index & (RATE_LIMIT_COLUMNS - 1))];
+
+        if (*cells[i] < arrival)
+            arrival = *cells[i];
+    }
+
+    if (arrival < limiter->time)
+        arrival = limiter->time;
+
+    if (arrival - limiter->time > budget->tolerance) {
+        ++limiter->dropped[packet_id];
+        return 0;
+    }
+
+    arrival += budget->interval;
+
+    for (i = 0; i < RATE_LIMIT_ROWS; ++i) {
+        if (*cells[i] < arrival)
+            *cells[i] = arrival;
+    }
+
+    return 1;
+}
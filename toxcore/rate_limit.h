@@ -0,0 +1,86 @@
+/* rate_limit.h
+ *
+ * Per source address token buckets for received packets
+ * -Each packet id gets its own budget: a rate in packets per second and a burst
+ * -Addresses in the same IPv4 or IPv6 prefix share their buckets
+ * -The buckets live in a count-min sketch so that memory stays the same no matter
+ *  how many addresses (spoofed or not) send to us
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "network.h"
+
+/* Rows and columns of the sketch, the columns must be a power of 2.
+ * Memory used is RATE_LIMIT_ROWS * RATE_LIMIT_COLUMNS * 8 bytes. */
+#define RATE_LIMIT_ROWS 4
+#define RATE_LIMIT_COLUMNS 4096
+
+typedef struct {
+    uint64_t interval; /* Microseconds one packet uses up, 0 if the packet id isn't limited. */
+    uint64_t tolerance; /* Microseconds a source can be ahead of its rate, (burst - 1) * interval. */
+} Rate_Limit_Budget;
+
+struct Rate_Limiter {
+    Rate_Limit_Budget budgets[256];
+    uint8_t ipv4_prefix;
+    uint8_t ipv6_prefix;
+
+    uint64_t hash_key; /* Random key for keyed_hash(). */
+
+    /* Time in microseconds at which each bucket will be full again, every source and packet id maps to one
+     * cell per row and its bucket is the one of the cell that is full the latest. */
+    uint64_t cells[RATE_LIMIT_ROWS * RATE_LIMIT_COLUMNS];
+
+    uint64_t time; /* Current time in microseconds, see rate_limiter_update_time(). */
+
+    uint64_t dropped[256]; /* Packets dropped per packet id. */
+};
+
+/* Create a rate limiter, addresses are grouped by their first ipv4_prefix (1 - 32) or ipv6_prefix (1 - 128) bits.
+ * No packet id is limited until a budget is set for it.
+ *
+ * return NULL on failure.
+ */
+Rate_Limiter *new_rate_limiter(uint8_t ipv4_prefix, uint8_t ipv6_prefix);
+
+void kill_rate_limiter(Rate_Limiter *limiter);
+
+/* Let every source send rate packets per second with packet_id, and up to burst of them at once.
+ * A rate of 0 removes the limit.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int rate_limiter_set_budget(Rate_Limiter *limiter, uint8_t packet_id, uint32_t rate, uint32_t burst);
+
+/* Set the time used by rate_limiter_allow() to now, call it before a batch of packets is checked. */
+void rate_limiter_update_time(Rate_Limiter *limiter);
+
+/* Take a token from the bucket of source for packet_id.
+ *
+ * return 1 if the packet can be processed.
+ * return 0 if it must be dropped, it is then counted in limiter->dropped.
+ */
+int rate_limiter_allow(Rate_Limiter *limiter, const IP *source, uint8_t packet_id);
+
+#endif
@@ -29,6 +29,7 @@
 #include "group_chats.h"
 #include "group_moderation.h"
 #include "logger.h"
+#include "node_cache.h"
 
 #include "../toxencryptsave/defines.h"
 
@@ -189,6 +190,66 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
                 return NULL;
         }
 
+        switch (options->congestion_control) {
+            case TOX_CONGESTION_CONTROL_QUEUE:
+                m_options.congestion_control = CRYPTO_CONGESTION_QUEUE;
+                break;
+
+            case TOX_CONGESTION_CONTROL_DELAY:
+                m_options.congestion_control = CRYPTO_CONGESTION_DELAY;
+                break;
+
+            default:
+                SET_ERROR_PARAMETER(error, TOX_ERR_NEW_BAD_OPTION);
+                return NULL;
+        }
+
+        switch (options->pmtu_discovery) {
+            case TOX_PMTU_DISCOVERY_LAN:
+                m_options.pmtu_discovery = CRYPTO_PMTU_LAN;
+                break;
+
+            case TOX_PMTU_DISCOVERY_ALL:
+                m_options.pmtu_discovery = CRYPTO_PMTU_ALL;
+                break;
+
+            case TOX_PMTU_DISCOVERY_DISABLED:
+                m_options.pmtu_discovery = CRYPTO_PMTU_DISABLED;
+                break;
+
+            default:
+                SET_ERROR_PARAMETER(error, TOX_ERR_NEW_BAD_OPTION);
+                return NULL;
+        }
+
+        switch (options->multipath) {
+            case TOX_MULTIPATH_FASTEST:
+                m_options.multipath = CRYPTO_MULTIPATH_FASTEST;
+                break;
+
+            case TOX_MULTIPATH_REDUNDANT:
+                m_options.multipath = CRYPTO_MULTIPATH_REDUNDANT;
+                break;
+
+            case TOX_MULTIPATH_DISABLED:
+                m_options.multipath = CRYPTO_MULTIPATH_DISABLED;
+                break;
+
+            default:
+                SET_ERROR_PARAMETER(error, TOX_ERR_NEW_BAD_OPTION);
+                return NULL;
+        }
+
+        if (options->handshake_workers > CRYPTO_MAX_HANDSHAKE_WORKERS
+                || options->decrypt_workers > CRYPTO_MAX_DECRYPT_WORKERS) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_BAD_OPTION);
+            return NULL;
+        }
+
+        m_options.coalesce_packets = options->coalesce_packets;
+        m_options.handshake_workers = options->handshake_workers;
+        m_options.decrypt_workers = options->decrypt_workers;
+
         if (m_options.proxy_info.proxy_type != TCP_PROXY_NONE) {
             if (options->proxy_port == 0) {
                 SET_ERROR_PARAMETER(error, TOX_ERR_NEW_PROXY_BAD_PORT);
@@ -213,6 +274,16 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
     unsigned int m_error;
     Messenger *m = new_messenger(&m_options, &m_error);
 
+    if (m == NULL) {
+        if (m_error == MESSENGER_ERROR_PORT || m_error == MESSENGER_ERROR_TCP_SERVER) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_PORT_ALLOC);
+        } else {
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_MALLOC);
+        }
+
+        return NULL;
+    }
+
     if (load_savedata_tox && messenger_load(m, options->savedata_data, options->savedata_length) == -1) {
         SET_ERROR_PARAMETER(error, TOX_ERR_NEW_LOAD_BAD_FORMAT);
     } else if (load_savedata_sk) {
@@ -222,6 +293,10 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         SET_ERROR_PARAMETER(error, TOX_ERR_NEW_OK);
     }
 
+    if (m && m->node_cache && options && options->node_cache_data) {
+        node_cache_load(m->node_cache, options->node_cache_data, options->node_cache_length);
+    }
+
     return m;
 }
 
@@ -247,65 +322,76 @@ void tox_get_savedata(const Tox *tox, uint8_t *data)
     }
 }
 
-bool tox_bootstrap(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error)
+size_t tox_get_node_cache_size(const Tox *tox)
 {
-    if (!address || !public_key) {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_NULL);
-        return 0;
-    }
+    const Messenger *m = tox;
 
-    if (port == 0) {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_PORT);
+    if (!m->node_cache)
         return 0;
-    }
 
-    struct addrinfo *root, *info;
+    return node_cache_size(m->node_cache);
+}
 
-    if (getaddrinfo(address, NULL, NULL, &root) != 0) {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_HOST);
-        return 0;
+void tox_get_node_cache(const Tox *tox, uint8_t *node_cache)
+{
+    const Messenger *m = tox;
+
+    if (node_cache && m->node_cache) {
+        node_cache_save(m->node_cache, node_cache);
     }
+}
 
-    info = root;
+static void bootstrap_resolved(void *object, IP_Port ip_port, const uint8_t *public_key)
+{
+    Messenger *m = object;
+    onion_add_bs_path_node(m->onion_c, ip_port, public_key);
+    DHT_bootstrap(m->dht, ip_port, public_key);
+}
 
-    unsigned int count = 0;
+static void tcp_relay_resolved(void *object, IP_Port ip_port, const uint8_t *public_key)
+{
+    Messenger *m = object;
+    add_tcp_relay(m->net_crypto, ip_port, public_key);
+}
 
-    do {
-        IP_Port ip_port;
-        ip_port.port = htons(port);
-        ip_port.ip.family = info->ai_family;
+/* Call callback with the addresses of address now, or from tox_iterate() once the hostname is resolved.
+ *
+ * return -1 if address doesn't resolve.
+ * return 0 on success.
+ */
+static int resolve_node(Messenger *m, const char *address, uint16_t port, const uint8_t *public_key,
+                        dns_resolved_cb *callback)
+{
+    if (m->dns_resolver) {
+        int ret = dns_resolve(m->dns_resolver, address, htons(port), public_key, callback, m);
 
-        if (info->ai_socktype && info->ai_socktype != SOCK_DGRAM) {
-            continue;
+        if (ret != -2) {
+            return ret == -1 ? -1 : 0;
         }
+    }
 
-        if (info->ai_family == AF_INET) {
-            ip_port.ip.ip4.in_addr = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
-        } else if (info->ai_family == AF_INET6) {
-            ip_port.ip.ip6.in6_addr = ((struct sockaddr_in6 *)info->ai_addr)->sin6_addr;
-        } else {
-            continue;
-        }
+    /* Without room for more lookups in the resolver the name is looked up here, blocking. */
+    IP_Port ip_port;
+    IP extra;
+    ip_reset(&ip_port.ip);
+    ip_reset(&extra);
 
-        Messenger *m = tox;
-        onion_add_bs_path_node(m->onion_c, ip_port, public_key);
-        DHT_bootstrap(m->dht, ip_port, public_key);
-        ++count;
-    } while ((info = info->ai_next));
+    if (!addr_resolve_or_parse_ip(address, &ip_port.ip, &extra)) {
+        return -1;
+    }
 
-    freeaddrinfo(root);
+    ip_port.port = htons(port);
+    callback(m, ip_port, public_key);
 
-    if (count) {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_OK);
-        return 1;
-    } else {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_HOST);
-        return 0;
+    if (extra.family != 0) {
+        ip_port.ip = extra;
+        callback(m, ip_port, public_key);
     }
+
+    return 0;
 }
 
-bool tox_add_tcp_relay(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key,
-                       TOX_ERR_BOOTSTRAP *error)
+bool tox_bootstrap(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error)
 {
     if (!address || !public_key) {
         SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_NULL);
@@ -317,48 +403,39 @@ bool tox_add_tcp_relay(Tox *tox, const char *address, uint16_t port, const uint8
         return 0;
     }
 
-    struct addrinfo *root, *info;
+    Messenger *m = tox;
 
-    if (getaddrinfo(address, NULL, NULL, &root) != 0) {
+    if (resolve_node(m, address, port, public_key, bootstrap_resolved) == -1) {
         SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_HOST);
         return 0;
     }
 
-    info = root;
-
-    unsigned int count = 0;
-
-    do {
-        IP_Port ip_port;
-        ip_port.port = htons(port);
-        ip_port.ip.family = info->ai_family;
-
-        if (info->ai_socktype && info->ai_socktype != SOCK_STREAM) {
-            continue;
-        }
+    SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_OK);
+    return 1;
+}
 
-        if (info->ai_family == AF_INET) {
-            ip_port.ip.ip4.in_addr = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
-        } else if (info->ai_family == AF_INET6) {
-            ip_port.ip.ip6.in6_addr = ((struct sockaddr_in6 *)info->ai_addr)->sin6_addr;
-        } else {
-            continue;
-        }
+bool tox_add_tcp_relay(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key,
+                       TOX_ERR_BOOTSTRAP *error)
+{
+    if (!address || !public_key) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_NULL);
+        return 0;
+    }
 
-        Messenger *m = tox;
-        add_tcp_relay(m->net_crypto, ip_port, public_key);
-        ++count;
-    } while ((info = info->ai_next));
+    if (port == 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_PORT);
+        return 0;
+    }
 
-    freeaddrinfo(root);
+    Messenger *m = tox;
 
-    if (count) {
-        SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_OK);
-        return 1;
-    } else {
+    if (resolve_node(m, address, port, public_key, tcp_relay_resolved) == -1) {
         SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_BAD_HOST);
         return 0;
     }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_BOOTSTRAP_OK);
+    return 1;
 }
 
 TOX_CONNECTION tox_self_get_connection_status(const Tox *tox)
@@ -791,6 +868,47 @@ void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_statu
     m_callback_connectionstatus(m, function, user_data);
 }
 
+bool tox_friend_get_connection_stats(const Tox *tox, uint32_t friend_number, struct Tox_Connection_Stats *stats,
+                                     TOX_ERR_FRIEND_QUERY *error)
+{
+    if (!stats) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox;
+    Crypto_Connection_Stats crypto_stats;
+    int ret = m_get_friend_connection_stats(m, friend_number, &crypto_stats);
+
+    if (ret == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(struct Tox_Connection_Stats));
+
+    if (ret == 1) {
+        if (crypto_stats.direct_connected) {
+            stats->connection_status = TOX_CONNECTION_UDP;
+        } else if (crypto_stats.online_tcp_relays) {
+            stats->connection_status = TOX_CONNECTION_TCP;
+        }
+
+        stats->rtt = crypto_stats.rtt_time;
+        stats->send_rate = crypto_stats.packet_send_rate;
+        stats->recv_rate = crypto_stats.packet_recv_rate;
+        stats->packets_sent = crypto_stats.packets_sent;
+        stats->packets_resent = crypto_stats.packets_resent;
+        stats->packets_received = crypto_stats.packets_received;
+        stats->send_queue = crypto_stats.send_queue;
+        stats->recv_queue = crypto_stats.recv_queue;
+        stats->max_packet_size = crypto_stats.max_packet_size;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return 1;
+}
+
 bool tox_friend_get_typing(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error)
 {
     const Messenger *m = tox;
@@ -1769,6 +1887,50 @@ bool tox_group_peer_get_public_key(const Tox *tox, uint32_t groupnumber, uint32_
     return 1;
 }
 
+bool tox_group_peer_get_connection_stats(const Tox *tox, uint32_t groupnumber, uint32_t peer_id,
+        struct Tox_Connection_Stats *stats, TOX_ERR_GROUP_PEER_QUERY *error)
+{
+    if (!stats) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_GROUP_PEER_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox;
+    const GC_Chat *chat = gc_get_group(m->group_handler, groupnumber);
+
+    if (chat == NULL) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_GROUP_PEER_QUERY_GROUP_NOT_FOUND);
+        return 0;
+    }
+
+    GC_Connection_Stats gc_stats;
+
+    if (gc_get_peer_connection_stats(chat, peer_id, &gc_stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_GROUP_PEER_QUERY_PEER_NOT_FOUND);
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(struct Tox_Connection_Stats));
+
+    if (gc_stats.direct_connected) {
+        stats->connection_status = TOX_CONNECTION_UDP;
+    } else if (gc_stats.tcp_connected) {
+        stats->connection_status = TOX_CONNECTION_TCP;
+    } else {
+        stats->connection_status = TOX_CONNECTION_NONE;
+    }
+
+    stats->rtt = gc_stats.rtt;
+    stats->packets_sent = gc_stats.packets_sent;
+    stats->packets_resent = gc_stats.packets_resent;
+    stats->packets_received = gc_stats.packets_received;
+    stats->send_queue = gc_stats.send_queue;
+    stats->recv_queue = gc_stats.recv_queue;
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_GROUP_PEER_QUERY_OK);
+    return 1;
+}
+
 bool tox_group_set_topic(Tox *tox, uint32_t groupnumber, const uint8_t *topic, size_t length,
                          TOX_ERR_GROUP_TOPIC_SET *error)
 {
@@ -410,6 +410,78 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Congestion control algorithm used to pace the data sent to friends.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Slow down when the queue of packets waiting to be sent grows.
+     */
+    TOX_CONGESTION_CONTROL_QUEUE,
+
+    /**
+     * Slow down when the round trip time grows above its minimum, and pace the
+     * packets. Keeps the latency low while sending files or calling.
+     */
+    TOX_CONGESTION_CONTROL_DELAY,
+
+} TOX_CONGESTION_CONTROL;
+
+
+/**
+ * Direct UDP connections on which the biggest packets the path carries are
+ * searched for, to send files faster on networks with jumbo frames.
+ *
+ * While it runs, all the UDP packets of the instance are sent with the don't
+ * fragment bit. It is not run on systems that can't set it.
+ */
+typedef enum TOX_PMTU_DISCOVERY {
+
+    /**
+     * Never send packets bigger than the ones every path carries.
+     */
+    TOX_PMTU_DISCOVERY_DISABLED,
+
+    /**
+     * Connections to friends on the LAN.
+     */
+    TOX_PMTU_DISCOVERY_LAN,
+
+    /**
+     * All direct connections, for networks with jumbo frames end to end.
+     */
+    TOX_PMTU_DISCOVERY_ALL,
+
+} TOX_PMTU_DISCOVERY;
+
+
+/**
+ * How friend connections use the direct UDP connection and a TCP relay when
+ * both are up. Only connections to friends that enabled it too use it.
+ */
+typedef enum TOX_MULTIPATH {
+
+    /**
+     * Send everything directly while the direct connection is up.
+     */
+    TOX_MULTIPATH_DISABLED,
+
+    /**
+     * Keep a TCP relay online and send on the path with the lowest round trip
+     * time.
+     */
+    TOX_MULTIPATH_FASTEST,
+
+    /**
+     * Like FASTEST, but also send lossy packets, typing notifications and call
+     * control on both paths, so they arrive when one path silently dies.
+     */
+    TOX_MULTIPATH_REDUNDANT,
+
+} TOX_MULTIPATH;
+
+
 /**
  * This struct contains all the startup options for Tox. You can either allocate
  * this object yourself, and pass it to tox_options_default, or call
@@ -517,6 +589,60 @@ struct Tox_Options {
      */
     size_t savedata_length;
 
+
+    /**
+     * A node cache obtained from tox_get_node_cache, or NULL to start without one.
+     *
+     * The best ranked DHT nodes and TCP relays in it are all contacted as soon as
+     * the instance starts. A cache that can't be loaded is ignored.
+     */
+    const uint8_t *node_cache_data;
+
+
+    /**
+     * The length of the node cache.
+     */
+    size_t node_cache_length;
+
+
+    /**
+     * The congestion control algorithm used for all friend connections.
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
+
+    /**
+     * Pack small lossless packets sent to friends that understand it into one
+     * packet, saving the overhead of sending each of them on its own.
+     */
+    bool coalesce_packets;
+
+
+    /**
+     * Number of threads that check the handshakes of peers connecting to us, at
+     * most 16. With 0 they are checked by the thread calling tox_iterate.
+     */
+    uint32_t handshake_workers;
+
+
+    /**
+     * Number of threads that decrypt the data packets friends send us, at most
+     * 16. With 0 they are decrypted by the thread calling tox_iterate.
+     */
+    uint32_t decrypt_workers;
+
+
+    /**
+     * The connections on which path MTU discovery runs.
+     */
+    TOX_PMTU_DISCOVERY pmtu_discovery;
+
+
+    /**
+     * How friend connections use both paths to friends.
+     */
+    TOX_MULTIPATH multipath;
+
 };
 
 
@@ -637,6 +763,12 @@ typedef enum TOX_ERR_NEW {
      */
     TOX_ERR_NEW_LOAD_BAD_FORMAT,
 
+    /**
+     * congestion_control, pmtu_discovery or multipath was not one of its enum
+     * values, or handshake_workers or decrypt_workers was greater than 16.
+     */
+    TOX_ERR_NEW_BAD_OPTION,
+
 } TOX_ERR_NEW;
 
 
@@ -684,6 +816,29 @@ size_t tox_get_savedata_size(const Tox *tox);
  */
 void tox_get_savedata(const Tox *tox, uint8_t *savedata);
 
+/**
+ * Calculates the number of bytes required to store the node cache with
+ * tox_get_node_cache.
+ *
+ * The node cache records the DHT nodes and TCP relays this instance talked to,
+ * with when they were last seen, how fast and how often they answered. It is
+ * not part of the savedata so that clients can keep it in its own file, share
+ * it between profiles and drop it without losing anything else.
+ *
+ * The result is 0 if the instance couldn't allocate a node cache.
+ */
+size_t tox_get_node_cache_size(const Tox *tox);
+
+/**
+ * Store the node cache to a byte array, pass it in Tox_Options.node_cache_data
+ * on the next start.
+ *
+ * @param node_cache A memory region large enough to store the node cache.
+ *   Call tox_get_node_cache_size to find the number of bytes required. If this
+ *   parameter is NULL, this function has no effect.
+ */
+void tox_get_node_cache(const Tox *tox, uint8_t *node_cache);
+
 
 /*******************************************************************************
  *
@@ -707,7 +862,9 @@ typedef enum TOX_ERR_BOOTSTRAP {
 
     /**
      * The address could not be resolved to an IP address, or the IP address
-     * passed was invalid.
+     * passed was invalid. Hostnames that were recently looked up without
+     * result fail this way right away, for those that still need to be looked
+     * up the function succeeds and the failure is silent.
      */
     TOX_ERR_BOOTSTRAP_BAD_HOST,
 
@@ -726,12 +883,19 @@ typedef enum TOX_ERR_BOOTSTRAP {
  * This function will attempt to connect to the node using UDP. You must use
  * this function even if Tox_Options.udp_enabled was set to false.
  *
+ * A hostname is looked up without blocking: the function returns right away
+ * and the request is sent from tox_iterate once the name is resolved. Results
+ * are cached, so bootstrapping from many nodes on the same host only looks it
+ * up once. When too many hostnames are already waiting to be looked up, the
+ * name is looked up before the function returns.
+ *
  * @param address The hostname or IP address (IPv4 or IPv6) of the node.
  * @param port The port on the host on which the bootstrap Tox instance is
  *   listening.
  * @param public_key The long term public key of the bootstrap node
  *   (TOX_PUBLIC_KEY_SIZE bytes).
- * @return true on success.
+ * @return true on success, or if the hostname is still being looked up. If
+ *   that lookup fails later, no error is reported and the node is not used.
  */
 bool tox_bootstrap(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error);
 
@@ -742,11 +906,14 @@ bool tox_bootstrap(Tox *tox, const char *address, uint16_t port, const uint8_t *
  * the same bootstrap node, or to add TCP relays without using them as
  * bootstrap nodes.
  *
+ * Hostnames are looked up without blocking, like in tox_bootstrap.
+ *
  * @param address The hostname or IP address (IPv4 or IPv6) of the TCP relay.
  * @param port The port on the host on which the TCP relay is listening.
  * @param public_key The long term public key of the TCP relay
  *   (TOX_PUBLIC_KEY_SIZE bytes).
- * @return true on success.
+ * @return true on success, or if the hostname is still being looked up. If
+ *   that lookup fails later, no error is reported and the relay is not used.
  */
 bool tox_add_tcp_relay(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key,
                        TOX_ERR_BOOTSTRAP *error);
@@ -1402,6 +1569,97 @@ typedef void tox_friend_connection_status_cb(Tox *tox, uint32_t friend_number, T
  */
 void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_status_cb *callback, void *user_data);
 
+/**
+ * Transport statistics of the connection to a friend or group peer.
+ *
+ * Values that are not known for a connection are set to 0.
+ */
+struct Tox_Connection_Stats {
+
+    /**
+     * How we are connected to the peer.
+     */
+    TOX_CONNECTION connection_status;
+
+
+    /**
+     * Estimated round trip time to the peer in milliseconds.
+     */
+    uint32_t rtt;
+
+
+    /**
+     * Number of lossless packets per second we may currently send to the peer.
+     */
+    uint32_t send_rate;
+
+
+    /**
+     * Number of lossless packets per second we currently receive from the peer.
+     */
+    uint32_t recv_rate;
+
+
+    /**
+     * Number of lossless packets sent to the peer, not counting packets sent
+     * again.
+     */
+    uint64_t packets_sent;
+
+
+    /**
+     * Number of lossless packets sent again because the peer did not receive
+     * them.
+     */
+    uint64_t packets_resent;
+
+
+    /**
+     * Number of lossless packets received from the peer.
+     */
+    uint64_t packets_received;
+
+
+    /**
+     * Number of lossless packets sent to the peer that it has not acknowledged
+     * yet.
+     */
+    uint32_t send_queue;
+
+
+    /**
+     * Number of lossless packets received from the peer that wait for missing
+     * packets before them.
+     */
+    uint32_t recv_queue;
+
+
+    /**
+     * Size in bytes of the biggest packets sent to the peer. Above 1400 when
+     * path MTU discovery found that the direct path to the peer carries bigger
+     * packets, see pmtu_discovery in Tox_Options.
+     */
+    uint16_t max_packet_size;
+
+};
+
+
+/**
+ * Write the transport statistics of the connection to a friend to a
+ * Tox_Connection_Stats struct.
+ *
+ * If the friend is offline, connection_status is set to TOX_CONNECTION_NONE and
+ * all the other values to 0.
+ *
+ * @param friend_number The friend number for which to query the statistics.
+ * @param stats A valid Tox_Connection_Stats struct. If this parameter is NULL,
+ *   the function fails with TOX_ERR_FRIEND_QUERY_NULL.
+ *
+ * @return true on success.
+ */
+bool tox_friend_get_connection_stats(const Tox *tox, uint32_t friend_number, struct Tox_Connection_Stats *stats,
+                                     TOX_ERR_FRIEND_QUERY *error);
+
 /**
  * Check whether a friend is currently typing a message.
  *
@@ -2852,6 +3110,11 @@ typedef enum TOX_ERR_GROUP_PEER_QUERY {
      */
     TOX_ERR_GROUP_PEER_QUERY_PEER_NOT_FOUND,
 
+    /**
+     * The pointer parameter for storing the query result was NULL.
+     */
+    TOX_ERR_GROUP_PEER_QUERY_NULL,
+
 } TOX_ERR_GROUP_PEER_QUERY;
 
 
@@ -2919,6 +3182,25 @@ TOX_GROUP_ROLE tox_group_peer_get_role(const Tox *tox, uint32_t groupnumber, uin
 bool tox_group_peer_get_public_key(const Tox *tox, uint32_t groupnumber, uint32_t peer_id, uint8_t *public_key,
                                    TOX_ERR_GROUP_PEER_QUERY *error);
 
+/**
+ * Write the transport statistics of the connection to the peer designated by
+ * the given ID to a Tox_Connection_Stats struct.
+ *
+ * connection_status is TOX_CONNECTION_UDP while we receive packets directly from
+ * the peer, TOX_CONNECTION_TCP while a TCP relay to the peer is online and
+ * TOX_CONNECTION_NONE otherwise. send_rate and recv_rate are not measured for
+ * group peers and are set to 0.
+ *
+ * @param groupnumber The group number of the group we wish to query.
+ * @param peer_id The ID of the peer whose connection we want to query.
+ * @param stats A valid Tox_Connection_Stats struct. If this parameter is NULL,
+ *   the function fails with TOX_ERR_GROUP_PEER_QUERY_NULL.
+ *
+ * @return true on success.
+ */
+bool tox_group_peer_get_connection_stats(const Tox *tox, uint32_t groupnumber, uint32_t peer_id,
+        struct Tox_Connection_Stats *stats, TOX_ERR_GROUP_PEER_QUERY *error);
+
 /**
  * @param groupnumber The group number of the group the name change is intended for.
  * @param peer_id The ID of the peer who has changed their name.
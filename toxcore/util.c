@@ -44,12 +44,13 @@ void unix_time_update()
     if (unix_base_time_value == 0)
         unix_base_time_value = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
 
-    unix_time_value = (current_time_monotonic() / 1000ULL) + unix_base_time_value;
+    /* Atomic because the TCP server workers read it from their own threads. */
+    atomic_store_u64(&unix_time_value, (current_time_monotonic() / 1000ULL) + unix_base_time_value, ATOMIC_RELAXED);
 }
 
 uint64_t unix_time()
 {
-    return unix_time_value;
+    return atomic_load_u64(&unix_time_value, ATOMIC_RELAXED);
 }
 
 int is_timeout(uint64_t timestamp, uint64_t timeout)
@@ -57,6 +58,23 @@ int is_timeout(uint64_t timestamp, uint64_t timeout)
     return timestamp + timeout <= unix_time();
 }
 
+uint64_t unix_time_until(uint64_t time)
+{
+    if (time <= unix_base_time_value)
+        return 0;
+
+    if (time - unix_base_time_value > UINT64_MAX / 1000ULL)
+        return UINT64_MAX;
+
+    uint64_t deadline = (time - unix_base_time_value) * 1000ULL;
+    uint64_t now = current_time_monotonic();
+
+    if (deadline <= now)
+        return 0;
+
+    return deadline - now;
+}
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src)
@@ -341,6 +359,66 @@ int create_recursive_mutex(pthread_mutex_t *mutex)
     return 0;
 }
 
+#if !defined(__GNUC__) && !defined(__clang__)
+
+static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define ATOMIC_LOAD(NAME, TYPE) \
+TYPE NAME(TYPE const *ptr, int order) \
+{ \
+    pthread_mutex_lock(&atomic_mutex); \
+    TYPE value = *ptr; \
+    pthread_mutex_unlock(&atomic_mutex); \
+    return value; \
+}
+
+#define ATOMIC_STORE(NAME, TYPE) \
+void NAME(TYPE *ptr, TYPE value, int order) \
+{ \
+    pthread_mutex_lock(&atomic_mutex); \
+    *ptr = value; \
+    pthread_mutex_unlock(&atomic_mutex); \
+}
+
+#define ATOMIC_EXCHANGE(NAME, TYPE) \
+TYPE NAME(TYPE *ptr, TYPE value, int order) \
+{ \
+    pthread_mutex_lock(&atomic_mutex); \
+    TYPE old = *ptr; \
+    *ptr = value; \
+    pthread_mutex_unlock(&atomic_mutex); \
+    return old; \
+}
+
+ATOMIC_LOAD(atomic_load_u8, uint8_t)
+ATOMIC_STORE(atomic_store_u8, uint8_t)
+ATOMIC_EXCHANGE(atomic_exchange_u8, uint8_t)
+ATOMIC_LOAD(atomic_load_u32, uint32_t)
+ATOMIC_STORE(atomic_store_u32, uint32_t)
+ATOMIC_LOAD(atomic_load_u64, uint64_t)
+ATOMIC_STORE(atomic_store_u64, uint64_t)
+ATOMIC_LOAD(atomic_load_voidptr, void *)
+ATOMIC_STORE(atomic_store_voidptr, void *)
+ATOMIC_EXCHANGE(atomic_exchange_voidptr, void *)
+
+uint32_t atomic_add_fetch_u32(uint32_t *ptr, uint32_t value, int order)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    uint32_t result = *ptr += value;
+    pthread_mutex_unlock(&atomic_mutex);
+    return result;
+}
+
+uint32_t atomic_sub_fetch_u32(uint32_t *ptr, uint32_t value, int order)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    uint32_t result = *ptr -= value;
+    pthread_mutex_unlock(&atomic_mutex);
+    return result;
+}
+
+#endif
+
 /* Returns a 32-bit hash of key of size len */
 uint32_t jenkins_one_at_a_time_hash(const uint8_t *key, size_t len)
 {
@@ -358,6 +436,32 @@ uint32_t jenkins_one_at_a_time_hash(const uint8_t *key, size_t len)
     return hash;
 }
 
+static uint64_t keyed_hash_word(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+}
+
+uint64_t keyed_hash(uint64_t hash_key, const uint8_t *data, size_t len)
+{
+    uint64_t hash = hash_key;
+    size_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        hash = keyed_hash_word(hash, word);
+    }
+
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        hash = keyed_hash_word(hash, word);
+    }
+
+    return hash;
+}
+
 
 struct RingBuffer {
     uint16_t size; /* Max size */
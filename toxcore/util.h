@@ -52,6 +52,9 @@ void unix_time_update();
 uint64_t unix_time();
 int is_timeout(uint64_t timestamp, uint64_t timeout);
 
+/* return the time in ms until unix_time() reaches time, 0 if it already has. */
+uint64_t unix_time_until(uint64_t time);
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src);
@@ -104,6 +107,59 @@ void U16_to_bytes(uint8_t *dest, uint16_t value);
 /* Returns -1 if failed or 0 if success */
 int create_recursive_mutex(pthread_mutex_t *mutex);
 
+/* Atomic access to variables shared between threads, with the memory order given by one of the ATOMIC_*
+ * values. The compiler builtins are used where there are any, otherwise every access takes one global
+ * mutex, which is at least as strong as any order.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+
+#define ATOMIC_RELAXED __ATOMIC_RELAXED
+#define ATOMIC_ACQUIRE __ATOMIC_ACQUIRE
+#define ATOMIC_RELEASE __ATOMIC_RELEASE
+#define ATOMIC_ACQ_REL __ATOMIC_ACQ_REL
+#define ATOMIC_SEQ_CST __ATOMIC_SEQ_CST
+
+#define atomic_load_u8(ptr, order) __atomic_load_n(ptr, order)
+#define atomic_store_u8(ptr, value, order) __atomic_store_n(ptr, value, order)
+#define atomic_exchange_u8(ptr, value, order) __atomic_exchange_n(ptr, value, order)
+#define atomic_load_u32(ptr, order) __atomic_load_n(ptr, order)
+#define atomic_store_u32(ptr, value, order) __atomic_store_n(ptr, value, order)
+#define atomic_add_fetch_u32(ptr, value, order) __atomic_add_fetch(ptr, value, order)
+#define atomic_sub_fetch_u32(ptr, value, order) __atomic_sub_fetch(ptr, value, order)
+#define atomic_load_u64(ptr, order) __atomic_load_n(ptr, order)
+#define atomic_store_u64(ptr, value, order) __atomic_store_n(ptr, value, order)
+#define atomic_load_ptr(ptr, order) __atomic_load_n(ptr, order)
+#define atomic_store_ptr(ptr, value, order) __atomic_store_n(ptr, value, order)
+#define atomic_exchange_ptr(ptr, value, order) __atomic_exchange_n(ptr, value, order)
+
+#else
+
+#define ATOMIC_RELAXED 0
+#define ATOMIC_ACQUIRE 0
+#define ATOMIC_RELEASE 0
+#define ATOMIC_ACQ_REL 0
+#define ATOMIC_SEQ_CST 0
+
+uint8_t atomic_load_u8(const uint8_t *ptr, int order);
+void atomic_store_u8(uint8_t *ptr, uint8_t value, int order);
+uint8_t atomic_exchange_u8(uint8_t *ptr, uint8_t value, int order);
+uint32_t atomic_load_u32(const uint32_t *ptr, int order);
+void atomic_store_u32(uint32_t *ptr, uint32_t value, int order);
+uint32_t atomic_add_fetch_u32(uint32_t *ptr, uint32_t value, int order);
+uint32_t atomic_sub_fetch_u32(uint32_t *ptr, uint32_t value, int order);
+uint64_t atomic_load_u64(const uint64_t *ptr, int order);
+void atomic_store_u64(uint64_t *ptr, uint64_t value, int order);
+
+/* ptr points to a pointer of any type. */
+#define atomic_load_ptr(ptr, order) atomic_load_voidptr((void *const *)(ptr), order)
+#define atomic_store_ptr(ptr, value, order) atomic_store_voidptr((void **)(ptr), value, order)
+#define atomic_exchange_ptr(ptr, value, order) atomic_exchange_voidptr((void **)(ptr), value, order)
+void *atomic_load_voidptr(void *const *ptr, int order);
+void atomic_store_voidptr(void **ptr, void *value, int order);
+void *atomic_exchange_voidptr(void **ptr, void *value, int order);
+
+#endif
+
 /* Ring buffer */
 typedef struct RingBuffer RingBuffer;
 bool rb_full(const RingBuffer *b);
@@ -118,4 +174,11 @@ uint16_t rb_data(const RingBuffer *b, void **dest);
 /* Returns a 32-bit hash of key of size len */
 uint32_t jenkins_one_at_a_time_hash(const uint8_t *key, size_t len);
 
+/* Returns a hash of data of size len keyed with hash_key.
+ *
+ * Tables that hold data picked by other peers hash it with a random hash_key, so that nobody
+ * can pick data that all lands in the same bucket.
+ */
+uint64_t keyed_hash(uint64_t hash_key, const uint8_t *data, size_t len);
+
 #endif /* UTIL_H */
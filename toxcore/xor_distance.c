@@ -0,0 +1,435 @@
+/* xor_distance.c
+ *
+ * XOR distance between public keys, the metric of the DHT
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xor_distance.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define KEY_ARRAY_LANES 8
+#define KEY_ARRAY_SET1 _mm256_set1_epi32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define KEY_ARRAY_LANES 4
+#define KEY_ARRAY_SET1 _mm_set1_epi32
+#endif
+
+#if crypto_box_PUBLICKEYBYTES != 32
+#error crypto_box_PUBLICKEYBYTES is required to be 32 bytes for the xor distance kernels to work.
+#endif
+
+static unsigned int lowest_bit(uint32_t mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++i;
+    }
+
+    return i;
+#endif
+}
+
+unsigned int key_first_difference(const uint8_t *pk1, const uint8_t *pk2)
+{
+    /* Most keys compared differ in their first bytes, the vector compare only pays off for the others. */
+    uint64_t head1, head2;
+    memcpy(&head1, pk1, sizeof(head1));
+    memcpy(&head2, pk2, sizeof(head2));
+
+    if (head1 != head2) {
+        unsigned int i = 0;
+
+        while (pk1[i] == pk2[i])
+            ++i;
+
+        return i;
+    }
+
+#if defined(__AVX2__)
+    __m256i a = _mm256_loadu_si256((const __m256i *)pk1);
+    __m256i b = _mm256_loadu_si256((const __m256i *)pk2);
+    uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+    return diff ? lowest_bit(diff) : crypto_box_PUBLICKEYBYTES;
+#elif defined(__SSE2__)
+    __m128i a = _mm_loadu_si128((const __m128i *)pk1), b = _mm_loadu_si128((const __m128i *)pk2);
+    uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    a = _mm_loadu_si128((const __m128i *)(pk1 + 16));
+    b = _mm_loadu_si128((const __m128i *)(pk2 + 16));
+    equal |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) << 16;
+
+    return ~equal ? lowest_bit(~equal) : crypto_box_PUBLICKEYBYTES;
+#else
+    unsigned int i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, pk1 + i, sizeof(a));
+        memcpy(&b, pk2 + i, sizeof(b));
+
+        if (a != b)
+            break;
+    }
+
+    for (; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        if (pk1[i] != pk2[i])
+            break;
+    }
+
+    return i;
+#endif
+}
+
+int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    /* The distances first differ where pk1 and pk2 do, for random keys that is mostly the first byte. */
+    unsigned int i = pk1[0] != pk2[0] ? 0 : key_first_difference(pk1, pk2);
+
+    if (i == crypto_box_PUBLICKEYBYTES)
+        return 0;
+
+    if ((pk[i] ^ pk1[i]) < (pk[i] ^ pk2[i]))
+        return 1;
+
+    return 2;
+}
+
+int key_array_init(Key_Array *keys, uint32_t size)
+{
+    uint32_t *words = calloc(size ? size : 1, KEY_ARRAY_WORDS * sizeof(uint32_t));
+
+    if (words == NULL)
+        return -1;
+
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i)
+        keys->words[i] = words + i * size;
+
+    keys->size = size;
+    return 0;
+}
+
+void key_array_free(Key_Array *keys)
+{
+    free(keys->words[0]);
+    memset(keys, 0, sizeof(Key_Array));
+}
+
+static void key_to_words(const uint8_t *public_key, uint32_t *words)
+{
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i) {
+        const uint8_t *bytes = public_key + i * sizeof(uint32_t);
+        words[i] = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+}
+
+void key_array_set(Key_Array *keys, uint32_t index, const uint8_t *public_key)
+{
+    uint32_t words[KEY_ARRAY_WORDS];
+    key_to_words(public_key, words);
+
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i)
+        keys->words[i][index] = words[i];
+}
+
+void key_array_clear(Key_Array *keys, uint32_t index)
+{
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i)
+        keys->words[i][index] = 0;
+}
+
+void key_array_get(const Key_Array *keys, uint32_t index, uint8_t *public_key)
+{
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i) {
+        uint32_t word = keys->words[i][index];
+        uint8_t *bytes = public_key + i * sizeof(uint32_t);
+        bytes[0] = word >> 24;
+        bytes[1] = word >> 16;
+        bytes[2] = word >> 8;
+        bytes[3] = word;
+    }
+}
+
+/* Compare the rest of key index with words, the first word is already known to be equal. */
+static _Bool key_equal(const Key_Array *keys, uint32_t index, const uint32_t *words)
+{
+    unsigned int i;
+
+    for (i = 1; i < KEY_ARRAY_WORDS; ++i) {
+        if (keys->words[i][index] != words[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+int key_array_find(const Key_Array *keys, uint32_t first, uint32_t num, const uint8_t *public_key)
+{
+    uint32_t words[KEY_ARRAY_WORDS];
+    key_to_words(public_key, words);
+
+    const uint32_t *word0 = keys->words[0];
+    uint32_t i = first, end = first + num;
+
+#if defined(__AVX2__)
+    __m256i target = _mm256_set1_epi32(words[0]);
+
+    for (; i + KEY_ARRAY_LANES <= end; i += KEY_ARRAY_LANES) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(word0 + i));
+        uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, target)));
+
+        while (mask) {
+            uint32_t index = i + lowest_bit(mask);
+
+            if (key_equal(keys, index, words))
+                return index;
+
+            mask &= mask - 1;
+        }
+    }
+
+#elif defined(__SSE2__)
+    __m128i target = _mm_set1_epi32(words[0]);
+
+    for (; i + KEY_ARRAY_LANES <= end; i += KEY_ARRAY_LANES) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(word0 + i));
+        uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, target)));
+
+        while (mask) {
+            uint32_t index = i + lowest_bit(mask);
+
+            if (key_equal(keys, index, words))
+                return index;
+
+            mask &= mask - 1;
+        }
+    }
+
+#endif
+
+    for (; i < end; ++i) {
+        if (word0[i] == words[0] && key_equal(keys, i, words))
+            return i;
+    }
+
+    return -1;
+}
+
+/* return 1 if key index1 is closer to the key made of words than key index2. */
+static _Bool key_closer(const Key_Array *keys, uint32_t index1, uint32_t index2, const uint32_t *words)
+{
+    unsigned int i;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i) {
+        uint32_t distance1 = keys->words[i][index1] ^ words[i];
+        uint32_t distance2 = keys->words[i][index2] ^ words[i];
+
+        if (distance1 != distance2)
+            return distance1 < distance2;
+    }
+
+    return 0;
+}
+
+/* Add index to the sorted list of the num closest keys, which holds at most max_num.
+ *
+ * return the new number of indexes.
+ */
+static uint32_t add_closest(const Key_Array *keys, uint32_t index, const uint32_t *words, uint32_t *indexes,
+                            uint32_t num, uint32_t max_num)
+{
+    uint32_t j = num;
+
+    while (j > 0 && key_closer(keys, index, indexes[j - 1], words))
+        --j;
+
+    if (j == max_num)
+        return num;
+
+    if (num < max_num)
+        ++num;
+
+    memmove(indexes + j + 1, indexes + j, (num - j - 1) * sizeof(uint32_t));
+    indexes[j] = index;
+    return num;
+}
+
+/* Distance of the furthest key kept so far. Only its first depth words are compared to those of
+ * other keys, the ones before the first word that isn't zero and that word: keys whose distance
+ * is larger there can't make it, only the others are compared in full. */
+typedef struct {
+    uint32_t words[KEY_ARRAY_WORDS];
+    unsigned int depth;
+} Threshold;
+
+static void set_threshold(Threshold *threshold, const Key_Array *keys, uint32_t index, const uint32_t *words)
+{
+    unsigned int i;
+
+    threshold->depth = KEY_ARRAY_WORDS;
+
+    for (i = 0; i < KEY_ARRAY_WORDS; ++i) {
+        threshold->words[i] = keys->words[i][index] ^ words[i];
+
+        if (threshold->words[i] != 0 && threshold->depth == KEY_ARRAY_WORDS)
+            threshold->depth = i + 1;
+    }
+}
+
+static _Bool above_threshold(const Threshold *threshold, const Key_Array *keys, uint32_t index, const uint32_t *words)
+{
+    unsigned int i;
+
+    for (i = 0; i < threshold->depth; ++i) {
+        uint32_t distance = keys->words[i][index] ^ words[i];
+
+        if (distance != threshold->words[i])
+            return distance > threshold->words[i];
+    }
+
+    return 0;
+}
+
+uint32_t key_array_closest(const Key_Array *keys, uint32_t first, uint32_t num, const uint8_t *public_key,
+                           uint32_t *indexes, uint32_t max_num, key_array_filter_cb *filter, const void *object)
+{
+    if (max_num == 0)
+        return 0;
+
+    uint32_t words[KEY_ARRAY_WORDS];
+    key_to_words(public_key, words);
+
+    uint32_t i = first, end = first + num, count = 0;
+    Threshold threshold;
+
+    /* Nothing is above the threshold until max_num keys are kept. */
+    memset(threshold.words, 0xFF, sizeof(threshold.words));
+    threshold.depth = 1;
+
+#if defined(__AVX2__)
+    /* The vectors compared, with flipped sign bits as there is no unsigned compare. */
+    __m256i sign = _mm256_set1_epi32(0x80000000), target[KEY_ARRAY_WORDS], limit[KEY_ARRAY_WORDS];
+    unsigned int w;
+
+    for (w = 0; w < KEY_ARRAY_WORDS; ++w) {
+        target[w] = _mm256_set1_epi32(words[w]);
+        limit[w] = KEY_ARRAY_SET1(threshold.words[w] ^ 0x80000000);
+    }
+
+    for (; i + KEY_ARRAY_LANES <= end; i += KEY_ARRAY_LANES) {
+        /* Distance of each key of the block above the threshold, compared a word at a time. */
+        __m256i distance = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys->words[0] + i)), target[0]);
+        distance = _mm256_xor_si256(distance, sign);
+        __m256i above = _mm256_cmpgt_epi32(distance, limit[0]);
+        __m256i equal = _mm256_cmpeq_epi32(distance, limit[0]);
+
+        for (w = 1; w < threshold.depth; ++w) {
+            distance = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys->words[w] + i)), target[w]);
+            distance = _mm256_xor_si256(distance, sign);
+            above = _mm256_or_si256(above, _mm256_and_si256(equal, _mm256_cmpgt_epi32(distance, limit[w])));
+            equal = _mm256_and_si256(equal, _mm256_cmpeq_epi32(distance, limit[w]));
+        }
+
+        uint32_t mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(above)) & 0xFF;
+#elif defined(__SSE2__)
+    __m128i sign = _mm_set1_epi32(0x80000000), target[KEY_ARRAY_WORDS], limit[KEY_ARRAY_WORDS];
+    unsigned int w;
+
+    for (w = 0; w < KEY_ARRAY_WORDS; ++w) {
+        target[w] = _mm_set1_epi32(words[w]);
+        limit[w] = KEY_ARRAY_SET1(threshold.words[w] ^ 0x80000000);
+    }
+
+    for (; i + KEY_ARRAY_LANES <= end; i += KEY_ARRAY_LANES) {
+        __m128i distance = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys->words[0] + i)), target[0]);
+        distance = _mm_xor_si128(distance, sign);
+        __m128i above = _mm_cmpgt_epi32(distance, limit[0]);
+        __m128i equal = _mm_cmpeq_epi32(distance, limit[0]);
+
+        for (w = 1; w < threshold.depth; ++w) {
+            distance = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys->words[w] + i)), target[w]);
+            distance = _mm_xor_si128(distance, sign);
+            above = _mm_or_si128(above, _mm_and_si128(equal, _mm_cmpgt_epi32(distance, limit[w])));
+            equal = _mm_and_si128(equal, _mm_cmpeq_epi32(distance, limit[w]));
+        }
+
+        uint32_t mask = ~_mm_movemask_ps(_mm_castsi128_ps(above)) & 0xF;
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+
+        while (mask) {
+            uint32_t index = i + lowest_bit(mask);
+            mask &= mask - 1;
+
+            /* The threshold can have moved since the block was compared. */
+            if (above_threshold(&threshold, keys, index, words))
+                continue;
+
+            if (filter && !filter(object, index))
+                continue;
+
+            count = add_closest(keys, index, words, indexes, count, max_num);
+
+            if (count == max_num) {
+                set_threshold(&threshold, keys, indexes[count - 1], words);
+
+                for (w = 0; w < threshold.depth; ++w)
+                    limit[w] = KEY_ARRAY_SET1(threshold.words[w] ^ 0x80000000);
+            }
+        }
+    }
+
+#endif
+
+    for (; i < end; ++i) {
+        if (above_threshold(&threshold, keys, i, words))
+            continue;
+
+        if (filter && !filter(object, i))
+            continue;
+
+        count = add_closest(keys, i, words, indexes, count, max_num);
+
+        if (count == max_num)
+            set_threshold(&threshold, keys, indexes[count - 1], words);
+    }
+
+    return count;
+}
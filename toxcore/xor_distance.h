@@ -0,0 +1,94 @@
+/* xor_distance.h
+ *
+ * XOR distance between public keys, the metric of the DHT
+ * -Kernels use AVX2 or SSE2 when the compiler targets them, plain C otherwise
+ * -Key_Array stores keys as a structure of arrays so that the distances of many keys to
+ *  one public key are compared in one pass
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XOR_DISTANCE_H
+#define XOR_DISTANCE_H
+
+#include "crypto_core.h"
+
+#define KEY_ARRAY_WORDS (crypto_box_PUBLICKEYBYTES / sizeof(uint32_t))
+
+/* Compares pk1 and pk2 with pk.
+ *
+ *  return 0 if both are same distance.
+ *  return 1 if pk1 is closer.
+ *  return 2 if pk2 is closer.
+ */
+int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* return the index of the first byte pk1 and pk2 differ in.
+ * return crypto_box_PUBLICKEYBYTES if they are equal.
+ */
+unsigned int key_first_difference(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Word i of key n is in words[i][n], in host byte order with the first byte of the key
+ * as most significant byte. XOR distances then compare like the words they are made of.
+ */
+typedef struct {
+    uint32_t *words[KEY_ARRAY_WORDS];
+    uint32_t size;
+} Key_Array;
+
+/* Make keys hold size keys, all zero.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int key_array_init(Key_Array *keys, uint32_t size);
+
+/* Free all the memory used by keys. */
+void key_array_free(Key_Array *keys);
+
+void key_array_set(Key_Array *keys, uint32_t index, const uint8_t *public_key);
+
+/* Set key index to zero. */
+void key_array_clear(Key_Array *keys, uint32_t index);
+
+void key_array_get(const Key_Array *keys, uint32_t index, uint8_t *public_key);
+
+/* return the index of public_key among the num keys starting at first.
+ * return -1 if it is not one of them.
+ */
+int key_array_find(const Key_Array *keys, uint32_t first, uint32_t num, const uint8_t *public_key);
+
+/* return 1 if key index may be picked by key_array_closest().
+ * return 0 if it must be skipped.
+ */
+typedef _Bool key_array_filter_cb(const void *object, uint32_t index);
+
+/* Put the indexes of the up to max_num keys among the num keys starting at first that are
+ * closest to public_key in indexes, closest first.
+ *
+ * If filter isn't NULL, only keys it accepts are picked. It is called with object, and only for
+ * keys closer than the ones kept so far, so it can do checks too slow to run on all of them,
+ * like skipping the zero keys key_array_clear() leaves.
+ *
+ * return the number of indexes.
+ */
+uint32_t key_array_closest(const Key_Array *keys, uint32_t first, uint32_t num, const uint8_t *public_key,
+                           uint32_t *indexes, uint32_t max_num, key_array_filter_cb *filter, const void *object);
+
+#endif